@@ -0,0 +1,499 @@
+#include <string.h>
+
+#include "aes.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define AES_HAVE_NI 1
+#include <wmmintrin.h>
+#include <emmintrin.h>
+#define AES_NI_TARGET __attribute__((target("aes,sse2")))
+#else
+#define AES_HAVE_NI 0
+#endif
+
+static const uint8_t AES_SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static const uint8_t AES_INV_SBOX[256] = {
+    0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+    0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+    0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+    0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+    0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+    0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+    0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+    0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+    0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+    0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+    0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+    0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+    0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+    0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+    0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+    0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d
+};
+
+static const uint8_t AES_RCON[AES_ROUNDS] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+
+// -1 = not checked yet, the cpu does not change while we run so a racy first check is harmless
+static int aesHw = -1;
+static int aesForcePortable;
+
+int aes_hw(void) {
+    if (aesForcePortable) {
+        return 0;
+    }
+#if AES_HAVE_NI
+    if (aesHw < 0) {
+        aesHw = __builtin_cpu_supports("aes") ? 1 : 0;
+    }
+    return aesHw;
+#else
+    (void)aesHw;
+    return 0;
+#endif
+}
+
+void aes_force_portable(int portable) {
+    aesForcePortable = portable;
+}
+
+// -------------------- Portable implementation -------------------------------
+
+static uint8_t aes_xtime(uint8_t x) {
+    return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0x00));
+}
+
+static uint8_t aes_mul(uint8_t x, uint8_t y) {
+    uint8_t product = 0;
+    while (y) {
+        if (y & 1) {
+            product ^= x;
+        }
+        x = aes_xtime(x);
+        y >>= 1;
+    }
+    return product;
+}
+
+static void aes_expand_portable(Aes128 *aes, const uint8_t key[AES_BLOCK_SIZE]) {
+    uint8_t *w = &aes->enc[0][0];
+    memcpy(w, key, AES_BLOCK_SIZE);
+    for (int i = 4; i < 4 * (AES_ROUNDS + 1); i++) {
+        uint8_t t[4] = { w[4 * i - 4], w[4 * i - 3], w[4 * i - 2], w[4 * i - 1] };
+        if (i % 4 == 0) {
+            uint8_t first = t[0];
+            t[0] = AES_SBOX[t[1]] ^ AES_RCON[i / 4 - 1];
+            t[1] = AES_SBOX[t[2]];
+            t[2] = AES_SBOX[t[3]];
+            t[3] = AES_SBOX[first];
+        }
+        for (int j = 0; j < 4; j++) {
+            w[4 * i + j] = w[4 * i - 16 + j] ^ t[j];
+        }
+    }
+}
+
+// the state is kept in input order: byte 4 * column + row
+static void aes_encrypt_portable(const Aes128 *aes, const uint8_t in[AES_BLOCK_SIZE], uint8_t out[AES_BLOCK_SIZE]) {
+    uint8_t s[AES_BLOCK_SIZE];
+    uint8_t t[AES_BLOCK_SIZE];
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+        s[i] = in[i] ^ aes->enc[0][i];
+    }
+    for (int round = 1; round <= AES_ROUNDS; round++) {
+        // SubBytes + ShiftRows (row r moves r columns to the left)
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) {
+                t[4 * c + r] = AES_SBOX[s[4 * ((c + r) % 4) + r]];
+            }
+        }
+        if (round < AES_ROUNDS) {
+            for (int c = 0; c < 4; c++) {
+                uint8_t *col = t + 4 * c;
+                uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+                uint8_t first = col[0];
+                col[0] ^= all ^ aes_xtime(col[0] ^ col[1]);
+                col[1] ^= all ^ aes_xtime(col[1] ^ col[2]);
+                col[2] ^= all ^ aes_xtime(col[2] ^ col[3]);
+                col[3] ^= all ^ aes_xtime(col[3] ^ first);
+            }
+        }
+        for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+            s[i] = t[i] ^ aes->enc[round][i];
+        }
+    }
+    memcpy(out, s, AES_BLOCK_SIZE);
+}
+
+static void aes_decrypt_portable(const Aes128 *aes, const uint8_t in[AES_BLOCK_SIZE], uint8_t out[AES_BLOCK_SIZE]) {
+    uint8_t s[AES_BLOCK_SIZE];
+    uint8_t t[AES_BLOCK_SIZE];
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+        s[i] = in[i] ^ aes->enc[AES_ROUNDS][i];
+    }
+    for (int round = AES_ROUNDS - 1; round >= 0; round--) {
+        // InvShiftRows + InvSubBytes + AddRoundKey
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) {
+                t[4 * ((c + r) % 4) + r] = AES_INV_SBOX[s[4 * c + r]] ^ aes->enc[round][4 * ((c + r) % 4) + r];
+            }
+        }
+        if (round > 0) {
+            for (int c = 0; c < 4; c++) {
+                const uint8_t *col = t + 4 * c;
+                s[4 * c + 0] = aes_mul(col[0], 14) ^ aes_mul(col[1], 11) ^ aes_mul(col[2], 13) ^ aes_mul(col[3], 9);
+                s[4 * c + 1] = aes_mul(col[0], 9) ^ aes_mul(col[1], 14) ^ aes_mul(col[2], 11) ^ aes_mul(col[3], 13);
+                s[4 * c + 2] = aes_mul(col[0], 13) ^ aes_mul(col[1], 9) ^ aes_mul(col[2], 14) ^ aes_mul(col[3], 11);
+                s[4 * c + 3] = aes_mul(col[0], 11) ^ aes_mul(col[1], 13) ^ aes_mul(col[2], 9) ^ aes_mul(col[3], 14);
+            }
+        } else {
+            memcpy(s, t, AES_BLOCK_SIZE);
+        }
+    }
+    memcpy(out, s, AES_BLOCK_SIZE);
+}
+
+// -------------------- AES-NI -------------------------------
+
+#if AES_HAVE_NI
+AES_NI_TARGET static inline __m128i aes_ni_expand_step(__m128i key, __m128i assist) {
+    assist = _mm_shuffle_epi32(assist, 0xFF);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+// aeskeygenassist needs the round constant as an immediate, hence the macros instead of a loop
+#define AES_NI_ROUND_KEY(i, rcon) \
+    k = aes_ni_expand_step(k, _mm_aeskeygenassist_si128(k, rcon)); \
+    _mm_storeu_si128((__m128i *)aes->enc[i], k)
+
+// four independent key schedules side by side, same idea as aes_encrypt_x4_ni
+#define AES_NI_ROUND_KEY_X4(i, rcon) \
+    k0 = aes_ni_expand_step(k0, _mm_aeskeygenassist_si128(k0, rcon)); \
+    k1 = aes_ni_expand_step(k1, _mm_aeskeygenassist_si128(k1, rcon)); \
+    k2 = aes_ni_expand_step(k2, _mm_aeskeygenassist_si128(k2, rcon)); \
+    k3 = aes_ni_expand_step(k3, _mm_aeskeygenassist_si128(k3, rcon)); \
+    _mm_storeu_si128((__m128i *)aes[0]->enc[i], k0); \
+    _mm_storeu_si128((__m128i *)aes[1]->enc[i], k1); \
+    _mm_storeu_si128((__m128i *)aes[2]->enc[i], k2); \
+    _mm_storeu_si128((__m128i *)aes[3]->enc[i], k3)
+
+AES_NI_TARGET static void aes_expand_ni(Aes128 *aes, const uint8_t key[AES_BLOCK_SIZE]) {
+    __m128i k = _mm_loadu_si128((const __m128i *)key);
+    _mm_storeu_si128((__m128i *)aes->enc[0], k);
+    AES_NI_ROUND_KEY(1, 0x01);
+    AES_NI_ROUND_KEY(2, 0x02);
+    AES_NI_ROUND_KEY(3, 0x04);
+    AES_NI_ROUND_KEY(4, 0x08);
+    AES_NI_ROUND_KEY(5, 0x10);
+    AES_NI_ROUND_KEY(6, 0x20);
+    AES_NI_ROUND_KEY(7, 0x40);
+    AES_NI_ROUND_KEY(8, 0x80);
+    AES_NI_ROUND_KEY(9, 0x1b);
+    AES_NI_ROUND_KEY(10, 0x36);
+}
+
+AES_NI_TARGET static void aes_expand_x4_ni(Aes128 *const aes[4], const uint8_t key[4][AES_BLOCK_SIZE]) {
+    __m128i k0 = _mm_loadu_si128((const __m128i *)key[0]);
+    __m128i k1 = _mm_loadu_si128((const __m128i *)key[1]);
+    __m128i k2 = _mm_loadu_si128((const __m128i *)key[2]);
+    __m128i k3 = _mm_loadu_si128((const __m128i *)key[3]);
+    _mm_storeu_si128((__m128i *)aes[0]->enc[0], k0);
+    _mm_storeu_si128((__m128i *)aes[1]->enc[0], k1);
+    _mm_storeu_si128((__m128i *)aes[2]->enc[0], k2);
+    _mm_storeu_si128((__m128i *)aes[3]->enc[0], k3);
+    AES_NI_ROUND_KEY_X4(1, 0x01);
+    AES_NI_ROUND_KEY_X4(2, 0x02);
+    AES_NI_ROUND_KEY_X4(3, 0x04);
+    AES_NI_ROUND_KEY_X4(4, 0x08);
+    AES_NI_ROUND_KEY_X4(5, 0x10);
+    AES_NI_ROUND_KEY_X4(6, 0x20);
+    AES_NI_ROUND_KEY_X4(7, 0x40);
+    AES_NI_ROUND_KEY_X4(8, 0x80);
+    AES_NI_ROUND_KEY_X4(9, 0x1b);
+    AES_NI_ROUND_KEY_X4(10, 0x36);
+}
+
+// aesdec wants the round keys of the equivalent inverse cipher: reversed and run through InvMixColumns
+AES_NI_TARGET static void aes_inverse_ni(Aes128 *aes) {
+    memcpy(aes->dec[0], aes->enc[AES_ROUNDS], AES_BLOCK_SIZE);
+    for (int i = 1; i < AES_ROUNDS; i++) {
+        _mm_storeu_si128((__m128i *)aes->dec[i], _mm_aesimc_si128(_mm_loadu_si128((const __m128i *)aes->enc[AES_ROUNDS - i])));
+    }
+    memcpy(aes->dec[AES_ROUNDS], aes->enc[0], AES_BLOCK_SIZE);
+}
+
+AES_NI_TARGET static void aes_encrypt_ni(const Aes128 *aes, const uint8_t in[AES_BLOCK_SIZE], uint8_t out[AES_BLOCK_SIZE]) {
+    __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), _mm_loadu_si128((const __m128i *)aes->enc[0]));
+    for (int round = 1; round < AES_ROUNDS; round++) {
+        s = _mm_aesenc_si128(s, _mm_loadu_si128((const __m128i *)aes->enc[round]));
+    }
+    _mm_storeu_si128((__m128i *)out, _mm_aesenclast_si128(s, _mm_loadu_si128((const __m128i *)aes->enc[AES_ROUNDS])));
+}
+
+AES_NI_TARGET static void aes_decrypt_ni(const Aes128 *aes, const uint8_t in[AES_BLOCK_SIZE], uint8_t out[AES_BLOCK_SIZE]) {
+    __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), _mm_loadu_si128((const __m128i *)aes->dec[0]));
+    for (int round = 1; round < AES_ROUNDS; round++) {
+        s = _mm_aesdec_si128(s, _mm_loadu_si128((const __m128i *)aes->dec[round]));
+    }
+    _mm_storeu_si128((__m128i *)out, _mm_aesdeclast_si128(s, _mm_loadu_si128((const __m128i *)aes->dec[AES_ROUNDS])));
+}
+
+// the four lanes are independent, so the cpu can have four aesenc in flight instead of waiting for each result
+AES_NI_TARGET static void aes_encrypt_x4_ni(const Aes128 *const aes[4], const uint8_t in[4][AES_BLOCK_SIZE], uint8_t out[4][AES_BLOCK_SIZE]) {
+    __m128i s0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in[0]), _mm_loadu_si128((const __m128i *)aes[0]->enc[0]));
+    __m128i s1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in[1]), _mm_loadu_si128((const __m128i *)aes[1]->enc[0]));
+    __m128i s2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in[2]), _mm_loadu_si128((const __m128i *)aes[2]->enc[0]));
+    __m128i s3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in[3]), _mm_loadu_si128((const __m128i *)aes[3]->enc[0]));
+    for (int round = 1; round < AES_ROUNDS; round++) {
+        s0 = _mm_aesenc_si128(s0, _mm_loadu_si128((const __m128i *)aes[0]->enc[round]));
+        s1 = _mm_aesenc_si128(s1, _mm_loadu_si128((const __m128i *)aes[1]->enc[round]));
+        s2 = _mm_aesenc_si128(s2, _mm_loadu_si128((const __m128i *)aes[2]->enc[round]));
+        s3 = _mm_aesenc_si128(s3, _mm_loadu_si128((const __m128i *)aes[3]->enc[round]));
+    }
+    _mm_storeu_si128((__m128i *)out[0], _mm_aesenclast_si128(s0, _mm_loadu_si128((const __m128i *)aes[0]->enc[AES_ROUNDS])));
+    _mm_storeu_si128((__m128i *)out[1], _mm_aesenclast_si128(s1, _mm_loadu_si128((const __m128i *)aes[1]->enc[AES_ROUNDS])));
+    _mm_storeu_si128((__m128i *)out[2], _mm_aesenclast_si128(s2, _mm_loadu_si128((const __m128i *)aes[2]->enc[AES_ROUNDS])));
+    _mm_storeu_si128((__m128i *)out[3], _mm_aesenclast_si128(s3, _mm_loadu_si128((const __m128i *)aes[3]->enc[AES_ROUNDS])));
+}
+
+AES_NI_TARGET static void aes_decrypt_x4_ni(const Aes128 *const aes[4], const uint8_t in[4][AES_BLOCK_SIZE], uint8_t out[4][AES_BLOCK_SIZE]) {
+    __m128i s0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in[0]), _mm_loadu_si128((const __m128i *)aes[0]->dec[0]));
+    __m128i s1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in[1]), _mm_loadu_si128((const __m128i *)aes[1]->dec[0]));
+    __m128i s2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in[2]), _mm_loadu_si128((const __m128i *)aes[2]->dec[0]));
+    __m128i s3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in[3]), _mm_loadu_si128((const __m128i *)aes[3]->dec[0]));
+    for (int round = 1; round < AES_ROUNDS; round++) {
+        s0 = _mm_aesdec_si128(s0, _mm_loadu_si128((const __m128i *)aes[0]->dec[round]));
+        s1 = _mm_aesdec_si128(s1, _mm_loadu_si128((const __m128i *)aes[1]->dec[round]));
+        s2 = _mm_aesdec_si128(s2, _mm_loadu_si128((const __m128i *)aes[2]->dec[round]));
+        s3 = _mm_aesdec_si128(s3, _mm_loadu_si128((const __m128i *)aes[3]->dec[round]));
+    }
+    _mm_storeu_si128((__m128i *)out[0], _mm_aesdeclast_si128(s0, _mm_loadu_si128((const __m128i *)aes[0]->dec[AES_ROUNDS])));
+    _mm_storeu_si128((__m128i *)out[1], _mm_aesdeclast_si128(s1, _mm_loadu_si128((const __m128i *)aes[1]->dec[AES_ROUNDS])));
+    _mm_storeu_si128((__m128i *)out[2], _mm_aesdeclast_si128(s2, _mm_loadu_si128((const __m128i *)aes[2]->dec[AES_ROUNDS])));
+    _mm_storeu_si128((__m128i *)out[3], _mm_aesdeclast_si128(s3, _mm_loadu_si128((const __m128i *)aes[3]->dec[AES_ROUNDS])));
+}
+#endif
+
+// -------------------- AES-128 -------------------------------
+
+// aes_expand only builds the encryption schedule, which is all CMAC needs. aes128_init adds the decryption one
+static void aes_expand(Aes128 *aes, const uint8_t key[AES_BLOCK_SIZE]) {
+#if AES_HAVE_NI
+    if (aes_hw()) {
+        aes_expand_ni(aes, key);
+        return;
+    }
+#endif
+    aes_expand_portable(aes, key);
+}
+
+static void aes_expand_x4(Aes128 *const aes[4], const uint8_t key[4][AES_BLOCK_SIZE]) {
+#if AES_HAVE_NI
+    if (aes_hw()) {
+        aes_expand_x4_ni(aes, key);
+        return;
+    }
+#endif
+    for (int lane = 0; lane < 4; lane++) {
+        aes_expand_portable(aes[lane], key[lane]);
+    }
+}
+
+void aes128_init(Aes128 *aes, const uint8_t key[AES_BLOCK_SIZE]) {
+    aes_expand(aes, key);
+#if AES_HAVE_NI
+    if (aes_hw()) {
+        aes_inverse_ni(aes);
+    }
+#endif
+}
+
+void aes128_encrypt(const Aes128 *aes, const uint8_t in[AES_BLOCK_SIZE], uint8_t out[AES_BLOCK_SIZE]) {
+#if AES_HAVE_NI
+    if (aes_hw()) {
+        aes_encrypt_ni(aes, in, out);
+        return;
+    }
+#endif
+    aes_encrypt_portable(aes, in, out);
+}
+
+void aes128_decrypt(const Aes128 *aes, const uint8_t in[AES_BLOCK_SIZE], uint8_t out[AES_BLOCK_SIZE]) {
+#if AES_HAVE_NI
+    if (aes_hw()) {
+        aes_decrypt_ni(aes, in, out);
+        return;
+    }
+#endif
+    aes_decrypt_portable(aes, in, out);
+}
+
+void aes128_encrypt_x4(const Aes128 *const aes[4], const uint8_t in[4][AES_BLOCK_SIZE], uint8_t out[4][AES_BLOCK_SIZE]) {
+#if AES_HAVE_NI
+    if (aes_hw()) {
+        aes_encrypt_x4_ni(aes, in, out);
+        return;
+    }
+#endif
+    for (int lane = 0; lane < 4; lane++) {
+        aes_encrypt_portable(aes[lane], in[lane], out[lane]);
+    }
+}
+
+void aes128_decrypt_x4(const Aes128 *const aes[4], const uint8_t in[4][AES_BLOCK_SIZE], uint8_t out[4][AES_BLOCK_SIZE]) {
+#if AES_HAVE_NI
+    if (aes_hw()) {
+        aes_decrypt_x4_ni(aes, in, out);
+        return;
+    }
+#endif
+    for (int lane = 0; lane < 4; lane++) {
+        aes_decrypt_portable(aes[lane], in[lane], out[lane]);
+    }
+}
+
+// -------------------- AES-CMAC (RFC 4493) -------------------------------
+
+// aes_cmac_double multiplies by x in GF(2^128), which is how K1 and K2 are derived from L = AES(K, 0)
+// (done on two big endian 64 bit halves instead of byte by byte)
+static void aes_cmac_double(const uint8_t in[AES_BLOCK_SIZE], uint8_t out[AES_BLOCK_SIZE]) {
+    uint64_t high = 0;
+    uint64_t low = 0;
+    for (int i = 0; i < 8; i++) {
+        high = (high << 8) | in[i];
+        low = (low << 8) | in[8 + i];
+    }
+    uint64_t reduce = (high >> 63) * 0x87;
+    high = (high << 1) | (low >> 63);
+    low = (low << 1) ^ reduce;
+    for (int i = 7; i >= 0; i--) {
+        out[i] = (uint8_t)high;
+        out[8 + i] = (uint8_t)low;
+        high >>= 8;
+        low >>= 8;
+    }
+}
+
+static void aes_cmac_subkeys(AesCmac *cmac, const uint8_t l[AES_BLOCK_SIZE]) {
+    aes_cmac_double(l, cmac->k1);
+    aes_cmac_double(cmac->k1, cmac->k2);
+}
+
+void aes_cmac_init(AesCmac *cmac, const uint8_t key[AES_BLOCK_SIZE]) {
+    static const uint8_t zero[AES_BLOCK_SIZE] = {0};
+    uint8_t l[AES_BLOCK_SIZE];
+    aes_expand(&cmac->aes, key);
+    aes128_encrypt(&cmac->aes, zero, l);
+    aes_cmac_subkeys(cmac, l);
+}
+
+void aes_cmac_init_x4(AesCmac *const cmac[4], const uint8_t key[4][AES_BLOCK_SIZE]) {
+    uint8_t l[4][AES_BLOCK_SIZE] = {{0}};
+    const Aes128 *aes[4];
+    Aes128 *expand[4];
+    for (int lane = 0; lane < 4; lane++) {
+        expand[lane] = &cmac[lane]->aes;
+        aes[lane] = &cmac[lane]->aes;
+    }
+    aes_expand_x4(expand, key);
+    aes128_encrypt_x4(aes, (const uint8_t (*)[AES_BLOCK_SIZE])l, l);
+    for (int lane = 0; lane < 4; lane++) {
+        aes_cmac_subkeys(cmac[lane], l[lane]);
+    }
+}
+
+// aes_cmac_block returns block `index` of the message ready to be xored into the chain: the last block gets K1, or the
+// 80 00 .. padding and K2 if it is incomplete (an empty message is one padded block)
+static void aes_cmac_block(const AesCmac *cmac, const uint8_t *message, size_t length, size_t index, size_t blocks, uint8_t out[AES_BLOCK_SIZE]) {
+    size_t offset = index * AES_BLOCK_SIZE;
+    if (index + 1 < blocks) {
+        memcpy(out, message + offset, AES_BLOCK_SIZE);
+        return;
+    }
+    size_t rest = length - offset;
+    if (rest == AES_BLOCK_SIZE) {
+        for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+            out[i] = message[offset + i] ^ cmac->k1[i];
+        }
+        return;
+    }
+    memset(out, 0, AES_BLOCK_SIZE);
+    if (rest > 0) {
+        memcpy(out, message + offset, rest);
+    }
+    out[rest] = 0x80;
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+        out[i] ^= cmac->k2[i];
+    }
+}
+
+static size_t aes_cmac_blocks(size_t length) {
+    return (length == 0) ? 1 : (length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+}
+
+void aes_cmac(const AesCmac *cmac, const uint8_t *message, size_t length, uint8_t mac[AES_BLOCK_SIZE]) {
+    uint8_t x[AES_BLOCK_SIZE] = {0};
+    uint8_t block[AES_BLOCK_SIZE];
+    size_t blocks = aes_cmac_blocks(length);
+    for (size_t b = 0; b < blocks; b++) {
+        aes_cmac_block(cmac, message, length, b, blocks, block);
+        for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+            x[i] ^= block[i];
+        }
+        aes128_encrypt(&cmac->aes, x, x);
+    }
+    memcpy(mac, x, AES_BLOCK_SIZE);
+}
+
+void aes_cmac_x4(const AesCmac *const cmac[4], const uint8_t *const message[4], const size_t length[4], uint8_t mac[4][AES_BLOCK_SIZE]) {
+    uint8_t x[4][AES_BLOCK_SIZE] = {{0}};
+    uint8_t y[4][AES_BLOCK_SIZE];
+    size_t blocks[4];
+    size_t most = 0;
+    const Aes128 *aes[4];
+    for (int lane = 0; lane < 4; lane++) {
+        blocks[lane] = aes_cmac_blocks(length[lane]);
+        most = (blocks[lane] > most) ? blocks[lane] : most;
+        aes[lane] = &cmac[lane]->aes;
+    }
+
+    // lanes that are already done run along with their old chaining value, the result is simply not taken
+    for (size_t b = 0; b < most; b++) {
+        for (int lane = 0; lane < 4; lane++) {
+            if (b < blocks[lane]) {
+                uint8_t block[AES_BLOCK_SIZE];
+                aes_cmac_block(cmac[lane], message[lane], length[lane], b, blocks[lane], block);
+                for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+                    x[lane][i] ^= block[i];
+                }
+            }
+        }
+        aes128_encrypt_x4(aes, (const uint8_t (*)[AES_BLOCK_SIZE])x, y);
+        for (int lane = 0; lane < 4; lane++) {
+            if (b < blocks[lane]) {
+                memcpy(x[lane], y[lane], AES_BLOCK_SIZE);
+            }
+        }
+    }
+    memcpy(mac, x, sizeof(x));
+}
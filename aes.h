@@ -0,0 +1,44 @@
+#ifndef AES_H
+#define AES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// AES-128 and AES-CMAC (RFC 4493) for offline work like SUN verification (sun.c). no PC/SC dependency.
+// on x86 with AES-NI the round functions run on the aesenc / aesdec instructions (picked at runtime, no special compiler
+// flags needed), everywhere else a portable byte oriented implementation is used. the _x4 variants push four
+// independent blocks (each with its own key) through the rounds together, which hides the latency of aesenc
+
+#define AES_BLOCK_SIZE  16
+#define AES_ROUNDS      10
+
+typedef struct Aes128 {
+    uint8_t enc[AES_ROUNDS + 1][AES_BLOCK_SIZE];    // expanded key
+    uint8_t dec[AES_ROUNDS + 1][AES_BLOCK_SIZE];    // round keys of the equivalent inverse cipher (only filled by aes128_init with AES-NI)
+} Aes128;
+
+typedef struct AesCmac {
+    Aes128 aes;
+    uint8_t k1[AES_BLOCK_SIZE];                     // subkey for a complete last block
+    uint8_t k2[AES_BLOCK_SIZE];                     // subkey for a padded last block
+} AesCmac;
+
+// aes_hw returns 1 if AES-NI is used, aes_force_portable(1) switches it off (for comparisons and tests)
+int aes_hw(void);
+void aes_force_portable(int portable);
+
+void aes128_init(Aes128 *aes, const uint8_t key[AES_BLOCK_SIZE]);
+void aes128_encrypt(const Aes128 *aes, const uint8_t in[AES_BLOCK_SIZE], uint8_t out[AES_BLOCK_SIZE]);
+void aes128_decrypt(const Aes128 *aes, const uint8_t in[AES_BLOCK_SIZE], uint8_t out[AES_BLOCK_SIZE]);
+// lane i is processed with aes[i], in and out may be the same buffer
+void aes128_encrypt_x4(const Aes128 *const aes[4], const uint8_t in[4][AES_BLOCK_SIZE], uint8_t out[4][AES_BLOCK_SIZE]);
+void aes128_decrypt_x4(const Aes128 *const aes[4], const uint8_t in[4][AES_BLOCK_SIZE], uint8_t out[4][AES_BLOCK_SIZE]);
+
+void aes_cmac_init(AesCmac *cmac, const uint8_t key[AES_BLOCK_SIZE]);
+// aes_cmac_init_x4 sets up four keys at once (the subkey derivation of all four goes through one aes128_encrypt_x4)
+void aes_cmac_init_x4(AesCmac *const cmac[4], const uint8_t key[4][AES_BLOCK_SIZE]);
+void aes_cmac(const AesCmac *cmac, const uint8_t *message, size_t length, uint8_t mac[AES_BLOCK_SIZE]);
+// aes_cmac_x4 runs the CBC chains of four messages (of any length) side by side
+void aes_cmac_x4(const AesCmac *const cmac[4], const uint8_t *const message[4], const size_t length[4], uint8_t mac[4][AES_BLOCK_SIZE]);
+
+#endif
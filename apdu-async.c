@@ -0,0 +1,322 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "apdu-async.h"
+#include "timing.h"
+#include "logging.h"
+
+// -------------------- Notification fd -------------------------------
+
+// the fd is signalled when the completion list goes from empty to non-empty and drained before the list is taken, so a
+// completion can never sit in the list with a quiet fd (at worst the loop wakes up once for nothing)
+
+static BOOL apdu_async_notify_open(ApduAsync *engine) {
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    engine->notifyFd[0] = fd;
+    engine->notifyFd[1] = fd;
+    return fd >= 0;
+#else
+    if (pipe(engine->notifyFd) != 0) {
+        return FALSE;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(engine->notifyFd[i], F_SETFL, fcntl(engine->notifyFd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(engine->notifyFd[i], F_SETFD, FD_CLOEXEC);
+    }
+    return TRUE;
+#endif
+}
+
+static void apdu_async_notify_close(ApduAsync *engine) {
+    if (engine->notifyFd[0] >= 0) {
+        close(engine->notifyFd[0]);
+    }
+    if ((engine->notifyFd[1] >= 0) && (engine->notifyFd[1] != engine->notifyFd[0])) {
+        close(engine->notifyFd[1]);
+    }
+    engine->notifyFd[0] = engine->notifyFd[1] = -1;
+}
+
+static void apdu_async_notify(ApduAsync *engine) {
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t n = write(engine->notifyFd[1], &one, sizeof(one));
+#else
+    BYTE one = 1;
+    ssize_t n = write(engine->notifyFd[1], &one, sizeof(one));
+#endif
+    (void)n; // EAGAIN: the fd is readable already, which is all that counts
+}
+
+static void apdu_async_notify_drain(ApduAsync *engine) {
+    BYTE buffer[64];
+    while (read(engine->notifyFd[0], buffer, sizeof(buffer)) > 0) {
+        // an eventfd is empty after one read, the pipe may need a few
+    }
+}
+
+// -------------------- Completion -------------------------------
+
+static void apdu_async_complete(ApduAsync *engine, ApduAsyncReader *reader, ApduAsyncRequest *request) {
+    request->completedNs = timing_now_ns();
+    request->next = NULL;
+
+    pthread_mutex_lock(&reader->lock);
+    reader->pending--;
+    pthread_mutex_unlock(&reader->lock);
+
+    pthread_mutex_lock(&engine->doneLock);
+    engine->completed++;
+    if (request->response.status == (LONG)SCARD_E_CANCELLED) {
+        engine->cancelled++;
+    }
+    if (engine->mode == APDU_ASYNC_CALLBACK_IO_THREAD) {
+        pthread_mutex_unlock(&engine->doneLock);
+        if (request->callback != NULL) {
+            request->callback(request, request->userData);
+        }
+        return;
+    }
+    BOOL wasEmpty = (engine->doneHead == NULL);
+    if (wasEmpty) {
+        engine->doneHead = request;
+    } else {
+        engine->doneTail->next = request;
+    }
+    engine->doneTail = request;
+    pthread_mutex_unlock(&engine->doneLock);
+
+    if (wasEmpty) {
+        apdu_async_notify(engine);
+    }
+}
+
+static void apdu_async_cancel(ApduAsync *engine, ApduAsyncReader *reader, ApduAsyncRequest *request) {
+    ApduView cancelled = {
+        .status = (LONG)SCARD_E_CANCELLED,
+        .outcome = APDU_TRANSMIT_FAILED,
+        .data = request->recvBuffer,
+        .data_len = 0,
+        .sw1 = 0x00,
+        .sw2 = 0x00,
+        .attempts = 0
+    };
+    request->response = cancelled;
+    request->startedNs = 0;
+    apdu_async_complete(engine, reader, request);
+}
+
+// -------------------- I/O thread -------------------------------
+
+// apdu_async_thread takes the whole queue of its reader at once and works through it without touching the lock in
+// between, so a burst of submits costs one wake up
+static void *apdu_async_thread(void *arg) {
+    ApduAsyncReader *reader = arg;
+    ApduAsync *engine = reader->engine;
+
+    for (;;) {
+        pthread_mutex_lock(&reader->lock);
+        while ((reader->head == NULL) && !reader->stop) {
+            pthread_cond_wait(&reader->wake, &reader->lock);
+        }
+        ApduAsyncRequest *batch = reader->head;
+        reader->head = NULL;
+        reader->tail = NULL;
+        BOOL stopping = reader->stop;
+        pthread_mutex_unlock(&reader->lock);
+
+        while (batch != NULL) {
+            ApduAsyncRequest *request = batch;
+            batch = batch->next;
+            if (stopping || __atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+                apdu_async_cancel(engine, reader, request);
+                continue;
+            }
+
+            request->startedNs = timing_now_ns();
+            DWORD recvBufferSize = request->recvBufferSize;
+            request->response = request->once
+                ? executeApduOnce(reader->hCard, request->command, request->commandLength, request->recvBuffer, &recvBufferSize)
+                : executeApdu(reader->hCard, request->command, request->commandLength, request->recvBuffer, &recvBufferSize);
+            apdu_async_complete(engine, reader, request);
+        }
+        if (stopping) {
+            return NULL;
+        }
+    }
+}
+
+// -------------------------------------------------------
+
+BOOL apdu_async_init(ApduAsync *engine, ApduAsyncCallbackMode mode) {
+    memset(engine, 0, sizeof(*engine));
+    engine->mode = mode;
+    engine->notifyFd[0] = engine->notifyFd[1] = -1;
+    if (!apdu_async_notify_open(engine)) {
+        LOG_ERROR("Could not create the completion fd: %s", strerror(errno));
+        apdu_async_notify_close(engine);
+        return FALSE;
+    }
+    pthread_mutex_init(&engine->doneLock, NULL);
+    return TRUE;
+}
+
+LONG apdu_async_add_reader(ApduAsync *engine, SCARDHANDLE hCard, size_t *reader) {
+    if (engine->count >= APDU_ASYNC_MAX_READERS) {
+        LOG_ERROR("Async apdu engine already has %d readers.", APDU_ASYNC_MAX_READERS);
+        return SCARD_E_INVALID_PARAMETER;
+    }
+    ApduAsyncReader *r = &engine->readers[engine->count];
+    memset(r, 0, sizeof(*r));
+    r->engine = engine;
+    r->index = engine->count;
+    r->hCard = hCard;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    if (pthread_create(&r->thread, NULL, apdu_async_thread, r) != 0) {
+        LOG_ERROR("Could not start the I/O thread of reader %zu.", r->index);
+        pthread_cond_destroy(&r->wake);
+        pthread_mutex_destroy(&r->lock);
+        return SCARD_F_INTERNAL_ERROR;
+    }
+    *reader = engine->count++;
+    return SCARD_S_SUCCESS;
+}
+
+BOOL apdu_async_submit(ApduAsync *engine, size_t reader, ApduAsyncRequest *request) {
+    // checked before the reader lock is touched, the locks are destroyed at the end of apdu_async_close
+    if (__atomic_load_n(&engine->closed, __ATOMIC_ACQUIRE) || (reader >= engine->count)) {
+        return FALSE;
+    }
+    ApduAsyncReader *r = &engine->readers[reader];
+    request->reader = reader;
+    request->next = NULL;
+    request->startedNs = 0;
+    request->completedNs = 0;
+    request->submittedNs = timing_now_ns();
+
+    pthread_mutex_lock(&r->lock);
+    if (r->stop || (r->pending >= APDU_ASYNC_QUEUE_MAX)) {
+        pthread_mutex_unlock(&r->lock);
+        return FALSE;
+    }
+    BOOL wasIdle = (r->head == NULL);
+    if (wasIdle) {
+        r->head = request;
+    } else {
+        r->tail->next = request;
+    }
+    r->tail = request;
+    r->pending++;
+    pthread_mutex_unlock(&r->lock);
+
+    // the thread only waits on the condition while the queue is empty
+    if (wasIdle) {
+        pthread_cond_signal(&r->wake);
+    }
+    return TRUE;
+}
+
+size_t apdu_async_pending(ApduAsync *engine, size_t reader) {
+    if (reader >= engine->count) {
+        return 0;
+    }
+    ApduAsyncReader *r = &engine->readers[reader];
+    pthread_mutex_lock(&r->lock);
+    size_t pending = r->pending;
+    pthread_mutex_unlock(&r->lock);
+    return pending;
+}
+
+int apdu_async_fd(const ApduAsync *engine) {
+    return engine->notifyFd[0];
+}
+
+size_t apdu_async_dispatch(ApduAsync *engine) {
+    apdu_async_notify_drain(engine);
+    pthread_mutex_lock(&engine->doneLock);
+    ApduAsyncRequest *done = engine->doneHead;
+    engine->doneHead = NULL;
+    engine->doneTail = NULL;
+    pthread_mutex_unlock(&engine->doneLock);
+
+    size_t dispatched = 0;
+    while (done != NULL) {
+        ApduAsyncRequest *request = done;
+        done = done->next; // read before the callback, it may submit the request again
+        request->next = NULL;
+        if (request->callback != NULL) {
+            request->callback(request, request->userData);
+        }
+        dispatched++;
+    }
+    return dispatched;
+}
+
+ApduAsyncRequest *apdu_async_completed(ApduAsync *engine) {
+    apdu_async_notify_drain(engine);
+    pthread_mutex_lock(&engine->doneLock);
+    ApduAsyncRequest *request = engine->doneHead;
+    if (request != NULL) {
+        engine->doneHead = request->next;
+        if (engine->doneHead == NULL) {
+            engine->doneTail = NULL;
+        }
+        request->next = NULL;
+    }
+    BOOL more = (engine->doneHead != NULL);
+    pthread_mutex_unlock(&engine->doneLock);
+
+    // the fd was drained above, keep it readable for the completions that are still waiting
+    if (more) {
+        apdu_async_notify(engine);
+    }
+    return request;
+}
+
+size_t apdu_async_wait(ApduAsync *engine, int timeoutMs) {
+    struct pollfd pfd = { .fd = engine->notifyFd[0], .events = POLLIN };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeoutMs);
+    } while ((ready < 0) && (errno == EINTR));
+    return (ready > 0) ? apdu_async_dispatch(engine) : 0;
+}
+
+void apdu_async_close(ApduAsync *engine) {
+    __atomic_store_n(&engine->closed, TRUE, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < engine->count; i++) {
+        ApduAsyncReader *r = &engine->readers[i];
+        pthread_mutex_lock(&r->lock);
+        __atomic_store_n(&r->stop, TRUE, __ATOMIC_RELEASE);
+        pthread_cond_signal(&r->wake);
+        pthread_mutex_unlock(&r->lock);
+    }
+    for (size_t i = 0; i < engine->count; i++) {
+        pthread_join(engine->readers[i].thread, NULL);
+    }
+    // callbacks run here may still call apdu_async_submit / _pending, so the reader locks stay alive until after this
+    if (engine->mode == APDU_ASYNC_CALLBACK_DISPATCH) {
+        apdu_async_dispatch(engine);
+    }
+    if (engine->cancelled > 0) {
+        LOG_INFO("Async apdu engine closed, %llu of %llu requests were cancelled.", engine->cancelled, engine->completed);
+    }
+
+    for (size_t i = 0; i < engine->count; i++) {
+        ApduAsyncReader *r = &engine->readers[i];
+        pthread_cond_destroy(&r->wake);
+        pthread_mutex_destroy(&r->lock);
+    }
+    apdu_async_notify_close(engine);
+    pthread_mutex_destroy(&engine->doneLock);
+    engine->count = 0;
+}
@@ -0,0 +1,112 @@
+#ifndef APDU_ASYNC_H
+#define APDU_ASYNC_H
+
+#include <pthread.h>
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#ifndef READER_H
+#include "reader.h"
+#endif
+
+// Non-blocking apdu submission: every reader handle that is added gets its own I/O thread and queue, the thread runs the
+// blocking executeApdu (retries, trace and metrics included) for one request after the other. a request is submitted
+// without waiting and completes later: either its callback runs on the I/O thread, or (default) the completion is queued
+// and apdu_async_fd becomes readable, so an existing poll / epoll loop picks it up and runs the callbacks itself with
+// apdu_async_dispatch. requests of one reader complete in the order they were submitted.
+//
+// requests are owned by the caller and are not copied: command and receive buffer must stay untouched until the request
+// completed. while a reader has requests pending its card handle belongs to the I/O thread.
+//
+//      static ApduAsync engine;
+//      size_t reader;
+//      apdu_async_init(&engine, APDU_ASYNC_CALLBACK_DISPATCH);
+//      apdu_async_add_reader(&engine, session.hCard, &reader);
+//      ApduAsyncRequest read = { .command = cmd, .commandLength = 5, .recvBuffer = buf, .recvBufferSize = sizeof(buf), .callback = on_read };
+//      apdu_async_submit(&engine, reader, &read);
+//      epoll_ctl(epfd, EPOLL_CTL_ADD, apdu_async_fd(&engine), &(struct epoll_event){ .events = EPOLLIN });
+//      ... epoll_wait says the fd is readable: apdu_async_dispatch(&engine);   // on_read(&read, userData) runs here
+//      apdu_async_close(&engine);
+
+#define APDU_ASYNC_MAX_READERS  16
+#define APDU_ASYNC_QUEUE_MAX    256     // pending requests per reader, apdu_async_submit says no beyond that
+
+typedef enum ApduAsyncCallbackMode {
+    APDU_ASYNC_CALLBACK_DISPATCH,       // completions are queued, apdu_async_fd / apdu_async_dispatch deliver them
+    APDU_ASYNC_CALLBACK_IO_THREAD,      // callbacks run right away on the I/O thread of the reader (keep them short)
+} ApduAsyncCallbackMode;
+
+struct ApduAsyncRequest;
+typedef void (*ApduAsyncCallback)(struct ApduAsyncRequest *request, void *userData);
+
+typedef struct ApduAsyncRequest {
+    // set by the caller
+    BYTE *command;
+    DWORD commandLength;
+    BYTE *recvBuffer;
+    DWORD recvBufferSize;
+    BOOL once;                          // executeApduOnce instead of executeApdu (commands that must not be repeated)
+    ApduAsyncCallback callback;         // may be NULL, the request can also be fetched with apdu_async_completed
+    void *userData;
+
+    // set by the engine
+    size_t reader;
+    ApduView response;                  // response.data points into recvBuffer. status SCARD_E_CANCELLED: closed before it ran
+    uint64_t submittedNs;               // timing_now_ns() of submit / start of the exchange / completion
+    uint64_t startedNs;
+    uint64_t completedNs;
+    struct ApduAsyncRequest *next;
+} ApduAsyncRequest;
+
+struct ApduAsync;
+
+typedef struct ApduAsyncReader {
+    struct ApduAsync *engine;
+    size_t index;
+    SCARDHANDLE hCard;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    ApduAsyncRequest *head;             // submitted, not started yet
+    ApduAsyncRequest *tail;
+    size_t pending;                     // submitted and not completed
+    volatile BOOL stop;
+} ApduAsyncReader;
+
+typedef struct ApduAsync {
+    ApduAsyncReader readers[APDU_ASYNC_MAX_READERS];
+    size_t count;
+    ApduAsyncCallbackMode mode;
+    int notifyFd[2];                    // eventfd (both entries the same) on linux, a pipe elsewhere
+    pthread_mutex_t doneLock;
+    ApduAsyncRequest *doneHead;         // completed, not dispatched yet
+    ApduAsyncRequest *doneTail;
+    unsigned long long completed;
+    unsigned long long cancelled;
+    BOOL closed;                        // set first thing by apdu_async_close, apdu_async_submit refuses from then on
+} ApduAsync;
+
+BOOL apdu_async_init(ApduAsync *engine, ApduAsyncCallbackMode mode);
+// apdu_async_add_reader starts the I/O thread for hCard, *reader is the index to submit to
+LONG apdu_async_add_reader(ApduAsync *engine, SCARDHANDLE hCard, size_t *reader);
+// apdu_async_submit queues request for reader and returns right away, FALSE if the queue is full or the engine is closing
+BOOL apdu_async_submit(ApduAsync *engine, size_t reader, ApduAsyncRequest *request);
+// apdu_async_pending is the number of requests of reader that did not complete yet
+size_t apdu_async_pending(ApduAsync *engine, size_t reader);
+
+// apdu_async_fd is readable while completions are waiting (level triggered until apdu_async_dispatch / _completed took them)
+int apdu_async_fd(const ApduAsync *engine);
+// apdu_async_dispatch takes every waiting completion and runs its callback on the calling thread, returns how many
+size_t apdu_async_dispatch(ApduAsync *engine);
+// apdu_async_completed hands out the oldest waiting completion without running its callback, NULL if there is none
+ApduAsyncRequest *apdu_async_completed(ApduAsync *engine);
+// apdu_async_wait blocks up to timeoutMs (-1: no limit) for completions and dispatches them, for callers without a loop
+size_t apdu_async_wait(ApduAsync *engine, int timeoutMs);
+
+// apdu_async_close lets the running exchanges finish, completes everything that did not start yet with SCARD_E_CANCELLED,
+// stops the threads and dispatches what is left on the calling thread (a callback that submits again gets FALSE)
+void apdu_async_close(ApduAsync *engine);
+
+#endif
@@ -0,0 +1,285 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+
+#include "apdu-retry.h"
+#include "transport.h"
+#include "timing.h"
+#include "logging.h"
+
+static ApduRetryPolicy retryPolicy = {
+    .maxAttempts = 4,
+    .maxProtocolAttempts = 2,
+    .baseDelayUs = 500,
+    .maxDelayUs = 8000,
+    .reconnect = TRUE
+};
+
+// -------------------- Classification -------------------------------
+
+ApduErrorClass apdu_classify(const ApduView *response) {
+    switch (response->outcome) {
+        case APDU_OK:
+            return APDU_ERROR_NONE;
+        case APDU_MALFORMED:
+            return APDU_ERROR_PROTOCOL;
+        case APDU_STATUS_ERROR:
+            // wrapped desfire commands answer 91 xx, the exchange worked and desfire.c judges the status of the card
+            if (response->sw1 == 0x91) {
+                return APDU_ERROR_NONE;
+            }
+            // 63 00 is the ACR1581U's "operation failed" for pseudo apdus, which is what a tag at the edge of the field produces
+            return ((response->sw1 == 0x63) && (response->sw2 == 0x00)) ? APDU_ERROR_TRANSIENT_RF : APDU_ERROR_PERMANENT;
+        case APDU_TRANSMIT_FAILED:
+            break;
+    }
+
+    switch (response->status) {
+        case SCARD_W_REMOVED_CARD:
+        case SCARD_W_RESET_CARD:
+        case SCARD_W_UNRESPONSIVE_CARD:
+        case SCARD_W_UNPOWERED_CARD:
+        case SCARD_E_NO_SMARTCARD:
+        case SCARD_E_NOT_TRANSACTED:
+        case SCARD_E_TIMEOUT:
+            return APDU_ERROR_TRANSIENT_RF;
+        case SCARD_E_PROTO_MISMATCH:
+        case SCARD_F_COMM_ERROR:
+        case SCARD_E_COMM_DATA_LOST:
+            return APDU_ERROR_PROTOCOL;
+        default:
+            return APDU_ERROR_PERMANENT; // invalid handle, buffer too small, reader gone, ...
+    }
+}
+
+const char *apdu_error_class_name(ApduErrorClass errorClass) {
+    switch (errorClass) {
+        case APDU_ERROR_NONE:           return "none";
+        case APDU_ERROR_TRANSIENT_RF:   return "transient rf";
+        case APDU_ERROR_PROTOCOL:       return "protocol";
+        default:                        return "permanent";
+    }
+}
+
+// -------------------- Policy -------------------------------
+
+// the policy is set once at startup, before readers are used from other threads
+void apdu_retry_set_policy(const ApduRetryPolicy *policy) {
+    retryPolicy = *policy;
+    if (retryPolicy.maxAttempts == 0) {
+        retryPolicy.maxAttempts = 1;
+    }
+    if (retryPolicy.maxProtocolAttempts == 0) {
+        retryPolicy.maxProtocolAttempts = 1;
+    }
+}
+
+ApduRetryPolicy apdu_retry_get_policy(void) {
+    return retryPolicy;
+}
+
+static DWORD apdu_retry_env(const char *name, DWORD fallback) {
+    const char *value = getenv(name);
+    if ((value == NULL) || (*value == '\0')) {
+        return fallback;
+    }
+    char *end;
+    unsigned long parsed = strtoul(value, &end, 0);
+    if (*end != '\0') {
+        LOG_WARN("Ignoring invalid value '%s' of %s", value, name);
+        return fallback;
+    }
+    return (DWORD)parsed;
+}
+
+void apdu_retry_configure_from_env(void) {
+    ApduRetryPolicy policy = retryPolicy;
+    policy.maxAttempts = apdu_retry_env("NFC_RETRY_ATTEMPTS", policy.maxAttempts);
+    policy.baseDelayUs = apdu_retry_env("NFC_RETRY_BASE_US", policy.baseDelayUs);
+    if (policy.maxProtocolAttempts > policy.maxAttempts) {
+        policy.maxProtocolAttempts = policy.maxAttempts;
+    }
+    apdu_retry_set_policy(&policy);
+}
+
+DWORD apdu_retry_backoff_us(const ApduRetryPolicy *policy, DWORD retry) {
+    // xorshift per thread, only has to keep readers that failed together from retrying in lockstep
+    static __thread uint64_t state;
+    if (state == 0) {
+        state = timing_now_ns() | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    uint64_t delay = policy->baseDelayUs;
+    for (DWORD i = 1; (i < retry) && (delay < policy->maxDelayUs); i++) {
+        delay *= 2;
+    }
+    delay = (delay > policy->maxDelayUs) ? policy->maxDelayUs : delay;
+    // "equal jitter": half of the delay is fixed, the other half random
+    return (DWORD)(delay / 2 + (delay > 1 ? state % (delay / 2 + 1) : 0));
+}
+
+// -------------------- Recovery -------------------------------
+
+// the UID belongs to the handle and not to the thread that read it: async I/O threads and the client threads of nfcd
+// run apdus on handles whose tag was identified somewhere else
+#define APDU_BOUND_UIDS 64
+
+typedef struct ApduBoundUid {
+    SCARDHANDLE hCard;          // 0 = free entry
+    BYTE uid[10];
+    BYTE uidLen;
+} ApduBoundUid;
+
+static ApduBoundUid boundUids[APDU_BOUND_UIDS];
+static pthread_mutex_t boundUidLock = PTHREAD_MUTEX_INITIALIZER;
+
+void apdu_retry_bind_uid(SCARDHANDLE hCard, const BYTE *uid, BYTE uidLen) {
+    if (hCard == 0) {
+        return;
+    }
+    pthread_mutex_lock(&boundUidLock);
+    ApduBoundUid *entry = NULL;
+    for (size_t i = 0; i < APDU_BOUND_UIDS; i++) {
+        if (boundUids[i].hCard == hCard) {
+            entry = &boundUids[i];
+            break;
+        }
+        if ((entry == NULL) && (boundUids[i].hCard == 0)) {
+            entry = &boundUids[i];
+        }
+    }
+    if ((uid == NULL) || (uidLen == 0)) {
+        if ((entry != NULL) && (entry->hCard == hCard)) {
+            entry->hCard = 0;
+            entry->uidLen = 0;
+        }
+    } else if (entry == NULL) {
+        LOG_WARN("More than %d handles with a bound UID, retries on handle 0x%lx are not checked", APDU_BOUND_UIDS, (unsigned long)hCard);
+    } else {
+        entry->hCard = hCard;
+        entry->uidLen = (uidLen > sizeof(entry->uid)) ? (BYTE)sizeof(entry->uid) : uidLen;
+        memcpy(entry->uid, uid, entry->uidLen);
+    }
+    pthread_mutex_unlock(&boundUidLock);
+}
+
+// apdu_retry_bound_uid copies the UID bound to hCard, FALSE if there is none
+static BOOL apdu_retry_bound_uid(SCARDHANDLE hCard, ApduBoundUid *out) {
+    BOOL found = FALSE;
+    pthread_mutex_lock(&boundUidLock);
+    for (size_t i = 0; (i < APDU_BOUND_UIDS) && !found; i++) {
+        if ((boundUids[i].hCard == hCard) && (boundUids[i].uidLen > 0)) {
+            *out = boundUids[i];
+            found = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&boundUidLock);
+    return found;
+}
+
+static ApduRetryStats retryStats; // every field is updated and read with __atomic_*
+
+ApduErrorClass apdu_retry_recover(SCARDHANDLE hCard, const ApduView *failed) {
+    if (failed->outcome != APDU_TRANSMIT_FAILED) {
+        return APDU_ERROR_NONE; // 63 00: the handle is fine, the tag just did not answer
+    }
+    if (!retryPolicy.reconnect) {
+        BOOL mute = (failed->status == SCARD_W_UNRESPONSIVE_CARD) || (failed->status == SCARD_E_TIMEOUT) || (failed->status == SCARD_E_NOT_TRANSACTED);
+        return mute ? APDU_ERROR_NONE : APDU_ERROR_TRANSIENT_RF;
+    }
+
+    const Transport *transport = transport_get();
+    DWORD protocol;
+    // same tag still (or again after a reset) in the field: LEAVE_CARD keeps its state, a tag that was out of the field needs RESET_CARD
+    // pcsc-lite lets LEAVE_CARD succeed on a tag that was swapped in the meantime, so success says nothing about which tag it is
+    LONG lRet = transport->reconnect(hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &protocol);
+    if ((lRet == SCARD_E_NO_SMARTCARD) || (lRet == SCARD_W_REMOVED_CARD) || (lRet == SCARD_W_UNRESPONSIVE_CARD)) {
+        lRet = transport->reconnect(hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &protocol);
+    }
+    __atomic_fetch_add(&retryStats.reconnects, 1, __ATOMIC_RELAXED);
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_DEBUG("Reconnect after 0x%x failed: 0x%x", (unsigned int)failed->status, (unsigned int)lRet);
+        return (lRet == SCARD_E_NO_SMARTCARD) ? APDU_ERROR_NONE : APDU_ERROR_TRANSIENT_RF; // not back yet, the next backoff gives it another chance
+    }
+    ApduBoundUid boundUid;
+    if (!apdu_retry_bound_uid(hCard, &boundUid)) {
+        return APDU_ERROR_NONE;
+    }
+
+    // every reconnect after a removed / reset / mute tag can have landed on another one, make sure it is the same
+    // tag before the apdu is repeated. the UID read can fail on a weak field as well, that is no proof either way
+    BYTE getUid[5] = { 0xFF, 0xCA, 0x00, 0x00, 0x00 };
+    BYTE reply[16];
+    for (DWORD attempt = 0; attempt < retryPolicy.maxAttempts; attempt++) {
+        DWORD replyLength = sizeof(reply);
+        lRet = transport->transmit(hCard, getUid, sizeof(getUid), reply, &replyLength);
+        if ((lRet != SCARD_S_SUCCESS) || (replyLength < 2) || (reply[replyLength - 2] != 0x90) || (reply[replyLength - 1] != 0x00)) {
+            continue;
+        }
+        if ((replyLength != (DWORD)boundUid.uidLen + 2) || (memcmp(reply, boundUid.uid, boundUid.uidLen) != 0)) {
+            LOG_WARN("A different tag showed up while retrying, giving up");
+            apdu_retry_bind_uid(hCard, NULL, 0);
+            return APDU_ERROR_PERMANENT;
+        }
+        return APDU_ERROR_NONE;
+    }
+    LOG_DEBUG("UID could not be read after the reconnect, not repeating the apdu");
+    return APDU_ERROR_TRANSIENT_RF;
+}
+
+// -------------------- Stats -------------------------------
+
+void apdu_retry_count(DWORD attempts, ApduErrorClass finalClass, const DWORD *failedByClass) {
+    __atomic_fetch_add(&retryStats.apdus, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&retryStats.attempts, attempts, __ATOMIC_RELAXED);
+    if (failedByClass[APDU_ERROR_TRANSIENT_RF] > 0) {
+        __atomic_fetch_add(&retryStats.transientRf, failedByClass[APDU_ERROR_TRANSIENT_RF], __ATOMIC_RELAXED);
+    }
+    if (failedByClass[APDU_ERROR_PROTOCOL] > 0) {
+        __atomic_fetch_add(&retryStats.protocol, failedByClass[APDU_ERROR_PROTOCOL], __ATOMIC_RELAXED);
+    }
+    if (failedByClass[APDU_ERROR_PERMANENT] > 0) {
+        __atomic_fetch_add(&retryStats.permanent, failedByClass[APDU_ERROR_PERMANENT], __ATOMIC_RELAXED);
+    }
+    // gave up: a retryable failure that did not go away, also with retries switched off or a tag swapped before the retry
+    BOOL retryable = (failedByClass[APDU_ERROR_TRANSIENT_RF] > 0) || (failedByClass[APDU_ERROR_PROTOCOL] > 0);
+    if ((attempts > 1) && (finalClass == APDU_ERROR_NONE)) {
+        __atomic_fetch_add(&retryStats.recovered, 1, __ATOMIC_RELAXED);
+    } else if ((finalClass != APDU_ERROR_NONE) && ((attempts > 1) || retryable)) {
+        __atomic_fetch_add(&retryStats.gaveUp, 1, __ATOMIC_RELAXED);
+    }
+}
+
+ApduRetryStats apdu_retry_stats(void) {
+    ApduRetryStats stats;
+    stats.apdus = __atomic_load_n(&retryStats.apdus, __ATOMIC_RELAXED);
+    stats.attempts = __atomic_load_n(&retryStats.attempts, __ATOMIC_RELAXED);
+    stats.transientRf = __atomic_load_n(&retryStats.transientRf, __ATOMIC_RELAXED);
+    stats.protocol = __atomic_load_n(&retryStats.protocol, __ATOMIC_RELAXED);
+    stats.permanent = __atomic_load_n(&retryStats.permanent, __ATOMIC_RELAXED);
+    stats.reconnects = __atomic_load_n(&retryStats.reconnects, __ATOMIC_RELAXED);
+    stats.recovered = __atomic_load_n(&retryStats.recovered, __ATOMIC_RELAXED);
+    stats.gaveUp = __atomic_load_n(&retryStats.gaveUp, __ATOMIC_RELAXED);
+    return stats;
+}
+
+void apdu_retry_reset_stats(void) {
+    __atomic_store_n(&retryStats.apdus, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&retryStats.attempts, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&retryStats.transientRf, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&retryStats.protocol, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&retryStats.permanent, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&retryStats.reconnects, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&retryStats.recovered, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&retryStats.gaveUp, 0, __ATOMIC_RELAXED);
+}
+
+void apdu_retry_stats_print(FILE *out) {
+    ApduRetryStats s = apdu_retry_stats();
+    fprintf(out, "apdus %llu, attempts %llu, failed attempts: %llu transient rf / %llu protocol / %llu permanent, reconnects %llu, recovered %llu, gave up %llu\n",
+            (unsigned long long)s.apdus, (unsigned long long)s.attempts, (unsigned long long)s.transientRf, (unsigned long long)s.protocol,
+            (unsigned long long)s.permanent, (unsigned long long)s.reconnects, (unsigned long long)s.recovered, (unsigned long long)s.gaveUp);
+}
@@ -0,0 +1,72 @@
+#ifndef APDU_RETRY_H
+#define APDU_RETRY_H
+
+#ifndef READER_H
+#include "reader.h"
+#endif
+
+// Retry layer of executeApdu: a tag with weak coupling (e.g. on a moving conveyor) often fails a single exchange and
+// answers the next one. every failed attempt is classified:
+//      APDU_ERROR_TRANSIENT_RF  tag left the field for a moment, is mute, or the reader reports an RF failure (63 00)
+//                               -> retried after a short jittered backoff, the card handle is reconnected if needed
+//      APDU_ERROR_PROTOCOL      reply without status word, protocol or buffer errors -> retried without reconnect
+//      APDU_ERROR_PERMANENT     any other status word (wrong length, not supported, ...) or a dead handle -> returned right away
+// every reconnect reads the UID again and gives up with a permanent error if it is not the tag that getUID last saw on
+// this handle (pcsc-lite reconnects a swapped tag even with SCARD_LEAVE_CARD), so a retry never ends up on the next tag
+// of the conveyor.
+// policy via apdu_retry_set_policy or environment (apdu_retry_configure_from_env):
+//      NFC_RETRY_ATTEMPTS  attempts per apdu including the first one (default 4, 1 = no retries)
+//      NFC_RETRY_BASE_US   first backoff in microseconds, doubled per retry with jitter (default 500)
+
+typedef enum ApduErrorClass {
+    APDU_ERROR_NONE,
+    APDU_ERROR_TRANSIENT_RF,
+    APDU_ERROR_PROTOCOL,
+    APDU_ERROR_PERMANENT
+} ApduErrorClass;
+
+typedef struct ApduRetryPolicy {
+    DWORD maxAttempts;          // including the first one
+    DWORD maxProtocolAttempts;  // protocol errors usually don't go away, so they get fewer tries
+    DWORD baseDelayUs;          // backoff before the first retry, doubled for every further one
+    DWORD maxDelayUs;           // upper bound of a single backoff
+    BOOL reconnect;             // reconnect the handle after card removed / reset / mute errors
+} ApduRetryPolicy;
+
+// counters over all threads since the start (or apdu_retry_reset_stats)
+typedef struct ApduRetryStats {
+    uint64_t apdus;             // executeApdu calls
+    uint64_t attempts;          // exchanges incl. retries
+    uint64_t transientRf;       // failed attempts per class
+    uint64_t protocol;
+    uint64_t permanent;
+    uint64_t reconnects;
+    uint64_t recovered;         // apdus that worked after at least one retry
+    uint64_t gaveUp;            // apdus that still failed when the attempts ran out (or the tag was swapped)
+} ApduRetryStats;
+
+ApduErrorClass apdu_classify(const ApduView *response);
+const char *apdu_error_class_name(ApduErrorClass errorClass);
+
+void apdu_retry_set_policy(const ApduRetryPolicy *policy);
+ApduRetryPolicy apdu_retry_get_policy(void);
+void apdu_retry_configure_from_env(void);
+
+// apdu_retry_backoff_us returns the jittered delay before retry number `retry` (1 = first retry)
+DWORD apdu_retry_backoff_us(const ApduRetryPolicy *policy, DWORD retry);
+
+// apdu_retry_recover reconnects hCard after a transient error. APDU_ERROR_NONE: go on with the retry,
+// APDU_ERROR_TRANSIENT_RF: the handle could not be reconnected, APDU_ERROR_PERMANENT: a different tag lies there now
+ApduErrorClass apdu_retry_recover(SCARDHANDLE hCard, const ApduView *failed);
+
+// apdu_retry_bind_uid remembers the UID that was read through hCard (called by getUID), NULL forgets it. the binding
+// is per handle, so retries on any thread that uses hCard check it. forget it before the handle is disconnected
+void apdu_retry_bind_uid(SCARDHANDLE hCard, const BYTE *uid, BYTE uidLen);
+
+// apdu_retry_count is called by executeApdu once per apdu with the amount of attempts and the final class
+void apdu_retry_count(DWORD attempts, ApduErrorClass finalClass, const DWORD *failedByClass);
+ApduRetryStats apdu_retry_stats(void);
+void apdu_retry_reset_stats(void);
+void apdu_retry_stats_print(FILE *out);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef APDU_TRACE_FORMAT_H
+#define APDU_TRACE_FORMAT_H
+
+#include <stdint.h>
+
+// On-disk format of binary APDU traces (written by apdu-trace.c, read by nfc-trace.c). all integers are little endian.
+// this header does not depend on PC/SC so the offline dumper can be built anywhere
+//
+//      file header (16 bytes):  "NFCTRACE" | u32 version | u32 reserved
+//      record header (24 bytes): u64 wall clock timestamp in ns since 1970 | u32 reader (card handle) | u32 status (pcsc, 0 = success)
+//                                | u32 length of bytes | u8 direction | 3 reserved bytes
+//      followed by <length> bytes of the command or response apdu
+
+#define APDU_TRACE_MAGIC            "NFCTRACE"
+#define APDU_TRACE_VERSION          1
+#define APDU_TRACE_FILE_HEADER_SIZE 16
+#define APDU_TRACE_RECORD_HEADER_SIZE 24
+
+#define APDU_TRACE_DIRECTION_COMMAND    0   // host -> tag ("> " in the console output)
+#define APDU_TRACE_DIRECTION_RESPONSE   1   // tag -> host ("< " in the console output)
+
+static inline void apdu_trace_put_le(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static inline uint64_t apdu_trace_get_le(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+
+#include "apdu-trace.h"
+#include "apdu-trace-format.h"
+#include "reader.h"
+#include "timing.h"
+#include "logging.h"
+
+#define APDU_TRACE_BUFFER_SIZE (1024 * 1024) // records are collected here and hit the disk in large writes
+
+// traceMode is only written under traceLock, apdu_trace_exchange reads it without the lock (atomically) so console
+// tracing and no tracing never touch the mutex
+static ApduTraceMode traceMode = APDU_TRACE_CONSOLE;
+static FILE *traceFile = NULL;
+static char *traceBuffer = NULL;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER; // keeps the records of one exchange together when multiple readers are used
+
+void apdu_trace_set_mode(ApduTraceMode mode) {
+    if (mode == APDU_TRACE_FILE) {
+        LOG_WARN("Use apdu_trace_open_file to trace into a file");
+        return;
+    }
+    apdu_trace_close();
+    pthread_mutex_lock(&traceLock);
+    __atomic_store_n(&traceMode, mode, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&traceLock);
+}
+
+ApduTraceMode apdu_trace_get_mode(void) {
+    return __atomic_load_n(&traceMode, __ATOMIC_ACQUIRE);
+}
+
+BOOL apdu_trace_open_file(const char *path) {
+    apdu_trace_close();
+
+    // a+: reading the header of an existing file, every write still goes to the end
+    FILE *file = fopen(path, "a+b");
+    if (file == NULL) {
+        LOG_ERROR("Failed to open trace file %s", path);
+        return FALSE;
+    }
+    char *buffer = malloc(APDU_TRACE_BUFFER_SIZE);
+    if (buffer != NULL) {
+        setvbuf(file, buffer, _IOFBF, APDU_TRACE_BUFFER_SIZE);
+    }
+
+    // new (empty) files get the file header, existing traces are only appended to if they are traces of this version
+    BYTE header[APDU_TRACE_FILE_HEADER_SIZE] = {0};
+    if ((fseek(file, 0, SEEK_END) != 0) || (ftell(file) < 0)) {
+        LOG_ERROR("Failed to open trace file %s", path);
+        fclose(file);
+        free(buffer);
+        return FALSE;
+    }
+    if (ftell(file) == 0) {
+        memcpy(header, APDU_TRACE_MAGIC, 8);
+        apdu_trace_put_le(header + 8, APDU_TRACE_VERSION, 4);
+        fwrite(header, 1, sizeof(header), file);
+    } else if ((fseek(file, 0, SEEK_SET) != 0) || (fread(header, 1, sizeof(header), file) != sizeof(header))
+               || (memcmp(header, APDU_TRACE_MAGIC, 8) != 0) || (apdu_trace_get_le(header + 8, 4) != APDU_TRACE_VERSION)) {
+        LOG_ERROR("%s exists and is not an apdu trace of version %d, refusing to append to it", path, APDU_TRACE_VERSION);
+        fclose(file);
+        free(buffer);
+        return FALSE;
+    }
+
+    pthread_mutex_lock(&traceLock);
+    traceFile = file;
+    traceBuffer = buffer;
+    __atomic_store_n(&traceMode, APDU_TRACE_FILE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&traceLock);
+    LOG_INFO("Tracing apdus into %s", path);
+    return TRUE;
+}
+
+void apdu_trace_close(void) {
+    pthread_mutex_lock(&traceLock);
+    if (traceFile != NULL) {
+        fclose(traceFile);
+        traceFile = NULL;
+        __atomic_store_n(&traceMode, APDU_TRACE_NONE, __ATOMIC_RELEASE);
+    }
+    free(traceBuffer);
+    traceBuffer = NULL;
+    pthread_mutex_unlock(&traceLock);
+}
+
+void apdu_trace_configure_from_env(void) {
+    const char *value = getenv("NFC_TRACE");
+    if ((value == NULL) || (strcmp(value, "console") == 0)) {
+        apdu_trace_set_mode(APDU_TRACE_CONSOLE);
+    } else if (strcmp(value, "none") == 0) {
+        apdu_trace_set_mode(APDU_TRACE_NONE);
+    } else if ((strncmp(value, "file:", 5) == 0) && apdu_trace_open_file(value + 5)) {
+        atexit(apdu_trace_close); // flush what is still buffered
+    } else {
+        LOG_WARN("Invalid NFC_TRACE '%s' (use console, none or file:<path>), tracing to console", value);
+        apdu_trace_set_mode(APDU_TRACE_CONSOLE);
+    }
+}
+
+static void apdu_trace_write_record(uint64_t timestamp, SCARDHANDLE hCard, LONG status, BYTE direction, const BYTE *data, DWORD length) {
+    BYTE header[APDU_TRACE_RECORD_HEADER_SIZE] = {0};
+    apdu_trace_put_le(header, timestamp, 8);
+    apdu_trace_put_le(header + 8, (uint32_t)hCard, 4);
+    apdu_trace_put_le(header + 12, (uint32_t)status, 4);
+    apdu_trace_put_le(header + 16, length, 4);
+    header[20] = direction;
+    fwrite(header, 1, sizeof(header), traceFile);
+    fwrite(data, 1, length, traceFile);
+}
+
+void apdu_trace_exchange(SCARDHANDLE hCard, const BYTE *command, DWORD commandLength, LONG status, const BYTE *response, DWORD responseLength) {
+    ApduTraceMode mode = __atomic_load_n(&traceMode, __ATOMIC_ACQUIRE);
+    if (mode == APDU_TRACE_NONE) {
+        return;
+    }
+
+    if (mode == APDU_TRACE_CONSOLE) {
+        flockfile(stdout);
+        if (status == SCARD_S_SUCCESS) {
+            // print which command you sent
+            printf("> ");
+            printHex(command, commandLength);
+
+            // print what you received
+            printf("< ");
+            printHex(response, responseLength);
+        } else {
+            printf("%08lx\n", (unsigned long)status);
+        }
+        funlockfile(stdout);
+        return;
+    }
+
+    uint64_t now = timing_wall_ns();
+    pthread_mutex_lock(&traceLock);
+    if (traceFile != NULL) {
+        apdu_trace_write_record(now, hCard, SCARD_S_SUCCESS, APDU_TRACE_DIRECTION_COMMAND, command, commandLength);
+        apdu_trace_write_record(now, hCard, status, APDU_TRACE_DIRECTION_RESPONSE, response, (status == SCARD_S_SUCCESS) ? responseLength : 0);
+    }
+    pthread_mutex_unlock(&traceLock);
+}
@@ -0,0 +1,29 @@
+#ifndef APDU_TRACE_H
+#define APDU_TRACE_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+// Where executeApdu reports the apdus it exchanged:
+//      APDU_TRACE_CONSOLE  "> ff ca 00 00 00" / "< ... 90 00" on stdout like it always did (default)
+//      APDU_TRACE_NONE     nothing at all, for production lines that don't want to pay for console i/o
+//      APDU_TRACE_FILE     compact binary records (see apdu-trace-format.h) through a large stdio buffer, dump with nfc-trace
+// selected with NFC_TRACE=console|none|file:<path> (apdu_trace_configure_from_env) or apdu_trace_open_file
+
+typedef enum ApduTraceMode {
+    APDU_TRACE_CONSOLE,
+    APDU_TRACE_NONE,
+    APDU_TRACE_FILE
+} ApduTraceMode;
+
+void apdu_trace_set_mode(ApduTraceMode mode);
+ApduTraceMode apdu_trace_get_mode(void);
+BOOL apdu_trace_open_file(const char *path);    // switches to APDU_TRACE_FILE, appends if the file already is a trace
+void apdu_trace_close(void);                    // flushes and closes the trace file (back to APDU_TRACE_NONE)
+void apdu_trace_configure_from_env(void);
+
+// apdu_trace_exchange records one command and its response. status is what SCardTransmit returned, on failure the response is not recorded
+void apdu_trace_exchange(SCARDHANDLE hCard, const BYTE *command, DWORD commandLength, LONG status, const BYTE *response, DWORD responseLength);
+
+#endif
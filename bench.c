@@ -0,0 +1,380 @@
+// nfc-bench: measures APDU round trips against the real reader or the simulated one (NFC_TRANSPORT=sim), see `make bench`
+//      usage: nfc-bench [-n iterations] [-o operation] [-v]
+//      operations: getuid, read_page, fastread, write_page, write_range, connect_identify, warm_identify, async_read_pages
+//      (default: all of them)
+#define _POSIX_C_SOURCE 200809L // dup, fileno, fdopen
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "nfcacr.h"
+#include "timing.h"
+#include "logging.h"
+
+#define BENCH_DEFAULT_ITERATIONS    200
+#define BENCH_PAGE                  0x3F // last user memory page, the write benchmark writes back what was already stored there
+#define BENCH_ASYNC_BATCH           16   // page reads that async_read_pages submits at once
+
+// BenchContext holds everything the operations need, so that each one only measures the APDU path it is named after
+typedef struct BenchContext {
+    SCARDCONTEXT hContext;
+    SCARDHANDLE hCard;
+    DWORD dwActiveProtocol;
+    char mszReaders[1024];
+    DWORD dwReaders;
+    char reader[256];
+    BYTE pbRecvBuffer[2048];
+    DWORD pbRecvBufferSize;
+    BYTE pageBackup[4];
+    BYTE userBackup[EM_4423_USER_MEMORY_BYTES];
+    BOOL pageBackupRead;        // the write benchmarks only run if they can write back what was there
+    BOOL userBackupRead;
+    ApduAsync async;            // started by the first async_read_pages
+    size_t asyncReader;
+    BOOL asyncStarted;
+} BenchContext;
+
+typedef BOOL (*BenchOp)(BenchContext *ctx);
+
+// BenchBackup names the backup a case writes back, a case whose backup could not be read is skipped
+typedef enum BenchBackup {
+    BENCH_BACKUP_NONE,
+    BENCH_BACKUP_PAGE,
+    BENCH_BACKUP_USER,
+} BenchBackup;
+
+typedef struct BenchCase {
+    const char *name;
+    BenchOp op;
+    BenchBackup backup;
+} BenchCase;
+
+static FILE *report; // real stdout, the functions under test print their apdus to the (silenced) stdout
+
+// -------------------- Operations -------------------------------
+
+static BOOL bench_getuid(BenchContext *ctx) {
+    return getUID(ctx->hCard, ctx->pbRecvBuffer, &ctx->pbRecvBufferSize, FALSE, NULL, NULL) == SCARD_S_SUCCESS;
+}
+
+static BOOL bench_read_page(BenchContext *ctx) {
+    return em_4423_read_page(BENCH_PAGE, ctx->hCard, ctx->pbRecvBuffer, &ctx->pbRecvBufferSize);
+}
+
+static BOOL bench_fastread(BenchContext *ctx) {
+    return em_4423_fastread(ctx->hCard, ctx->pbRecvBuffer, &ctx->pbRecvBufferSize);
+}
+
+static BOOL bench_write_page(BenchContext *ctx) {
+    return em_4423_write_page(ctx->pageBackup, BENCH_PAGE, ctx->hCard, ctx->pbRecvBuffer, &ctx->pbRecvBufferSize);
+}
+
+// bench_write_range rewrites the whole user memory with its current content (bulk write + one read back)
+static BOOL bench_write_range(BenchContext *ctx) {
+    return em_4423_write_range(EM_4423_FIRST_USER_PAGE, ctx->userBackup, sizeof(ctx->userBackup), ctx->hCard, ctx->pbRecvBuffer, &ctx->pbRecvBufferSize);
+}
+
+// bench_connect_identify repeats everything main() does: context, reader list, buzzer, connect, UID / ATR / ATS, disconnect
+static BOOL bench_connect_identify(BenchContext *ctx) {
+    const Transport *transport = transport_get();
+    SCARDCONTEXT hContext;
+    SCARDHANDLE hCard = 0;
+    DWORD dwActiveProtocol;
+    char mszReaders[1024];
+    DWORD dwReaders = sizeof(mszReaders);
+    TagIdentity tag;
+
+    if (transport->establishContext(SCARD_SCOPE_SYSTEM, &hContext) != SCARD_S_SUCCESS) {
+        return FALSE;
+    }
+    if (getAvailableReaders(hContext, mszReaders, &dwReaders) != SCARD_S_SUCCESS) {
+        transport->releaseContext(hContext);
+        return FALSE;
+    }
+    char *reader = findPiccReader(mszReaders);
+    if ((reader == NULL) || (disableBuzzer(hContext, reader, &hCard, &dwActiveProtocol, ctx->pbRecvBuffer, &ctx->pbRecvBufferSize) != SCARD_S_SUCCESS)) {
+        transport->releaseContext(hContext);
+        return FALSE;
+    }
+    transport->disconnect(hCard, SCARD_LEAVE_CARD);
+    ctx->pbRecvBufferSize = sizeof(ctx->pbRecvBuffer);
+
+    LONG lRet = waitForTag(hContext, reader, &hCard, &dwActiveProtocol, NULL);
+    if (lRet != SCARD_S_SUCCESS) {
+        transport->releaseContext(hContext);
+        return FALSE;
+    }
+    lRet = identifyTag(hCard, mszReaders, dwReaders, &dwActiveProtocol, ctx->pbRecvBuffer, &ctx->pbRecvBufferSize, &tag);
+    disconnectReader(hCard, hContext);
+    return lRet == SCARD_S_SUCCESS;
+}
+
+// bench_warm_identify is what a session does for a tag: reuse the open handle (SCardReconnect) and identify the tag
+// inside one transaction, compare with connect_identify
+static BOOL bench_warm_identify(BenchContext *ctx) {
+    const Transport *transport = transport_get();
+    TagIdentity tag;
+
+    if (transport->reconnect(ctx->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &ctx->dwActiveProtocol) != SCARD_S_SUCCESS) {
+        return FALSE;
+    }
+    if (transport->beginTransaction(ctx->hCard) != SCARD_S_SUCCESS) {
+        return FALSE;
+    }
+    ctx->dwReaders = sizeof(ctx->mszReaders);
+    LONG lRet = identifyTag(ctx->hCard, ctx->mszReaders, ctx->dwReaders, &ctx->dwActiveProtocol, ctx->pbRecvBuffer, &ctx->pbRecvBufferSize, &tag);
+    transport->endTransaction(ctx->hCard, SCARD_LEAVE_CARD);
+    return lRet == SCARD_S_SUCCESS;
+}
+
+// bench_async_read_pages submits one READ BINARY per user page through the async engine and waits on its fd until all
+// of them completed, the difference to BENCH_ASYNC_BATCH x read_page is the cost of queue, I/O thread and completion fd
+static BOOL bench_async_read_pages(BenchContext *ctx) {
+    static BYTE commands[BENCH_ASYNC_BATCH][5];
+    static BYTE responses[BENCH_ASYNC_BATCH][16];
+    static ApduAsyncRequest requests[BENCH_ASYNC_BATCH];
+
+    if (!ctx->asyncStarted) {
+        if (!apdu_async_init(&ctx->async, APDU_ASYNC_CALLBACK_DISPATCH)) {
+            return FALSE;
+        }
+        if (apdu_async_add_reader(&ctx->async, ctx->hCard, &ctx->asyncReader) != SCARD_S_SUCCESS) {
+            apdu_async_close(&ctx->async);
+            return FALSE;
+        }
+        ctx->asyncStarted = TRUE;
+    }
+
+    for (size_t i = 0; i < BENCH_ASYNC_BATCH; i++) {
+        BYTE cmd[5] = { 0xFF, 0xB0, 0x00, (BYTE)(EM_4423_FIRST_USER_PAGE + i), 0x04 };
+        memcpy(commands[i], cmd, sizeof(cmd));
+        ApduAsyncRequest request = { .command = commands[i], .commandLength = sizeof(cmd), .recvBuffer = responses[i], .recvBufferSize = sizeof(responses[i]) };
+        requests[i] = request;
+        if (!apdu_async_submit(&ctx->async, ctx->asyncReader, &requests[i])) {
+            return FALSE;
+        }
+    }
+
+    BOOL ok = TRUE;
+    size_t done = 0;
+    while (done < BENCH_ASYNC_BATCH) {
+        ApduAsyncRequest *request = apdu_async_completed(&ctx->async);
+        if (request == NULL) {
+            struct pollfd pfd = { .fd = apdu_async_fd(&ctx->async), .events = POLLIN };
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        ok = ok && (request->response.outcome == APDU_OK);
+        done++;
+    }
+    return ok;
+}
+
+static const BenchCase BENCH_CASES[] = {
+    { "getuid",             bench_getuid,               BENCH_BACKUP_NONE },
+    { "read_page",          bench_read_page,            BENCH_BACKUP_NONE },
+    { "fastread",           bench_fastread,             BENCH_BACKUP_NONE },
+    { "write_page",         bench_write_page,           BENCH_BACKUP_PAGE },
+    { "write_range",        bench_write_range,          BENCH_BACKUP_USER },
+    { "connect_identify",   bench_connect_identify,     BENCH_BACKUP_NONE },
+    { "warm_identify",      bench_warm_identify,        BENCH_BACKUP_NONE },
+    { "async_read_pages",   bench_async_read_pages,     BENCH_BACKUP_NONE },
+};
+
+// -------------------- Statistics -------------------------------
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// bench_percentile expects sorted samples and uses the nearest-rank method
+static uint64_t bench_percentile(const uint64_t *sorted, size_t count, double percentile) {
+    size_t rank = (size_t)(percentile / 100.0 * (double)count + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    return sorted[(rank > count ? count : rank) - 1];
+}
+
+// bench_print_histogram prints one line per power-of-two microsecond bucket that holds at least one sample
+static void bench_print_histogram(const uint64_t *samples, size_t count) {
+    size_t buckets[32] = {0};
+    size_t largest = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t us = samples[i] / 1000;
+        int bucket = 0;
+        while ((us > 1) && (bucket < 31)) {
+            us >>= 1;
+            bucket++;
+        }
+        buckets[bucket]++;
+        if (buckets[bucket] > largest) {
+            largest = buckets[bucket];
+        }
+    }
+    for (int b = 0; b < 32; b++) {
+        if (buckets[b] == 0) {
+            continue;
+        }
+        int width = (int)((buckets[b] * 40 + largest - 1) / largest);
+        fprintf(report, "    < %8llu us %7zu |%.*s\n", 1ull << (b + 1), buckets[b], width, "########################################");
+    }
+}
+
+static void bench_run(const BenchCase *bc, BenchContext *ctx, size_t iterations) {
+    uint64_t *samples = calloc(iterations, sizeof(uint64_t));
+    if (samples == NULL) {
+        fprintf(report, "%-18s out of memory\n", bc->name);
+        return;
+    }
+
+    bc->op(ctx); // warm-up, not measured
+
+    size_t failures = 0;
+    uint64_t started = timing_now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        uint64_t t0 = timing_now_ns();
+        if (!bc->op(ctx)) {
+            failures++;
+        }
+        samples[i] = timing_now_ns() - t0;
+    }
+    uint64_t total = timing_now_ns() - started;
+
+    qsort(samples, iterations, sizeof(uint64_t), compare_u64);
+    fprintf(report, "%-18s n=%-6zu fail=%-4zu p50=%9.1f us  p99=%9.1f us  max=%9.1f us  %10.1f ops/s\n",
+            bc->name, iterations, failures,
+            bench_percentile(samples, iterations, 50.0) / 1000.0,
+            bench_percentile(samples, iterations, 99.0) / 1000.0,
+            samples[iterations - 1] / 1000.0,
+            (double)iterations * 1e9 / (double)(total ? total : 1));
+    bench_print_histogram(samples, iterations);
+
+    free(samples);
+}
+
+// -------------------------------------------------------
+
+int main(int argc, char **argv) {
+    size_t iterations = BENCH_DEFAULT_ITERATIONS;
+    const char *only = NULL;
+    BOOL verbose = FALSE;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) {
+            // strtoul takes "-1" (as ULONG_MAX), "" and "12abc" without complaint, so check all of it
+            const char *value = argv[++i];
+            char *end;
+            errno = 0;
+            unsigned long n = strtoul(value, &end, 10);
+            if ((value[0] < '0') || (value[0] > '9') || (*end != '\0') || (errno == ERANGE) || (n == 0)) {
+                fprintf(stderr, "%s: -n needs a positive number of iterations, not '%s'\n", argv[0], value);
+                return 1;
+            }
+            iterations = n;
+        } else if ((strcmp(argv[i], "-o") == 0) && (i + 1 < argc)) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = TRUE;
+        } else {
+            fprintf(stderr, "usage: %s [-n iterations] [-o getuid|read_page|fastread|write_page|write_range|connect_identify|warm_identify|async_read_pages] [-v]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // keep the real stdout for the report and silence the apdu dumps and log lines unless -v was passed
+    report = fdopen(dup(fileno(stdout)), "w");
+    if (report == NULL) {
+        perror("fdopen");
+        return 1;
+    }
+    if (!verbose) {
+        if ((freopen("/dev/null", "w", stdout) == NULL) || (freopen("/dev/null", "w", stderr) == NULL)) {
+            fprintf(report, "Failed to silence stdout / stderr\n");
+        }
+    }
+
+    if ((getenv("NFC_LOG_ASYNC") != NULL) && log_async_start()) {
+        atexit(log_async_stop);
+    }
+    const Transport *transport = transport_select_from_env();
+    apdu_trace_configure_from_env();
+    apdu_retry_configure_from_env();
+    metrics_configure_from_env();
+    fprintf(report, "transport: %s, trace: %s, iterations per operation: %zu\n\n", transport->name, getenv("NFC_TRACE") ? getenv("NFC_TRACE") : "console", iterations);
+
+    static BenchContext ctx;
+    ctx.dwReaders = sizeof(ctx.mszReaders);
+    ctx.pbRecvBufferSize = sizeof(ctx.pbRecvBuffer);
+
+    // same setup as main(), done once here so the per-operation numbers only contain the operation itself
+    if (transport->establishContext(SCARD_SCOPE_SYSTEM, &ctx.hContext) != SCARD_S_SUCCESS) {
+        fprintf(report, "Failed to establish context (is pcscd running? or use NFC_TRANSPORT=sim)\n");
+        return 1;
+    }
+    if (getAvailableReaders(ctx.hContext, ctx.mszReaders, &ctx.dwReaders) != SCARD_S_SUCCESS) {
+        fprintf(report, "Failed to list readers\n");
+        transport->releaseContext(ctx.hContext);
+        return 1;
+    }
+    char *reader = findPiccReader(ctx.mszReaders);
+    if (reader == NULL) {
+        fprintf(report, "No PICC reader found\n");
+        transport->releaseContext(ctx.hContext);
+        return 1;
+    }
+    strncpy(ctx.reader, reader, sizeof(ctx.reader) - 1);
+    if (disableBuzzer(ctx.hContext, ctx.reader, &ctx.hCard, &ctx.dwActiveProtocol, ctx.pbRecvBuffer, &ctx.pbRecvBufferSize) == SCARD_S_SUCCESS) {
+        transport->disconnect(ctx.hCard, SCARD_LEAVE_CARD);
+    }
+    ctx.pbRecvBufferSize = sizeof(ctx.pbRecvBuffer);
+    if (waitForTag(ctx.hContext, ctx.reader, &ctx.hCard, &ctx.dwActiveProtocol, NULL) != SCARD_S_SUCCESS) {
+        fprintf(report, "Failed to connect to a tag\n");
+        transport->releaseContext(ctx.hContext);
+        return 1;
+    }
+
+    // the write benchmark must not destroy anything, so it writes back the current content of BENCH_PAGE
+    if (em_4423_read_page(BENCH_PAGE, ctx.hCard, ctx.pbRecvBuffer, &ctx.pbRecvBufferSize)) {
+        memcpy(ctx.pageBackup, ctx.pbRecvBuffer, sizeof(ctx.pageBackup));
+        ctx.pageBackupRead = TRUE;
+    } else {
+        fprintf(report, "Warning: could not read page 0x%02X, is this an EM4423?\n\n", BENCH_PAGE);
+    }
+    EM_4423_Pages tag_content;
+    if (em_4423_fastread_into(&tag_content, ctx.hCard, ctx.pbRecvBuffer, &ctx.pbRecvBufferSize)) {
+        memcpy(ctx.userBackup, tag_content.Pages[EM_4423_FIRST_USER_PAGE], sizeof(ctx.userBackup));
+        ctx.userBackupRead = TRUE;
+    }
+
+    size_t ran = 0;
+    size_t failed = 0;
+    for (size_t i = 0; i < sizeof(BENCH_CASES) / sizeof(BENCH_CASES[0]); i++) {
+        if ((only != NULL) && (strcmp(only, BENCH_CASES[i].name) != 0)) {
+            continue;
+        }
+        ran++;
+        BenchBackup backup = BENCH_CASES[i].backup;
+        if (((backup == BENCH_BACKUP_PAGE) && !ctx.pageBackupRead) || ((backup == BENCH_BACKUP_USER) && !ctx.userBackupRead)) {
+            // writing without a backup would replace the content of the tag with zeros
+            fprintf(report, "%-18s skipped: could not read what is stored there, refusing to overwrite it\n", BENCH_CASES[i].name);
+            failed++;
+            continue;
+        }
+        bench_run(&BENCH_CASES[i], &ctx, iterations);
+    }
+    if (ran == 0) {
+        fprintf(report, "Unknown operation '%s'\n", only);
+    }
+    apdu_retry_stats_print(report);
+
+    if (ctx.asyncStarted) {
+        apdu_async_close(&ctx.async);
+    }
+    disconnectReader(ctx.hCard, ctx.hContext);
+    fclose(report);
+    return (ran == 0) || (failed > 0);
+}
@@ -0,0 +1,283 @@
+#include "desfire.h"
+#include "apdu-retry.h"
+#include "metrics.h"
+#include "timing.h"
+#include "logging.h"
+
+// FSC for FSCI 0 - 8 (ISO 14443-4), higher values are reserved and count as 256
+static const DWORD DESFIRE_FSC[9] = { 16, 24, 32, 40, 48, 64, 96, 128, 256 };
+
+// DesfireTransfer is one native command: the parameters always go into the first frame, data is spread over as many
+// frames as needed behind them, and whatever the card answers (over all 91 AF frames) is appended to out
+typedef struct DesfireTransfer {
+    BYTE ins;
+    BYTE *header;               // ReadData: file, offset, length, moved forward when a broken off read is resumed
+    DWORD headerLen;
+    const BYTE *data;
+    DWORD dataLen;
+    BYTE *out;
+    DWORD capacity;
+    DWORD received;             // bytes of the current attempt
+    DWORD total;                // bytes of all attempts
+} DesfireTransfer;
+
+DWORD desfire_fsc_from_ats(const BYTE *ats, DWORD atsLen) {
+    // TL T0 ..., T0 only counts if TL says it is there. without T0 the default FSCI 2 applies
+    if ((ats == NULL) || (atsLen < 2) || (ats[0] < 2)) {
+        return DESFIRE_FSC[2];
+    }
+    BYTE fsci = ats[1] & 0x0F;
+    return (fsci < 9) ? DESFIRE_FSC[fsci] : DESFIRE_MAX_FRAME;
+}
+
+LONG desfire_open(DesfireCard *card, SCARDHANDLE hCard, const BYTE *ats, DWORD atsLen) {
+    memset(card, 0, sizeof(*card));
+    card->hCard = hCard;
+
+    if (ats == NULL) {
+        BYTE pbSendBuffer[] = { 0xFF, 0xCA, 0x01, 0x00, 0x00 };
+        DWORD size = sizeof(card->bounce);
+        ApduView response = executeApdu(hCard, pbSendBuffer, sizeof(pbSendBuffer), card->bounce, &size);
+        if (response.outcome != APDU_OK) {
+            LOG_WARN("Failed to get ATS, is this a DESFire?");
+            return apduResult(response);
+        }
+        ats = response.data;
+        atsLen = response.data_len;
+    }
+
+    card->frameSize = desfire_fsc_from_ats(ats, atsLen);
+    card->maxFrameData = card->frameSize - DESFIRE_FRAME_OVERHEAD;
+    if (card->maxFrameData > 255) {
+        card->maxFrameData = 255; // Lc of a short apdu
+    }
+    LOG_DEBUG("DESFire frame size: %lu bytes (%lu data bytes per command frame)", (unsigned long)card->frameSize, (unsigned long)card->maxFrameData);
+    return SCARD_S_SUCCESS;
+}
+
+// desfire_frame sends one wrapped frame. the first frame of a command goes through executeApdu and is retried like any
+// other apdu. continuation frames (90 AF) must not be repeated: if only the answer got lost the card already moved on
+// and a second 90 AF would silently skip a frame, so they are sent once and desfire_transfer restarts the whole command
+static ApduView desfire_frame(DesfireCard *card, BYTE ins, const BYTE *data, DWORD len, BYTE *recv, DWORD recvSize, BOOL first) {
+    BYTE apdu[5 + 255 + 1];
+    DWORD n = 0;
+    apdu[n++] = DESFIRE_CLA;
+    apdu[n++] = ins;
+    apdu[n++] = 0x00;
+    apdu[n++] = 0x00;
+    if (len > 0) {
+        apdu[n++] = (BYTE)len;
+        memcpy(apdu + n, data, len);
+        n += len;
+    }
+    apdu[n++] = 0x00; // Le
+
+    ApduView response;
+    if (first) {
+        response = executeApdu(card->hCard, apdu, n, recv, &recvSize);
+    } else {
+        uint64_t start = timing_now_ns();
+        response = executeApduOnce(card->hCard, apdu, n, recv, &recvSize);
+        metrics_record_apdu(card->hCard, apdu, n, response.outcome, timing_now_ns() - start);
+    }
+    card->frames++;
+    card->sw1 = response.sw1;
+    card->sw2 = response.sw2;
+    return response;
+}
+
+// desfire_transfer_once runs the command once. *failed is the frame that went wrong, *restartable tells whether it was a
+// continuation frame (the first one was already retried by executeApdu)
+static LONG desfire_transfer_once(DesfireCard *card, DesfireTransfer *transfer, ApduView *failed, BOOL *restartable) {
+    BYTE frame[255];
+    DWORD firstData = (card->maxFrameData > transfer->headerLen) ? card->maxFrameData - transfer->headerLen : 0;
+    DWORD chunk = (transfer->dataLen < firstData) ? transfer->dataLen : firstData;
+    memcpy(frame, transfer->header, transfer->headerLen);
+    memcpy(frame + transfer->headerLen, transfer->data, chunk);
+    DWORD len = transfer->headerLen + chunk;
+    DWORD sent = chunk;
+    BYTE ins = transfer->ins;
+    BOOL first = TRUE;
+    transfer->received = 0;
+
+    for (;;) {
+        // frames land directly in the caller's buffer, only the tail that has no room for a whole frame + SW goes through bounce
+        DWORD room = (transfer->out != NULL) ? transfer->capacity - transfer->received : 0;
+        BYTE *dst = card->bounce;
+        DWORD dstSize = sizeof(card->bounce);
+        if (room >= DESFIRE_MAX_FRAME + 2) {
+            dst = transfer->out + transfer->received;
+            dstSize = room;
+        }
+
+        ApduView response = desfire_frame(card, ins, frame, len, dst, dstSize, first);
+        if ((response.outcome == APDU_TRANSMIT_FAILED) || (response.outcome == APDU_MALFORMED) || (response.sw1 != 0x91)) {
+            *failed = response;
+            *restartable = !first;
+            return (response.outcome == APDU_TRANSMIT_FAILED) ? response.status : ACR_90_00_FAILURE;
+        }
+        first = FALSE;
+
+        if (response.data_len > room) {
+            LOG_ERROR("DESFire answer does not fit into %lu bytes", (unsigned long)transfer->capacity);
+            return SCARD_E_INSUFFICIENT_BUFFER;
+        }
+        if ((dst == card->bounce) && (response.data_len > 0)) {
+            memcpy(transfer->out + transfer->received, card->bounce, response.data_len);
+        }
+        transfer->received += response.data_len;
+
+        if (response.sw2 == DESFIRE_STATUS_OK) {
+            return SCARD_S_SUCCESS;
+        }
+        if (response.sw2 != DESFIRE_STATUS_ADDITIONAL_FRAME) {
+            LOG_WARN("DESFire command %02x failed: %s (91 %02x)", transfer->ins, desfire_status_name(response.sw2), response.sw2);
+            *failed = response;
+            *restartable = FALSE;
+            return ACR_90_00_FAILURE;
+        }
+
+        chunk = transfer->dataLen - sent;
+        if (chunk > card->maxFrameData) {
+            chunk = card->maxFrameData;
+        }
+        memcpy(frame, transfer->data + sent, chunk);
+        len = chunk;
+        sent += chunk;
+        ins = DESFIRE_CMD_ADDITIONAL_FRAME;
+    }
+}
+
+static DWORD desfire_get_u24(const BYTE *in) {
+    return in[0] | ((DWORD)in[1] << 8) | ((DWORD)in[2] << 16);
+}
+
+static void desfire_put_u24(BYTE *out, DWORD value) {
+    out[0] = (BYTE)value;
+    out[1] = (BYTE)(value >> 8);
+    out[2] = (BYTE)(value >> 16);
+}
+
+// desfire_resume_read turns a broken off ReadData into one for the part that is still missing. the frames that arrived
+// are fine (the reader checked their CRC), so a large file does not have to make it through the field in one go
+static BOOL desfire_resume_read(DesfireTransfer *transfer) {
+    DWORD length = desfire_get_u24(transfer->header + 4);
+    if ((length != 0) && (transfer->received >= length)) {
+        return FALSE; // nothing missing (0 would mean "up to the end of the file")
+    }
+    desfire_put_u24(transfer->header + 1, desfire_get_u24(transfer->header + 1) + transfer->received);
+    desfire_put_u24(transfer->header + 4, (length != 0) ? length - transfer->received : 0);
+    transfer->out += transfer->received;
+    transfer->capacity -= transfer->received;
+    return TRUE;
+}
+
+// desfire_transfer runs the command and starts it over when a continuation frame was lost (reads continue behind the
+// bytes that arrived, see desfire_resume_read). attempts only count up while no data gets through
+static LONG desfire_transfer(DesfireCard *card, DesfireTransfer *transfer) {
+    ApduRetryPolicy policy = apdu_retry_get_policy();
+    card->frames = 0;
+
+    for (DWORD attempt = 1;; attempt++) {
+        ApduView failed;
+        BOOL restartable = FALSE;
+        LONG lRet = desfire_transfer_once(card, transfer, &failed, &restartable);
+        // what arrived is in out, unless the command starts over from scratch below and sends it again
+        transfer->total += transfer->received;
+        if ((lRet == SCARD_S_SUCCESS) || !restartable || (apdu_classify(&failed) != APDU_ERROR_TRANSIENT_RF) || (attempt >= policy.maxAttempts)) {
+            return lRet;
+        }
+
+        LOG_DEBUG("DESFire command %02x broke off after %lu frames, starting it over", transfer->ins, (unsigned long)card->frames);
+        timing_sleep_us(apdu_retry_backoff_us(&policy, attempt));
+        if (apdu_retry_recover(card->hCard, &failed) != APDU_ERROR_NONE) {
+            return lRet;
+        }
+        // a re-activated card is back at PICC level (selecting is harmless if it was not re-activated)
+        DWORD frames = card->frames;
+        if ((card->aid != 0) && (transfer->ins != DESFIRE_CMD_SELECT_APPLICATION) && (desfire_select_application(card, card->aid) != SCARD_S_SUCCESS)) {
+            return lRet;
+        }
+        card->frames += frames;
+
+        if ((transfer->ins == DESFIRE_CMD_READ_DATA) && (transfer->received > 0)) {
+            if (!desfire_resume_read(transfer)) {
+                return SCARD_S_SUCCESS;
+            }
+            attempt = 0;
+        } else {
+            transfer->total -= transfer->received;
+        }
+    }
+}
+
+LONG desfire_select_application(DesfireCard *card, DWORD aid) {
+    BYTE header[3];
+    desfire_put_u24(header, aid); // AIDs are sent LSB first
+    DesfireTransfer transfer = { .ins = DESFIRE_CMD_SELECT_APPLICATION, .header = header, .headerLen = sizeof(header) };
+    LONG lRet = desfire_transfer(card, &transfer);
+    if (lRet == SCARD_S_SUCCESS) {
+        card->aid = aid & 0xFFFFFF;
+    }
+    return lRet;
+}
+
+LONG desfire_get_file_ids(DesfireCard *card, BYTE *fileIds, DWORD capacity, DWORD *count) {
+    DesfireTransfer transfer = { .ins = DESFIRE_CMD_GET_FILE_IDS, .out = fileIds, .capacity = capacity };
+    LONG lRet = desfire_transfer(card, &transfer);
+    *count = transfer.total;
+    return lRet;
+}
+
+LONG desfire_read_data(DesfireCard *card, BYTE fileNo, DWORD offset, DWORD length, BYTE *out, DWORD capacity, DWORD *read) {
+    *read = 0;
+    if ((offset > 0xFFFFFF) || (length > 0xFFFFFF)) {
+        return SCARD_E_INVALID_PARAMETER;
+    }
+    if (length > capacity) {
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+
+    BYTE header[7];
+    header[0] = fileNo;
+    desfire_put_u24(header + 1, offset);
+    desfire_put_u24(header + 4, length);
+    DesfireTransfer transfer = { .ins = DESFIRE_CMD_READ_DATA, .header = header, .headerLen = sizeof(header), .out = out, .capacity = capacity };
+    LONG lRet = desfire_transfer(card, &transfer);
+    *read = transfer.total;
+    LOG_DEBUG("Read %lu bytes of DESFire file %02x in %lu frames", (unsigned long)transfer.total, fileNo, (unsigned long)card->frames);
+    return lRet;
+}
+
+// desfire_write_data is only repeated as a whole: rewriting the same bytes of a standard data file does no harm
+LONG desfire_write_data(DesfireCard *card, BYTE fileNo, DWORD offset, const BYTE *data, DWORD length) {
+    if ((length == 0) || (offset > 0xFFFFFF) || (length > 0xFFFFFF)) {
+        return SCARD_E_INVALID_PARAMETER;
+    }
+
+    BYTE header[7];
+    header[0] = fileNo;
+    desfire_put_u24(header + 1, offset);
+    desfire_put_u24(header + 4, length);
+    DesfireTransfer transfer = { .ins = DESFIRE_CMD_WRITE_DATA, .header = header, .headerLen = sizeof(header), .data = data, .dataLen = length };
+    LONG lRet = desfire_transfer(card, &transfer);
+    LOG_DEBUG("Wrote %lu bytes to DESFire file %02x in %lu frames", (unsigned long)length, fileNo, (unsigned long)card->frames);
+    return lRet;
+}
+
+const char *desfire_status_name(BYTE status) {
+    switch (status) {
+        case DESFIRE_STATUS_OK:                 return "ok";
+        case DESFIRE_STATUS_ILLEGAL_COMMAND:    return "illegal command";
+        case DESFIRE_STATUS_LENGTH_ERROR:       return "length error";
+        case DESFIRE_STATUS_PERMISSION_DENIED:  return "permission denied";
+        case DESFIRE_STATUS_PARAMETER_ERROR:    return "parameter error";
+        case DESFIRE_STATUS_APP_NOT_FOUND:      return "application not found";
+        case DESFIRE_STATUS_AUTH_ERROR:         return "authentication error";
+        case DESFIRE_STATUS_ADDITIONAL_FRAME:   return "additional frame";
+        case DESFIRE_STATUS_BOUNDARY_ERROR:     return "boundary error";
+        case DESFIRE_STATUS_COMMAND_ABORTED:    return "command aborted";
+        case DESFIRE_STATUS_FILE_NOT_FOUND:     return "file not found";
+        default:                                return "unknown status";
+    }
+}
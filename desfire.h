@@ -0,0 +1,69 @@
+#ifndef DESFIRE_H
+#define DESFIRE_H
+
+#ifndef READER_H
+#include "reader.h"
+#endif
+
+// Mifare DESFire (EV1 - EV3) native commands, wrapped in ISO 7816 APDUs: 90 <cmd> 00 00 [Lc data] 00, the card answers
+// data + 91 <status>. 91 AF means there is more, the next frame is fetched (or sent) with 90 AF 00 00 [Lc data] 00.
+// only plain communication is covered (no authentication, files must allow free access).
+//
+//      DesfireCard card;
+//      desfire_open(&card, hCard, NULL, 0);                    // asks the reader for the ATS to learn the frame size
+//      desfire_select_application(&card, 0x000001);
+//      BYTE file[4096]; DWORD fileLen;
+//      desfire_read_data(&card, 0x01, 0, 0, file, sizeof(file), &fileLen);  // length 0 = up to the end of the file
+
+#define DESFIRE_CLA                     0x90
+
+#define DESFIRE_CMD_SELECT_APPLICATION  0x5A
+#define DESFIRE_CMD_GET_FILE_IDS        0x6F
+#define DESFIRE_CMD_READ_DATA           0xBD
+#define DESFIRE_CMD_WRITE_DATA          0x3D
+#define DESFIRE_CMD_ADDITIONAL_FRAME    0xAF
+
+// SW2 of 91 xx
+#define DESFIRE_STATUS_OK               0x00
+#define DESFIRE_STATUS_ILLEGAL_COMMAND  0x1C
+#define DESFIRE_STATUS_LENGTH_ERROR     0x7E
+#define DESFIRE_STATUS_PERMISSION_DENIED 0x9D
+#define DESFIRE_STATUS_PARAMETER_ERROR  0x9E
+#define DESFIRE_STATUS_APP_NOT_FOUND    0xA0
+#define DESFIRE_STATUS_AUTH_ERROR       0xAE
+#define DESFIRE_STATUS_ADDITIONAL_FRAME 0xAF
+#define DESFIRE_STATUS_BOUNDARY_ERROR   0xBE
+#define DESFIRE_STATUS_COMMAND_ABORTED  0xCA
+#define DESFIRE_STATUS_FILE_NOT_FOUND   0xF0
+
+#define DESFIRE_MAX_FILES               32      // file numbers 0x00 - 0x1F
+#define DESFIRE_MAX_FRAME               256     // FSC of FSCI 8, the largest frame ISO 14443-4 allows
+#define DESFIRE_FRAME_OVERHEAD          9       // PCB + CRC and CLA INS P1 P2 Lc Le of the wrapping
+
+typedef struct DesfireCard {
+    SCARDHANDLE hCard;
+    DWORD frameSize;            // FSC of the card (from the ATS), a command frame including wrapping must fit into it
+    DWORD maxFrameData;         // data bytes per wrapped command frame
+    DWORD aid;                  // selected application (0 = PICC level), selected again after a restarted command
+    BYTE sw1, sw2;              // status word of the last frame, sw2 is the DESFire status if sw1 is 91
+    DWORD frames;               // frames exchanged by the last command (all attempts)
+    BYTE bounce[DESFIRE_MAX_FRAME + 2]; // takes the last frames of a read when the caller's buffer can't hold a whole frame + SW
+} DesfireCard;
+
+// desfire_fsc_from_ats returns the frame size the card announces in T0 of its ATS (32 if the ATS has no T0)
+DWORD desfire_fsc_from_ats(const BYTE *ats, DWORD atsLen);
+
+// desfire_open prepares card for hCard. ats can be NULL, then it is requested from the reader (FF CA 01 00)
+LONG desfire_open(DesfireCard *card, SCARDHANDLE hCard, const BYTE *ats, DWORD atsLen);
+
+// all commands return SCARD_S_SUCCESS, the error of SCardTransmit, SCARD_E_INSUFFICIENT_BUFFER if the answer does not
+// fit, or ACR_90_00_FAILURE if the card answered with another status than 91 00 (see card->sw1 / card->sw2)
+LONG desfire_select_application(DesfireCard *card, DWORD aid);
+LONG desfire_get_file_ids(DesfireCard *card, BYTE *fileIds, DWORD capacity, DWORD *count);
+// desfire_read_data streams all frames of the answer straight into out, length 0 reads from offset to the end of the file
+LONG desfire_read_data(DesfireCard *card, BYTE fileNo, DWORD offset, DWORD length, BYTE *out, DWORD capacity, DWORD *read);
+LONG desfire_write_data(DesfireCard *card, BYTE fileNo, DWORD offset, const BYTE *data, DWORD length);
+
+const char *desfire_status_name(BYTE status);
+
+#endif
@@ -0,0 +1,165 @@
+#include "em-4423-image.h"
+#include "logging.h"
+#include "reader.h"
+#include "tag-memory.h"
+
+static void em_4423_image_mark(EM_4423_TagImage *image, BYTE page, BOOL dirty) {
+    if (dirty) {
+        image->dirty[page / 8] |= (BYTE)(1u << (page % 8));
+    } else {
+        image->dirty[page / 8] &= (BYTE)~(1u << (page % 8));
+    }
+}
+
+BOOL em_4423_image_is_dirty(const EM_4423_TagImage *image, BYTE page) {
+    return (page < EM_4423_PAGE_COUNT) && (image->dirty[page / 8] & (1u << (page % 8)));
+}
+
+size_t em_4423_image_dirty_count(const EM_4423_TagImage *image) {
+    size_t count = 0;
+    for (BYTE page = 0; page < EM_4423_PAGE_COUNT; page++) {
+        count += em_4423_image_is_dirty(image, page) ? 1 : 0;
+    }
+    return count;
+}
+
+EM_4423_TagImage *em_4423_image_cache_find(EM_4423_ImageCache *cache, const BYTE *uid, BYTE uid_len) {
+    for (size_t i = 0; i < EM_4423_IMAGE_CACHE_SIZE; i++) {
+        EM_4423_TagImage *entry = &cache->entries[i];
+        if (entry->loaded && (entry->uid_len == uid_len) && (memcmp(entry->uid, uid, uid_len) == 0)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// em_4423_read_uid sends GET UID and copies the UID out of the reply
+static BOOL em_4423_read_uid(SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, BYTE *uid, BYTE *uid_len) {
+    BYTE APDU_GetUid[5] = { 0xff, 0xca, 0x00, 0x00, 0x00 };
+    ApduView response = executeApdu(hCard, APDU_GetUid, sizeof(APDU_GetUid), pbRecvBuffer, pbRecvBufferSize);
+    if ((response.outcome != APDU_OK) || (response.data_len == 0) || (response.data_len > EM_4423_UID_MAX)) {
+        LOG_ERROR("Failed to read UID of tag.");
+        return FALSE;
+    }
+    memcpy(uid, response.data, response.data_len);
+    *uid_len = (BYTE)response.data_len;
+    return TRUE;
+}
+
+BOOL em_4423_image_load(EM_4423_ImageCache *cache, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, BOOL refresh, EM_4423_TagImage **image) {
+    BYTE uid[EM_4423_UID_MAX];
+    BYTE uid_len;
+    if (!em_4423_read_uid(hCard, pbRecvBuffer, pbRecvBufferSize, uid, &uid_len)) {
+        return FALSE;
+    }
+
+    EM_4423_TagImage *entry = em_4423_image_cache_find(cache, uid, uid_len);
+    if ((entry != NULL) && !refresh) {
+        LOG_DEBUG("Tag image found in cache, skipping fastread.");
+        *image = entry;
+        return TRUE;
+    }
+    if (entry == NULL) {
+        entry = &cache->entries[cache->next];
+        cache->next = (cache->next + 1) % EM_4423_IMAGE_CACHE_SIZE;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    if (!em_4423_fastread_into(&entry->on_tag, hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        return FALSE;
+    }
+    memcpy(entry->uid, uid, uid_len);
+    entry->uid_len = uid_len;
+    entry->pages = entry->on_tag;
+    entry->loaded = TRUE;
+
+    *image = entry;
+    return TRUE;
+}
+
+// em_4423_image_check_user_pages makes sure that the len bytes starting at first_page are all user memory
+static BOOL em_4423_image_check_user_pages(BYTE first_page, size_t len) {
+    size_t pages = (len + EM_4423_PAGE_SIZE - 1) / EM_4423_PAGE_SIZE;
+    if (!tag_memory_range_is_user(tag_memory_profile(TAG_MEMORY_EM4423), first_page, pages)) {
+        LOG_WARN("Pages 0x%02x - 0x%02zx are not all user memory. Refusing to write there.", first_page, first_page + pages - 1);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL em_4423_image_touch(EM_4423_TagImage *image, BYTE first_page, size_t len) {
+    if (!em_4423_image_check_user_pages(first_page, len)) {
+        return FALSE;
+    }
+    size_t pages = (len + EM_4423_PAGE_SIZE - 1) / EM_4423_PAGE_SIZE;
+    for (size_t i = 0; i < pages; i++) {
+        BYTE page = (BYTE)(first_page + i);
+        em_4423_image_mark(image, page, memcmp(image->pages.Pages[page], image->on_tag.Pages[page], EM_4423_PAGE_SIZE) != 0);
+    }
+    return TRUE;
+}
+
+BOOL em_4423_image_write(EM_4423_TagImage *image, BYTE first_page, const BYTE *data, size_t len) {
+    if (!em_4423_image_check_user_pages(first_page, len)) {
+        return FALSE;
+    }
+    // pages are contiguous in EM_4423_Pages, a short last page keeps its remaining bytes
+    memmove(image->pages.Pages[first_page], data, len);
+    return em_4423_image_touch(image, first_page, len);
+}
+
+BOOL em_4423_image_commit(EM_4423_TagImage *image, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    // contiguous runs of dirty pages go out as one bulk write each
+    int first = -1, last = -1;
+    for (int page = 0; page < EM_4423_PAGE_COUNT; page++) {
+        if (!em_4423_image_is_dirty(image, (BYTE)page)) {
+            continue;
+        }
+        int run_end = page;
+        while ((run_end + 1 < EM_4423_PAGE_COUNT) && em_4423_image_is_dirty(image, (BYTE)(run_end + 1))) {
+            run_end++;
+        }
+        if (!em_4423_write_pages((BYTE)page, image->pages.Pages[page], (size_t)(run_end - page + 1), hCard, pbRecvBuffer, pbRecvBufferSize)) {
+            return FALSE;
+        }
+        first = (first < 0) ? page : first;
+        last = run_end;
+        page = run_end;
+    }
+    if (first < 0) {
+        LOG_DEBUG("Tag image is clean, nothing to write.");
+        return TRUE;
+    }
+
+    // verify: read back the range that contains all written pages (one READ BINARY for up to the whole user memory)
+    BYTE on_tag[EM_4423_PAGE_COUNT * EM_4423_PAGE_SIZE];
+    if (!tag_memory_read(tag_memory_profile(TAG_MEMORY_EM4423), (size_t)first, (size_t)(last - first + 1), on_tag, hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        LOG_ERROR("Failed to read back pages 0x%02x - 0x%02x for verification.", first, last);
+        return FALSE;
+    }
+    // every page of the range is compared, not only the written ones: a page that differs from image->pages was changed
+    // by someone else since the image was loaded (the cache is stale there). on_tag takes what was read in both cases,
+    // a written page that did not stick stays dirty for the next commit, an untouched one takes the content of the tag
+    BOOL verified = TRUE;
+    for (int page = first; page <= last; page++) {
+        const BYTE *read = on_tag + (page - first) * EM_4423_PAGE_SIZE;
+        BOOL dirty = em_4423_image_is_dirty(image, (BYTE)page);
+        if (memcmp(read, image->pages.Pages[page], EM_4423_PAGE_SIZE) != 0) {
+            if (dirty) {
+                LOG_ERROR("Verification of page 0x%02x failed.", page);
+            } else {
+                LOG_ERROR("Page 0x%02x changed on the tag since the image was loaded, taking it over.", page);
+                memcpy(image->pages.Pages[page], read, EM_4423_PAGE_SIZE);
+            }
+            verified = FALSE;
+        }
+        memcpy(image->on_tag.Pages[page], read, EM_4423_PAGE_SIZE);
+        em_4423_image_mark(image, (BYTE)page, memcmp(image->pages.Pages[page], read, EM_4423_PAGE_SIZE) != 0);
+    }
+    if (!verified) {
+        return FALSE;
+    }
+
+    LOG_INFO("Committed and verified pages 0x%02x - 0x%02x.", first, last);
+    return TRUE;
+}
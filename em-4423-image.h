@@ -0,0 +1,53 @@
+#ifndef EM_4423_IMAGE_H
+#define EM_4423_IMAGE_H
+
+#ifndef EM_4423_H
+#include "em-4423.h"
+#endif
+
+// Tag image layer on top of EM_4423_Pages: the tag memory is read once with a single fastread, then edited locally and
+// em_4423_image_commit only writes (and verifies) the user pages whose content actually changed. images are kept in a
+// small cache keyed by UID, so a tag that comes back does not even need the fastread again. a cached image does not see
+// what other writers did to the tag in the meantime: the commit notices it for the pages it reads back, refresh = TRUE
+// in em_4423_image_load reads the whole tag again.
+//
+//      EM_4423_ImageCache cache = {0};
+//      EM_4423_TagImage *image;
+//      em_4423_image_load(&cache, hCard, pbRecvBuffer, &pbRecvBufferSize, FALSE, &image);   // UID + fastread (UID only if cached)
+//      em_4423_image_write(image, 0x04, ndef, ndef_len);                                   // marks the pages that differ
+//      em_4423_image_commit(image, hCard, pbRecvBuffer, &pbRecvBufferSize);                // writes + verifies only those
+
+#define EM_4423_UID_MAX             10
+#define EM_4423_IMAGE_CACHE_SIZE    16
+
+typedef struct EM_4423_TagImage {
+    BYTE uid[EM_4423_UID_MAX];
+    BYTE uid_len;
+    BOOL loaded;
+    EM_4423_Pages pages;        // what the tag should contain (last read + local edits)
+    EM_4423_Pages on_tag;       // what is known to be on the tag right now
+    BYTE dirty[(EM_4423_PAGE_COUNT + 7) / 8]; // one bit per page: pages differs from on_tag
+} EM_4423_TagImage;
+
+typedef struct EM_4423_ImageCache {
+    EM_4423_TagImage entries[EM_4423_IMAGE_CACHE_SIZE];
+    size_t next; // entry that is replaced next (round robin)
+} EM_4423_ImageCache;
+
+// em_4423_image_load reads the UID and returns the cached image for it, a fastread only happens for unknown tags or if refresh is TRUE
+BOOL em_4423_image_load(EM_4423_ImageCache *cache, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, BOOL refresh, EM_4423_TagImage **image);
+EM_4423_TagImage *em_4423_image_cache_find(EM_4423_ImageCache *cache, const BYTE *uid, BYTE uid_len);
+
+// em_4423_image_write copies len bytes into the image starting at first_page (user memory only) and marks the pages that change
+BOOL em_4423_image_write(EM_4423_TagImage *image, BYTE first_page, const BYTE *data, size_t len);
+// em_4423_image_touch recomputes the dirty bits after the caller encoded into image->pages directly (e.g. with an NdefBuilder)
+BOOL em_4423_image_touch(EM_4423_TagImage *image, BYTE first_page, size_t len);
+BOOL em_4423_image_is_dirty(const EM_4423_TagImage *image, BYTE page);
+size_t em_4423_image_dirty_count(const EM_4423_TagImage *image);
+
+// em_4423_image_commit writes each run of dirty pages with one bulk write and verifies them with one read over the dirty
+// range. FALSE if a written page did not stick (it stays dirty) or if a page in the range was changed by someone else
+// since the image was loaded (the image takes it over, check the content before committing again)
+BOOL em_4423_image_commit(EM_4423_TagImage *image, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+
+#endif
@@ -1,6 +1,7 @@
 #include "em-4423.h"
-#include "logging.c"
-#include "main.h"
+#include "logging.h"
+#include "reader.h"
+#include "tag-memory.h"
 // 7 byte UID
 
 // there are two different versions of the em-4423:
@@ -8,19 +9,8 @@
 //  - EM4423V221 (large EPC version, extra 8 bytes of user memory), so total user memory is 240+8 = 248 bytes (1984-bit)
 // in this code i will only use the 240 bytes that are present in both versions
 
-// each page holds 4 bytes, but 60*4=240 bytes
-const BYTE EM_4423_USER_MEMORY_PAGES[60] = {                           0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
-                                               0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
-                                               0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
-                                               0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F };
-
-const BYTE EM_4423_EXISTING_PAGES[99] =    {   0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
-                                               0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
-                                               0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
-                                               0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
-                                               0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
-                                               0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F,
-                                               0x60, 0x61, 0x62 };
+// page layout (user memory 0x04 - 0x3F, 99 pages in total) is described by TAG_MEMORY_EM4423 in tag-memory.c
+#define EM_4423_PROFILE tag_memory_profile(TAG_MEMORY_EM4423)
 
 // ---------------- write / read tag --------------------------------------------------
 
@@ -28,7 +18,7 @@ const BYTE EM_4423_EXISTING_PAGES[99] =    {   0x00, 0x01, 0x02, 0x03, 0x04, 0x0
 BOOL em_4423_write_page(BYTE* data, BYTE page, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
     LOG_DEBUG("Trying to write to page 0x%02x.", page);
     // sanity check
-    if (!is_byte_in_array(page, EM_4423_USER_MEMORY_PAGES, 60)) {
+    if (!tag_memory_page_is_user(EM_4423_PROFILE, page)) {
         LOG_WARN("Page 0x%02x is not a user memory page. Refusing to write there.", page);
         return FALSE;
     }
@@ -37,8 +27,8 @@ BOOL em_4423_write_page(BYTE* data, BYTE page, SCARDHANDLE hCard, BYTE *pbRecvBu
     memcpy(APDU_Write + 5, data, 4);
 
     // write to page
-    ApduResponse response = executeApdu(hCard, APDU_Write, sizeof(APDU_Write), pbRecvBuffer, pbRecvBufferSize);
-    if (response.status != 0 || !(pbRecvBuffer[response.amount_response_bytes-2] == 0x90 && pbRecvBuffer[response.amount_response_bytes-1] == 0x00)) {
+    ApduView response = executeApdu(hCard, APDU_Write, sizeof(APDU_Write), pbRecvBuffer, pbRecvBufferSize);
+    if (response.outcome != APDU_OK) {
         LOG_ERROR("Failed to write to page 0x%02x. Aborting..", page);
         return FALSE;
     }
@@ -47,18 +37,56 @@ BOOL em_4423_write_page(BYTE* data, BYTE page, SCARDHANDLE hCard, BYTE *pbRecvBu
     return TRUE;
 }
 
+// em_4423_write_pages writes pages * 4 bytes starting at first_page with as few UPDATE BINARY apdus as the reader
+// allows (no verification, see em_4423_write_range). the payload shrinks if the reader rejects it, see tag_memory_write
+BOOL em_4423_write_pages(BYTE first_page, const BYTE *data, size_t pages, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    return tag_memory_write(EM_4423_PROFILE, first_page, pages, data, hCard, pbRecvBuffer, pbRecvBufferSize);
+}
+
+// em_4423_verify_range reads pages * 4 bytes starting at first_page (one READ BINARY for the whole user memory) and compares them to expected
+BOOL em_4423_verify_range(BYTE first_page, const BYTE *expected, size_t pages, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    BYTE on_tag[EM_4423_PAGE_COUNT * EM_4423_PAGE_SIZE];
+    if ((first_page + pages > EM_4423_PAGE_COUNT) || !tag_memory_read(EM_4423_PROFILE, first_page, pages, on_tag, hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        LOG_ERROR("Failed to read back %zu pages starting at page 0x%02x.", pages, first_page);
+        return FALSE;
+    }
+    if (memcmp(on_tag, expected, pages * EM_4423_PAGE_SIZE) != 0) {
+        LOG_ERROR("Verification of %zu pages starting at page 0x%02x failed.", pages, first_page);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// em_4423_write_range writes len bytes starting at first_page (a partial last page is padded with zeros) and verifies
+// everything with a single read. a 240 byte NDEF message costs 2 apdus instead of 60 writes when the reader takes it
+BOOL em_4423_write_range(BYTE first_page, const BYTE *data, size_t len, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    if ((len == 0) || (len > EM_4423_USER_MEMORY_BYTES)) {
+        LOG_WARN("Can not write %zu bytes, user memory holds %d bytes.", len, EM_4423_USER_MEMORY_BYTES);
+        return FALSE;
+    }
+
+    BYTE padded[EM_4423_USER_MEMORY_BYTES] = {0};
+    size_t pages = (len + 3) / 4;
+    memcpy(padded, data, len);
+
+    if (!em_4423_write_pages(first_page, padded, pages, hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        return FALSE;
+    }
+    return em_4423_verify_range(first_page, padded, pages, hCard, pbRecvBuffer, pbRecvBufferSize);
+}
+
 // em_4423_read_page reads a 4 byte page
 BOOL em_4423_read_page(BYTE page, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
     LOG_DEBUG("Trying to read page 0x%02x.", page);
     // sanity check
-    if (!is_byte_in_array(page, EM_4423_EXISTING_PAGES, 99)) {
+    if (!tag_memory_page_exists(EM_4423_PROFILE, page)) {
         LOG_WARN("Page 0x%02x is not a valid page. 0x62 is the last valid page for EM4423.", page);
         return FALSE;
     }
 
     BYTE APDU_Read[5] = { 0xff, 0xb0, 0x00, page, 0x04 };
-    ApduResponse response = executeApdu(hCard, APDU_Read, sizeof(APDU_Read), pbRecvBuffer, pbRecvBufferSize);
-    if (response.status != 0 || !(pbRecvBuffer[response.amount_response_bytes-2] == 0x90 && pbRecvBuffer[response.amount_response_bytes-1] == 0x00)) {
+    ApduView response = executeApdu(hCard, APDU_Read, sizeof(APDU_Read), pbRecvBuffer, pbRecvBufferSize);
+    if ((response.outcome != APDU_OK) || (response.data_len < 4)) {
         LOG_ERROR("Failed to read from page 0x%02x. Aborting..", page);
         return FALSE;
     }
@@ -67,36 +95,35 @@ BOOL em_4423_read_page(BYTE page, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *
     return TRUE;
 }
 
-// em_4423_fastread reads the entire tag memory at once
-BOOL em_4423_fastread(SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+// em_4423_fastread_into reads the entire tag memory into tag_content (nothing is printed). the profile allows all
+// 99 * 4 = 396 bytes in one READ BINARY with extended Le (page 93 of ref-acr1581u), reading further wraps around to page 0
+BOOL em_4423_fastread_into(EM_4423_Pages *tag_content, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
     LOG_DEBUG("Trying to fastread the entire tag.");
 
+    if (!tag_memory_read(EM_4423_PROFILE, 0, EM_4423_PAGE_COUNT, &tag_content->Pages[0][0], hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        LOG_ERROR("Failed to fastread entire tag. Aborting..");
+        return FALSE;
+    }
+
+    LOG_INFO("Fastread entire tag with success.");
+    return TRUE;
+}
+
+// em_4423_fastread reads the entire tag memory at once and prints it
+BOOL em_4423_fastread(SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
     // store page data
     EM_4423_Pages tag_content = {0};
 
-    // if you can't use extended apdu then u can read only 0xff = 255 bytes at once
-    // BYTE APDU_Read[5] = { 0xff, 0xb0, 0x00, 0x00, 0xff };
-    
-    // page 93 of ref-acr1581u: extended apdu - you can put 2 bytes for amount of bytes to read
-    //                     class,   INS,     P1,      P2,       LE (number of bytes to read) [index 0: announces extended apdu, index 1 and 2: 2-byte value of how many bytes to read (4*99 = 396 = 0x018C)]
-    BYTE APDU_Read[7] = {  0xff,    0xb0,   0x00,    0x00,      0x00, 0x01, 0x8c }; // larger value than 8c wraps around (continues reading from start again)
-    ApduResponse response = executeApdu(hCard, APDU_Read, sizeof(APDU_Read), pbRecvBuffer, pbRecvBufferSize);
-    if (response.status != 0 || !(pbRecvBuffer[response.amount_response_bytes-2] == 0x90 && pbRecvBuffer[response.amount_response_bytes-1] == 0x00)) {
-        LOG_ERROR("Failed to fastread entire tag. Aborting..");
+    if (!em_4423_fastread_into(&tag_content, hCard, pbRecvBuffer, pbRecvBufferSize)) {
         return FALSE;
     }
 
-    // copy into object tag_content (99 pages a 4 bytes are copied at once)
-    memcpy(tag_content.Pages, pbRecvBuffer, 99 * 4);
-
     em_4423_pages_object_print_all(&tag_content);
-
-    LOG_INFO("Fastread entire tag with success.");
     return TRUE;
 }
 
 void em_4423_pages_object_print_all(EM_4423_Pages *tag_content) {
-    for (BYTE i = 0x00; i < 0x99; ++i) {
+    for (BYTE i = 0x00; i < EM_4423_PAGE_COUNT; ++i) {
         printf("[Page 0x%02X]\t0x%02X  0x%02X  0x%02X  0x%02X\n",
            i,
            tag_content->Pages[i][0],
@@ -1,23 +1,22 @@
 #ifndef EM_4423_H
 #define EM_4423_H
 
-#ifndef MAIN_H
-#include "main.h"
+#ifndef READER_H
+#include "reader.h"
 #endif
 
 #ifndef COMMON_H
 #include "common.h"
 #endif
 
-#ifndef LOGGING_C
-#include "logging.c"
-#endif
+#define EM_4423_USER_MEMORY_BYTES 240 // 60 pages a 4 bytes, the part that both EM4423 versions have
 
-extern const BYTE EM_4423_USER_MEMORY_PAGES[60];
-extern const BYTE EM_4423_EXISTING_PAGES[99];
+#define EM_4423_FIRST_USER_PAGE   0x04 // user memory is 0x04 - 0x3F, the full layout is TAG_MEMORY_EM4423 (tag-memory.c)
+#define EM_4423_PAGE_COUNT        99
+#define EM_4423_PAGE_SIZE         4
 
 typedef struct EM_4423_Pages {
-    BYTE Pages[99][4]; // 99 pages (0x00 - 0x62) with 4 bytes per page
+    BYTE Pages[EM_4423_PAGE_COUNT][EM_4423_PAGE_SIZE]; // 99 pages (0x00 - 0x62) with 4 bytes per page
 } EM_4423_Pages;
 
 void em_4423_pages_object_print_all(EM_4423_Pages *tag_content);
@@ -25,5 +24,9 @@ void em_4423_pages_object_print_all(EM_4423_Pages *tag_content);
 BOOL em_4423_write_page(BYTE* data, BYTE page, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
 BOOL em_4423_read_page(BYTE page, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
 BOOL em_4423_fastread(SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+BOOL em_4423_write_pages(BYTE first_page, const BYTE *data, size_t pages, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+BOOL em_4423_verify_range(BYTE first_page, const BYTE *expected, size_t pages, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+BOOL em_4423_write_range(BYTE first_page, const BYTE *data, size_t len, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+BOOL em_4423_fastread_into(EM_4423_Pages *tag_content, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
 
 #endif
@@ -0,0 +1,160 @@
+#include "icode-slix.h"
+#include "logging.h"
+#include "reader.h"
+#include "tag-memory.h"
+
+// block layout of every family member is in tag-memory.c (TAG_MEMORY_ICODE_*). all blocks are user memory, the lock
+// state of a block is a status bit on the tag and not part of the memory map
+
+// -------------------- Identification -------------------------------
+
+BOOL icode_slix_kind_from_uid(const BYTE *uid, BYTE uidLen, TagMemoryKind *kind) {
+    if (uidLen != ICODE_SLIX_UID_LENGTH) {
+        return FALSE;
+    }
+
+    // ISO 15693 sends the UID LSB first and the reader passes it on like that (E0 is the last byte). turn it around
+    // if it comes MSB first, so that msb[0] is always E0
+    BYTE msb[ICODE_SLIX_UID_LENGTH];
+    for (int i = 0; i < ICODE_SLIX_UID_LENGTH; i++) {
+        msb[i] = (uid[ICODE_SLIX_UID_LENGTH - 1] == 0xE0) ? uid[ICODE_SLIX_UID_LENGTH - 1 - i] : uid[i];
+    }
+    if ((msb[0] != 0xE0) || (msb[1] != 0x04)) {
+        return FALSE;
+    }
+
+    switch (msb[2]) {
+    case 0x01:
+        // bits 37 / 36: 00 = SLI, 10 = SLIX, 01 = SLIX2, 11 = DNA. SLI and SLIX share the 28 block layout
+        switch ((msb[3] >> 3) & 0x03) {
+        case 0x00:
+        case 0x02:
+            *kind = TAG_MEMORY_ICODE_SLIX;
+            return TRUE;
+        case 0x01:
+            *kind = TAG_MEMORY_ICODE_SLIX2;
+            return TRUE;
+        default:
+            return FALSE;
+        }
+    case 0x02:
+        *kind = TAG_MEMORY_ICODE_SLIX_S;
+        return TRUE;
+    case 0x03:
+        *kind = TAG_MEMORY_ICODE_SLIX_L;
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+// -------------------- Reading -------------------------------
+
+// icode_slix_read_block reads a single 4 byte block (only for spot checks, use icode_slix_read_into for more)
+BOOL icode_slix_read_block(TagMemoryKind kind, BYTE block, BYTE out[ICODE_SLIX_BLOCK_SIZE], SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    LOG_DEBUG("Trying to read block 0x%02x.", block);
+    return tag_memory_read(tag_memory_profile(kind), block, 1, out, hCard, pbRecvBuffer, pbRecvBufferSize);
+}
+
+BOOL icode_slix_read_into(ICODE_SLIX_Blocks *tag_content, const BYTE *uid, BYTE uidLen, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    TagMemoryKind kind;
+    if (!icode_slix_kind_from_uid(uid, uidLen, &kind)) {
+        LOG_WARN("UID does not belong to an ICODE SLIX / SLIX2 / SLIX-S / SLIX-L.");
+        return FALSE;
+    }
+
+    const TagMemoryProfile *profile = tag_memory_profile(kind);
+    memset(tag_content, 0, sizeof(*tag_content));
+    tag_content->kind = kind;
+    if (!tag_memory_read(profile, 0, profile->pageCount, &tag_content->Blocks[0][0], hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        LOG_ERROR("Failed to read the %u blocks of the %s. Aborting..", (unsigned int)profile->pageCount, profile->name);
+        return FALSE;
+    }
+
+    LOG_INFO("Read all %u blocks of the %s with success.", (unsigned int)profile->pageCount, profile->name);
+    return TRUE;
+}
+
+// -------------------- Writing -------------------------------
+
+// icode_slix_verify_range reads blocks blocks starting at first_block with one READ BINARY and compares them to expected
+static BOOL icode_slix_verify_range(const TagMemoryProfile *profile, size_t first_block, const BYTE *expected, size_t blocks, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    BYTE on_tag[ICODE_SLIX_MAX_BLOCKS * ICODE_SLIX_BLOCK_SIZE];
+    if (!tag_memory_read(profile, first_block, blocks, on_tag, hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        LOG_ERROR("Failed to read back blocks 0x%02zx - 0x%02zx.", first_block, first_block + blocks - 1);
+        return FALSE;
+    }
+    if (memcmp(on_tag, expected, blocks * ICODE_SLIX_BLOCK_SIZE) != 0) {
+        LOG_ERROR("Verification of blocks 0x%02zx - 0x%02zx failed.", first_block, first_block + blocks - 1);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL icode_slix_write_range(TagMemoryKind kind, BYTE first_block, const BYTE *data, size_t len, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    const TagMemoryProfile *profile = tag_memory_profile(kind);
+    size_t blocks = (len + ICODE_SLIX_BLOCK_SIZE - 1) / ICODE_SLIX_BLOCK_SIZE;
+    if ((profile == NULL) || (len == 0) || (first_block + blocks > profile->pageCount)) {
+        LOG_WARN("Can not write %zu bytes starting at block 0x%02x.", len, first_block);
+        return FALSE;
+    }
+
+    BYTE padded[ICODE_SLIX_MAX_BLOCKS * ICODE_SLIX_BLOCK_SIZE] = {0};
+    memcpy(padded, data, len);
+
+    if (!tag_memory_write(profile, first_block, blocks, padded, hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        return FALSE;
+    }
+    return icode_slix_verify_range(profile, first_block, padded, blocks, hCard, pbRecvBuffer, pbRecvBufferSize);
+}
+
+BOOL icode_slix_commit(ICODE_SLIX_Blocks *tag_content, const ICODE_SLIX_Blocks *edited, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    const TagMemoryProfile *profile = tag_memory_profile(tag_content->kind);
+    if ((profile == NULL) || (edited->kind != tag_content->kind)) {
+        LOG_WARN("Edited blocks do not belong to the same kind of tag.");
+        return FALSE;
+    }
+
+    // contiguous runs of changed blocks go out as one bulk write each
+    int first = -1, last = -1;
+    for (int block = 0; block < profile->pageCount; block++) {
+        if (memcmp(edited->Blocks[block], tag_content->Blocks[block], ICODE_SLIX_BLOCK_SIZE) == 0) {
+            continue;
+        }
+        int run_end = block;
+        while ((run_end + 1 < profile->pageCount) && (memcmp(edited->Blocks[run_end + 1], tag_content->Blocks[run_end + 1], ICODE_SLIX_BLOCK_SIZE) != 0)) {
+            run_end++;
+        }
+        if (!tag_memory_write(profile, (size_t)block, (size_t)(run_end - block + 1), edited->Blocks[block], hCard, pbRecvBuffer, pbRecvBufferSize)) {
+            return FALSE;
+        }
+        first = (first < 0) ? block : first;
+        last = run_end;
+        block = run_end;
+    }
+    if (first < 0) {
+        LOG_DEBUG("No block changed, nothing to write.");
+        return TRUE;
+    }
+
+    // one read over everything that was written (the unchanged blocks in between are compared as well)
+    if (!icode_slix_verify_range(profile, (size_t)first, edited->Blocks[first], (size_t)(last - first + 1), hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        return FALSE;
+    }
+    memcpy(tag_content->Blocks[first], edited->Blocks[first], (size_t)(last - first + 1) * ICODE_SLIX_BLOCK_SIZE);
+
+    LOG_INFO("Committed and verified blocks 0x%02x - 0x%02x.", first, last);
+    return TRUE;
+}
+
+void icode_slix_blocks_print_all(const ICODE_SLIX_Blocks *tag_content) {
+    const TagMemoryProfile *profile = tag_memory_profile(tag_content->kind);
+    for (int i = 0; (profile != NULL) && (i < profile->pageCount); ++i) {
+        printf("[Block 0x%02X]\t0x%02X  0x%02X  0x%02X  0x%02X\n",
+           i,
+           tag_content->Blocks[i][0],
+           tag_content->Blocks[i][1],
+           tag_content->Blocks[i][2],
+           tag_content->Blocks[i][3]);
+    }
+}
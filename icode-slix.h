@@ -0,0 +1,53 @@
+#ifndef ICODE_SLIX_H
+#define ICODE_SLIX_H
+
+#ifndef READER_H
+#include "reader.h"
+#endif
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#ifndef TAG_MEMORY_H
+#include "tag-memory.h"
+#endif
+
+// NXP ICODE SLIX family (ISO 15693 vicinity tags, 4 byte blocks). every RF round trip to a vicinity tag is slow, so
+// nothing here goes block by block: the whole memory comes in with READ BINARY over many blocks (the reader sends one
+// Read Multiple Blocks, see the ICODE profiles in tag-memory.c) and writes go out as few UPDATE BINARY apdus as the
+// reader takes (tag_memory_write), followed by a single read back.
+//
+//      ICODE_SLIX_Blocks tag_content, edited;
+//      icode_slix_read_into(&tag_content, tag.uid, tag.uidLen, hCard, pbRecvBuffer, &pbRecvBufferSize);  // 1 apdu for a SLIX
+//      edited = tag_content;
+//      memcpy(edited.Blocks[1], ndef, ndef_len);
+//      icode_slix_commit(&tag_content, &edited, hCard, pbRecvBuffer, &pbRecvBufferSize);                 // changed blocks only
+
+#define ICODE_SLIX_BLOCK_SIZE   4
+#define ICODE_SLIX_MAX_BLOCKS   80      // SLIX2, the biggest member of the family
+#define ICODE_SLIX_UID_LENGTH   8
+
+typedef struct ICODE_SLIX_Blocks {
+    TagMemoryKind kind;         // TAG_MEMORY_ICODE_SLIX, _SLIX_S, _SLIX_L or _SLIX2, decides how many blocks are used
+    BYTE Blocks[ICODE_SLIX_MAX_BLOCKS][ICODE_SLIX_BLOCK_SIZE];
+} ICODE_SLIX_Blocks;
+
+// icode_slix_kind_from_uid tells the family members apart by IC manufacturer (04 = NXP), family code and type bits of the
+// UID (bits 36 and 37). returns FALSE for other ISO 15693 tags (e.g. ICODE DNA, which needs authentication)
+BOOL icode_slix_kind_from_uid(const BYTE *uid, BYTE uidLen, TagMemoryKind *kind);
+
+BOOL icode_slix_read_block(TagMemoryKind kind, BYTE block, BYTE out[ICODE_SLIX_BLOCK_SIZE], SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+// icode_slix_read_into reads every block of the tag (kind from the UID) with as few READ BINARY as the profile allows
+BOOL icode_slix_read_into(ICODE_SLIX_Blocks *tag_content, const BYTE *uid, BYTE uidLen, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+
+// icode_slix_write_range writes len bytes starting at first_block (a partial last block is padded with zeros) in as few
+// apdus as the reader allows and verifies everything with a single read
+BOOL icode_slix_write_range(TagMemoryKind kind, BYTE first_block, const BYTE *data, size_t len, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+// icode_slix_commit writes each run of blocks where edited differs from tag_content with one bulk write, verifies all of
+// them with one read and then updates tag_content
+BOOL icode_slix_commit(ICODE_SLIX_Blocks *tag_content, const ICODE_SLIX_Blocks *edited, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+
+void icode_slix_blocks_print_all(const ICODE_SLIX_Blocks *tag_content);
+
+#endif
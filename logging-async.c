@@ -0,0 +1,242 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "logging.h"
+#include "timing.h"
+
+// bounded multi-producer / single-consumer ring (Vyukov style): every slot carries a sequence number that tells producers
+// whether it is free and the consumer whether it is filled, so producers never take a lock. if the ring is full the
+// record is dropped and counted instead of blocking the caller (which might be in the middle of an RF exchange).
+// an idle writer thread sleeps on a condition variable, a producer only takes the mutex to wake it when it really sleeps
+
+#define LOG_ASYNC_SLOTS         1024 // must be a power of two
+#define LOG_ASYNC_MESSAGE_SIZE  240
+
+typedef struct LogRecord {
+    uint64_t sequence;
+    uint64_t timestampNs;           // timing_now_ns() of the LOG_* call
+    const char *level;              // string literals, so storing the pointer is fine
+    const char *file;
+    int line;
+    char message[LOG_ASYNC_MESSAGE_SIZE];
+} LogRecord;
+
+volatile int log_async_active = 0;
+
+static LogRecord logRing[LOG_ASYNC_SLOTS];
+static uint64_t logEnqueuePos = 0;
+static uint64_t logDequeuePos = 0;
+static unsigned long long logDropped = 0;
+static int logStopRequested = 0;
+static int logInFlight = 0;         // producers between their log_async_active check and the publish of their record
+static int logWriterSleeping = 0;
+static pthread_mutex_t logWakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logWake = PTHREAD_COND_INITIALIZER;
+static pthread_t logThread;
+static uint64_t logBaseMonotonicNs; // monotonic and wall clock taken at the same moment, used to turn record timestamps into wall time
+static struct timespec logBaseWall;
+
+// log_async_print_sync prints like the synchronous LOG_FMT, for a producer that saw log_async_active before
+// log_async_stop cleared it
+static void log_async_print_sync(const char *level, const char *file, int line, const char *fmt, va_list args) {
+    char message[LOG_ASYNC_MESSAGE_SIZE];
+    vsnprintf(message, sizeof(message), fmt, args);
+    time_t t = time(NULL);
+    struct tm lt;
+    char timestr[20];
+    localtime_r(&t, &lt);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &lt);
+    fprintf(stderr, "[%s] [%s] [%s:%d] %s\n", timestr, level, file, line, message);
+}
+
+// log_async_wake wakes the writer thread if it sleeps. the fence orders the publish of the record before the load of
+// logWriterSleeping, the writer stores logWriterSleeping before it looks at the ring a last time, so one of both sees the other
+static void log_async_wake(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&logWriterSleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&logWakeLock);
+        pthread_cond_signal(&logWake);
+        pthread_mutex_unlock(&logWakeLock);
+    }
+}
+
+void log_async_write(const char *level, const char *file, int line, const char *fmt, ...) {
+    uint64_t now = timing_now_ns();
+    va_list args;
+
+    // the check of LOG_FMT is only the fast path: log_async_stop waits for every producer that is counted here, so a
+    // record that is enqueued after this check is still written by the final drain
+    __atomic_add_fetch(&logInFlight, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&log_async_active, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&logInFlight, 1, __ATOMIC_SEQ_CST);
+        va_start(args, fmt);
+        log_async_print_sync(level, file, line, fmt, args);
+        va_end(args);
+        return;
+    }
+
+    uint64_t pos = __atomic_load_n(&logEnqueuePos, __ATOMIC_RELAXED);
+    LogRecord *record;
+
+    for (;;) {
+        record = &logRing[pos & (LOG_ASYNC_SLOTS - 1)];
+        uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(sequence - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&logEnqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break; // slot is ours
+            }
+            // pos was reloaded by the failed compare exchange
+        } else if (diff < 0) {
+            __atomic_fetch_add(&logDropped, 1, __ATOMIC_RELAXED); // ring is full
+            __atomic_sub_fetch(&logInFlight, 1, __ATOMIC_SEQ_CST);
+            return;
+        } else {
+            pos = __atomic_load_n(&logEnqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+
+    record->timestampNs = now;
+    record->level = level;
+    record->file = file;
+    record->line = line;
+    va_start(args, fmt);
+    vsnprintf(record->message, sizeof(record->message), fmt, args);
+    va_end(args);
+
+    __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+    log_async_wake();
+    __atomic_sub_fetch(&logInFlight, 1, __ATOMIC_SEQ_CST);
+}
+
+// log_async_format formats one record the same way the synchronous LOG_FMT does (plus milliseconds), returns the length
+static int log_async_format(const LogRecord *record, char *out, size_t size) {
+    uint64_t sinceBase = record->timestampNs - logBaseMonotonicNs + (uint64_t)logBaseWall.tv_nsec;
+    time_t seconds = logBaseWall.tv_sec + (time_t)(sinceBase / 1000000000ull);
+    unsigned int millis = (unsigned int)((sinceBase % 1000000000ull) / 1000000ull);
+
+    struct tm lt;
+    char timestr[20];
+    localtime_r(&seconds, &lt);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &lt);
+    return snprintf(out, size, "[%s.%03u] [%s] [%s:%d] %s\n", timestr, millis, record->level, record->file, record->line, record->message);
+}
+
+// log_async_drain writes everything that is in the ring right now to stderr (batched into few writes), returns how many records were written
+static size_t log_async_drain(void) {
+    static char batch[16 * 1024];
+    size_t used = 0;
+    size_t printed = 0;
+
+    for (;;) {
+        LogRecord *record = &logRing[logDequeuePos & (LOG_ASYNC_SLOTS - 1)];
+        uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        if (sequence != logDequeuePos + 1) {
+            break; // empty (or the producer of this slot has not finished writing yet)
+        }
+
+        char line[LOG_ASYNC_MESSAGE_SIZE + 128];
+        int length = log_async_format(record, line, sizeof(line));
+        __atomic_store_n(&record->sequence, logDequeuePos + LOG_ASYNC_SLOTS, __ATOMIC_RELEASE);
+        logDequeuePos++;
+        printed++;
+
+        if (length <= 0) {
+            continue;
+        }
+        if ((size_t)length >= sizeof(line)) {
+            length = sizeof(line) - 1;
+        }
+        if (used + (size_t)length > sizeof(batch)) {
+            fwrite(batch, 1, used, stderr);
+            used = 0;
+        }
+        memcpy(batch + used, line, (size_t)length);
+        used += (size_t)length;
+    }
+
+    if (used > 0) {
+        fwrite(batch, 1, used, stderr);
+    }
+    return printed;
+}
+
+// log_async_ready tells whether the record at the head of the ring is published
+static int log_async_ready(void) {
+    const LogRecord *record = &logRing[logDequeuePos & (LOG_ASYNC_SLOTS - 1)];
+    return __atomic_load_n(&record->sequence, __ATOMIC_SEQ_CST) == logDequeuePos + 1;
+}
+
+static void *log_async_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (log_async_drain() > 0) {
+            continue;
+        }
+        pthread_mutex_lock(&logWakeLock);
+        __atomic_store_n(&logWriterSleeping, 1, __ATOMIC_SEQ_CST);
+        while (!logStopRequested && !log_async_ready()) {
+            pthread_cond_wait(&logWake, &logWakeLock);
+        }
+        __atomic_store_n(&logWriterSleeping, 0, __ATOMIC_SEQ_CST);
+        int stop = logStopRequested;
+        pthread_mutex_unlock(&logWakeLock);
+        if (stop) {
+            break;
+        }
+    }
+    // log_async_stop only asks for the stop once no producer is in flight any more, so this drain gets every record
+    log_async_drain();
+    return NULL;
+}
+
+int log_async_start(void) {
+    if (log_async_active) {
+        return 1;
+    }
+    for (uint64_t i = 0; i < LOG_ASYNC_SLOTS; i++) {
+        logRing[i].sequence = i;
+    }
+    logEnqueuePos = 0;
+    logDequeuePos = 0;
+    logStopRequested = 0;
+    logWriterSleeping = 0;
+    clock_gettime(CLOCK_REALTIME, &logBaseWall);
+    logBaseMonotonicNs = timing_now_ns();
+
+    if (pthread_create(&logThread, NULL, log_async_thread, NULL) != 0) {
+        return 0;
+    }
+    __atomic_store_n(&log_async_active, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void log_async_stop(void) {
+    if (!log_async_active) {
+        return;
+    }
+    // from here on LOG_* prints synchronously again. producers that passed the check before are still counted in
+    // logInFlight, the writer thread is only stopped after the last of them published its record and then empties the
+    // ring once more before it exits
+    __atomic_store_n(&log_async_active, 0, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&logInFlight, __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+    pthread_mutex_lock(&logWakeLock);
+    logStopRequested = 1;
+    pthread_cond_signal(&logWake);
+    pthread_mutex_unlock(&logWakeLock);
+    pthread_join(logThread, NULL);
+    if (logDropped > 0) {
+        fprintf(stderr, "[logging] %llu log records were dropped because the ring buffer was full\n", logDropped);
+    }
+}
+
+unsigned long long log_async_dropped(void) {
+    return __atomic_load_n(&logDropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,80 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <stdio.h>
+#include <time.h>
+
+// log levels. everything below LOG_LEVEL_MIN is compiled away completely (arguments are not even evaluated),
+// e.g. make LOG_LEVEL=LOG_LEVEL_WARN removes the DEBUG and INFO lines that are printed for every apdu
+#define LOG_LEVEL_DEBUG     0
+#define LOG_LEVEL_INFO      1
+#define LOG_LEVEL_WARN      2
+#define LOG_LEVEL_ERROR     3
+#define LOG_LEVEL_CRITICAL  4
+
+#ifndef LOG_LEVEL_MIN
+#define LOG_LEVEL_MIN LOG_LEVEL_DEBUG
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOG_PRINTF_LIKE(fmtIndex, argIndex) __attribute__((format(printf, fmtIndex, argIndex)))
+#else
+#define LOG_PRINTF_LIKE(fmtIndex, argIndex)
+#endif
+
+// async mode (see logging-async.c): when active, LOG_* only copies the formatted message plus a monotonic timestamp into
+// a lock-free ring buffer and a background thread does the localtime/strftime/fprintf part
+extern volatile int log_async_active;
+int log_async_start(void);
+void log_async_stop(void);
+unsigned long long log_async_dropped(void);
+void log_async_write(const char *level, const char *file, int line, const char *fmt, ...) LOG_PRINTF_LIKE(4, 5);
+
+#define LOG_FMT(level, fmt, ...) \
+    do { \
+        if (log_async_active) { \
+            log_async_write(level, __FILE__, __LINE__, fmt, ##__VA_ARGS__); \
+            break; \
+        } \
+        time_t t = time(NULL); \
+        struct tm *lt = localtime(&t); \
+        char timestr[20]; \
+        strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", lt); \
+        fprintf(stderr, "[%s] [%s] [%s:%d] " fmt "\n", timestr, level, __FILE__, __LINE__, ##__VA_ARGS__); \
+    } while (0)
+
+// disabled levels keep the format check of the compiler but generate no code
+#define LOG_DISABLED(fmt, ...) \
+    do { \
+        if (0) { \
+            fprintf(stderr, fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#if LOG_LEVEL_MIN <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...)   	LOG_FMT("DEBUG", fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...)   	LOG_DISABLED(fmt, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL_MIN <= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...)    	LOG_FMT("INFO", fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...)    	LOG_DISABLED(fmt, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL_MIN <= LOG_LEVEL_WARN
+#define LOG_WARN(fmt, ...)    	LOG_FMT("WARN", fmt, ##__VA_ARGS__)
+#else
+#define LOG_WARN(fmt, ...)    	LOG_DISABLED(fmt, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL_MIN <= LOG_LEVEL_ERROR
+#define LOG_ERROR(fmt, ...)   	LOG_FMT("ERROR", fmt, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(fmt, ...)   	LOG_DISABLED(fmt, ##__VA_ARGS__)
+#endif
+
+#define LOG_CRITICAL(fmt, ...)	LOG_FMT("CRITICAL", fmt, ##__VA_ARGS__) // never filtered
+
+#endif
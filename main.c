@@ -1,317 +1,148 @@
-// install drivers from https://www.acs.com.hk/en/products/583/acr1581u-dualboost-iii-usb-dual-interface-reader/
-#include "main.h"
-#include "ndef.h"
-#include "em-4423.h"
+// main: command line front-end of libnfcacr (nfcacr.h), every step it takes is a library call
+#include "nfcacr.h"
 
-#include "logging.c"
+#include "timing.h"
+#include "logging.h"
 
-
-// -------------------- Functions that interact with reader -------------------------------
-
-LONG getAvailableReaders(SCARDCONTEXT hContext, char *mszReaders, DWORD *dwReaders) {
-    LONG lRet = SCardListReaders(hContext, NULL, mszReaders, dwReaders);
-    if (lRet != SCARD_S_SUCCESS) {
-        if (lRet == 0x8010002E) {
-            LOG_CRITICAL("Failed to list readers: Are you sure your smart card reader is connected and turned on?\n");
-        } else {
-            LOG_CRITICAL("Failed to list readers: 0x%lX\n", lRet);
-        }
-    }
-
-    return lRet;
+// printIdentifiedTag is the tag handler of the --all-readers mode, every reader worker calls it for its tag
+static BOOL printIdentifiedTag(ReaderWorker *worker, void *userData) {
+    (void)userData;
+    LOG_INFO("[%s] Identified tag: %s (detection to first APDU: %.3f ms)", worker->reader, tag_type_name(worker->tag.type), presence_first_apdu(&worker->session.watcher) / 1e6);
+    return TRUE;
 }
 
-LONG connectToReader(SCARDCONTEXT hContext, const char *reader, SCARDHANDLE *hCard, DWORD *dwActiveProtocol, BOOL directConnect) {
-    LONG lRet;
-
-    if (directConnect) {
-        // direct communication with reader (no present tag required)
-        lRet = SCardConnect(hContext, reader, SCARD_SHARE_DIRECT, SCARD_PROTOCOL_T1, hCard, dwActiveProtocol);
-    } else {
-        // T1 = block transmission (works), T0 = character transmission (did not work when testing), Tx = T0 | T1 (works)
-        // https://learn.microsoft.com/en-us/openspecs/windows_protocols/ms-rdpesc/41673567-2710-4e86-be87-7b6f46fe10af
-        lRet = SCardConnect(hContext, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, hCard, dwActiveProtocol);
-    }
-
-    return lRet;
-}
-
-// executes command and returns the amount of bytes that the response contains
-ApduResponse executeApdu(SCARDHANDLE hCard, BYTE *pbSendBuffer, DWORD dwSendLength, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
-    // first reset first 2048 bytes of response buffer to all zeroes (to avoid that 90 00 from some previous command is later read and confused)
-    resetBuffer2048(pbRecvBuffer);
-
-    // this took me long to figure out (part 1): i want to always remember the size of the array that holds the response. but SCardTransmit modifies the value of pbRecvBufferSize to the amount of bytes of the response. thats why we can lose the information how big our buffer is. this can lead to nasty bugs (e.g. you just once forget to update pbRecvBufferSize to the amount of bytes of the expected response and then u get UB due to buffer overflow. so safer is to just always reset to actual buffer size)
-    DWORD pbRecvBufferSizeBackup = *pbRecvBufferSize;
-
-    LONG lRet = SCardTransmit(hCard, SCARD_PCI_T1, pbSendBuffer, dwSendLength, NULL, pbRecvBuffer, pbRecvBufferSize);
-    // also print reply
-    if (lRet == SCARD_S_SUCCESS) {
-        // print which command you sent
-        printf("> ");
-        printHex(pbSendBuffer, dwSendLength);
-
-        // print what you received
-        printf("< ");
-        printHex(pbRecvBuffer, *pbRecvBufferSize);
-
-    } else {
-        //printf("%08x\n", lRet);
-        printf("%08lx\n", lRet);
-    }
-
-    LOG_DEBUG("Response status: %0lx (0 means success)", lRet);
-    LOG_DEBUG("Response size: %lu bytes", *pbRecvBufferSize); // linux wants %lu, macos wants %u. just use either and ignore warning lul
-    
-    // return both status and length of response
-    // ApduResponse response;
-    // response.status = lRet;
-    // response.amount_response_bytes = *pbRecvBufferSize;
-    ApduResponse response = {
-        .status = lRet,
-        .amount_response_bytes = *pbRecvBufferSize
-    };
-
-    // this took me long to figure out (part 2): i want to always retain the constant buffer size in this variable
-    *pbRecvBufferSize = pbRecvBufferSizeBackup;
-
-    return response;
-}
-
-LONG disableBuzzer(SCARDCONTEXT hContext, const char *reader, SCARDHANDLE *hCard, DWORD *dwActiveProtocol, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
-    LONG lRet = connectToReader(hContext, reader, hCard, dwActiveProtocol, TRUE);
+// runAllReaders identifies one tag on every connected ACR1581U at the same time (one worker thread per reader)
+static int runAllReaders(void) {
+    static MultiReader engine; // ~50 KB, too large for the stack of some platforms
+    LONG lRet = multi_reader_start(&engine, "ACR1581", printIdentifiedTag, NULL, FALSE);
     if (lRet != SCARD_S_SUCCESS) {
-        LOG_ERROR("Failed to connect: 0x%x\n", (unsigned int)lRet);
         return 1;
     }
+    multi_reader_join(&engine);
 
-    // APDU command to disable the buzzer sound of ACR1581U
-    BYTE pbSendBuffer[6] = { 0xE0, 0x00, 0x00, 0x21, 0x01, 0x01 };
-
-    LONG result = SCardControl(*hCard, SCARD_CTL_CODE(3500), pbSendBuffer, sizeof(pbSendBuffer), pbRecvBuffer, *pbRecvBufferSize, pbRecvBufferSize);
-
-    return result;
+    int failures = 0;
+    for (size_t i = 0; i < engine.count; i++) {
+        if (engine.workers[i].lastStatus != SCARD_S_SUCCESS) {
+            LOG_ERROR("[%s] Failed with error code: 0x%x", engine.workers[i].reader, (unsigned int)engine.workers[i].lastStatus);
+            failures++;
+        }
+    }
+    return failures ? 1 : 0;
 }
 
-void disconnectReader(SCARDHANDLE hCard, SCARDCONTEXT hContext) {
-    SCardDisconnect(hCard, SCARD_LEAVE_CARD);
-    SCardReleaseContext(hContext);
+// uriPayload is the payload of the --provision mode: one URI record "<prefix><sequence>", e.g. https://example.com/tag/17
+static BOOL uriPayload(uint64_t sequence, NdefBuilder *builder, void *userData) {
+    char uri[256];
+    int n = snprintf(uri, sizeof(uri), "%s%llu", (const char *)userData, (unsigned long long)sequence);
+    return (n > 0) && ((size_t)n < sizeof(uri)) && ndef_builder_add_uri(builder, uri);
 }
 
-// -------------------- General Functions that interact with various tags -------------------------------
-
-LONG getUID(SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, BOOL printResult) {
-    LOG_INFO("Will now try to determine UID");
-    // Define the GET UID APDU command (PC/SC standard for many cards)
-    BYTE pbSendBuffer[5] = { 0xFF, 0xCA, 0x00, 0x00, 0x00 }; // if u change last byte to e.g. 0x04 then u only get first 4 bytes of UID
-    ApduResponse response = executeApdu(hCard, pbSendBuffer, sizeof(pbSendBuffer), pbRecvBuffer, pbRecvBufferSize);
-    if (response.status != SCARD_S_SUCCESS) {
-        return response.status;
-    }
+// runProvisioning writes a numbered URI to every tag that is put on the PICC reader until count tags are done or Ctrl+C
+static int runProvisioning(uint64_t count, const char *uriPrefix) {
+    SCARDCONTEXT hContext;
+    char mszReaders[1024];
+    DWORD dwReaders = sizeof(mszReaders);
 
-    // ensure 90 00 success is returned
-    if ((!((pbRecvBuffer[4] == 0x90 && pbRecvBuffer[5] == 0x00) ||   // UID of length 4: single UID
-         (pbRecvBuffer[7] == 0x90 && pbRecvBuffer[8] == 0x00)   ||   // UID of length 7: double UID
-         (pbRecvBuffer[10] == 0x90 && pbRecvBuffer[11] == 0x00)     // UID of length 10: oh baby a triple oh yeah UID
-         ))) {      
-        
-        //dump_response_buffer_256(pbRecvBuffer);
-        return ACR_90_00_FAILURE;
+    LONG lRet = transport_get()->establishContext(SCARD_SCOPE_SYSTEM, &hContext);
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_CRITICAL("Failed to establish context: 0x%X\n", (unsigned int)lRet);
+        return 1;
     }
-
-    if (printResult) {
-        // success: now print UID
-        printf("Detected UID: ");
-        for (DWORD i = 0; i < *pbRecvBufferSize - 2; i++) { // -2 because no need to print success code 90 00
-            // avoid printing entire buffer of zeroes, but check for 90 00 only if i+1 is in bounds
-            if ((i + 1 < *pbRecvBufferSize) &&
-                (pbRecvBuffer[i] == 0x90) &&
-                (pbRecvBuffer[i + 1] == 0x00)) {
-                printf("\n\n");
-                return response.status;
-            }
-            printf("%02X ", pbRecvBuffer[i]);
-        }
+    char *reader = NULL;
+    if (getAvailableReaders(hContext, mszReaders, &dwReaders) == SCARD_S_SUCCESS) {
+        reader = findPiccReader(mszReaders);
     }
-
-    printf("\n");
-    return response.status;
-}
-
-// getATS_14443A sends a RATS (Request for Answer To Select) to the tag (afaik only stuff like desfire, ntag 424 dna, smartMX and some java cards even support this)
-ApduResponse getATS_14443A(SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, char *tagName) {
-    LOG_INFO("Will now try to determine ATS");
-    BYTE pbSendBuffer[] = { 0xFF, 0xCA, 0x01, 0x00, 0x00 };
-    ApduResponse response = executeApdu(hCard, pbSendBuffer, sizeof(pbSendBuffer), pbRecvBuffer, pbRecvBufferSize);
-
-    if ((pbRecvBuffer[0] == 0x6A) && (pbRecvBuffer[1] == 0x81)) {
-        LOG_WARN("Accessing ATS of this tag type is currently not supported by this program\n");
+    if ((reader == NULL) || !containsSubstring(reader, "ACR1581")) {
+        LOG_CRITICAL("No ACR1581 PICC reader found.\n");
+        transport_get()->releaseContext(hContext);
+        return 1;
     }
 
-    // identify Mifare Desfire EV3 8k
-    if ((pbRecvBuffer[0] == 0x06) && (pbRecvBuffer[1] == 0x75) && (pbRecvBuffer[2] == 0x77) && (pbRecvBuffer[3] == 0x81) && (pbRecvBuffer[4] == 0x02) && (pbRecvBuffer[5] == 0x80)) {
-        LOG_INFO("I now know for sure that your tag is: Desfire EV3");
-        // update stored tag name
-        strncpy(tagName, "Mifare Desfire EV3 8k", 99); // i dont own enough tags to tell whether that decides just desfire, or desfire ev3, or desfire ev3 8k
-    } 
-    // identify NTAG 424 DNA TT
-    else if ((pbRecvBuffer[0] == 0x06) && (pbRecvBuffer[1] == 0x77) && (pbRecvBuffer[2] == 0x77) && (pbRecvBuffer[3] == 0x71) && (pbRecvBuffer[4] == 0x02) && (pbRecvBuffer[5] == 0x80)) {
-        LOG_INFO("I now know for sure that your tag is: NTAG DNA 424 DNA");
-        // update stored tag name
-        strncpy(tagName, "NTAG 424 DNA TT", 99);
+    NfcSession session;
+    lRet = session_open(&session, hContext, reader);
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_CRITICAL("Failed to watch reader: 0x%x\n", (unsigned int)lRet);
+        session_close(&session);
+        return 1;
     }
 
-    printf("\n");
-    return response;
-}
-
-LONG getStatus(SCARDHANDLE *hCard, char *mszReaders, DWORD dwState, DWORD dwReaders, DWORD *dwActiveProtocol, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, BOOL printResult, char *tagName) {
-    LOG_INFO("Will now try to determine which model your tag is");
-    LONG lRet = SCardStatus(*hCard, mszReaders, &dwReaders, &dwState, dwActiveProtocol, pbRecvBuffer, pbRecvBufferSize);
-    if ((lRet == SCARD_S_SUCCESS) && printResult) {
-        // success: now print status
-        printf("Detected tag type: ");
-        for (DWORD i = 0; i < *pbRecvBufferSize - 2; i++) { // -2 because no need to print success code 90 00
-            printf("%02X ", pbRecvBuffer[i]);
-        }
-        printf("\n");
-
-        if (*pbRecvBuffer < 8) {
-            LOG_ERROR("Failed to identify the tag (reply too short)\n");
-            strncpy(tagName, "UNIDENTIFIED TAG", 99);
-            return 1;
-        }
-
-        // determine which kind of tag this is
-        BYTE tagIdentifyingByte1 = pbRecvBuffer[13];
-        BYTE tagIdentifyingByte2 = pbRecvBuffer[14];
-        if ((tagIdentifyingByte1 == 0x00) &&  (tagIdentifyingByte2 == 0x01)) {
-            printf("Identified tag as: Mifare Classic 1k\n");
-            strncpy(tagName, "Mifare Classic 1k", 99); // copy less than 100 chars cuz that's how long the name buffer is
-        } else if ((pbRecvBuffer[13] == 0x00) && (pbRecvBuffer[14] == 0x02)) {
-            printf("Identified tag as: Mifare Classic 4k\n");
-            strncpy(tagName, "Mifare Classic 4k", 99);
-        } else if ((pbRecvBuffer[13] == 0x00) && (pbRecvBuffer[14] == 0x03)) {
-            printf("Identified tag as: Mifare Ultralight or NTAG2xx\n");
-            strncpy(tagName, "Mifare Ultralight or NTAG2xx", 99);
-        } else if ((pbRecvBuffer[13] == 0x00) && (pbRecvBuffer[14] == 0x26)) {
-            printf("Identified tag as: Mifare Mini\n");
-            strncpy(tagName, "Mifare Mini", 99);
-        } else if ((pbRecvBuffer[13] == 0xF0) && (pbRecvBuffer[14] == 0x04)) {
-            printf("Identified tag as: Topaz/Jewel\n");
-            strncpy(tagName, "Topaz/Jewel", 99);
-        } else if ((pbRecvBuffer[13] == 0xF0) && (pbRecvBuffer[14] == 0x11)) {
-            printf("Identified tag as: FeliCa 212K\n");
-            strncpy(tagName, "FeliCa 212K", 99);
-        } else if ((pbRecvBuffer[13] == 0xF0) && (pbRecvBuffer[14] == 0x12)) {
-            printf("Identified tag as: FeliCa 424K\n");
-            strncpy(tagName, "FeliCa 424K", 99);
-        } else if ((pbRecvBuffer[0] == 0x3B) && (pbRecvBuffer[1] == 0x81) && (pbRecvBuffer[2] == 0x80) && (pbRecvBuffer[3] == 0x01) ) {
-            printf("Identified tag as: Mifare Desfire EV3 8k or NTAG 424 DNA TT\n");
-            strncpy(tagName, "Mifare Desfire EV3 8k or NTAG 424 DNA TT", 99);
-        } else if (pbRecvBuffer[13] == 0xFF) {
-            LOG_WARN("Identified tag as: UNKNOWN TAG\n");
-            strncpy(tagName, "UNKNOWN TAG", 99);
-        } 
-
-        else {
-            LOG_ERROR("Failed to identify the tag\n");
-            strncpy(tagName, "UNIDENTIFIED TAG", 99);
-        }
+    static Provisioner provisioner; // holds two 2 KB buffers and the payload slots, keep it off the stack
+    ProvisionConfig config = { .payload = uriPayload, .userData = (void *)uriPrefix, .maxTags = count, .reportEvery = 10 };
+    if (!provision_stop_on_sigint(&provisioner)) {
+        LOG_WARN("Ctrl+C handler could not be installed, stop with --count");
     }
-
-    printf("\n");
-    return lRet;
+    LOG_INFO("Provisioning on %s, put the tags on the reader one after another", reader);
+    lRet = provision_run(&provisioner, &session, &config);
+    session_close(&session);
+    return ((lRet == SCARD_S_SUCCESS) && (provisioner.stats.tagsFailed == 0)) ? 0 : 1;
 }
 
-// -------------------- Helper functions -------------------------------------------------------
-
-BOOL containsSubstring(const char *string, const char *substring) {
-    // Edge case: if substring is empty, it's always considered a match
-    if (*substring == '\0') {
-        return TRUE;
+// archiveTag reads the memory of the identified tag and appends it to the archive at path (nfc-archive looks at it).
+// ultralight / EM4423, ICODE SLIX and the sectors of a Mifare Classic that open with a default key are dumped completely,
+// for every other tag only the UID is recorded
+static BOOL archiveTag(const char *path, const TagIdentity *tag, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    static EM_4423_Pages pages;
+    static ICODE_SLIX_Blocks blocks;
+    static MIFARE_Classic_Blocks sectors;
+    static MifareClassicReader classic;
+    BOOL isClassic = (mifare_classic_sector_count(tag->type) > 0);
+    if (isClassic) {
+        mifare_classic_reader_init(&classic, hCard);
     }
-
-    // Iterate through the string
-    for (const char *s = string; *s != '\0'; ++s) {
-        // Check if the current character matches the first character of substring
-        if (*s == *substring) {
-            const char *str_ptr = s;
-            const char *sub_ptr = substring;
-
-            // Compare the substring starting from here
-            while (*sub_ptr != '\0' && *str_ptr == *sub_ptr) {
-                str_ptr++;
-                sub_ptr++;
-            }
-
-            // If the entire substring matches, return 1 (true)
-            if (*sub_ptr == '\0') {
-                return TRUE;
-            }
-        }
+    const BYTE *image = NULL;
+    size_t imageLength = 0;
+    BYTE pageSize = 0;
+
+    if ((tag->type == TAG_TYPE_ULTRALIGHT_NTAG2XX) && em_4423_fastread_into(&pages, hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        image = &pages.Pages[0][0];
+        imageLength = sizeof(pages.Pages);
+        pageSize = EM_4423_PAGE_SIZE;
+    } else if ((tag->type == TAG_TYPE_ICODE_SLI) && icode_slix_read_into(&blocks, tag->uid, tag->uidLen, hCard, pbRecvBuffer, pbRecvBufferSize)) {
+        image = &blocks.Blocks[0][0];
+        imageLength = (size_t)tag_memory_profile(blocks.kind)->pageCount * ICODE_SLIX_BLOCK_SIZE;
+        pageSize = ICODE_SLIX_BLOCK_SIZE;
+    } else if (isClassic && mifare_classic_dump(&classic, tag->type, MIFARE_CLASSIC_DEFAULT_KEYS, MIFARE_CLASSIC_DEFAULT_KEY_COUNT, &sectors, pbRecvBuffer, pbRecvBufferSize)) {
+        image = &sectors.Blocks[0][0];
+        imageLength = mifare_classic_block_count(sectors.type) * MIFARE_CLASSIC_BLOCK_SIZE;
+        pageSize = MIFARE_CLASSIC_BLOCK_SIZE;
+    } else if ((tag->type == TAG_TYPE_ULTRALIGHT_NTAG2XX) || (tag->type == TAG_TYPE_ICODE_SLI) || isClassic) {
+        LOG_WARN("Could not read the tag memory, archiving the UID only.");
     }
 
-    // Return 0 (false) if the substring was not found
-    return FALSE;
-}
-
-// printHex prints bytes as hex
-void printHex(LPCBYTE pbData, DWORD cbData) {
-    for (DWORD i = 0; i < cbData; i++) {
-        printf("%02x ", pbData[i]);
+    TagArchive archive;
+    uint64_t offset;
+    TagArchiveStatus status = tag_archive_open(&archive, path, 1);
+    if (status == TAG_ARCHIVE_OK) {
+        status = tag_archive_append(&archive, tag->uid, tag->uidLen, (uint8_t)tag->type, pageSize, image, imageLength, timing_wall_ns(), &offset);
     }
-    printf("\n");
-}
-
-// dump_response_buffer_16 prints the first 16 values contained in the array (but there is more in the array, so maybe write a full dump function if necessary)
-void dump_response_buffer_16(BYTE *pbRecvBuffer) {
-    printf("\nDumping first 16 values in response buffer:\n");
-    for (int i = 0; i < 16; i++) {
-        printf("0x%02x", pbRecvBuffer[i]);
-        if (i != 15) {
-            printf("  ");
-        }
+    if (status == TAG_ARCHIVE_OK) {
+        status = tag_archive_sync(&archive);
     }
-    printf("\n\n");
-}
-
-// dump_response_buffer_256 prints the first 256 values contained in the array. line-breaks after every 4 bytes.
-void dump_response_buffer_256(BYTE *pbRecvBuffer) {
-    printf("\nDumping first 256 values in response buffer:\n");
-    for (int i = 0; i < 256; i++) {
-        printf("0x%02x", pbRecvBuffer[i]);
-        if ((i+1) % 4 == 0) { // +1 so that it doesnt line-break for i=0
-            printf("\n");
-        }
-        else {
-            printf("  ");
+    if (status != TAG_ARCHIVE_OK) {
+        LOG_ERROR("Could not archive the tag in %s: %s", path, tag_archive_status_name(status));
+        if (archive.fd >= 0) {
+            tag_archive_close(&archive);
         }
+        return FALSE;
     }
-    printf("\n\n");
+    LOG_INFO("Archived %zu bytes of the tag in %s (record @%llu, %llu records of %llu tags).", imageLength, path, (unsigned long long)offset,
+             (unsigned long long)tag_archive_record_count(&archive), (unsigned long long)tag_archive_uid_count(&archive));
+    tag_archive_close(&archive);
+    return TRUE;
 }
 
-// resetBuffer2048 is used to reset the reply buffer to all zeroes, e.g. resetBuffer(pbRecvBuffer);
-void resetBuffer2048(BYTE *buffer) {
-    memset(buffer, 0, 2048);
-    LOG_DEBUG("Response buffer has been reset to all zeroes");
-}
-
-// is_byte_in_array is a helper function to check whether passed byte value is an element in the array 'array' of size 'size'
-// C feels really old here, not being able to get size of array that has static size because it decays to a pointer in this function is kinda cringe no cap
-BOOL is_byte_in_array(BYTE value, const BYTE *array, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-        if (array[i] == value) {
-            return TRUE;
-        }
+// usage: main [--all-readers | --provision [--count N] [--uri PREFIX] | --archive PATH]
+//      environment: NFC_TRANSPORT=sim (simulated reader), NFC_LOG_ASYNC=1 (log from a background thread),
+//                   NFC_TRACE=console|none|file:<path> (where the exchanged apdus go)
+//      without arguments the last PICC reader is used to identify one tag, --all-readers does the same on every ACR1581U in parallel
+//      --provision writes the NDEF URI "<PREFIX><n>" (default https://example.com/tag/) to tag after tag, n counts up from 0
+//      --archive identifies the tag like without arguments and appends a dump of its memory to the tag archive at PATH
+int main(int argc, char **argv) {
+    // NFC_LOG_ASYNC=1 moves formatting and printing of log lines to a background thread (see logging-async.c)
+    if ((getenv("NFC_LOG_ASYNC") != NULL) && log_async_start()) {
+        atexit(log_async_stop);
     }
-    return FALSE;
-}
 
-
-// -------------------------------------------------------
-
-int main(void) {
     SCARDCONTEXT hContext;
     SCARDHANDLE hCard = 0;
     DWORD dwActiveProtocol;
@@ -321,12 +152,44 @@ int main(void) {
     BYTE pbRecvBuffer[2048] = {0};
     DWORD pbRecvBufferSize = sizeof(pbRecvBuffer);
 
-    DWORD dwState = SCARD_POWERED; // TODO: can u dynamically request the actual state somehow?
-
-    char connectedTag[100]; // will later hold e.g. "Mifare Classic 4k", just pre-alloc 100 bytes for the name (and 100% reason to remember the name)
+    TagIdentity connectedTag; // will later hold UID, type (e.g. TAG_TYPE_MIFARE_CLASSIC_4K) and capabilities of the tag
+    const char *archivePath = NULL;
+
+    // NFC_TRANSPORT=sim swaps the real reader for the simulated ACR1581U in sim-reader.c
+    const Transport *transport = transport_select_from_env();
+    apdu_trace_configure_from_env();
+    apdu_retry_configure_from_env();
+    metrics_configure_from_env();
+
+    if ((argc > 1) && (strcmp(argv[1], "--all-readers") == 0)) {
+        return runAllReaders();
+    } else if ((argc > 1) && (strcmp(argv[1], "--provision") == 0)) {
+        uint64_t count = 0;
+        const char *uriPrefix = "https://example.com/tag/";
+        for (int i = 2; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "--count") == 0) {
+                count = strtoull(argv[i + 1], NULL, 0);
+            } else if (strcmp(argv[i], "--uri") == 0) {
+                uriPrefix = argv[i + 1];
+            } else {
+                LOG_CRITICAL("Unknown argument '%s', usage: %s --provision [--count N] [--uri PREFIX]", argv[i], argv[0]);
+                return 1;
+            }
+        }
+        if (argc % 2 != 0) {
+            LOG_CRITICAL("Missing value, usage: %s --provision [--count N] [--uri PREFIX]", argv[0]);
+            return 1;
+        }
+        return runProvisioning(count, uriPrefix);
+    } else if ((argc == 3) && (strcmp(argv[1], "--archive") == 0)) {
+        archivePath = argv[2];
+    } else if (argc > 1) {
+        LOG_CRITICAL("Unknown argument '%s', usage: %s [--all-readers | --provision [--count N] [--uri PREFIX] | --archive PATH]", argv[1], argv[0]);
+        return 1;
+    }
 
     // Establish context
-    LONG lRet = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+    LONG lRet = transport->establishContext(SCARD_SCOPE_SYSTEM, &hContext);
     if (lRet != SCARD_S_SUCCESS) {
         if (lRet == 0x8010001E) {
             LOG_CRITICAL("Error: 'SCARD_E_SERVICE_STOPPED: The Smart card resource manager has shut down.' Could be related to incompatible PCSCLite version. Are there error-hinting logs when you run: 'sudo systemctl status pcscd' ?");
@@ -340,31 +203,18 @@ int main(void) {
     // Get available readers (you might have multiple smart card readers connected)
     lRet = getAvailableReaders(hContext, mszReaders, &dwReaders);
     if (lRet != SCARD_S_SUCCESS) {
-        SCardReleaseContext(hContext);
+        transport->releaseContext(hContext);
         return 1;
     }
 
     // Print connected readers and select the first one
     //      ACS ACR1581 1S Dual Reader [ACR1581 1S Dual Reader ICC] 00 00
     LOG_INFO("Available Smart Card Readers:");
-    char *reader = NULL;
-    char *p = mszReaders;
-
-    while (*p) {
-        printf("found reader: %s\n", p);
-        // we want to connect to the CONTACTLESS interface (01 00 or 00 00?), so pick the one with 'PICC' in it
-        // if you want to connect to the CONTACT interface (00 00 or 01 00?), then replace 'PICC' with 'ICC'
-        // if you want to connect to the SAM interface (02 00), then replace 'PICC' with 'SAM'
-        if (strstr(p, "PICC")) {
-            reader = p;
-        }
-        p += strlen(p) + 1;   // jump to next entry
-    }
+    char *reader = findPiccReader(mszReaders);
     // case: PICC reader not found (critical)
     if (!reader) {
-        reader = mszReaders;
         LOG_CRITICAL("No PICC reader found.\n");
-        SCardReleaseContext(hContext);
+        transport->releaseContext(hContext);
         return 1;
     }
 
@@ -377,90 +227,45 @@ int main(void) {
     }
     LOG_INFO("Connected to reader: %s\n", reader);
 
-    // Turn off buzzer of ACR1581
-    lRet = disableBuzzer(hContext, reader, &hCard, &dwActiveProtocol, pbRecvBuffer, &pbRecvBufferSize);
-    if (lRet == 0) {
-        LOG_INFO("Disabled buzzer of reader\n");
-        SCardDisconnect(hCard, SCARD_LEAVE_CARD);
-        // SCardControl sets buffer size to 0 (the command returns 0 byte and it says the response buffer is of size 0, but we want to keep the actual info how large our buffer is!)
-        pbRecvBufferSize = sizeof(pbRecvBuffer);
-    } else {
-        if (lRet == (int32_t)0x80100016) { // https://pcsclite.apdu.fr/api/group__ErrorCodes.html
-            LOG_ERROR("Failed to disable buzzer of ACR1581: SCARD_E_NOT_TRANSACTED - An attempt was made to end a nonexistent transaction.\n");
-            return 1;
-        } else {
-            LOG_ERROR("Failed to disable buzzer of ACR1581: 0x%x\n", (unsigned int)lRet);
-            return 1;
-        } 
+    // Open a session: keeps context and card handle warm and turns off the buzzer of ACR1581 (see session.h)
+    NfcSession session;
+    lRet = session_open(&session, hContext, reader);
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_CRITICAL("Failed to watch reader: 0x%x\n", (unsigned int)lRet);
+        session_close(&session);
+        return 1;
     }
 
-    // Connect to the first reader
-    lRet = connectToReader(hContext, reader, &hCard, &dwActiveProtocol, FALSE);
-    BOOL didPrintWarningAlready = FALSE;
-    while (lRet != SCARD_S_SUCCESS) {
-        if ((lRet == SCARD_E_NO_SMARTCARD) || (lRet == SCARD_W_REMOVED_CARD) || (lRet == SCARD_E_TIMEOUT)) {
-            if (!didPrintWarningAlready) {
-                LOG_WARN("Did not detect a connected tag / NFC chip, please hold one near the reader."); //  Error Code: %0lx\n", lRet
-                didPrintWarningAlready = TRUE;
-            }
-        }
-        else {
-            if (!didPrintWarningAlready) {
-                LOG_ERROR("Google this pcsc-lite error code: 0x%x\n", (unsigned int)lRet);
-                didPrintWarningAlready = TRUE;
-            }
-        }
-        
-        // wait a bit and retry (maybe user is not holding a tag near the reader yet)
-        SLEEP_CUSTOM(50); // milliseconds (don't put this value too low, it never worked for me with 1 ms)
-        lRet = connectToReader(hContext, reader, &hCard, &dwActiveProtocol, FALSE);
+    // Connect to the first reader (blocks until a tag is there)
+    lRet = session_wait_tag(&session);
+    if (lRet != SCARD_S_SUCCESS) {
+        session_close(&session);
+        return 1;
     }
+    hCard = session.hCard;
+    dwActiveProtocol = session.dwActiveProtocol;
     LOG_INFO("Detected an NFC tag");
+    LOG_DEBUG("Detection to first APDU: %.3f ms", presence_first_apdu(&session.watcher) / 1e6);
 
     // -------------- Interact with tag ---------------------------
 
-    // Get UID of detected tag
-    lRet = getUID(hCard, pbRecvBuffer, &pbRecvBufferSize, TRUE);
+    // everything below runs in one transaction, so pcscd locks the reader once instead of once per APDU
+    lRet = session_begin(&session);
     if (lRet != SCARD_S_SUCCESS) {
-        if (lRet == ACR_90_00_FAILURE) {
-            LOG_ERROR("Failed to get UID of tag: %0lx\n", lRet);
-            return 1;
-        } else if (lRet == SCARD_E_INSUFFICIENT_BUFFER) {
-            LOG_ERROR("Failed to get UID of tag because the buffer is insufficient!");
-            return 1;
-        }
-        
-        LOG_ERROR("Failed to get UID with unknown error code: %0lx", lRet);
-        disconnectReader(hCard, hContext);
+        session_close(&session);
         return 1;
     }
 
-    lRet = getStatus(&hCard, mszReaders, dwState, dwReaders, &dwActiveProtocol, pbRecvBuffer, &pbRecvBufferSize, TRUE, connectedTag);
+    // Get UID and type of detected tag
+    lRet = identifyTag(hCard, mszReaders, dwReaders, &dwActiveProtocol, pbRecvBuffer, &pbRecvBufferSize, &connectedTag);
     if (lRet != SCARD_S_SUCCESS) {
-        LOG_WARN("Failed to get status of tag: 0x%x\n", (unsigned int)lRet);
-        disconnectReader(hCard, hContext);
+        session_close(&session);
         return 1;
     }
-    // getStatus uses SCardStatus, so we must restore actual buffer size again
-    pbRecvBufferSize = sizeof(pbRecvBuffer);
-
-    // only try to get RATS if currently connected tag is DESFIRE 8k (only desfire i have) or NTAG 424 DNA TT
-    //      strcmp only reads (and compares) up to the \n terminator, so it doesn't matter what is in rest of array
-    BOOL try_to_get_rats = FALSE;
-    if (strcmp(connectedTag, "Mifare Desfire EV3 8k or NTAG 424 DNA TT") == 0) {
-        try_to_get_rats = TRUE;
-    }
-
-    if (try_to_get_rats) {
-        ApduResponse response = getATS_14443A(hCard, pbRecvBuffer, &pbRecvBufferSize, connectedTag);
-        if (response.status != SCARD_S_SUCCESS) {
-            LOG_WARN("Failed to get ATS of tag: 0x%x\n", (unsigned int)response.status);
-            disconnectReader(hCard, hContext);
-            return 1;
-        }
 
-        // it should now be decided which tag we are working with
-        //printf("%s", connectedTag);
+    if ((archivePath != NULL) && !archiveTag(archivePath, &connectedTag, hCard, pbRecvBuffer, &pbRecvBufferSize)) {
+        session_close(&session);
+        return 1;
     }
     
     // ------------------------------ USAGE EXAMPLES -----------------------------
@@ -473,13 +278,49 @@ int main(void) {
     //      em_4423_read_page(0x04, hCard, pbRecvBuffer, &pbRecvBufferSize);
     // READ ALL PAGES AT ONCE:
     //      em_4423_fastread(hCard, pbRecvBuffer, &pbRecvBufferSize);
+    // FIND THE FIRST URI RECORD (no copies, the views point into tag_content):
+    //      EM_4423_Pages tag_content;
+    //      em_4423_fastread_into(&tag_content, hCard, pbRecvBuffer, &pbRecvBufferSize);
+    //      NdefReader ndef; NdefRecordView uri;
+    //      ndef_reader_init(&ndef, tag_content.Pages[0x04], EM_4423_USER_MEMORY_BYTES);
+    //      if (ndef_find_record(&ndef, NDEF_TNF_WELL_KNOWN, (const BYTE *)"U", 1, &uri) == NDEF_PARSE_OK) { ... }
+    // WRITE AN NDEF MESSAGE (encoded in place, one bulk write + one read back):
+    //      BYTE ndef_msg[EM_4423_USER_MEMORY_BYTES]; NdefBuilder builder; size_t ndef_len;
+    //      ndef_builder_init(&builder, ndef_msg, sizeof(ndef_msg));
+    //      ndef_builder_add_uri(&builder, "https://example.com");
+    //      if (ndef_builder_finish(&builder, &ndef_len)) em_4423_write_range(0x04, ndef_msg, ndef_len, hCard, pbRecvBuffer, &pbRecvBufferSize);
+
+    // ----------------------- ICODE SLIX ----------------------------------------
+    // READ ALL BLOCKS (one READ BINARY, the kind of SLIX comes from the UID):
+    //      ICODE_SLIX_Blocks slix, edited;
+    //      icode_slix_read_into(&slix, connectedTag.uid, connectedTag.uidLen, hCard, pbRecvBuffer, &pbRecvBufferSize);
+    // WRITE ONLY WHAT CHANGED (one bulk write per run of changed blocks + one read back):
+    //      edited = slix; memcpy(edited.Blocks[0x01], data, 8);
+    //      icode_slix_commit(&slix, &edited, hCard, pbRecvBuffer, &pbRecvBufferSize);
+
+    // ----------------------- MIFARE CLASSIC ------------------------------------
+    // DUMP ALL SECTORS (keys are loaded into the reader once, one authentication + one READ BINARY per sector):
+    //      static MifareClassicReader mc;     // keep it for the next tag on this reader: mifare_classic_new_tag(&mc, hCard)
+    //      MIFARE_Classic_Blocks classic;
+    //      mifare_classic_reader_init(&mc, hCard);
+    //      mifare_classic_dump(&mc, connectedTag.type, MIFARE_CLASSIC_DEFAULT_KEYS, MIFARE_CLASSIC_DEFAULT_KEY_COUNT, &classic, pbRecvBuffer, &pbRecvBufferSize);
+    //      mifare_classic_blocks_print_all(&classic);
+
+    // ----------------------- DESFIRE EV3 ---------------------------------------
+    // READ A WHOLE FILE (answer frames are streamed into the buffer, frame size from the ATS):
+    //      DesfireCard card; BYTE file[4096]; DWORD file_len;
+    //      desfire_open(&card, hCard, NULL, 0);
+    //      desfire_select_application(&card, 0x000001);
+    //      desfire_read_data(&card, 0x01, 0, 0, file, sizeof(file), &file_len);
+    // WRITE (split into as many frames as needed):
+    //      desfire_write_data(&card, 0x01, 0, file, file_len);
 
     // ---------------------------------------------------------------------------
     // TODO:
     //  - get firmware (update if possible)
     // how to adjust getStatus() to be able to distinguish Mifare Ultralight, NTAG2xx, em4423, ...?
 
-    // Clean up
-    disconnectReader(hCard, hContext);
+    // Clean up (ends the transaction, disconnects and releases the context)
+    session_close(&session);
     return 0;
 }
@@ -0,0 +1,529 @@
+#define _POSIX_C_SOURCE 200809L // open_memstream
+
+#include <pthread.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "apdu-retry.h"
+#include "timing.h"
+#include "logging.h"
+
+// upper bounds of the buckets in ns, the last bucket is +Inf
+static const uint64_t METRICS_BUCKET_NS[METRICS_BUCKETS - 1] = {
+    50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 1000000000
+};
+
+typedef struct MetricsHistogram {
+    uint64_t buckets[METRICS_BUCKETS];  // not cumulative, summed up when exported
+    uint64_t count;
+    uint64_t sumNs;
+} MetricsHistogram;
+
+typedef struct MetricsApduSeries {
+    BYTE reader;                        // slot in metricsReaders
+    BYTE ins;
+    MetricsHistogram latency;
+    uint64_t outcomes[APDU_MALFORMED + 1];
+} MetricsApduSeries;
+
+typedef struct MetricsReader {
+    char name[256];
+    MetricsHistogram connect[METRICS_CONNECT_MODES];
+    uint64_t connectFailures[METRICS_CONNECT_MODES];
+    MetricsHistogram control;
+    uint64_t controlFailures;
+    MetricsHistogram detection;
+    uint64_t inserts;
+    uint64_t removals;
+} MetricsReader;
+
+// slot 0 is "unknown" (handles that were never bound, e.g. in tools), 1 .. METRICS_MAX_READERS are real readers
+static MetricsReader metricsReaders[METRICS_MAX_READERS + 1] = { { .name = "unknown" } };
+static size_t metricsReaderCount = 1;
+static MetricsApduSeries metricsSeries[METRICS_MAX_SERIES];
+static size_t metricsSeriesCount;
+static uint16_t metricsSeriesIndex[METRICS_MAX_READERS + 1][256]; // index + 1 into metricsSeries, 0 = not allocated yet
+
+// handle -> reader slot, written on connect (rare, under the lock), read without lock
+#define METRICS_MAX_HANDLES 64
+typedef struct MetricsHandle {
+    SCARDHANDLE hCard;
+    BYTE reader;
+} MetricsHandle;
+static MetricsHandle metricsHandles[METRICS_MAX_HANDLES];
+static size_t metricsHandleNext;
+static unsigned int metricsHandleGeneration; // bumped by every binding, invalidates the per thread lookup caches
+
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// -------------------- Recording -------------------------------
+
+static void metrics_observe(MetricsHistogram *histogram, uint64_t ns) {
+    size_t bucket = 0;
+    while ((bucket < METRICS_BUCKETS - 1) && (ns > METRICS_BUCKET_NS[bucket])) {
+        bucket++;
+    }
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sumNs, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+}
+
+static BYTE metrics_reader_slot_locked(const char *reader) {
+    if (reader == NULL) {
+        return 0;
+    }
+    for (size_t i = 1; i < metricsReaderCount; i++) {
+        if (strcmp(metricsReaders[i].name, reader) == 0) {
+            return (BYTE)i;
+        }
+    }
+    if (metricsReaderCount == METRICS_MAX_READERS + 1) {
+        return 0;
+    }
+    strncpy(metricsReaders[metricsReaderCount].name, reader, sizeof(metricsReaders[0].name) - 1);
+    // the name is complete before the slot is published, metrics_reader_slot looks at published slots without the lock
+    __atomic_store_n(&metricsReaderCount, metricsReaderCount + 1, __ATOMIC_RELEASE);
+    return (BYTE)(metricsReaderCount - 1);
+}
+
+static BYTE metrics_reader_slot(const char *reader) {
+    if (reader == NULL) {
+        return 0;
+    }
+    // every thread mostly records for one reader, so the last lookup is remembered (names of slots never change, one
+    // strcmp tells whether the buffer behind the pointer still holds the same name)
+    static __thread const char *lastReader;
+    static __thread BYTE lastSlot;
+    if ((reader == lastReader) && (lastSlot != 0) && (strcmp(metricsReaders[lastSlot].name, reader) == 0)) {
+        return lastSlot;
+    }
+    BYTE slot = 0;
+    size_t count = __atomic_load_n(&metricsReaderCount, __ATOMIC_ACQUIRE);
+    for (size_t i = 1; i < count; i++) {
+        if (strcmp(metricsReaders[i].name, reader) == 0) {
+            slot = (BYTE)i;
+            break;
+        }
+    }
+    if (slot == 0) {
+        // first time this reader is seen, the lock only keeps two threads from adding it twice
+        pthread_mutex_lock(&metricsLock);
+        slot = metrics_reader_slot_locked(reader);
+        pthread_mutex_unlock(&metricsLock);
+    }
+    lastReader = reader;
+    lastSlot = slot;
+    return slot;
+}
+
+static BYTE metrics_handle_slot(SCARDHANDLE hCard) {
+    // every thread mostly talks to one handle, so the last lookup is remembered until a handle is bound again (pcsc
+    // hands out the same handle value again after a disconnect, possibly for another reader)
+    static __thread SCARDHANDLE lastHandle;
+    static __thread BYTE lastSlot;
+    static __thread unsigned int lastGeneration;
+    unsigned int generation = __atomic_load_n(&metricsHandleGeneration, __ATOMIC_ACQUIRE);
+    if ((hCard == lastHandle) && (hCard != 0) && (generation == lastGeneration)) {
+        return lastSlot;
+    }
+    BYTE slot = 0;
+    for (size_t i = 0; i < METRICS_MAX_HANDLES; i++) {
+        if (__atomic_load_n(&metricsHandles[i].hCard, __ATOMIC_ACQUIRE) == hCard) {
+            slot = metricsHandles[i].reader;
+            break;
+        }
+    }
+    lastHandle = hCard;
+    lastSlot = slot;
+    lastGeneration = generation;
+    return slot;
+}
+
+void metrics_bind_handle(SCARDHANDLE hCard, const char *reader) {
+    pthread_mutex_lock(&metricsLock);
+    BYTE slot = metrics_reader_slot_locked(reader);
+    size_t i = 0;
+    while ((i < METRICS_MAX_HANDLES) && (metricsHandles[i].hCard != hCard)) {
+        i++;
+    }
+    if (i == METRICS_MAX_HANDLES) {
+        i = metricsHandleNext; // oldest binding goes, handles of finished connections are never looked up again
+        metricsHandleNext = (metricsHandleNext + 1) % METRICS_MAX_HANDLES;
+    }
+    metricsHandles[i].reader = slot;
+    __atomic_store_n(&metricsHandles[i].hCard, hCard, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&metricsHandleGeneration, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&metricsLock);
+}
+
+static MetricsApduSeries *metrics_series(BYTE reader, BYTE ins) {
+    uint16_t index = __atomic_load_n(&metricsSeriesIndex[reader][ins], __ATOMIC_ACQUIRE);
+    if (index == 0) {
+        pthread_mutex_lock(&metricsLock);
+        index = metricsSeriesIndex[reader][ins];
+        if ((index == 0) && (metricsSeriesCount < METRICS_MAX_SERIES)) {
+            MetricsApduSeries *series = &metricsSeries[metricsSeriesCount++];
+            series->reader = reader;
+            series->ins = ins;
+            index = (uint16_t)metricsSeriesCount;
+            __atomic_store_n(&metricsSeriesIndex[reader][ins], index, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&metricsLock);
+    }
+    return (index == 0) ? NULL : &metricsSeries[index - 1];
+}
+
+void metrics_record_apdu(SCARDHANDLE hCard, const BYTE *command, DWORD length, ApduOutcome outcome, uint64_t ns) {
+    MetricsApduSeries *series = metrics_series(metrics_handle_slot(hCard), (length > 1) ? command[1] : 0x00);
+    if (series == NULL) {
+        return;
+    }
+    metrics_observe(&series->latency, ns);
+    __atomic_fetch_add(&series->outcomes[outcome], 1, __ATOMIC_RELAXED);
+}
+
+void metrics_record_connect(const char *reader, MetricsConnectMode mode, LONG result, uint64_t ns) {
+    MetricsReader *r = &metricsReaders[metrics_reader_slot(reader)];
+    metrics_observe(&r->connect[mode], ns);
+    if (result != SCARD_S_SUCCESS) {
+        __atomic_fetch_add(&r->connectFailures[mode], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_record_reconnect(SCARDHANDLE hCard, LONG result, uint64_t ns) {
+    MetricsReader *r = &metricsReaders[metrics_handle_slot(hCard)];
+    metrics_observe(&r->connect[METRICS_RECONNECT], ns);
+    if (result != SCARD_S_SUCCESS) {
+        __atomic_fetch_add(&r->connectFailures[METRICS_RECONNECT], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_record_control(SCARDHANDLE hCard, LONG result, uint64_t ns) {
+    MetricsReader *r = &metricsReaders[metrics_handle_slot(hCard)];
+    metrics_observe(&r->control, ns);
+    if (result != SCARD_S_SUCCESS) {
+        __atomic_fetch_add(&r->controlFailures, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_record_presence(const char *reader, BOOL inserted) {
+    MetricsReader *r = &metricsReaders[metrics_reader_slot(reader)];
+    __atomic_fetch_add(inserted ? &r->inserts : &r->removals, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_record_detection(const char *reader, uint64_t detectToFirstApduNs) {
+    metrics_observe(&metricsReaders[metrics_reader_slot(reader)].detection, detectToFirstApduNs);
+}
+
+// -------------------- Prometheus text format -------------------------------
+
+static const char *const METRICS_OUTCOME_NAMES[APDU_MALFORMED + 1] = { "ok", "transmit_failed", "status_error", "malformed" };
+static const char *const METRICS_CONNECT_MODE_NAMES[METRICS_CONNECT_MODES] = { "connect", "direct", "reconnect" };
+
+// metrics_label_value escapes a reader name for a label value (backslash, quote and newline must be escaped)
+static void metrics_label_value(FILE *out, const char *value) {
+    for (const char *c = value; *c; c++) {
+        if ((*c == '\\') || (*c == '"')) {
+            fputc('\\', out);
+            fputc(*c, out);
+        } else if (*c == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*c, out);
+        }
+    }
+}
+
+static void metrics_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// labels is the already formatted label list without braces, e.g. reader="...",ins="b0"
+static void metrics_histogram(FILE *out, const char *name, const char *labels, const MetricsHistogram *histogram) {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (i < METRICS_BUCKETS - 1) {
+            fprintf(out, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels, METRICS_BUCKET_NS[i] / 1e9, (unsigned long long)cumulative);
+        } else {
+            fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)cumulative);
+        }
+    }
+    fprintf(out, "%s_sum{%s} %.9f\n", name, labels, __atomic_load_n(&histogram->sumNs, __ATOMIC_RELAXED) / 1e9);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)__atomic_load_n(&histogram->count, __ATOMIC_RELAXED));
+}
+
+// metrics_reader_labels formats reader="<name>" plus an optional extra label into buffer
+static const char *metrics_reader_labels(char *buffer, size_t size, size_t reader, const char *extra) {
+    FILE *out = fmemopen(buffer, size, "w");
+    if (out == NULL) {
+        return "reader=\"?\"";
+    }
+    fputs("reader=\"", out);
+    metrics_label_value(out, metricsReaders[reader].name);
+    fprintf(out, "\"%s%s", extra ? "," : "", extra ? extra : "");
+    fclose(out);
+    return buffer;
+}
+
+void metrics_write_prometheus(FILE *out) {
+    char labels[512];
+    char extra[64];
+    pthread_mutex_lock(&metricsLock); // only keeps series / readers from being added while they are listed
+    size_t readers = metricsReaderCount;
+    size_t series = metricsSeriesCount;
+    pthread_mutex_unlock(&metricsLock);
+
+    metrics_header(out, "nfc_apdu_duration_seconds", "histogram", "Time of executeApdu including retries, per reader and INS byte.");
+    for (size_t i = 0; i < series; i++) {
+        snprintf(extra, sizeof(extra), "ins=\"%02x\"", metricsSeries[i].ins);
+        metrics_histogram(out, "nfc_apdu_duration_seconds", metrics_reader_labels(labels, sizeof(labels), metricsSeries[i].reader, extra), &metricsSeries[i].latency);
+    }
+    metrics_header(out, "nfc_apdu_total", "counter", "APDUs per reader, INS byte and outcome.");
+    for (size_t i = 0; i < series; i++) {
+        for (int o = APDU_OK; o <= APDU_MALFORMED; o++) {
+            snprintf(extra, sizeof(extra), "ins=\"%02x\",outcome=\"%s\"", metricsSeries[i].ins, METRICS_OUTCOME_NAMES[o]);
+            fprintf(out, "nfc_apdu_total{%s} %llu\n", metrics_reader_labels(labels, sizeof(labels), metricsSeries[i].reader, extra),
+                    (unsigned long long)__atomic_load_n(&metricsSeries[i].outcomes[o], __ATOMIC_RELAXED));
+        }
+    }
+
+    metrics_header(out, "nfc_connect_duration_seconds", "histogram", "SCardConnect / SCardReconnect time per reader.");
+    for (size_t r = 0; r < readers; r++) {
+        for (int m = 0; m < METRICS_CONNECT_MODES; m++) {
+            if (__atomic_load_n(&metricsReaders[r].connect[m].count, __ATOMIC_RELAXED) == 0) {
+                continue;
+            }
+            snprintf(extra, sizeof(extra), "mode=\"%s\"", METRICS_CONNECT_MODE_NAMES[m]);
+            metrics_histogram(out, "nfc_connect_duration_seconds", metrics_reader_labels(labels, sizeof(labels), r, extra), &metricsReaders[r].connect[m]);
+        }
+    }
+    metrics_header(out, "nfc_connect_failures_total", "counter", "Failed SCardConnect / SCardReconnect calls per reader.");
+    for (size_t r = 0; r < readers; r++) {
+        for (int m = 0; m < METRICS_CONNECT_MODES; m++) {
+            snprintf(extra, sizeof(extra), "mode=\"%s\"", METRICS_CONNECT_MODE_NAMES[m]);
+            fprintf(out, "nfc_connect_failures_total{%s} %llu\n", metrics_reader_labels(labels, sizeof(labels), r, extra),
+                    (unsigned long long)__atomic_load_n(&metricsReaders[r].connectFailures[m], __ATOMIC_RELAXED));
+        }
+    }
+
+    metrics_header(out, "nfc_control_duration_seconds", "histogram", "SCardControl (escape command) time per reader.");
+    for (size_t r = 0; r < readers; r++) {
+        if (__atomic_load_n(&metricsReaders[r].control.count, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        metrics_histogram(out, "nfc_control_duration_seconds", metrics_reader_labels(labels, sizeof(labels), r, NULL), &metricsReaders[r].control);
+    }
+    metrics_header(out, "nfc_control_failures_total", "counter", "Failed SCardControl calls per reader.");
+    for (size_t r = 0; r < readers; r++) {
+        fprintf(out, "nfc_control_failures_total{%s} %llu\n", metrics_reader_labels(labels, sizeof(labels), r, NULL),
+                (unsigned long long)__atomic_load_n(&metricsReaders[r].controlFailures, __ATOMIC_RELAXED));
+    }
+
+    metrics_header(out, "nfc_detect_to_first_apdu_seconds", "histogram", "Time from the insert event to the first APDU to the tag.");
+    for (size_t r = 0; r < readers; r++) {
+        if (__atomic_load_n(&metricsReaders[r].detection.count, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        metrics_histogram(out, "nfc_detect_to_first_apdu_seconds", metrics_reader_labels(labels, sizeof(labels), r, NULL), &metricsReaders[r].detection);
+    }
+    metrics_header(out, "nfc_tag_events_total", "counter", "Tags put on / taken off the reader.");
+    for (size_t r = 0; r < readers; r++) {
+        fprintf(out, "nfc_tag_events_total{%s} %llu\n", metrics_reader_labels(labels, sizeof(labels), r, "event=\"inserted\""),
+                (unsigned long long)__atomic_load_n(&metricsReaders[r].inserts, __ATOMIC_RELAXED));
+        fprintf(out, "nfc_tag_events_total{%s} %llu\n", metrics_reader_labels(labels, sizeof(labels), r, "event=\"removed\""),
+                (unsigned long long)__atomic_load_n(&metricsReaders[r].removals, __ATOMIC_RELAXED));
+    }
+
+    // process wide retry counters of apdu-retry.c
+    ApduRetryStats retry = apdu_retry_stats();
+    metrics_header(out, "nfc_apdu_attempts_total", "counter", "Exchanges incl. retries.");
+    fprintf(out, "nfc_apdu_attempts_total %llu\n", (unsigned long long)retry.attempts);
+    metrics_header(out, "nfc_apdu_failed_attempts_total", "counter", "Failed exchanges per error class.");
+    fprintf(out, "nfc_apdu_failed_attempts_total{class=\"transient_rf\"} %llu\n", (unsigned long long)retry.transientRf);
+    fprintf(out, "nfc_apdu_failed_attempts_total{class=\"protocol\"} %llu\n", (unsigned long long)retry.protocol);
+    fprintf(out, "nfc_apdu_failed_attempts_total{class=\"permanent\"} %llu\n", (unsigned long long)retry.permanent);
+    metrics_header(out, "nfc_apdu_retry_reconnects_total", "counter", "Reconnects done by the retry layer.");
+    fprintf(out, "nfc_apdu_retry_reconnects_total %llu\n", (unsigned long long)retry.reconnects);
+    metrics_header(out, "nfc_apdu_recovered_total", "counter", "APDUs that worked after a retry.");
+    fprintf(out, "nfc_apdu_recovered_total %llu\n", (unsigned long long)retry.recovered);
+    metrics_header(out, "nfc_apdu_gave_up_total", "counter", "APDUs that still failed after all retries.");
+    fprintf(out, "nfc_apdu_gave_up_total %llu\n", (unsigned long long)retry.gaveUp);
+}
+
+// -------------------- Export -------------------------------
+
+BOOL metrics_write_file(const char *path) {
+    char tmp[512];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return FALSE;
+    }
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        return FALSE;
+    }
+    metrics_write_prometheus(out);
+    if (fclose(out) != 0) {
+        remove(tmp);
+        return FALSE;
+    }
+    return rename(tmp, path) == 0;
+}
+
+static char metricsFilePath[512];
+static DWORD metricsFileIntervalMs;
+static pthread_t metricsFileThread;
+static BOOL metricsFileStop = FALSE;
+static pthread_mutex_t metricsFileLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t metricsFileWake = PTHREAD_COND_INITIALIZER;
+
+static void *metrics_file_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&metricsFileLock);
+    while (!metricsFileStop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t ns = (uint64_t)deadline.tv_nsec + (uint64_t)metricsFileIntervalMs * 1000000;
+        deadline.tv_sec += (time_t)(ns / 1000000000ull);
+        deadline.tv_nsec = (long)(ns % 1000000000ull);
+        int waited = 0;
+        while (!metricsFileStop && (waited != ETIMEDOUT)) {
+            waited = pthread_cond_timedwait(&metricsFileWake, &metricsFileLock, &deadline);
+        }
+        if (metricsFileStop) {
+            break;
+        }
+        pthread_mutex_unlock(&metricsFileLock);
+        if (!metrics_write_file(metricsFilePath)) {
+            LOG_WARN("Failed to write metrics to %s", metricsFilePath);
+        }
+        pthread_mutex_lock(&metricsFileLock);
+    }
+    pthread_mutex_unlock(&metricsFileLock);
+    return NULL;
+}
+
+static void metrics_write_file_at_exit(void) {
+    // the writer thread has to be gone first, both write the same .tmp file
+    pthread_mutex_lock(&metricsFileLock);
+    metricsFileStop = TRUE;
+    pthread_cond_signal(&metricsFileWake);
+    pthread_mutex_unlock(&metricsFileLock);
+    pthread_join(metricsFileThread, NULL);
+    metrics_write_file(metricsFilePath);
+}
+
+BOOL metrics_start_file(const char *path, DWORD intervalMs) {
+    if ((metricsFilePath[0] != '\0') || (strlen(path) >= sizeof(metricsFilePath))) {
+        return FALSE;
+    }
+    strcpy(metricsFilePath, path);
+    metricsFileIntervalMs = (intervalMs == 0) ? 1000 : intervalMs;
+
+    if (pthread_create(&metricsFileThread, NULL, metrics_file_thread, NULL) != 0) {
+        return FALSE;
+    }
+    atexit(metrics_write_file_at_exit); // short runs (one tag) end before the first interval
+    return TRUE;
+}
+
+#define METRICS_HTTP_TIMEOUT_S 2
+
+static void *metrics_http_thread(void *arg) {
+    int listenFd = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                timing_sleep_us(100000);
+            }
+            continue;
+        }
+        // scrapes are served one after the other, a client that connects and then sends or reads nothing must not
+        // stall the exporter
+        struct timeval timeout = { .tv_sec = METRICS_HTTP_TIMEOUT_S, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        // whatever was asked for, the answer is the metrics page (the request is read so the client does not get a reset)
+        char request[1024];
+        if (read(fd, request, sizeof(request)) < 0) {
+            close(fd);
+            continue;
+        }
+
+        char *body = NULL;
+        size_t bodyLength = 0;
+        FILE *out = open_memstream(&body, &bodyLength);
+        if (out != NULL) {
+            metrics_write_prometheus(out);
+            fclose(out);
+            char header[128];
+            int headerLength = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodyLength);
+            if ((write(fd, header, (size_t)headerLength) == headerLength) && (write(fd, body, bodyLength) < 0)) {
+                LOG_DEBUG("Metrics client hung up");
+            }
+            free(body);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+BOOL metrics_start_http(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return FALSE;
+    }
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // local only, put a proxy in front to scrape from elsewhere
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(fd, 8) != 0)) {
+        LOG_ERROR("Failed to serve metrics on port %u: %s", port, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_http_thread, (void *)(intptr_t)fd) != 0) {
+        close(fd);
+        return FALSE;
+    }
+    pthread_detach(thread);
+    LOG_INFO("Serving metrics on http://127.0.0.1:%u/metrics", port);
+    return TRUE;
+}
+
+void metrics_configure_from_env(void) {
+    const char *value = getenv("NFC_METRICS");
+    if ((value == NULL) || (*value == '\0')) {
+        return;
+    }
+    BOOL ok;
+    if (strncmp(value, "file:", 5) == 0) {
+        ok = metrics_start_file(value + 5, 1000);
+    } else if (strncmp(value, "http:", 5) == 0) {
+        char *end;
+        errno = 0;
+        unsigned long port = strtoul(value + 5, &end, 10);
+        if ((value[5] < '0') || (value[5] > '9') || (*end != '\0') || (errno != 0) || (port == 0) || (port > 65535)) {
+            LOG_WARN("Ignoring NFC_METRICS='%s', the port has to be a number from 1 to 65535", value);
+            return;
+        }
+        ok = metrics_start_http((uint16_t)port);
+    } else {
+        LOG_WARN("Ignoring NFC_METRICS='%s' (file:<path> or http:<port>)", value);
+        return;
+    }
+    if (!ok) {
+        LOG_WARN("Failed to export metrics to %s", value);
+    }
+}
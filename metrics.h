@@ -0,0 +1,44 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#ifndef READER_H
+#include "reader.h"
+#endif
+
+// Counters and fixed-bucket latency histograms for everything that talks to a reader: executeApdu (per reader and INS
+// byte), connects / reconnects, SCardControl and tag detection (insert to first APDU). recording is a handful of relaxed
+// atomic adds, no locks and no allocation on the hot path. the values are exported in the Prometheus text format:
+//      NFC_METRICS=file:<path>   rewritten every second and at exit (e.g. for the node_exporter textfile collector)
+//      NFC_METRICS=http:<port>   served on 127.0.0.1:<port>, scrape http://127.0.0.1:<port>/metrics
+
+#define METRICS_MAX_READERS     8       // readers with their own label, everything else is reader="unknown"
+#define METRICS_MAX_SERIES      128     // (reader, INS) pairs that get an apdu histogram
+#define METRICS_BUCKETS         14      // 50 us ... 1 s and +Inf
+
+typedef enum MetricsConnectMode {
+    METRICS_CONNECT,            // SCardConnect to a tag
+    METRICS_CONNECT_DIRECT,     // SCardConnect to the reader itself (escape commands)
+    METRICS_RECONNECT,          // SCardReconnect of a warm session
+    METRICS_CONNECT_MODES
+} MetricsConnectMode;
+
+// metrics_bind_handle labels everything that is done through hCard with reader (called by connectToReader)
+void metrics_bind_handle(SCARDHANDLE hCard, const char *reader);
+
+void metrics_record_apdu(SCARDHANDLE hCard, const BYTE *command, DWORD length, ApduOutcome outcome, uint64_t ns);
+void metrics_record_connect(const char *reader, MetricsConnectMode mode, LONG result, uint64_t ns);
+// metrics_record_reconnect is metrics_record_connect(METRICS_RECONNECT) for code that only knows the handle
+void metrics_record_reconnect(SCARDHANDLE hCard, LONG result, uint64_t ns);
+void metrics_record_control(SCARDHANDLE hCard, LONG result, uint64_t ns);
+void metrics_record_presence(const char *reader, BOOL inserted);
+void metrics_record_detection(const char *reader, uint64_t detectToFirstApduNs);
+
+// metrics_write_prometheus writes all series in the Prometheus text exposition format (version 0.0.4)
+void metrics_write_prometheus(FILE *out);
+// metrics_write_file replaces path atomically (temporary file + rename), so a scraper never sees half a file
+BOOL metrics_write_file(const char *path);
+BOOL metrics_start_file(const char *path, DWORD intervalMs);
+BOOL metrics_start_http(uint16_t port);
+void metrics_configure_from_env(void);
+
+#endif
@@ -0,0 +1,353 @@
+#include "mifare-classic.h"
+#include "apdu-retry.h"
+#include "logging.h"
+#include "metrics.h"
+#include "reader.h"
+#include "timing.h"
+#include "transport.h"
+
+const BYTE MIFARE_CLASSIC_DEFAULT_KEYS[MIFARE_CLASSIC_DEFAULT_KEY_COUNT][MIFARE_CLASSIC_KEY_SIZE] = {
+    { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF },
+    { 0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5 },
+    { 0xD3, 0xF7, 0xD3, 0xF7, 0xD3, 0xF7 },
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
+
+// -------------------- Geometry -------------------------------
+
+// sectors 0 - 31 have 4 blocks (the last one is the trailer with keys and access bits), sectors 32 - 39 of the 4k have 16
+
+BYTE mifare_classic_sector_count(TagType type) {
+    switch (type) {
+    case TAG_TYPE_MIFARE_MINI:          return 5;
+    case TAG_TYPE_MIFARE_CLASSIC_1K:    return 16;
+    case TAG_TYPE_MIFARE_CLASSIC_4K:    return 40;
+    default:                            return 0;
+    }
+}
+
+BYTE mifare_classic_first_block(BYTE sector) {
+    return (sector < 32) ? (BYTE)(sector * 4) : (BYTE)(128 + (sector - 32) * 16);
+}
+
+BYTE mifare_classic_blocks_in_sector(BYTE sector) {
+    return (sector < 32) ? 4 : 16;
+}
+
+BYTE mifare_classic_sector_of_block(BYTE block) {
+    return (block < 128) ? (BYTE)(block / 4) : (BYTE)(32 + (block - 128) / 16);
+}
+
+size_t mifare_classic_block_count(TagType type) {
+    BYTE sectors = mifare_classic_sector_count(type);
+    return (sectors == 0) ? 0 : (size_t)mifare_classic_first_block((BYTE)(sectors - 1)) + mifare_classic_blocks_in_sector((BYTE)(sectors - 1));
+}
+
+// -------------------- Reader context -------------------------------
+
+void mifare_classic_reader_init(MifareClassicReader *reader, SCARDHANDLE hCard) {
+    memset(reader, 0, sizeof(*reader));
+    reader->hCard = hCard;
+    reader->authSector = -1;
+    reader->maxReadBlocks = 16;
+    for (int i = 0; i < MIFARE_CLASSIC_MAX_SECTORS; i++) {
+        reader->lastKey[i] = -1;
+    }
+}
+
+void mifare_classic_new_tag(MifareClassicReader *reader, SCARDHANDLE hCard) {
+    reader->hCard = hCard;
+    reader->authSector = -1;
+}
+
+// mifare_classic_key_slot returns the slot that holds key, loading it into the least recently used slot if none does
+static int mifare_classic_key_slot(MifareClassicReader *reader, const BYTE key[MIFARE_CLASSIC_KEY_SIZE], BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    int slot = -1;
+    for (int i = 0; i < MIFARE_CLASSIC_KEY_SLOTS; i++) {
+        if (reader->slotLoaded[i] && (memcmp(reader->slotKey[i], key, MIFARE_CLASSIC_KEY_SIZE) == 0)) {
+            reader->slotUsed[i] = ++reader->useClock;
+            return i;
+        }
+        if ((slot < 0) || (!reader->slotLoaded[i] && reader->slotLoaded[slot]) || (reader->slotLoaded[i] == reader->slotLoaded[slot] && reader->slotUsed[i] < reader->slotUsed[slot])) {
+            slot = i;
+        }
+    }
+
+    BYTE APDU_LoadKey[5 + MIFARE_CLASSIC_KEY_SIZE] = { 0xff, 0x82, 0x00, (BYTE)slot, MIFARE_CLASSIC_KEY_SIZE };
+    memcpy(APDU_LoadKey + 5, key, MIFARE_CLASSIC_KEY_SIZE);
+    ApduView response = executeApdu(reader->hCard, APDU_LoadKey, sizeof(APDU_LoadKey), pbRecvBuffer, pbRecvBufferSize);
+    reader->keyLoads++;
+    if (response.outcome != APDU_OK) {
+        LOG_ERROR("Reader did not take the key for slot %d (SW %02x %02x).", slot, response.sw1, response.sw2);
+        reader->slotLoaded[slot] = FALSE;
+        return -1;
+    }
+    memcpy(reader->slotKey[slot], key, MIFARE_CLASSIC_KEY_SIZE);
+    reader->slotLoaded[slot] = TRUE;
+    reader->slotUsed[slot] = ++reader->useClock;
+    LOG_DEBUG("Loaded key %02x%02x%02x%02x%02x%02x into slot %d.", key[0], key[1], key[2], key[3], key[4], key[5], slot);
+    return slot;
+}
+
+// mifare_classic_exchange sends one apdu without retries (a retry may need an authentication first, the callers decide)
+// and records it in the metrics like executeApdu does
+static ApduView mifare_classic_exchange(MifareClassicReader *reader, BYTE *apdu, DWORD length, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    uint64_t start = timing_now_ns();
+    ApduView response = executeApduOnce(reader->hCard, apdu, length, pbRecvBuffer, pbRecvBufferSize);
+    metrics_record_apdu(reader->hCard, apdu, length, response.outcome, timing_now_ns() - start);
+    return response;
+}
+
+// mifare_classic_reactivate selects the tag again after it went into HALT (failed authentication)
+static BOOL mifare_classic_reactivate(MifareClassicReader *reader) {
+    DWORD protocol;
+    uint64_t start = timing_now_ns();
+    LONG lRet = transport_get()->reconnect(reader->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &protocol);
+    metrics_record_reconnect(reader->hCard, lRet, timing_now_ns() - start);
+    reader->authSector = -1;
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_ERROR("Could not activate the tag again: 0x%lx", (unsigned long)lRet);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// -------------------- Authentication -------------------------------
+
+BOOL mifare_classic_authenticate(MifareClassicReader *reader, BYTE sector, const BYTE key[MIFARE_CLASSIC_KEY_SIZE], BYTE keyType, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    int slot = mifare_classic_key_slot(reader, key, pbRecvBuffer, pbRecvBufferSize);
+    if (slot < 0) {
+        return FALSE;
+    }
+
+    // any block of the sector will do, the trailer is the one that is there in every sector
+    BYTE block = (BYTE)(mifare_classic_first_block(sector) + mifare_classic_blocks_in_sector(sector) - 1);
+    BYTE APDU_Auth[10] = { 0xff, 0x86, 0x00, 0x00, 0x05, 0x01, 0x00, block, keyType, (BYTE)slot };
+    // no retries: a wrong key answers 63 00 just like a weak field would, and every attempt halts the tag
+    ApduView response = mifare_classic_exchange(reader, APDU_Auth, sizeof(APDU_Auth), pbRecvBuffer, pbRecvBufferSize);
+    reader->authentications++;
+    if (response.outcome == APDU_OK) {
+        reader->authSector = sector;
+        memcpy(reader->authKey, key, MIFARE_CLASSIC_KEY_SIZE);
+        reader->authKeyType = keyType;
+        return TRUE;
+    }
+
+    reader->failedAuthentications++;
+    LOG_DEBUG("Key %c from slot %d does not open sector %u (SW %02x %02x).", (keyType == MIFARE_CLASSIC_KEY_A) ? 'A' : 'B', slot, (unsigned int)sector, response.sw1, response.sw2);
+    mifare_classic_reactivate(reader);
+    return FALSE;
+}
+
+// -------------------- Reading -------------------------------
+
+// mifare_classic_reauthenticate opens sector again with the key that opened it before (it still sits in its slot). a
+// broken off exchange ends the crypto session, and after a reconnect the tag is not authenticated at all anymore. if
+// the tag is halted the failed attempt activates it again, so a second one follows
+static BOOL mifare_classic_reauthenticate(MifareClassicReader *reader, BYTE sector, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    BYTE key[MIFARE_CLASSIC_KEY_SIZE];
+    memcpy(key, reader->authKey, sizeof(key));
+    BYTE keyType = reader->authKeyType;
+    return mifare_classic_authenticate(reader, sector, key, keyType, pbRecvBuffer, pbRecvBufferSize)
+        || mifare_classic_authenticate(reader, sector, key, keyType, pbRecvBuffer, pbRecvBufferSize);
+}
+
+BOOL mifare_classic_read_sector(MifareClassicReader *reader, BYTE sector, BYTE *out, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    if (reader->authSector != (int)sector) {
+        LOG_WARN("Sector %u is not authenticated.", (unsigned int)sector);
+        return FALSE;
+    }
+
+    ApduRetryPolicy policy = apdu_retry_get_policy();
+    BYTE first = mifare_classic_first_block(sector);
+    DWORD blocks = mifare_classic_blocks_in_sector(sector);
+    DWORD done = 0;
+    DWORD attempt = 0;
+    DWORD failedByClass[APDU_ERROR_PERMANENT + 1] = {0};
+    while (done < blocks) {
+        DWORD chunk = ((blocks - done) < reader->maxReadBlocks) ? (blocks - done) : reader->maxReadBlocks;
+        DWORD length = chunk * MIFARE_CLASSIC_BLOCK_SIZE;
+        BYTE block = (BYTE)(first + done);
+
+        // a whole 16 block sector is 256 bytes, one more than a short Le can ask for
+        BYTE APDU_Read[7] = { 0xff, 0xb0, 0x00, block, 0x00, (BYTE)(length >> 8), (BYTE)length };
+        DWORD apdu_length = 7;
+        if (length <= 0xFF) {
+            APDU_Read[4] = (BYTE)length;
+            apdu_length = 5;
+        }
+
+        // the retries of executeApdu would repeat the read on a tag that lost its authentication, so they happen here
+        ApduView response = mifare_classic_exchange(reader, APDU_Read, apdu_length, pbRecvBuffer, pbRecvBufferSize);
+        reader->reads++;
+        attempt++;
+        if ((response.outcome == APDU_OK) && (response.data_len >= length)) {
+            apdu_retry_count(attempt, APDU_ERROR_NONE, failedByClass);
+            memcpy(out + done * MIFARE_CLASSIC_BLOCK_SIZE, response.data, length);
+            done += chunk;
+            attempt = 0;
+            memset(failedByClass, 0, sizeof(failedByClass));
+            continue;
+        }
+        // same as tag_memory_write: only wrong length makes the read smaller, and the smaller size sticks to the reader
+        if ((response.outcome == APDU_STATUS_ERROR) && ((response.sw1 == 0x67) || (response.sw1 == 0x6C)) && (chunk > 1)) {
+            reader->maxReadBlocks = chunk / 2;
+            LOG_DEBUG("Reader refused a %lu block read (SW %02x %02x), trying %lu blocks.", (unsigned long)chunk, response.sw1, response.sw2, (unsigned long)reader->maxReadBlocks);
+            continue;
+        }
+
+        ApduErrorClass errorClass = apdu_classify(&response);
+        if (errorClass == APDU_ERROR_NONE) {
+            errorClass = APDU_ERROR_PERMANENT; // 90 00 with less data than asked for
+        }
+        failedByClass[errorClass]++;
+        DWORD limit = (errorClass == APDU_ERROR_PROTOCOL) ? policy.maxProtocolAttempts : policy.maxAttempts;
+        BOOL retry = (errorClass != APDU_ERROR_PERMANENT) && (attempt < limit);
+        if (retry) {
+            timing_sleep_us(apdu_retry_backoff_us(&policy, attempt));
+            ApduErrorClass recovered = (errorClass == APDU_ERROR_TRANSIENT_RF) ? apdu_retry_recover(reader->hCard, &response) : APDU_ERROR_NONE;
+            if (recovered != APDU_ERROR_NONE) {
+                errorClass = recovered;
+                retry = FALSE;
+            } else if (!mifare_classic_reauthenticate(reader, sector, pbRecvBuffer, pbRecvBufferSize)) {
+                LOG_ERROR("Sector %u does not open again after a failed read.", (unsigned int)sector);
+                retry = FALSE;
+            }
+        }
+        if (!retry) {
+            apdu_retry_count(attempt, errorClass, failedByClass);
+            LOG_ERROR("Failed to read block 0x%02x of sector %u.", block, (unsigned int)sector);
+            return FALSE;
+        }
+        LOG_DEBUG("Read of block 0x%02x failed (0x%lx, SW %02x %02x), authenticated sector %u again.", block, (unsigned long)response.status,
+                  response.sw1, response.sw2, (unsigned int)sector);
+    }
+    return TRUE;
+}
+
+// -------------------- Dump -------------------------------
+
+typedef struct MifareClassicAttempt {
+    BYTE sector;
+    int key;            // index into the key list
+    BYTE keyType;
+    BOOL inSlot;        // key already sits in a slot of the reader, costs no LOAD KEYS
+} MifareClassicAttempt;
+
+static BOOL mifare_classic_attempt_before(const MifareClassicAttempt *a, const MifareClassicAttempt *b) {
+    if (a->inSlot != b->inSlot) {
+        return a->inSlot;
+    }
+    if (a->key != b->key) {
+        return a->key < b->key;
+    }
+    return a->sector < b->sector;
+}
+
+static BOOL mifare_classic_key_in_slot(const MifareClassicReader *reader, const BYTE key[MIFARE_CLASSIC_KEY_SIZE]) {
+    for (int i = 0; i < MIFARE_CLASSIC_KEY_SLOTS; i++) {
+        if (reader->slotLoaded[i] && (memcmp(reader->slotKey[i], key, MIFARE_CLASSIC_KEY_SIZE) == 0)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// mifare_classic_dump_sector authenticates, reads the sector into dump and remembers the key for the next tag
+static BOOL mifare_classic_dump_sector(MifareClassicReader *reader, BYTE sector, const BYTE keys[][MIFARE_CLASSIC_KEY_SIZE], int key, BYTE keyType,
+                                       MIFARE_Classic_Blocks *dump, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    if (!mifare_classic_authenticate(reader, sector, keys[key], keyType, pbRecvBuffer, pbRecvBufferSize)) {
+        return FALSE;
+    }
+    BYTE first = mifare_classic_first_block(sector);
+    BYTE blocks = mifare_classic_blocks_in_sector(sector);
+    if (!mifare_classic_read_sector(reader, sector, dump->Blocks[first], pbRecvBuffer, pbRecvBufferSize)) {
+        return FALSE;
+    }
+    // the tag never sends key A (and key B only if the access bits make it readable), put in what we know
+    if (keyType == MIFARE_CLASSIC_KEY_A) {
+        memcpy(dump->Blocks[first + blocks - 1], keys[key], MIFARE_CLASSIC_KEY_SIZE);
+    } else {
+        memcpy(dump->Blocks[first + blocks - 1] + 10, keys[key], MIFARE_CLASSIC_KEY_SIZE);
+    }
+    dump->sectorRead[sector] = TRUE;
+    dump->sectorKeyType[sector] = keyType;
+    memcpy(dump->sectorKey[sector], keys[key], MIFARE_CLASSIC_KEY_SIZE);
+    reader->lastKey[sector] = key;
+    reader->lastKeyType[sector] = keyType;
+    return TRUE;
+}
+
+BOOL mifare_classic_dump(MifareClassicReader *reader, TagType type, const BYTE keys[][MIFARE_CLASSIC_KEY_SIZE], size_t keyCount, MIFARE_Classic_Blocks *dump, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    BYTE sectors = mifare_classic_sector_count(type);
+    if ((sectors == 0) || (keyCount == 0)) {
+        LOG_WARN("Nothing to dump: %s is no Mifare Classic or no keys were given.", tag_type_name(type));
+        return FALSE;
+    }
+    memset(dump, 0, sizeof(*dump));
+    dump->type = type;
+    DWORD keyLoads = reader->keyLoads, authentications = reader->authentications, reads = reader->reads;
+
+    // first round: every sector with the key that opened it on the last tag (the first key for sectors never seen),
+    // ordered so that keys already in a slot go first and each other key is loaded once for all of its sectors
+    MifareClassicAttempt attempts[MIFARE_CLASSIC_MAX_SECTORS];
+    for (BYTE sector = 0; sector < sectors; sector++) {
+        int key = reader->lastKey[sector];
+        BOOL known = (key >= 0) && ((size_t)key < keyCount);
+        MifareClassicAttempt attempt = { sector, known ? key : 0, known ? reader->lastKeyType[sector] : MIFARE_CLASSIC_KEY_A, FALSE };
+        attempt.inSlot = mifare_classic_key_in_slot(reader, keys[attempt.key]);
+        BYTE i = sector;
+        while ((i > 0) && mifare_classic_attempt_before(&attempt, &attempts[i - 1])) {
+            attempts[i] = attempts[i - 1];
+            i--;
+        }
+        attempts[i] = attempt;
+    }
+    for (BYTE i = 0; i < sectors; i++) {
+        mifare_classic_dump_sector(reader, attempts[i].sector, keys, attempts[i].key, attempts[i].keyType, dump, pbRecvBuffer, pbRecvBufferSize);
+    }
+
+    // second round for the sectors that stayed closed: key by key (A, then B) over all of them, so every key is
+    // loaded once no matter how many sectors still need it
+    for (int k = 0; k < 2; k++) {
+        BYTE keyType = (k == 0) ? MIFARE_CLASSIC_KEY_A : MIFARE_CLASSIC_KEY_B;
+        for (size_t key = 0; key < keyCount; key++) {
+            for (BYTE i = 0; i < sectors; i++) {
+                const MifareClassicAttempt *first = &attempts[i];
+                if (dump->sectorRead[first->sector] || (((size_t)first->key == key) && (first->keyType == keyType))) {
+                    continue;
+                }
+                mifare_classic_dump_sector(reader, first->sector, keys, (int)key, keyType, dump, pbRecvBuffer, pbRecvBufferSize);
+            }
+        }
+    }
+
+    BYTE opened = 0;
+    for (BYTE sector = 0; sector < sectors; sector++) {
+        if (dump->sectorRead[sector]) {
+            opened++;
+        } else {
+            reader->lastKey[sector] = -1;
+            LOG_WARN("None of the %zu keys opens sector %u.", keyCount, (unsigned int)sector);
+        }
+    }
+    LOG_INFO("Read %u of %u sectors of the %s: %lu key loads, %lu authentications, %lu reads.", (unsigned int)opened, (unsigned int)sectors, tag_type_name(type),
+             (unsigned long)(reader->keyLoads - keyLoads), (unsigned long)(reader->authentications - authentications), (unsigned long)(reader->reads - reads));
+    return opened > 0;
+}
+
+void mifare_classic_blocks_print_all(const MIFARE_Classic_Blocks *dump) {
+    size_t blocks = mifare_classic_block_count(dump->type);
+    for (size_t block = 0; block < blocks; block++) {
+        BYTE sector = mifare_classic_sector_of_block((BYTE)block);
+        if (block == mifare_classic_first_block(sector)) {
+            if (dump->sectorRead[sector]) {
+                printf("[Sector %2u]\tkey %c\n", (unsigned int)sector, (dump->sectorKeyType[sector] == MIFARE_CLASSIC_KEY_A) ? 'A' : 'B');
+            } else {
+                printf("[Sector %2u]\tnot read\n", (unsigned int)sector);
+            }
+        }
+        printf("[Block 0x%02X]\t", (unsigned int)block);
+        printHex(dump->Blocks[block], MIFARE_CLASSIC_BLOCK_SIZE);
+    }
+}
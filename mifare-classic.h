@@ -0,0 +1,96 @@
+#ifndef MIFARE_CLASSIC_H
+#define MIFARE_CLASSIC_H
+
+#ifndef READER_H
+#include "reader.h"
+#endif
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#ifndef TAG_TYPE_H
+#include "tag-type.h"
+#endif
+
+// Mifare Classic Mini / 1k / 4k through the reader's pseudo apdus. every sector needs an authentication before its
+// blocks can be read, and the key for it has to sit in one of the two volatile key slots of the reader first:
+//      FF 82 00 <slot> 06 <key>                LOAD KEYS
+//      FF 86 00 00 05 01 00 <block> 60|61 <slot>   GENERAL AUTHENTICATE (key A / key B)
+//      FF B0 00 <block> <n * 16>               READ BINARY over n blocks of the authenticated sector
+// a dump therefore costs one authentication per sector and as few READ BINARY as the reader answers (the whole sector
+// if it can). the reader context lives longer than a tag: the keys that are in the slots are remembered, so they are
+// only loaded again if a different key is needed, and the key that opened a sector of the last tag is tried first on
+// the next one (a batch of tags from one issuer usually shares its keys). a failed authentication halts the tag, it is
+// activated again (SCARD_RESET_CARD) before the next key is tried.
+//
+//      static MifareClassicReader mc;                          // one per reader, keep it across tags
+//      mifare_classic_reader_init(&mc, hCard);
+//      MIFARE_Classic_Blocks dump;
+//      mifare_classic_dump(&mc, tag.type, MIFARE_CLASSIC_DEFAULT_KEYS, MIFARE_CLASSIC_DEFAULT_KEY_COUNT, &dump, pbRecvBuffer, &pbRecvBufferSize);
+
+#define MIFARE_CLASSIC_BLOCK_SIZE       16
+#define MIFARE_CLASSIC_KEY_SIZE         6
+#define MIFARE_CLASSIC_MAX_BLOCKS       256     // 4k: 32 sectors of 4 blocks, then 8 sectors of 16 blocks
+#define MIFARE_CLASSIC_MAX_SECTORS      40
+#define MIFARE_CLASSIC_KEY_SLOTS        2       // volatile key slots of the ACR1581U
+
+#define MIFARE_CLASSIC_KEY_A            0x60
+#define MIFARE_CLASSIC_KEY_B            0x61
+
+// well known transport / NFC Forum keys: factory default, MAD sector, NDEF sectors, all zero
+extern const BYTE MIFARE_CLASSIC_DEFAULT_KEYS[][MIFARE_CLASSIC_KEY_SIZE];
+#define MIFARE_CLASSIC_DEFAULT_KEY_COUNT 4
+
+typedef struct MifareClassicReader {
+    SCARDHANDLE hCard;
+    BYTE slotKey[MIFARE_CLASSIC_KEY_SLOTS][MIFARE_CLASSIC_KEY_SIZE];
+    BOOL slotLoaded[MIFARE_CLASSIC_KEY_SLOTS];
+    DWORD slotUsed[MIFARE_CLASSIC_KEY_SLOTS];   // use counter of the slot, the least recently used one is overwritten
+    DWORD useClock;
+    int authSector;                     // sector the tag is authenticated for right now, -1 = none
+    BYTE authKey[MIFARE_CLASSIC_KEY_SIZE];  // key and key type that opened authSector, a read that broke off authenticates again with them
+    BYTE authKeyType;
+    DWORD maxReadBlocks;                // largest READ BINARY in blocks the reader answered, halved when one is refused
+    // key (index into the key list of the last dump) and key type that opened each sector of the previous tag, -1 = none
+    int lastKey[MIFARE_CLASSIC_MAX_SECTORS];
+    BYTE lastKeyType[MIFARE_CLASSIC_MAX_SECTORS];
+    // counters since mifare_classic_reader_init
+    DWORD keyLoads;
+    DWORD authentications;
+    DWORD failedAuthentications;
+    DWORD reads;
+} MifareClassicReader;
+
+typedef struct MIFARE_Classic_Blocks {
+    TagType type;                       // TAG_TYPE_MIFARE_CLASSIC_1K, _4K or TAG_TYPE_MIFARE_MINI, decides how many blocks are used
+    BYTE Blocks[MIFARE_CLASSIC_MAX_BLOCKS][MIFARE_CLASSIC_BLOCK_SIZE];
+    BOOL sectorRead[MIFARE_CLASSIC_MAX_SECTORS];    // FALSE: no key of the list opened the sector, its blocks are zero
+    BYTE sectorKeyType[MIFARE_CLASSIC_MAX_SECTORS];
+    BYTE sectorKey[MIFARE_CLASSIC_MAX_SECTORS][MIFARE_CLASSIC_KEY_SIZE];
+} MIFARE_Classic_Blocks;
+
+// geometry. unknown tag types have 0 sectors
+BYTE mifare_classic_sector_count(TagType type);
+BYTE mifare_classic_first_block(BYTE sector);
+BYTE mifare_classic_blocks_in_sector(BYTE sector);
+BYTE mifare_classic_sector_of_block(BYTE block);
+size_t mifare_classic_block_count(TagType type);
+
+void mifare_classic_reader_init(MifareClassicReader *reader, SCARDHANDLE hCard);
+// mifare_classic_new_tag forgets the authentication of the previous tag, the key slots and remembered keys stay
+void mifare_classic_new_tag(MifareClassicReader *reader, SCARDHANDLE hCard);
+
+// mifare_classic_authenticate makes sure sector is open with key (loads it into a slot only if no slot holds it)
+BOOL mifare_classic_authenticate(MifareClassicReader *reader, BYTE sector, const BYTE key[MIFARE_CLASSIC_KEY_SIZE], BYTE keyType, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+// mifare_classic_read_sector reads all blocks of the authenticated sector into out with as few READ BINARY as possible.
+// a read that fails like a weak field does (63 00, mute tag) is repeated after authenticating the sector again
+BOOL mifare_classic_read_sector(MifareClassicReader *reader, BYTE sector, BYTE *out, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+
+// mifare_classic_dump reads every sector of the tag that one of the keys (key A first, then key B) opens. returns
+// FALSE if no sector could be read. sector trailers show the key that opened them instead of the zeros the tag sends
+BOOL mifare_classic_dump(MifareClassicReader *reader, TagType type, const BYTE keys[][MIFARE_CLASSIC_KEY_SIZE], size_t keyCount, MIFARE_Classic_Blocks *dump, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+
+void mifare_classic_blocks_print_all(const MIFARE_Classic_Blocks *dump);
+
+#endif
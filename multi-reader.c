@@ -0,0 +1,166 @@
+#include "multi-reader.h"
+#include "reader.h"
+#include "transport.h"
+#include "logging.h"
+
+static void *multi_reader_worker(void *arg) {
+    ReaderWorker *worker = (ReaderWorker *)arg;
+    MultiReader *engine = worker->engine;
+    SCARDCONTEXT hContext;
+
+    worker->lastStatus = transport_get()->establishContext(SCARD_SCOPE_SYSTEM, &hContext);
+    if (worker->lastStatus != SCARD_S_SUCCESS) {
+        LOG_ERROR("[%s] Failed to establish context: 0x%x", worker->reader, (unsigned int)worker->lastStatus);
+        __atomic_store_n(&worker->finished, TRUE, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    // the session keeps context and card handle open for all tags of this reader (and switches the buzzer off once)
+    worker->lastStatus = session_open(&worker->session, hContext, worker->reader);
+    if (worker->lastStatus != SCARD_S_SUCCESS) {
+        LOG_ERROR("[%s] Failed to watch reader: 0x%x", worker->reader, (unsigned int)worker->lastStatus);
+        session_close(&worker->session);
+        __atomic_store_n(&worker->finished, TRUE, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    // session_open fills the struct that session_cancel reads, so multi_reader_stop waits for this before cancelling.
+    // what it reads (context and watcher) is not written again until the engine is started anew
+    __atomic_store_n(&worker->sessionReady, TRUE, __ATOMIC_RELEASE);
+    worker->pbRecvBufferSize = sizeof(worker->pbRecvBuffer);
+
+    while (!__atomic_load_n(&engine->stop, __ATOMIC_ACQUIRE)) {
+        LONG lRet = session_wait_tag(&worker->session);
+        if (lRet != SCARD_S_SUCCESS) {
+            if (lRet != SCARD_E_CANCELLED) {
+                worker->lastStatus = lRet;
+            }
+            break;
+        }
+        presence_first_apdu(&worker->session.watcher);
+
+        // identification and the handler run in one transaction
+        BOOL keepGoing = TRUE;
+        lRet = session_begin(&worker->session);
+        if (lRet == SCARD_S_SUCCESS) {
+            lRet = session_identify(&worker->session, worker->mszReaders, sizeof(worker->mszReaders), worker->pbRecvBuffer, &worker->pbRecvBufferSize, &worker->tag);
+        }
+        if (lRet == SCARD_S_SUCCESS) {
+            keepGoing = engine->handler(worker, engine->userData);
+            worker->tagsHandled++;
+        } else {
+            worker->lastStatus = lRet;
+        }
+        session_end(&worker->session);
+
+        if (!engine->continuous || !keepGoing) {
+            break;
+        }
+        // the same tag must not be handled twice, so wait until it is gone
+        while (!__atomic_load_n(&engine->stop, __ATOMIC_ACQUIRE) && worker->session.attached) {
+            lRet = session_wait_removal(&worker->session);
+            if (lRet != SCARD_S_SUCCESS) {
+                break;
+            }
+        }
+        if ((lRet != SCARD_S_SUCCESS) && !__atomic_load_n(&engine->stop, __ATOMIC_ACQUIRE)) {
+            if (lRet != SCARD_E_CANCELLED) {
+                worker->lastStatus = lRet;
+            }
+            break;
+        }
+    }
+
+    session_close(&worker->session);
+    __atomic_store_n(&worker->finished, TRUE, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+LONG multi_reader_start(MultiReader *engine, const char *nameFilter, ReaderTagHandler handler, void *userData, BOOL continuous) {
+    const Transport *transport = transport_get();
+    SCARDCONTEXT hContext;
+    char mszReaders[1024];
+    DWORD dwReaders = sizeof(mszReaders);
+
+    memset(engine, 0, sizeof(*engine));
+    engine->handler = handler;
+    engine->userData = userData;
+    engine->continuous = continuous;
+
+    // this context is only used to find the readers, every worker establishes its own one
+    LONG lRet = transport->establishContext(SCARD_SCOPE_SYSTEM, &hContext);
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_CRITICAL("Failed to establish context: 0x%x", (unsigned int)lRet);
+        return lRet;
+    }
+    lRet = getAvailableReaders(hContext, mszReaders, &dwReaders);
+    transport->releaseContext(hContext);
+    if (lRet != SCARD_S_SUCCESS) {
+        return lRet;
+    }
+
+    for (char *p = mszReaders; *p; p += strlen(p) + 1) {
+        if (!strstr(p, "PICC") || !containsSubstring(p, nameFilter)) {
+            continue;
+        }
+        if (engine->count == MULTI_READER_MAX) {
+            LOG_WARN("Ignoring reader %s, at most %d readers are supported", p, MULTI_READER_MAX);
+            continue;
+        }
+        // a cut off name would not connect anyway
+        size_t nameLength = strlen(p);
+        if (nameLength >= sizeof(engine->workers[0].reader)) {
+            LOG_WARN("Ignoring reader %s, its name is longer than %zu characters", p, sizeof(engine->workers[0].reader) - 1);
+            continue;
+        }
+        ReaderWorker *worker = &engine->workers[engine->count];
+        worker->engine = engine;
+        worker->index = engine->count;
+        memcpy(worker->reader, p, nameLength + 1);
+        engine->count++;
+    }
+    if (engine->count == 0) {
+        LOG_CRITICAL("No PICC reader matching '%s' found.", nameFilter);
+        return SCARD_E_NO_READERS_AVAILABLE;
+    }
+
+    for (size_t i = 0; i < engine->count; i++) {
+        if (pthread_create(&engine->workers[i].thread, NULL, multi_reader_worker, &engine->workers[i]) != 0) {
+            LOG_CRITICAL("Failed to start worker for reader %s", engine->workers[i].reader);
+            engine->count = i; // only join what was started
+            multi_reader_stop(engine);
+            multi_reader_join(engine);
+            return SCARD_F_INTERNAL_ERROR;
+        }
+        LOG_INFO("Started worker %zu for reader %s", i, engine->workers[i].reader);
+    }
+
+    return SCARD_S_SUCCESS;
+}
+
+void multi_reader_stop(MultiReader *engine) {
+    __atomic_store_n(&engine->stop, TRUE, __ATOMIC_RELEASE);
+
+    // a worker might be just about to enter SCardGetStatusChange when the first cancel arrives, so repeat until all are out
+    BOOL allFinished = FALSE;
+    while (!allFinished) {
+        allFinished = TRUE;
+        for (size_t i = 0; i < engine->count; i++) {
+            ReaderWorker *worker = &engine->workers[i];
+            if (!__atomic_load_n(&worker->finished, __ATOMIC_ACQUIRE)) {
+                allFinished = FALSE;
+                // a worker that is still in session_open is cancelled in a later round
+                if (__atomic_load_n(&worker->sessionReady, __ATOMIC_ACQUIRE)) {
+                    session_cancel(&worker->session);
+                }
+            }
+        }
+        if (!allFinished) {
+            SLEEP_CUSTOM(10);
+        }
+    }
+}
+
+void multi_reader_join(MultiReader *engine) {
+    for (size_t i = 0; i < engine->count; i++) {
+        pthread_join(engine->workers[i].thread, NULL);
+    }
+}
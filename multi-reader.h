@@ -0,0 +1,66 @@
+#ifndef MULTI_READER_H
+#define MULTI_READER_H
+
+#include <pthread.h>
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#ifndef PRESENCE_H
+#include "presence.h"
+#endif
+
+#ifndef TAG_TYPE_H
+#include "tag-type.h"
+#endif
+
+#ifndef SESSION_H
+#include "session.h"
+#endif
+
+// Multi reader mode: one worker thread per ACR1581U PICC interface. every worker owns its SCARDCONTEXT, card handle,
+// receive buffer and tag identity, so nothing is shared between readers except the (thread safe) transport
+
+#define MULTI_READER_MAX 16
+
+struct MultiReader;
+
+typedef struct ReaderWorker {
+    struct MultiReader *engine;
+    size_t index;
+    char reader[256];
+    NfcSession session;         // context + warm card handle of this reader
+    char mszReaders[1024];      // scratch space for SCardStatus (it writes the reader name in there)
+    BYTE pbRecvBuffer[2048];
+    DWORD pbRecvBufferSize;
+    TagIdentity tag;
+    pthread_t thread;
+    LONG lastStatus;            // status of the last failed step (SCARD_S_SUCCESS if everything went well)
+    size_t tagsHandled;
+    BOOL sessionReady;          // session_open is done, multi_reader_stop may cancel the session (__atomic_*)
+    BOOL finished;              // set by the worker thread, read with __atomic_load_n
+} ReaderWorker;
+
+// called by a worker for every tag after it was connected and identified (UID, ATR, ATS), inside the transaction of
+// that tag. worker->session.hCard and worker->pbRecvBuffer can be used for further APDUs. return FALSE to make this worker stop
+typedef BOOL (*ReaderTagHandler)(ReaderWorker *worker, void *userData);
+
+typedef struct MultiReader {
+    ReaderWorker workers[MULTI_READER_MAX];
+    size_t count;
+    ReaderTagHandler handler;
+    void *userData;
+    BOOL continuous;            // FALSE: every worker handles one tag and stops, TRUE: keep going until multi_reader_stop
+    BOOL stop;                  // written and read with __atomic_* by the caller and all workers
+} MultiReader;
+
+// multi_reader_start opens every PICC reader whose name contains nameFilter (e.g. "ACR1581") and starts one worker per reader.
+// engine is large (one 2 KB receive buffer per reader), so don't put it on a small stack
+LONG multi_reader_start(MultiReader *engine, const char *nameFilter, ReaderTagHandler handler, void *userData, BOOL continuous);
+
+// multi_reader_stop asks all workers to finish and wakes up those that wait for a tag, multi_reader_join waits for them
+void multi_reader_stop(MultiReader *engine);
+void multi_reader_join(MultiReader *engine);
+
+#endif
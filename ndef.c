@@ -1,5 +1,5 @@
-#include "logging.c"
-#include "main.h"
+#include "logging.h"
+#include "reader.h"
 #include "ndef.h"
 
 
@@ -21,6 +21,12 @@ BYTE* NewNDEF_SR_Text(const BYTE* text, BYTE text_len, size_t* out_total_size) {
     // round up to multiple of 4 bytes (should be easy to write to any tag if message is multiples of 4 bytes)
     size_t padded_size = (total_size + 3) & ~0x03; // TODO: what is this
 
+    // check this before allocating, otherwise the buffer leaks
+    if (out_total_size == NULL) {
+        LOG_CRITICAL("Failed to set out_total_size");
+        return NULL;
+    }
+
     // allocate buffer
     BYTE* buffer = calloc(1, padded_size);
     if (buffer == NULL) {
@@ -42,11 +48,374 @@ BYTE* NewNDEF_SR_Text(const BYTE* text, BYTE text_len, size_t* out_total_size) {
     // add TLV Terminator (can't be part of struct unless i switch order of fields due to C limitation)
     buffer[sizeof(NDEF_SR_Text) + text_len] = TLV_TERMINATOR;
 
-    if (out_total_size == NULL) {
-        LOG_CRITICAL("Failed to set out_total_size");
-        return NULL;
-    }
     *out_total_size = padded_size; // set how many bytes (multiple of 4) this encoded ndef message consists of
 
     return buffer;
 }
+
+
+// -------------------- Parser -------------------------------
+
+void ndef_reader_init(NdefReader *reader, const BYTE *data, size_t length) {
+    memset(reader, 0, sizeof(*reader));
+    reader->data = data;
+    reader->length = length;
+}
+
+// ndef_next_tlv returns the next TLV block, NULL TLVs are skipped. reaching the terminator ends the walk for good
+NdefParseResult ndef_next_tlv(NdefReader *reader, NdefTlvView *tlv) {
+    while (reader->tlv_pos < reader->length) {
+        BYTE tag = reader->data[reader->tlv_pos];
+        if (tag == TLV_NULL) {
+            reader->tlv_pos++;
+            continue;
+        }
+        if (tag == TLV_TERMINATOR) {
+            reader->tlv_pos = reader->length;
+            return NDEF_PARSE_END;
+        }
+
+        size_t pos = reader->tlv_pos + 1;
+        if (pos >= reader->length) {
+            return NDEF_PARSE_TRUNCATED;
+        }
+        DWORD length = reader->data[pos++];
+        if (length == TLV_LONG_LENGTH) {
+            if (pos + 2 > reader->length) {
+                return NDEF_PARSE_TRUNCATED;
+            }
+            length = ((DWORD)reader->data[pos] << 8) | reader->data[pos + 1];
+            pos += 2;
+        }
+        if (length > reader->length - pos) {
+            return NDEF_PARSE_TRUNCATED;
+        }
+
+        tlv->tag = tag;
+        tlv->value = reader->data + pos;
+        tlv->length = length;
+        reader->tlv_pos = pos + length;
+        return NDEF_PARSE_OK;
+    }
+    return NDEF_PARSE_END;
+}
+
+// ndef_parse_record decodes the record at reader->record_pos of the current message and checks the chunk rules
+static NdefParseResult ndef_parse_record(NdefReader *reader, NdefRecordView *record) {
+    const BYTE *p = reader->message + reader->record_pos;
+    size_t left = reader->message_length - reader->record_pos;
+
+    if (left < 3) {
+        return NDEF_PARSE_TRUNCATED;
+    }
+    BYTE header = p[0];
+    BYTE type_len = p[1];
+    size_t pos = 2;
+    DWORD payload_len;
+    if (header & NDEF_FLAG_SR) {
+        payload_len = p[pos++];
+    } else {
+        if (left < pos + 4) {
+            return NDEF_PARSE_TRUNCATED;
+        }
+        payload_len = ((DWORD)p[pos] << 24) | ((DWORD)p[pos + 1] << 16) | ((DWORD)p[pos + 2] << 8) | p[pos + 3];
+        pos += 4;
+    }
+    BYTE id_len = 0;
+    if (header & NDEF_FLAG_IL) {
+        if (left < pos + 1) {
+            return NDEF_PARSE_TRUNCATED;
+        }
+        id_len = p[pos++];
+    }
+    // compare against what is left instead of adding up, a 4 byte payload length must not overflow anything
+    if ((type_len > left - pos) || (id_len > left - pos - type_len) || (payload_len > left - pos - type_len - id_len)) {
+        return NDEF_PARSE_TRUNCATED;
+    }
+
+    NdefTnf tnf = (NdefTnf)(header & NDEF_TNF_MASK);
+    if ((tnf == NDEF_TNF_EMPTY) && ((type_len != 0) || (id_len != 0) || (payload_len != 0))) {
+        return NDEF_PARSE_MALFORMED;
+    }
+    if (((tnf == NDEF_TNF_UNKNOWN) || (tnf == NDEF_TNF_UNCHANGED)) && (type_len != 0)) {
+        return NDEF_PARSE_MALFORMED;
+    }
+    // chunks after the first one must be UNCHANGED without ID, and UNCHANGED is not allowed anywhere else
+    if (reader->in_chunk != (tnf == NDEF_TNF_UNCHANGED)) {
+        return NDEF_PARSE_MALFORMED;
+    }
+    if (reader->in_chunk && (id_len != 0)) {
+        return NDEF_PARSE_MALFORMED;
+    }
+    if ((header & NDEF_FLAG_CF) && (header & NDEF_FLAG_ME)) {
+        return NDEF_PARSE_MALFORMED;
+    }
+
+    record->header = header;
+    record->id = p + pos + type_len;
+    record->id_len = id_len;
+    record->payload = p + pos + type_len + id_len;
+    record->payload_len = payload_len;
+    record->chunked = reader->in_chunk || (header & NDEF_FLAG_CF);
+    record->last_chunk = !(header & NDEF_FLAG_CF);
+    if (reader->in_chunk) {
+        record->tnf = reader->chunk_tnf;
+        record->type = reader->chunk_type;
+        record->type_len = reader->chunk_type_len;
+        record->chunk_index = ++reader->chunk_index;
+    } else {
+        record->tnf = tnf;
+        record->type = p + pos;
+        record->type_len = type_len;
+        record->chunk_index = 0;
+        reader->chunk_index = 0;
+        reader->chunk_tnf = tnf;
+        reader->chunk_type = record->type;
+        reader->chunk_type_len = type_len;
+    }
+
+    reader->in_chunk = (header & NDEF_FLAG_CF) != 0;
+    reader->message_end = (header & NDEF_FLAG_ME) != 0;
+    reader->record_pos += pos + type_len + id_len + payload_len;
+    return NDEF_PARSE_OK;
+}
+
+// ndef_next_record returns the next record, moving on to the next NDEF TLV when the current message is done
+NdefParseResult ndef_next_record(NdefReader *reader, NdefRecordView *record) {
+    for (;;) {
+        if ((reader->message != NULL) && !reader->message_end && (reader->record_pos < reader->message_length)) {
+            return ndef_parse_record(reader, record);
+        }
+        if ((reader->message != NULL) && reader->in_chunk) {
+            return NDEF_PARSE_MALFORMED; // message ended in the middle of a chunked record
+        }
+
+        NdefTlvView tlv;
+        NdefParseResult result;
+        do {
+            result = ndef_next_tlv(reader, &tlv);
+        } while ((result == NDEF_PARSE_OK) && (tlv.tag != TLV_HEADER)); // lock / memory control and proprietary TLVs hold no records
+        if (result != NDEF_PARSE_OK) {
+            return result;
+        }
+
+        reader->message = tlv.value;
+        reader->message_length = tlv.length;
+        reader->record_pos = 0;
+        reader->message_end = FALSE;
+    }
+}
+
+// ndef_find_record is the lazy mode: it parses only up to the first record with the given TNF and type and leaves the
+// reader right behind it, so calling it again finds the next one. for a chunked record the first chunk is returned,
+// the remaining ones follow with ndef_next_record
+NdefParseResult ndef_find_record(NdefReader *reader, NdefTnf tnf, const BYTE *type, BYTE type_len, NdefRecordView *record) {
+    NdefParseResult result;
+    while ((result = ndef_next_record(reader, record)) == NDEF_PARSE_OK) {
+        if ((record->chunk_index == 0) && (record->tnf == tnf) && (record->type_len == type_len) && (memcmp(record->type, type, type_len) == 0)) {
+            return NDEF_PARSE_OK;
+        }
+    }
+    return result;
+}
+
+// ndef_text_view splits the payload of a text record ("T") into language code and text (status byte: bit 7 = UTF-16, bits 0-5 = lang length)
+BOOL ndef_text_view(const NdefRecordView *record, const BYTE **lang, BYTE *lang_len, const BYTE **text, DWORD *text_len) {
+    if ((record->payload_len < 1) || ((record->payload[0] & 0x3F) > record->payload_len - 1)) {
+        return FALSE;
+    }
+    *lang_len = record->payload[0] & 0x3F;
+    *lang = record->payload + 1;
+    *text = record->payload + 1 + *lang_len;
+    *text_len = record->payload_len - 1 - *lang_len;
+    return TRUE;
+}
+
+// URI identifier codes, the first payload byte of a URI record ("U") replaces one of these prefixes (NFC Forum URI RTD)
+static const char *const NDEF_URI_PREFIXES[] = {
+    "", "http://www.", "https://www.", "http://", "https://", "tel:", "mailto:", "ftp://anonymous:anonymous@",
+    "ftp://ftp.", "ftps://", "sftp://", "smb://", "nfs://", "ftp://", "dav://", "news:",
+    "telnet://", "imap:", "rtsp://", "urn:", "pop:", "sip:", "sips:", "tftp:",
+    "btspp://", "btl2cap://", "btgoep://", "tcpobex://", "irdaobex://", "file://", "urn:epc:id:", "urn:epc:tag:",
+    "urn:epc:pat:", "urn:epc:raw:", "urn:epc:", "urn:nfc:",
+};
+
+const char *ndef_uri_prefix(BYTE code) {
+    if (code >= sizeof(NDEF_URI_PREFIXES) / sizeof(NDEF_URI_PREFIXES[0])) {
+        return ""; // reserved codes mean no prefix
+    }
+    return NDEF_URI_PREFIXES[code];
+}
+
+
+// -------------------- Builder -------------------------------
+
+void ndef_builder_init(NdefBuilder *builder, BYTE *buffer, size_t capacity) {
+    memset(builder, 0, sizeof(*builder));
+    builder->buffer = buffer;
+    builder->capacity = capacity;
+    builder->length = NDEF_TLV_RESERVED;
+    builder->failed = (capacity < NDEF_TLV_RESERVED + 1); // header + terminator must always fit
+}
+
+// ndef_builder_reserve_record writes the record header and returns where the payload_len payload bytes go, so callers
+// can encode the payload in place. short record (1 byte payload length) if possible, long record otherwise
+BYTE *ndef_builder_reserve_record(NdefBuilder *builder, NdefTnf tnf, const BYTE *type, BYTE type_len, const BYTE *id, BYTE id_len, DWORD payload_len) {
+    if (builder->failed) {
+        return NULL;
+    }
+    BOOL short_record = (payload_len <= 0xFF);
+    size_t header_len = 2 + (short_record ? 1 : 4) + ((id_len > 0) ? 1 : 0);
+    size_t record_len = header_len + type_len + id_len + payload_len;
+    // 1 byte is kept for the terminator, and the TLV length field only has 2 bytes
+    if ((payload_len > builder->capacity) || (record_len + 1 > builder->capacity - builder->length)
+        || (builder->length + record_len - NDEF_TLV_RESERVED > 0xFFFE)) {
+        LOG_ERROR("NDEF record with %lu byte payload does not fit into the message buffer.", (unsigned long)payload_len);
+        builder->failed = TRUE;
+        return NULL;
+    }
+
+    BYTE *p = builder->buffer + builder->length;
+    *p++ = (BYTE)((builder->records == 0 ? NDEF_FLAG_MB : 0) | (short_record ? NDEF_FLAG_SR : 0) | ((id_len > 0) ? NDEF_FLAG_IL : 0) | (tnf & NDEF_TNF_MASK));
+    *p++ = type_len;
+    if (short_record) {
+        *p++ = (BYTE)payload_len;
+    } else {
+        *p++ = (BYTE)(payload_len >> 24); *p++ = (BYTE)(payload_len >> 16); *p++ = (BYTE)(payload_len >> 8); *p++ = (BYTE)payload_len;
+    }
+    if (id_len > 0) {
+        *p++ = id_len;
+    }
+    if (type_len > 0) {
+        memcpy(p, type, type_len);
+        p += type_len;
+    }
+    if (id_len > 0) {
+        memcpy(p, id, id_len);
+        p += id_len;
+    }
+
+    builder->last_record = builder->length;
+    builder->length += record_len;
+    builder->records++;
+    return p;
+}
+
+BOOL ndef_builder_add_record(NdefBuilder *builder, NdefTnf tnf, const BYTE *type, BYTE type_len, const BYTE *id, BYTE id_len, const BYTE *payload, DWORD payload_len) {
+    BYTE *p = ndef_builder_reserve_record(builder, tnf, type, type_len, id, id_len, payload_len);
+    if (p == NULL) {
+        return FALSE;
+    }
+    if (payload_len > 0) {
+        memcpy(p, payload, payload_len);
+    }
+    return TRUE;
+}
+
+// ndef_builder_add_text adds a UTF-8 text record ("T"), lang is any RFC 5646 code ("en", "de-AT", ...) up to 63 chars
+BOOL ndef_builder_add_text(NdefBuilder *builder, const char *lang, const BYTE *text, DWORD text_len) {
+    size_t lang_len = strlen(lang);
+    if (lang_len > 0x3F) {
+        LOG_ERROR("Language code '%s' is too long for a text record.", lang);
+        builder->failed = TRUE;
+        return FALSE;
+    }
+    BYTE type = RECORD_TYPE;
+    BYTE *p = ndef_builder_reserve_record(builder, NDEF_TNF_WELL_KNOWN, &type, 1, NULL, 0, (DWORD)(1 + lang_len + text_len));
+    if (p == NULL) {
+        return FALSE;
+    }
+    *p++ = (BYTE)lang_len; // status byte: UTF-8, length of the language code
+    memcpy(p, lang, lang_len);
+    memcpy(p + lang_len, text, text_len);
+    return TRUE;
+}
+
+// ndef_builder_add_uri adds a URI record ("U") and replaces the longest known prefix by its identifier code
+BOOL ndef_builder_add_uri(NdefBuilder *builder, const char *uri) {
+    BYTE code = 0;
+    size_t prefix_len = 0;
+    for (BYTE i = 1; i < sizeof(NDEF_URI_PREFIXES) / sizeof(NDEF_URI_PREFIXES[0]); i++) {
+        size_t len = strlen(NDEF_URI_PREFIXES[i]);
+        if ((len > prefix_len) && (strncmp(uri, NDEF_URI_PREFIXES[i], len) == 0)) {
+            code = i;
+            prefix_len = len;
+        }
+    }
+
+    size_t rest = strlen(uri) - prefix_len;
+    BYTE type = 'U';
+    BYTE *p = ndef_builder_reserve_record(builder, NDEF_TNF_WELL_KNOWN, &type, 1, NULL, 0, (DWORD)(1 + rest));
+    if (p == NULL) {
+        return FALSE;
+    }
+    *p++ = code;
+    memcpy(p, uri + prefix_len, rest);
+    return TRUE;
+}
+
+// ndef_builder_add_mime adds a media type record, e.g. "application/json"
+BOOL ndef_builder_add_mime(NdefBuilder *builder, const char *mime_type, const BYTE *payload, DWORD payload_len) {
+    size_t type_len = strlen(mime_type);
+    if (type_len > 0xFF) {
+        LOG_ERROR("MIME type is too long for a record type.");
+        builder->failed = TRUE;
+        return FALSE;
+    }
+    return ndef_builder_add_record(builder, NDEF_TNF_MIME, (const BYTE *)mime_type, (BYTE)type_len, NULL, 0, payload, payload_len);
+}
+
+// ndef_builder_finish sets ME on the last record, fills in the TLV length (1 or 3 bytes), adds the terminator and pads
+// with zeros up to the next page boundary. out_len is the number of bytes to write to the tag
+BOOL ndef_builder_finish(NdefBuilder *builder, size_t *out_len) {
+    if (builder->failed) {
+        return FALSE;
+    }
+    if (builder->records > 0) {
+        builder->buffer[builder->last_record] |= NDEF_FLAG_ME;
+    }
+
+    size_t message_len = builder->length - NDEF_TLV_RESERVED;
+    builder->buffer[0] = TLV_HEADER;
+    if (message_len < TLV_LONG_LENGTH) {
+        // short form: the records move 2 bytes to the front, in place
+        builder->buffer[1] = (BYTE)message_len;
+        memmove(builder->buffer + 2, builder->buffer + NDEF_TLV_RESERVED, message_len);
+        builder->length -= 2;
+    } else {
+        builder->buffer[1] = TLV_LONG_LENGTH;
+        builder->buffer[2] = (BYTE)(message_len >> 8);
+        builder->buffer[3] = (BYTE)message_len;
+    }
+    builder->buffer[builder->length++] = TLV_TERMINATOR;
+
+    while ((builder->length % 4 != 0) && (builder->length < builder->capacity)) {
+        builder->buffer[builder->length++] = 0x00;
+    }
+    *out_len = builder->length;
+    builder->failed = TRUE; // finished, adding more records would corrupt the message
+    return TRUE;
+}
+
+// -------------------- Arena -------------------------------
+
+void ndef_arena_init(NdefArena *arena, BYTE *memory, size_t capacity) {
+    arena->base = memory;
+    arena->capacity = capacity;
+    arena->used = 0;
+}
+
+// ndef_arena_alloc returns size bytes (rounded up to whole pages) or NULL if the arena is full
+BYTE *ndef_arena_alloc(NdefArena *arena, size_t size) {
+    size_t rounded = (size + 3) & ~(size_t)0x03;
+    if (rounded > arena->capacity - arena->used) {
+        return NULL;
+    }
+    BYTE *p = arena->base + arena->used;
+    arena->used += rounded;
+    return p;
+}
+
+void ndef_arena_reset(NdefArena *arena) {
+    arena->used = 0;
+}
@@ -1,18 +1,14 @@
 #ifndef NDEF_H
 #define NDEF_H
 
-#ifndef MAIN_H
-#include "main.h"
+#ifndef READER_H
+#include "reader.h"
 #endif
 
 #ifndef COMMON_H
 #include "common.h"
 #endif
 
-#ifndef LOGGING_C
-#include "logging.c"
-#endif
-
 
 // structs
 
@@ -78,5 +74,144 @@ typedef struct NDEF_SR_Text {
 BYTE* NewNDEF_SR_Text(const BYTE* text, BYTE text_len, size_t* out_total_size);
 
 
+// -------------------- Parser -------------------------------
+
+// The parser walks TLVs and NDEF records in place: every view points into the buffer that was passed to
+// ndef_reader_init (e.g. the user memory of a fastread), nothing is copied or allocated. the buffer must stay alive as
+// long as the views are used.
+//
+//      NdefReader reader;
+//      NdefRecordView record;
+//      ndef_reader_init(&reader, tag_content.Pages[0x04], 240);
+//      while (ndef_next_record(&reader, &record) == NDEF_PARSE_OK) { ... }
+//
+// or lazily, stopping at the first URI record:
+//      ndef_find_record(&reader, NDEF_TNF_WELL_KNOWN, (const BYTE *)"U", 1, &record);
+
+// TLV blocks (NFC Forum Type 2 Tag spec)
+#define TLV_NULL                0x00    // padding, has no length byte
+#define TLV_LOCK_CONTROL        0x01
+#define TLV_MEMORY_CONTROL      0x02
+#define TLV_PROPRIETARY         0xFD
+// TLV_HEADER (0x03, NDEF message) and TLV_TERMINATOR (0xFE, has no length byte) are defined above
+#define TLV_LONG_LENGTH         0xFF    // length byte that announces a 2 byte (big endian) length
+
+// record header flags
+#define NDEF_FLAG_MB            0x80    // message begin
+#define NDEF_FLAG_ME            0x40    // message end
+#define NDEF_FLAG_CF            0x20    // chunk flag (more chunks follow)
+#define NDEF_FLAG_SR            0x10    // short record (1 byte payload length instead of 4)
+#define NDEF_FLAG_IL            0x08    // ID length field is present
+#define NDEF_TNF_MASK           0x07
+
+typedef enum {
+    NDEF_TNF_EMPTY          = 0x00,
+    NDEF_TNF_WELL_KNOWN     = 0x01, // NFC Forum RTD, e.g. "T" (text) or "U" (URI)
+    NDEF_TNF_MIME           = 0x02, // RFC 2046 media type
+    NDEF_TNF_ABSOLUTE_URI   = 0x03,
+    NDEF_TNF_EXTERNAL       = 0x04, // e.g. "android.com:pkg"
+    NDEF_TNF_UNKNOWN        = 0x05,
+    NDEF_TNF_UNCHANGED      = 0x06, // middle and terminating chunks of a chunked record
+    NDEF_TNF_RESERVED       = 0x07,
+} NdefTnf;
+
+typedef enum {
+    NDEF_PARSE_OK,
+    NDEF_PARSE_END,         // terminator TLV or end of buffer reached
+    NDEF_PARSE_TRUNCATED,   // a length points past the end of the buffer
+    NDEF_PARSE_MALFORMED,   // lengths / flags that the spec does not allow
+} NdefParseResult;
+
+typedef struct NdefTlvView {
+    BYTE tag;
+    const BYTE *value;
+    DWORD length;
+} NdefTlvView;
+
+typedef struct NdefRecordView {
+    BYTE header;            // raw record header (MB ME CF SR IL TNF)
+    NdefTnf tnf;            // for chunks after the first one this is the TNF of the first chunk
+    const BYTE *type;       // for chunks after the first one this is the type of the first chunk
+    BYTE type_len;
+    const BYTE *id;
+    BYTE id_len;
+    const BYTE *payload;
+    DWORD payload_len;      // of this chunk only
+    BOOL chunked;           // record is part of a chunked record
+    DWORD chunk_index;      // 0 for the first chunk
+    BOOL last_chunk;        // TRUE for unchunked records and the terminating chunk
+} NdefRecordView;
+
+typedef struct NdefReader {
+    const BYTE *data;
+    size_t length;
+    size_t tlv_pos;         // next TLV
+    const BYTE *message;    // value of the current NDEF TLV, NULL if none
+    size_t message_length;
+    size_t record_pos;      // next record inside message
+    BOOL message_end;       // ME of the current message was seen
+    BOOL in_chunk;          // previous record had CF set
+    DWORD chunk_index;
+    NdefTnf chunk_tnf;
+    const BYTE *chunk_type;
+    BYTE chunk_type_len;
+} NdefReader;
+
+void ndef_reader_init(NdefReader *reader, const BYTE *data, size_t length);
+NdefParseResult ndef_next_tlv(NdefReader *reader, NdefTlvView *tlv);
+NdefParseResult ndef_next_record(NdefReader *reader, NdefRecordView *record);
+NdefParseResult ndef_find_record(NdefReader *reader, NdefTnf tnf, const BYTE *type, BYTE type_len, NdefRecordView *record);
+
+// helpers for the two record types that are actually used
+BOOL ndef_text_view(const NdefRecordView *record, const BYTE **lang, BYTE *lang_len, const BYTE **text, DWORD *text_len);
+const char *ndef_uri_prefix(BYTE code);
+
+
+// -------------------- Builder -------------------------------
+
+// The builder encodes a complete NDEF TLV (03 len records FE, zero padded to whole 4 byte pages) straight into memory
+// the caller owns: a stack buffer, a slice of an NdefArena or the user pages of an EM_4423_TagImage. the result is
+// written to the tag as is, there is no malloc and no copy in between.
+//
+//      BYTE msg[EM_4423_USER_MEMORY_BYTES];
+//      NdefBuilder builder;
+//      size_t msg_len;
+//      ndef_builder_init(&builder, msg, sizeof(msg));
+//      ndef_builder_add_uri(&builder, "https://example.com");
+//      ndef_builder_add_text(&builder, "de-AT", (const BYTE *)"Servus", 6);
+//      if (ndef_builder_finish(&builder, &msg_len)) em_4423_write_range(0x04, msg, msg_len, ...);
+
+#define NDEF_TLV_RESERVED   4   // 03 FF hi lo, shrunk to 03 len in ndef_builder_finish when the message is short
+
+typedef struct NdefBuilder {
+    BYTE *buffer;
+    size_t capacity;
+    size_t length;          // bytes used, including the reserved TLV header
+    size_t last_record;     // offset of the header byte of the last record (gets ME in ndef_builder_finish)
+    DWORD records;
+    BOOL failed;            // something did not fit, ndef_builder_finish will refuse
+} NdefBuilder;
+
+void ndef_builder_init(NdefBuilder *builder, BYTE *buffer, size_t capacity);
+BYTE *ndef_builder_reserve_record(NdefBuilder *builder, NdefTnf tnf, const BYTE *type, BYTE type_len, const BYTE *id, BYTE id_len, DWORD payload_len);
+BOOL ndef_builder_add_record(NdefBuilder *builder, NdefTnf tnf, const BYTE *type, BYTE type_len, const BYTE *id, BYTE id_len, const BYTE *payload, DWORD payload_len);
+BOOL ndef_builder_add_text(NdefBuilder *builder, const char *lang, const BYTE *text, DWORD text_len);
+BOOL ndef_builder_add_uri(NdefBuilder *builder, const char *uri);
+BOOL ndef_builder_add_mime(NdefBuilder *builder, const char *mime_type, const BYTE *payload, DWORD payload_len);
+BOOL ndef_builder_finish(NdefBuilder *builder, size_t *out_len);
+
+// NdefArena hands out page aligned slices of one block, so messages for many tags can be prepared up front and
+// dropped together with ndef_arena_reset
+typedef struct NdefArena {
+    BYTE *base;
+    size_t capacity;
+    size_t used;
+} NdefArena;
+
+void ndef_arena_init(NdefArena *arena, BYTE *memory, size_t capacity);
+BYTE *ndef_arena_alloc(NdefArena *arena, size_t size);
+void ndef_arena_reset(NdefArena *arena);
+
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,404 @@
+// nfc-archive: looks at a tag archive (main --archive <path>) without a reader
+//      usage: nfc-archive <archive> <command>
+//      lookup <uid> [-a]           newest dump of a tag with all pages, -a lists the older dumps as well
+//      diff <uid>[@n] [<uid>[@m]]  pages that differ between two dumps (@n = n dumps back, default: newest vs the one before)
+//      scan [-t type] [-u uid prefix] [-s unix seconds] [-c hex bytes] [-q]
+//                                  every record that matches all filters (-c: image contains the bytes), -q only counts
+//      list                        every record, one line each
+//      stats | verify | reindex    counts per tag type / checksum of every record / rebuild the index
+//      fill <n>                    appends n made up NTAG215 dumps (spread over n / 4 UIDs), for trying out big archives
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tag-archive.h"
+#include "tag-type.h"
+#include "timing.h"
+
+#define NFC_ARCHIVE_HEX_MAX 64
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s <archive> lookup <uid> [-a] | diff <uid>[@n] [<uid>[@m]] | scan [-t type] [-u uid prefix] [-s since] [-c hex] [-q]\n"
+                    "       | list | stats | verify | reindex | fill <n>\n", name);
+}
+
+// parse_hex reads "04a1b2", "04:A1:B2" or "04 a1 b2", returns the number of bytes or -1
+static int parse_hex(const char *text, uint8_t *out, int max) {
+    int length = 0;
+    int high = -1;
+    for (; *text != '\0'; text++) {
+        int nibble;
+        if ((*text == ':') || (*text == ' ')) {
+            continue;
+        } else if ((*text >= '0') && (*text <= '9')) {
+            nibble = *text - '0';
+        } else if ((*text >= 'a') && (*text <= 'f')) {
+            nibble = *text - 'a' + 10;
+        } else if ((*text >= 'A') && (*text <= 'F')) {
+            nibble = *text - 'A' + 10;
+        } else {
+            return -1;
+        }
+        if (high < 0) {
+            high = nibble;
+            continue;
+        }
+        if (length == max) {
+            return -1;
+        }
+        out[length++] = (uint8_t)((high << 4) | nibble);
+        high = -1;
+    }
+    return (high < 0) ? length : -1;
+}
+
+static void print_uid(const TagArchiveRecord *record) {
+    for (uint8_t i = 0; i < record->uidLength; i++) {
+        printf("%02X", record->uid[i]);
+    }
+}
+
+static void print_timestamp(uint64_t timestampNs) {
+    time_t seconds = (time_t)(timestampNs / 1000000000ull);
+    struct tm lt;
+    char timestr[20];
+    localtime_r(&seconds, &lt);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &lt);
+    printf("%s.%03u", timestr, (unsigned int)((timestampNs % 1000000000ull) / 1000000ull));
+}
+
+static void print_record_line(const TagArchiveRecord *record) {
+    printf("@%-12llu ", (unsigned long long)record->offset);
+    print_timestamp(record->timestamp);
+    printf("  ");
+    print_uid(record);
+    printf("  %s, %u bytes\n", tag_type_name((TagType)record->tagType), (unsigned int)record->imageLength);
+}
+
+static void print_pages(const TagArchiveRecord *record) {
+    if (record->pageSize == 0) {
+        return;
+    }
+    for (unsigned int page = 0; page * record->pageSize < record->imageLength; page++) {
+        printf("[Page 0x%02X]\t", page);
+        for (unsigned int i = page * record->pageSize; (i < (page + 1u) * record->pageSize) && (i < record->imageLength); i++) {
+            printf("0x%02X  ", record->image[i]);
+        }
+        printf("\n");
+    }
+}
+
+// find_dump parses "<uid>[@n]" and follows the chain of previous dumps n steps back
+static int find_dump(TagArchive *archive, const char *spec, unsigned long defaultBack, TagArchiveRecord *record) {
+    char text[2 * NFC_ARCHIVE_HEX_MAX + 1];
+    unsigned long back = defaultBack;
+    const char *at = strchr(spec, '@');
+    size_t length = (at != NULL) ? (size_t)(at - spec) : strlen(spec);
+    if (length >= sizeof(text)) {
+        length = sizeof(text) - 1;
+    }
+    memcpy(text, spec, length);
+    text[length] = '\0';
+    if (at != NULL) {
+        back = strtoul(at + 1, NULL, 10);
+    }
+
+    uint8_t uid[TAG_ARCHIVE_UID_MAX];
+    int uidLength = parse_hex(text, uid, TAG_ARCHIVE_UID_MAX);
+    if (uidLength <= 0) {
+        fprintf(stderr, "Bad UID %s\n", text);
+        return 0;
+    }
+    TagArchiveStatus status = tag_archive_lookup(archive, uid, (uint8_t)uidLength, record);
+    for (unsigned long i = 0; (status == TAG_ARCHIVE_OK) && (i < back); i++) {
+        status = (record->previous != 0) ? tag_archive_read(archive, record->previous, record) : TAG_ARCHIVE_NOT_FOUND;
+    }
+    if (status != TAG_ARCHIVE_OK) {
+        fprintf(stderr, "%s: %s\n", spec, tag_archive_status_name(status));
+        return 0;
+    }
+    return 1;
+}
+
+static int command_lookup(TagArchive *archive, int argc, char **argv) {
+    TagArchiveRecord record;
+    if (argc < 1) {
+        fprintf(stderr, "lookup needs a UID\n");
+        return 1;
+    }
+    if (!find_dump(archive, argv[0], 0, &record)) {
+        return 1;
+    }
+    int all = (argc > 1) && (strcmp(argv[1], "-a") == 0);
+    print_record_line(&record);
+    print_pages(&record);
+    while (all && (record.previous != 0) && (tag_archive_read(archive, record.previous, &record) == TAG_ARCHIVE_OK)) {
+        print_record_line(&record);
+    }
+    return 0;
+}
+
+static int command_diff(TagArchive *archive, int argc, char **argv) {
+    TagArchiveRecord a, b;
+    if (argc < 1) {
+        fprintf(stderr, "diff needs a UID\n");
+        return 1;
+    }
+    // with one argument the newest dump is compared to the one before it
+    const char *newer = (argc > 1) ? argv[1] : argv[0];
+    if (!find_dump(archive, argv[0], (argc > 1) ? 0 : 1, &a) || !find_dump(archive, newer, 0, &b)) {
+        return 1;
+    }
+    print_record_line(&a);
+    print_record_line(&b);
+
+    unsigned int pageSize = (a.pageSize != 0) ? a.pageSize : 4;
+    unsigned int longest = (a.imageLength > b.imageLength) ? a.imageLength : b.imageLength;
+    unsigned int differing = 0;
+    for (unsigned int start = 0; start < longest; start += pageSize) {
+        unsigned int end = (start + pageSize < longest) ? start + pageSize : longest;
+        int same = (end <= a.imageLength) && (end <= b.imageLength) && (memcmp(a.image + start, b.image + start, end - start) == 0);
+        if (same) {
+            continue;
+        }
+        differing++;
+        printf("[Page 0x%02X]\t", start / pageSize);
+        for (unsigned int i = start; i < end; i++) {
+            if (i < a.imageLength) {
+                printf("%02X", a.image[i]);
+            } else {
+                printf("--");
+            }
+        }
+        printf(" -> ");
+        for (unsigned int i = start; i < end; i++) {
+            if (i < b.imageLength) {
+                printf("%02X", b.image[i]);
+            } else {
+                printf("--");
+            }
+        }
+        printf("\n");
+    }
+    printf("%u page(s) differ\n", differing);
+    return 0;
+}
+
+// parse_type takes a TagType number or a part of its name ("Ultralight", "ICODE")
+static int parse_type(const char *text) {
+    char *end;
+    long number = strtol(text, &end, 10);
+    if ((*end == '\0') && (number >= 0) && (number < TAG_TYPE_COUNT)) {
+        return (int)number;
+    }
+    for (int type = 0; type < TAG_TYPE_COUNT; type++) {
+        if (strstr(tag_type_name((TagType)type), text) != NULL) {
+            return type;
+        }
+    }
+    return -1;
+}
+
+static int contains_bytes(const uint8_t *data, size_t length, const uint8_t *pattern, size_t patternLength) {
+    for (size_t i = 0; i + patternLength <= length; i++) {
+        const uint8_t *p = memchr(data + i, pattern[0], length - patternLength + 1 - i);
+        if (p == NULL) {
+            return 0;
+        }
+        i = (size_t)(p - data);
+        if (memcmp(p, pattern, patternLength) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int command_scan(TagArchive *archive, int argc, char **argv, int printAll) {
+    int type = -1;
+    int quiet = 0;
+    uint64_t since = 0;
+    uint8_t prefix[TAG_ARCHIVE_UID_MAX];
+    int prefixLength = 0;
+    uint8_t pattern[NFC_ARCHIVE_HEX_MAX];
+    int patternLength = 0;
+    for (int i = 0; i < argc; i++) {
+        int hasValue = (i + 1 < argc);
+        if ((strcmp(argv[i], "-t") == 0) && hasValue) {
+            type = parse_type(argv[++i]);
+            if (type < 0) {
+                fprintf(stderr, "Unknown tag type %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((strcmp(argv[i], "-u") == 0) && hasValue) {
+            prefixLength = parse_hex(argv[++i], prefix, TAG_ARCHIVE_UID_MAX);
+        } else if ((strcmp(argv[i], "-s") == 0) && hasValue) {
+            since = strtoull(argv[++i], NULL, 10) * 1000000000ull;
+        } else if ((strcmp(argv[i], "-c") == 0) && hasValue) {
+            patternLength = parse_hex(argv[++i], pattern, NFC_ARCHIVE_HEX_MAX);
+        } else if (strcmp(argv[i], "-q") == 0) {
+            quiet = 1;
+        } else {
+            fprintf(stderr, "Unknown scan option %s\n", argv[i]);
+            return 1;
+        }
+        if ((prefixLength < 0) || (patternLength < 0)) {
+            fprintf(stderr, "Bad hex value %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    uint64_t startNs = timing_now_ns();
+    uint64_t cursor = 0;
+    unsigned long long records = 0, matches = 0, bytes = 0;
+    TagArchiveRecord record;
+    TagArchiveStatus status;
+    while ((status = tag_archive_next(archive, &cursor, &record)) == TAG_ARCHIVE_OK) {
+        records++;
+        bytes += TAG_ARCHIVE_RECORD_HEADER_SIZE + record.imageLength;
+        if (((type >= 0) && (record.tagType != type)) || (record.timestamp < since)
+            || (record.uidLength < prefixLength) || (memcmp(record.uid, prefix, (size_t)prefixLength) != 0)
+            || ((patternLength > 0) && !contains_bytes(record.image, record.imageLength, pattern, (size_t)patternLength))) {
+            continue;
+        }
+        matches++;
+        if (!quiet) {
+            print_record_line(&record);
+        }
+    }
+    if (status != TAG_ARCHIVE_END) {
+        fprintf(stderr, "Scan stopped at offset %llu: %s\n", (unsigned long long)cursor, tag_archive_status_name(status));
+    }
+
+    if (!printAll || quiet) {
+        double seconds = (double)(timing_now_ns() - startNs) / 1e9;
+        fprintf(stderr, "%llu of %llu records matched in %.3f s (%.0f records/s, %.1f MB/s)\n", matches, records, seconds,
+                (seconds > 0) ? (double)records / seconds : 0.0, (seconds > 0) ? (double)bytes / seconds / 1e6 : 0.0);
+    }
+    return (status == TAG_ARCHIVE_END) ? 0 : 1;
+}
+
+static int command_stats(TagArchive *archive) {
+    unsigned long long perType[TAG_TYPE_COUNT + 1] = {0};
+    unsigned long long bytes = 0;
+    uint64_t first = 0, last = 0, cursor = 0;
+    TagArchiveRecord record;
+    while (tag_archive_next(archive, &cursor, &record) == TAG_ARCHIVE_OK) {
+        perType[(record.tagType < TAG_TYPE_COUNT) ? record.tagType : TAG_TYPE_COUNT]++;
+        bytes += record.imageLength;
+        first = (first == 0) ? record.timestamp : first;
+        last = record.timestamp;
+    }
+
+    printf("records:  %llu\n", (unsigned long long)tag_archive_record_count(archive));
+    printf("uids:     %llu\n", (unsigned long long)tag_archive_uid_count(archive));
+    printf("size:     %llu bytes (%llu bytes of images)\n", (unsigned long long)archive->end, bytes);
+    if (first != 0) {
+        printf("first:    ");
+        print_timestamp(first);
+        printf("\nlast:     ");
+        print_timestamp(last);
+        printf("\n");
+    }
+    for (int type = 0; type <= TAG_TYPE_COUNT; type++) {
+        if (perType[type] != 0) {
+            printf("%8llu  %s\n", perType[type], (type < TAG_TYPE_COUNT) ? tag_type_name((TagType)type) : "(unknown type)");
+        }
+    }
+    return 0;
+}
+
+static int command_verify(TagArchive *archive) {
+    uint64_t cursor = 0;
+    unsigned long long records = 0, bad = 0;
+    TagArchiveRecord record;
+    TagArchiveStatus status;
+    while ((status = tag_archive_next(archive, &cursor, &record)) == TAG_ARCHIVE_OK) {
+        records++;
+        if (tag_archive_check(archive, &record) != TAG_ARCHIVE_OK) {
+            bad++;
+            printf("bad checksum: ");
+            print_record_line(&record);
+        }
+    }
+    printf("%llu records, %llu with a bad checksum%s\n", records, bad, (status == TAG_ARCHIVE_END) ? "" : ", stopped at a corrupt record");
+    return ((bad == 0) && (status == TAG_ARCHIVE_END)) ? 0 : 1;
+}
+
+static int command_fill(TagArchive *archive, int argc, char **argv) {
+    unsigned long count = (argc > 0) ? strtoul(argv[0], NULL, 10) : 0;
+    if (count == 0) {
+        fprintf(stderr, "fill needs a number of records\n");
+        return 1;
+    }
+    unsigned long uids = (count / 4 > 0) ? count / 4 : 1;
+    uint8_t image[540];                      // NTAG215: 135 pages of 4 bytes
+    uint64_t startNs = timing_now_ns();
+    uint64_t now = timing_wall_ns();
+    srand((unsigned int)now);
+    for (unsigned long i = 0; i < count; i++) {
+        unsigned long n = (unsigned long)rand() % uids;
+        uint8_t uid[7] = { 0x04, (uint8_t)(n >> 24), (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n, 0x5A, 0x80 };
+        memset(image, 0, sizeof(image));
+        memcpy(image, uid, 3);
+        memcpy(image + 4, uid + 3, 4);
+        image[12] = 0xE1; image[13] = 0x10; image[14] = 0x3E;   // capability container
+        for (size_t j = 16; j < 64; j++) {
+            image[j] = (uint8_t)rand();
+        }
+        TagArchiveStatus status = tag_archive_append(archive, uid, sizeof(uid), TAG_TYPE_ULTRALIGHT_NTAG2XX, 4, image, sizeof(image), now + i, NULL);
+        if (status != TAG_ARCHIVE_OK) {
+            fprintf(stderr, "Append #%lu failed: %s\n", i, tag_archive_status_name(status));
+            return 1;
+        }
+    }
+    tag_archive_sync(archive);
+    double seconds = (double)(timing_now_ns() - startNs) / 1e9;
+    fprintf(stderr, "Appended %lu records in %.3f s (%.0f records/s)\n", count, seconds, (seconds > 0) ? (double)count / seconds : 0.0);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *command = argv[2];
+    int writable = (strcmp(command, "reindex") == 0) || (strcmp(command, "fill") == 0);
+
+    TagArchive archive;
+    TagArchiveStatus status = tag_archive_open(&archive, argv[1], writable);
+    if (status != TAG_ARCHIVE_OK) {
+        fprintf(stderr, "%s: %s\n", argv[1], tag_archive_status_name(status));
+        return 1;
+    }
+
+    int result;
+    if (strcmp(command, "lookup") == 0) {
+        result = command_lookup(&archive, argc - 3, argv + 3);
+    } else if (strcmp(command, "diff") == 0) {
+        result = command_diff(&archive, argc - 3, argv + 3);
+    } else if (strcmp(command, "scan") == 0) {
+        result = command_scan(&archive, argc - 3, argv + 3, 0);
+    } else if (strcmp(command, "list") == 0) {
+        result = command_scan(&archive, 0, NULL, 1);
+    } else if (strcmp(command, "stats") == 0) {
+        result = command_stats(&archive);
+    } else if (strcmp(command, "verify") == 0) {
+        result = command_verify(&archive);
+    } else if (strcmp(command, "reindex") == 0) {
+        status = tag_archive_reindex(&archive);
+        printf("%s: %llu records, %llu uids\n", tag_archive_status_name(status),
+               (unsigned long long)tag_archive_record_count(&archive), (unsigned long long)tag_archive_uid_count(&archive));
+        result = (status == TAG_ARCHIVE_OK) ? 0 : 1;
+    } else if (strcmp(command, "fill") == 0) {
+        result = command_fill(&archive, argc - 3, argv + 3);
+    } else {
+        usage(argv[0]);
+        result = 1;
+    }
+    tag_archive_close(&archive);
+    return result;
+}
@@ -0,0 +1,285 @@
+// nfc-sun: verifies NTAG 424 DNA SUN messages (scanned URLs) offline, see sun.h. no reader and no PC/SC needed
+//      usage: nfc-sun [-k META_READ_KEY] [-f FILE_READ_KEY] [-m empty|picc] [-p] selftest | verify [URL ...] | bench [N]
+//      keys are 32 hex digits (default: the all zero factory keys), -m tells where the MAC input starts (see SunMacInput)
+//      verify checks the given URLs, or one URL per line from stdin, and prints "<status> <uid> <counter> <url>"
+//      -p uses the portable AES even if the cpu has AES-NI
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sun.h"
+#include "timing.h"
+
+#define NFC_SUN_BATCH       4096    // URLs read from stdin before they are verified together
+#define NFC_SUN_LINE_MAX    1024
+
+static SunMacInput macInputMode = SUN_MAC_INPUT_EMPTY;
+
+static void print_result(const SunResult *result, const char *url) {
+    printf("%-12s ", sun_status_name(result->status));
+    if ((result->status == SUN_OK) || (result->status == SUN_BAD_MAC)) {
+        for (int i = 0; i < SUN_UID_LENGTH; i++) {
+            printf("%02X", result->uid[i]);
+        }
+        printf(" %8u ", (unsigned int)result->counter);
+    } else {
+        printf("%14s %8s ", "-", "-");
+    }
+    printf("%s\n", url);
+}
+
+// verify_lines parses and verifies count URLs in one batch, returns how many were fine
+static size_t verify_lines(const SunVerifier *verifier, char **urls, size_t count, SunMessage *messages, SunResult *results) {
+    for (size_t i = 0; i < count; i++) {
+        sun_parse_url(urls[i], macInputMode, &messages[i]);
+    }
+    sun_verify_batch(verifier, messages, count, results);
+
+    size_t ok = 0;
+    for (size_t i = 0; i < count; i++) {
+        print_result(&results[i], urls[i]);
+        ok += (results[i].status == SUN_OK);
+    }
+    return ok;
+}
+
+static int run_verify(const SunVerifier *verifier, int argc, char **argv) {
+    static SunMessage messages[NFC_SUN_BATCH];
+    static SunResult results[NFC_SUN_BATCH];
+    size_t total = 0;
+    size_t ok = 0;
+    uint64_t started = timing_now_ns();
+
+    if (argc > 0) {
+        for (int i = 0; i < argc; i += NFC_SUN_BATCH) {
+            size_t count = ((size_t)(argc - i) < NFC_SUN_BATCH) ? (size_t)(argc - i) : NFC_SUN_BATCH;
+            ok += verify_lines(verifier, argv + i, count, messages, results);
+            total += count;
+        }
+    } else {
+        static char lines[NFC_SUN_BATCH][NFC_SUN_LINE_MAX];
+        static char *urls[NFC_SUN_BATCH];
+        size_t count = 0;
+        for (;;) {
+            int more = (fgets(lines[count], NFC_SUN_LINE_MAX, stdin) != NULL);
+            if (more) {
+                lines[count][strcspn(lines[count], "\r\n")] = '\0';
+                if (lines[count][0] == '\0') {
+                    continue;
+                }
+                urls[count] = lines[count];
+                count++;
+            }
+            if ((count == NFC_SUN_BATCH) || (!more && (count > 0))) {
+                ok += verify_lines(verifier, urls, count, messages, results);
+                total += count;
+                count = 0;
+            }
+            if (!more) {
+                break;
+            }
+        }
+    }
+
+    double seconds = (timing_now_ns() - started) / 1e9;
+    fprintf(stderr, "%zu of %zu messages ok (%.0f messages/s incl. parsing and printing, %s)\n",
+            ok, total, (seconds > 0) ? total / seconds : 0.0, aes_hw() ? "AES-NI" : "portable AES");
+    return (ok == total) ? 0 : 2;
+}
+
+// -------------------- Self test -------------------------------
+
+static int check(const char *name, const uint8_t *got, const char *expectedHex, size_t length) {
+    uint8_t expected[64];
+    sun_parse_hex(expectedHex, length, expected);
+    int ok = (memcmp(got, expected, length) == 0);
+    printf("%-44s %s\n", name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// selftest_once runs all vectors with the AES implementation that is currently selected
+static int selftest_once(void) {
+    int ok = 1;
+    uint8_t key[16];
+    uint8_t block[16];
+    uint8_t out[16];
+    uint8_t message[64];
+    Aes128 aes;
+    AesCmac cmac;
+
+    // FIPS-197 appendix C.1
+    sun_parse_hex("000102030405060708090a0b0c0d0e0f", 16, key);
+    sun_parse_hex("00112233445566778899aabbccddeeff", 16, block);
+    aes128_init(&aes, key);
+    aes128_encrypt(&aes, block, out);
+    ok &= check("FIPS-197 C.1 encrypt", out, "69c4e0d86a7b0430d8cdb78070b4c55a", 16);
+    aes128_decrypt(&aes, out, out);
+    ok &= check("FIPS-197 C.1 decrypt", out, "00112233445566778899aabbccddeeff", 16);
+
+    // RFC 4493 section 4
+    sun_parse_hex("2b7e151628aed2a6abf7158809cf4f3c", 16, key);
+    sun_parse_hex("6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", 64, message);
+    aes_cmac_init(&cmac, key);
+    ok &= check("RFC 4493 subkey K1", cmac.k1, "fbeed618357133667c85e08f7236a8de", 16);
+    ok &= check("RFC 4493 subkey K2", cmac.k2, "f7ddac306ae266ccf90bc11ee46d513b", 16);
+    aes_cmac(&cmac, message, 0, out);
+    ok &= check("RFC 4493 CMAC, 0 bytes", out, "bb1d6929e95937287fa37d129b756746", 16);
+    aes_cmac(&cmac, message, 16, out);
+    ok &= check("RFC 4493 CMAC, 16 bytes", out, "070a16b46b4d4144f79bdd9dd04a287c", 16);
+    aes_cmac(&cmac, message, 40, out);
+    ok &= check("RFC 4493 CMAC, 40 bytes", out, "dfa66747de9ae63030ca32611497c827", 16);
+    aes_cmac(&cmac, message, 64, out);
+    ok &= check("RFC 4493 CMAC, 64 bytes", out, "51f0bebf7e3b9d92fc49741779363cfe", 16);
+
+    // the same four messages side by side
+    const AesCmac *const cmacs[4] = { &cmac, &cmac, &cmac, &cmac };
+    const uint8_t *const messages[4] = { message, message, message, message };
+    const size_t lengths[4] = { 0, 16, 40, 64 };
+    uint8_t macs[4][16];
+    aes_cmac_x4(cmacs, messages, lengths, macs);
+    ok &= check("RFC 4493 CMAC x4, 0 bytes", macs[0], "bb1d6929e95937287fa37d129b756746", 16);
+    ok &= check("RFC 4493 CMAC x4, 64 bytes", macs[3], "51f0bebf7e3b9d92fc49741779363cfe", 16);
+
+    // NXP AN12196: PICCData and SDM MAC with the factory keys
+    SunKeys keys;
+    SunVerifier verifier;
+    SunMessage sun;
+    SunResult result;
+    memset(&keys, 0, sizeof(keys));
+    sun_verifier_init(&verifier, &keys);
+    sun_parse_url("https://choose.url.com/ntag424?e=EF963FF7828658A599F3041510671E88&c=94EED9EE65337086", SUN_MAC_INPUT_EMPTY, &sun);
+    sun_verify(&verifier, &sun, &result);
+    ok &= check("AN12196 UID", result.uid, "04DE5F1EACC040", 7);
+    printf("%-44s %s\n", "AN12196 SDMReadCtr", (result.counter == 0x3D) ? "ok" : "FAILED");
+    printf("%-44s %s\n", "AN12196 SDM MAC", (result.status == SUN_OK) ? "ok" : "FAILED");
+    ok &= (result.counter == 0x3D) && (result.status == SUN_OK);
+
+    sun.mac[7] ^= 0x01;
+    sun_verify(&verifier, &sun, &result);
+    printf("%-44s %s\n", "AN12196 with a flipped MAC bit is rejected", (result.status == SUN_BAD_MAC) ? "ok" : "FAILED");
+    ok &= (result.status == SUN_BAD_MAC);
+
+    // batch and single verification have to agree, also for broken messages in between
+    SunMessage batch[11];
+    SunResult batchResults[11];
+    SunResult single;
+    int agree = 1;
+    for (int i = 0; i < 11; i++) {
+        uint8_t uid[7] = { 0x04, 0x10, 0x20, 0x30, 0x40, 0x50, (uint8_t)i };
+        uint8_t random[5] = { (uint8_t)(i * 3), 1, 2, 3, 4 };
+        sun_make_message(&verifier, uid, 1000u + (uint32_t)i, random, &batch[i]);
+    }
+    batch[2].mac[0] ^= 0x80;
+    batch[5].piccData[3] ^= 0x01;
+    batch[9].parsed = SUN_BAD_FORMAT;
+    sun_verify_batch(&verifier, batch, 11, batchResults);
+    for (int i = 0; i < 11; i++) {
+        sun_verify(&verifier, &batch[i], &single);
+        SunStatus expected = (i == 2) ? SUN_BAD_MAC : (i == 9) ? SUN_BAD_FORMAT : (i == 5) ? single.status : SUN_OK;
+        agree &= (batchResults[i].status == single.status) && (single.status == expected) && (batchResults[i].counter == single.counter);
+    }
+    agree &= (batchResults[5].status != SUN_OK);
+    printf("%-44s %s\n", "batch == single verification", agree ? "ok" : "FAILED");
+    return ok && agree;
+}
+
+static int run_selftest(void) {
+    int hw = aes_hw();
+    printf("AES implementation: %s\n", hw ? "AES-NI" : "portable");
+    int ok = selftest_once();
+    if (hw) {
+        aes_force_portable(1);
+        printf("\nAES implementation: portable\n");
+        ok &= selftest_once();
+        aes_force_portable(0);
+    }
+    printf("\n%s\n", ok ? "all tests passed" : "SOME TESTS FAILED");
+    return ok ? 0 : 1;
+}
+
+// -------------------- Benchmark -------------------------------
+
+static int run_bench(const SunVerifier *verifier, size_t count) {
+    SunMessage *messages = calloc(count, sizeof(SunMessage));
+    SunResult *results = calloc(count, sizeof(SunResult));
+    if ((messages == NULL) || (results == NULL)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint8_t uid[7] = { 0x04, (uint8_t)(i >> 24), (uint8_t)(i >> 16), (uint8_t)(i >> 8), (uint8_t)i, 0x5E, 0x80 };
+        uint8_t random[5] = { (uint8_t)(i * 13), (uint8_t)(i * 7), 0x11, 0x22, 0x33 };
+        sun_make_message(verifier, uid, (uint32_t)i & 0xFFFFFF, random, &messages[i]);
+    }
+
+    printf("%zu messages, %s\n", count, aes_hw() ? "AES-NI" : "portable AES");
+    uint64_t t0 = timing_now_ns();
+    size_t ok = 0;
+    for (size_t i = 0; i < count; i++) {
+        ok += (sun_verify(verifier, &messages[i], &results[i]) == SUN_OK);
+    }
+    uint64_t t1 = timing_now_ns();
+    sun_verify_batch(verifier, messages, count, results);
+    uint64_t t2 = timing_now_ns();
+    size_t batchOk = 0;
+    for (size_t i = 0; i < count; i++) {
+        batchOk += (results[i].status == SUN_OK);
+    }
+
+    printf("  single: %10.0f messages/s  %6.1f ns/message  (%zu ok)\n", count * 1e9 / (double)(t1 - t0), (double)(t1 - t0) / count, ok);
+    printf("  batch:  %10.0f messages/s  %6.1f ns/message  (%zu ok)\n", count * 1e9 / (double)(t2 - t1), (double)(t2 - t1) / count, batchOk);
+    free(messages);
+    free(results);
+    return ((ok == count) && (batchOk == count)) ? 0 : 1;
+}
+
+// -------------------------------------------------------
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-k META_READ_KEY] [-f FILE_READ_KEY] [-m empty|picc] [-p] selftest | verify [URL ...] | bench [N]\n", name);
+}
+
+int main(int argc, char **argv) {
+    SunKeys keys;
+    memset(&keys, 0, sizeof(keys));
+
+    int i = 1;
+    for (; (i < argc) && (argv[i][0] == '-'); i++) {
+        if (((strcmp(argv[i], "-k") == 0) || (strcmp(argv[i], "-f") == 0)) && (i + 1 < argc)) {
+            uint8_t *key = (argv[i][1] == 'k') ? keys.metaRead : keys.fileRead;
+            if ((strlen(argv[i + 1]) != 32) || !sun_parse_hex(argv[i + 1], 16, key)) {
+                fprintf(stderr, "%s: keys are 32 hex digits\n", argv[0]);
+                return 1;
+            }
+            i++;
+        } else if ((strcmp(argv[i], "-m") == 0) && (i + 1 < argc)) {
+            macInputMode = (strcmp(argv[++i], "picc") == 0) ? SUN_MAC_INPUT_FROM_PICC_DATA : SUN_MAC_INPUT_EMPTY;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            aes_force_portable(1);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (i >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // the verifier is set up after -p, the expanded keys depend on the AES implementation
+    SunVerifier verifier;
+    sun_verifier_init(&verifier, &keys);
+
+    if (strcmp(argv[i], "selftest") == 0) {
+        return run_selftest();
+    } else if (strcmp(argv[i], "verify") == 0) {
+        return run_verify(&verifier, argc - i - 1, argv + i + 1);
+    } else if (strcmp(argv[i], "bench") == 0) {
+        size_t count = (i + 1 < argc) ? strtoul(argv[i + 1], NULL, 10) : 1000000;
+        return run_bench(&verifier, (count == 0) ? 1 : count);
+    }
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,101 @@
+// nfc-trace: prints a binary apdu trace (NFC_TRACE=file:<path>) in the same "> ..." / "< ..." form that the console trace uses
+//      usage: nfc-trace [-v] <trace file>
+//      -v adds a line with timestamp, reader handle and status in front of every exchange
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apdu-trace-format.h"
+
+static void print_hex(const uint8_t *data, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        printf("%02x ", data[i]);
+    }
+    printf("\n");
+}
+
+static void print_timestamp(uint64_t timestampNs) {
+    time_t seconds = (time_t)(timestampNs / 1000000000ull);
+    struct tm lt;
+    char timestr[20];
+    localtime_r(&seconds, &lt);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &lt);
+    printf("[%s.%06u]", timestr, (unsigned int)((timestampNs % 1000000000ull) / 1000ull));
+}
+
+int main(int argc, char **argv) {
+    int verbose = 0;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [-v] <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    uint8_t header[APDU_TRACE_FILE_HEADER_SIZE];
+    if ((fread(header, 1, sizeof(header), file) != sizeof(header)) || (memcmp(header, APDU_TRACE_MAGIC, 8) != 0)) {
+        fprintf(stderr, "%s is not an apdu trace\n", path);
+        fclose(file);
+        return 1;
+    }
+    if (apdu_trace_get_le(header + 8, 4) != APDU_TRACE_VERSION) {
+        fprintf(stderr, "Unsupported trace version %u\n", (unsigned int)apdu_trace_get_le(header + 8, 4));
+        fclose(file);
+        return 1;
+    }
+
+    uint8_t *data = malloc(65536 + 2); // largest possible response: extended Le (65536 bytes) + SW1 SW2
+    if (data == NULL) {
+        fclose(file);
+        return 1;
+    }
+
+    unsigned long records = 0;
+    uint8_t recordHeader[APDU_TRACE_RECORD_HEADER_SIZE];
+    while (fread(recordHeader, 1, sizeof(recordHeader), file) == sizeof(recordHeader)) {
+        uint64_t timestamp = apdu_trace_get_le(recordHeader, 8);
+        uint32_t reader = (uint32_t)apdu_trace_get_le(recordHeader + 8, 4);
+        uint32_t status = (uint32_t)apdu_trace_get_le(recordHeader + 12, 4);
+        uint32_t length = (uint32_t)apdu_trace_get_le(recordHeader + 16, 4);
+        uint8_t direction = recordHeader[20];
+
+        if ((length > 65536 + 2) || (fread(data, 1, length, file) != length)) {
+            fprintf(stderr, "Truncated or corrupt record #%lu\n", records);
+            break;
+        }
+        records++;
+
+        if (direction == APDU_TRACE_DIRECTION_COMMAND) {
+            if (verbose) {
+                print_timestamp(timestamp);
+                printf(" reader 0x%08x\n", reader);
+            }
+            printf("> ");
+            print_hex(data, length);
+        } else if (status != 0) {
+            printf("%08x\n", status); // same as the console trace for failed transmits
+        } else {
+            printf("< ");
+            print_hex(data, length);
+        }
+    }
+
+    free(data);
+    fclose(file);
+    return 0;
+}
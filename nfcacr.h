@@ -0,0 +1,71 @@
+#ifndef NFCACR_H
+#define NFCACR_H
+
+// Public header of libnfcacr (libnfcacr.a / libnfcacr.so), the reader and tag code behind main, nfcd and nfc-bench.
+// a service links the library and includes only this header: reader setup (context, session, buzzer) is done once and
+// every tag after that costs only its APDUs, instead of a fork/exec of main plus the reader setup per tag.
+//
+//      cc -I<include dir> service.c -lnfcacr -lpcsclite -lpthread
+//
+//      NfcSession session; TagIdentity tag; BYTE buf[2048]; DWORD bufSize = sizeof(buf);
+//      transport_select_from_env();
+//      session_open(&session, hContext, reader);
+//      while (session_wait_tag(&session) == SCARD_S_SUCCESS) {
+//          session_begin(&session);
+//          session_identify(&session, mszReaders, dwReaders, buf, &bufSize, &tag);
+//          ...
+//          session_wait_removal(&session);
+//      }
+//
+// the log lines of the library go to stderr (LOG_* in logging.h, an internal header), log_async_start moves the printing
+// to a background thread. only the headers included below are installed.
+//
+// what NFCACR_VERSION_MAJOR (also the soname of the shared library) covers: the functions, enums and the data structs
+// that callers fill or read (TagIdentity, ApduView, ApduAsyncRequest, ProvisionConfig / ProvisionStats, the tag dumps,
+// TagArchiveRecord, ...), it changes when one of them changes incompatibly.
+// what it does NOT cover: the layout of the long lived engine structs NfcSession, PresenceWatcher, MultiReader /
+// ReaderWorker, Provisioner, ApduAsync, DesfireCard, MifareClassicReader and TagArchive. they are declared here only so
+// callers can put them in static storage, their internal fields change in minor releases. read only the fields their
+// header documents for callers (e.g. session.hCard, worker->tag) and build against the headers of the library version
+// you link: link statically, or require the exact NFCACR_VERSION_MAJOR.NFCACR_VERSION_MINOR of the shared library
+
+#define NFCACR_VERSION_MAJOR 1
+#define NFCACR_VERSION_MINOR 0
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+// readers, sessions and apdus
+#include "reader.h"
+#include "transport.h"
+#include "presence.h"
+#include "session.h"
+#include "multi-reader.h"
+#include "apdu-retry.h"
+#include "apdu-trace.h"
+#include "apdu-async.h"
+#include "metrics.h"
+
+// tags
+#include "tag-type.h"
+#include "tag-memory.h"
+#include "ndef.h"
+#include "em-4423.h"
+#include "em-4423-image.h"
+#include "icode-slix.h"
+#include "mifare-classic.h"
+#include "desfire.h"
+#include "provision.h"
+
+// offline (no reader needed)
+#include "tag-archive.h"
+#include "aes.h"
+#include "sun.h"
+
+// logging (see logging.h)
+int log_async_start(void);
+void log_async_stop(void);
+unsigned long long log_async_dropped(void);
+
+#endif
@@ -0,0 +1,101 @@
+// nfcctl: command line client for nfcd (see nfcd-proto.h), also shows how services talk to the daemon
+//      usage: nfcctl [-s <socket>] [-r <reader>] [-w <wait ms>] [-n <repeat>] ping|uid|identify|fastread|write-uri <uri>
+//      -n repeats the request and prints the average round trip instead of the answer
+#define _POSIX_C_SOURCE 200809L
+
+#include "nfcd-client.h"
+#include "ndef.h"
+#include "timing.h"
+
+static void print_hex(const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        printf("%02X%s", data[i], ((i % 16 == 15) || (i + 1 == length)) ? "\n" : " ");
+    }
+}
+
+static int usage(const char *self) {
+    fprintf(stderr, "usage: %s [-s <socket>] [-r <reader>] [-w <wait ms>] [-n <repeat>] ping|uid|identify|fastread|write-uri <uri>\n", self);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    const char *path = getenv("NFCD_SOCKET") ? getenv("NFCD_SOCKET") : NFCD_DEFAULT_SOCKET;
+    uint8_t reader = 0;
+    uint16_t waitMs = 1000;
+    unsigned long repeat = 0;
+
+    int i = 1;
+    for (; (i + 1 < argc) && (argv[i][0] == '-'); i += 2) {
+        if (strcmp(argv[i], "-s") == 0) {
+            path = argv[i + 1];
+        } else if (strcmp(argv[i], "-r") == 0) {
+            reader = (uint8_t)strtoul(argv[i + 1], NULL, 0);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            waitMs = (uint16_t)strtoul(argv[i + 1], NULL, 0);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            repeat = strtoul(argv[i + 1], NULL, 0);
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (i >= argc) {
+        return usage(argv[0]);
+    }
+
+    const char *command = argv[i];
+    uint8_t op;
+    uint8_t payload[NFCD_WRITE_NDEF_MAX];
+    size_t length = 0;
+    if (strcmp(command, "ping") == 0) {
+        op = NFCD_OP_PING;
+    } else if (strcmp(command, "uid") == 0) {
+        op = NFCD_OP_READ_UID;
+    } else if (strcmp(command, "identify") == 0) {
+        op = NFCD_OP_IDENTIFY;
+    } else if (strcmp(command, "fastread") == 0) {
+        op = NFCD_OP_FASTREAD;
+    } else if ((strcmp(command, "write-uri") == 0) && (i + 1 < argc)) {
+        op = NFCD_OP_WRITE_NDEF;
+        NdefBuilder builder;
+        ndef_builder_init(&builder, payload, sizeof(payload));
+        if (!ndef_builder_add_uri(&builder, argv[i + 1]) || !ndef_builder_finish(&builder, &length)) {
+            fprintf(stderr, "URI does not fit on the tag\n");
+            return 1;
+        }
+    } else {
+        return usage(argv[0]);
+    }
+
+    int fd = nfcd_client_open(path);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to connect to %s, is nfcd running?\n", path);
+        return 1;
+    }
+
+    uint8_t response[NFCD_MAX_PAYLOAD];
+    size_t responseLength = 0;
+    int status = NFCD_STATUS_OK;
+    uint64_t start = timing_now_ns();
+    unsigned long calls = (repeat > 0) ? repeat : 1;
+    for (unsigned long n = 0; (n < calls) && (status == NFCD_STATUS_OK); n++) {
+        status = nfcd_call(fd, op, reader, waitMs, payload, (uint16_t)length, response, sizeof(response), &responseLength);
+    }
+    uint64_t elapsed = timing_now_ns() - start;
+    nfcd_client_close(fd);
+
+    if (status != NFCD_STATUS_OK) {
+        fprintf(stderr, "%s: %s\n", command, nfcd_status_name(status));
+        return 1;
+    }
+    if (repeat > 0) {
+        printf("%lu x %s: %.1f us per request\n", repeat, command, elapsed / 1e3 / repeat);
+    } else if (op == NFCD_OP_PING) {
+        printf("%u reader(s)\n", response[0]);
+    } else if (op == NFCD_OP_IDENTIFY) {
+        printf("type %u, capabilities 0x%04X, UID ", response[0], nfcd_get_u16(&response[1]));
+        print_hex(&response[3], responseLength - 3);
+    } else if (responseLength > 0) {
+        print_hex(response, responseLength);
+    }
+    return 0;
+}
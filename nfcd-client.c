@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nfcd-client.h"
+
+int nfcd_client_open(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void nfcd_client_close(int fd) {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static int nfcd_read_full(int fd, uint8_t *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t n = read(fd, buffer, length);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buffer += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+static int nfcd_write_full(int fd, const uint8_t *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, buffer, length);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buffer += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+int nfcd_call(int fd, uint8_t op, uint8_t reader, uint16_t waitMs, const uint8_t *payload, uint16_t length,
+              uint8_t *response, size_t responseSize, size_t *responseLength) {
+    if (length > NFCD_MAX_PAYLOAD) {
+        return -1;
+    }
+    // header and payload go out in one write, so the daemon usually gets the whole request with one read
+    uint8_t request[NFCD_REQUEST_HEADER_SIZE + NFCD_MAX_PAYLOAD];
+    request[0] = op;
+    request[1] = reader;
+    nfcd_put_u16(&request[2], waitMs);
+    nfcd_put_u16(&request[4], length);
+    if (length > 0) {
+        memcpy(&request[NFCD_REQUEST_HEADER_SIZE], payload, length);
+    }
+    if (nfcd_write_full(fd, request, NFCD_REQUEST_HEADER_SIZE + (size_t)length) != 0) {
+        return -1;
+    }
+
+    uint8_t header[NFCD_RESPONSE_HEADER_SIZE];
+    if (nfcd_read_full(fd, header, sizeof(header)) != 0) {
+        return -1;
+    }
+    size_t answerLength = nfcd_get_u16(&header[2]);
+    if ((header[1] != op) || (answerLength > responseSize)) {
+        return -1;
+    }
+    if (nfcd_read_full(fd, response, answerLength) != 0) {
+        return -1;
+    }
+    if (responseLength != NULL) {
+        *responseLength = answerLength;
+    }
+    return header[0];
+}
+
+const char *nfcd_status_name(int status) {
+    switch (status) {
+        case NFCD_STATUS_OK:            return "ok";
+        case NFCD_STATUS_NO_TAG:        return "no tag";
+        case NFCD_STATUS_BAD_REQUEST:   return "bad request";
+        case NFCD_STATUS_NO_READER:     return "no such reader";
+        case NFCD_STATUS_TAG_ERROR:     return "tag error";
+        case NFCD_STATUS_UNSUPPORTED:   return "not supported by this tag";
+        case NFCD_STATUS_READER_ERROR:  return "reader error";
+        default:                        return "connection failed";
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef NFCD_CLIENT_H
+#define NFCD_CLIENT_H
+
+#include <stddef.h>
+
+#include "nfcd-proto.h"
+
+// Minimal blocking client for nfcd (see nfcd-proto.h). keep the connection open, one request costs one write and one
+// or two reads on the socket:
+//
+//      int fd = nfcd_client_open(NFCD_DEFAULT_SOCKET);
+//      uint8_t uid[16]; size_t uidLen;
+//      if (nfcd_call(fd, NFCD_OP_READ_UID, 0, 500, NULL, 0, uid, sizeof(uid), &uidLen) == NFCD_STATUS_OK) { ... }
+//      nfcd_client_close(fd);
+
+// nfcd_client_open connects to the daemon socket, returns -1 on failure
+int nfcd_client_open(const char *path);
+void nfcd_client_close(int fd);
+
+// nfcd_call sends one request and waits for the answer. returns the NFCD_STATUS_* of the daemon or -1 if the connection
+// failed (or the response did not fit into responseSize, the connection is unusable then)
+int nfcd_call(int fd, uint8_t op, uint8_t reader, uint16_t waitMs, const uint8_t *payload, uint16_t length,
+              uint8_t *response, size_t responseSize, size_t *responseLength);
+
+const char *nfcd_status_name(int status);
+
+#endif
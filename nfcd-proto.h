@@ -0,0 +1,52 @@
+#ifndef NFCD_PROTO_H
+#define NFCD_PROTO_H
+
+#include <stdint.h>
+
+// Wire format of the nfcd unix socket (served by nfcd.c, spoken by nfcd-client.c). all integers are little endian.
+// this header does not depend on PC/SC so clients can be built anywhere
+//
+//      request  (6 bytes):  u8 op | u8 reader index | u16 wait ms | u16 payload length | payload
+//      response (4 bytes):  u8 status | u8 op | u16 payload length | payload
+//
+// a connection can carry any amount of requests, every request is answered before the next one is read.
+// wait ms is how long the daemon waits for a tag if there is none on the reader (0 = answer NFCD_STATUS_NO_TAG right away)
+//
+//      op                    request payload                       response payload
+//      NFCD_OP_PING          -                                     u8 amount of readers
+//      NFCD_OP_READ_UID      -                                     UID (4, 7 or 10 bytes)
+//      NFCD_OP_IDENTIFY      -                                     u8 TagType | u16 TagCapabilities | UID
+//      NFCD_OP_FASTREAD      -                                     all pages of the EM4423 (NFCD_FASTREAD_BYTES)
+//      NFCD_OP_WRITE_NDEF    NDEF TLV area (e.g. ndef_builder_finish) -   (written from page 04 on and read back)
+
+#define NFCD_DEFAULT_SOCKET     "/tmp/nfcd.sock"
+#define NFCD_REQUEST_HEADER_SIZE    6
+#define NFCD_RESPONSE_HEADER_SIZE   4
+#define NFCD_MAX_PAYLOAD        1024
+#define NFCD_FASTREAD_BYTES     (99 * 4)
+#define NFCD_WRITE_NDEF_MAX     240     // user memory of the EM4423 (EM_4423_USER_MEMORY_BYTES)
+
+#define NFCD_OP_PING            0x00
+#define NFCD_OP_READ_UID        0x01
+#define NFCD_OP_IDENTIFY        0x02
+#define NFCD_OP_FASTREAD        0x03
+#define NFCD_OP_WRITE_NDEF      0x04
+
+#define NFCD_STATUS_OK          0x00
+#define NFCD_STATUS_NO_TAG      0x01    // no tag showed up within wait ms
+#define NFCD_STATUS_BAD_REQUEST 0x02    // unknown op, payload too long or invalid
+#define NFCD_STATUS_NO_READER   0x03    // reader index out of range
+#define NFCD_STATUS_TAG_ERROR   0x04    // the tag did not answer as expected (taken away during the operation, write not verified, ...)
+#define NFCD_STATUS_UNSUPPORTED 0x05    // the operation does not exist for this tag type
+#define NFCD_STATUS_READER_ERROR 0x06   // pcscd / reader failure
+
+static inline void nfcd_put_u16(uint8_t *out, uint16_t value) {
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+}
+
+static inline uint16_t nfcd_get_u16(const uint8_t *in) {
+    return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+#endif
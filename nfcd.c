@@ -0,0 +1,384 @@
+// nfcd: resident reader daemon. context, reader list and buzzer setting are set up once, every ACR1581U PICC reader
+// keeps a warm NfcSession, and clients send requests over a unix socket (wire format in nfcd-proto.h)
+//      usage: nfcd [-s <socket path>]   (default NFCD_SOCKET or /tmp/nfcd.sock)
+//      NFC_TRANSPORT=sim runs it against the simulated reader, NFC_TRACE defaults to none here
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "nfcacr.h"
+#include "nfcd-proto.h"
+#include "logging.h"
+
+#define NFCD_MAX_READERS 8
+
+typedef struct NfcdReader {
+    NfcSession session;
+    pthread_mutex_t lock;       // one request at a time per reader, clients of different readers don't wait for each other
+    TagIdentity tag;
+    BOOL identified;            // tag belongs to the tag the session is attached to right now
+    char mszReaders[1024];      // scratch for SCardStatus in identifyTag
+    BYTE pbRecvBuffer[2048];
+} NfcdReader;
+
+static NfcdReader nfcdReaders[NFCD_MAX_READERS];
+static size_t nfcdReaderCount;
+static volatile sig_atomic_t nfcdStop;
+
+// -------------------- Readers -------------------------------
+
+static LONG nfcd_open_readers(void) {
+    const Transport *transport = transport_get();
+    SCARDCONTEXT hContext;
+    char mszReaders[1024];
+    DWORD dwReaders = sizeof(mszReaders);
+
+    LONG lRet = transport->establishContext(SCARD_SCOPE_SYSTEM, &hContext);
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_CRITICAL("Failed to establish context: 0x%x", (unsigned int)lRet);
+        return lRet;
+    }
+    lRet = getAvailableReaders(hContext, mszReaders, &dwReaders);
+    transport->releaseContext(hContext);
+    if (lRet != SCARD_S_SUCCESS) {
+        return lRet;
+    }
+
+    for (char *p = mszReaders; *p; p += strlen(p) + 1) {
+        if (!strstr(p, "PICC") || !containsSubstring(p, "ACR1581")) {
+            continue;
+        }
+        if (nfcdReaderCount == NFCD_MAX_READERS) {
+            LOG_WARN("Ignoring reader %s, at most %d readers are supported", p, NFCD_MAX_READERS);
+            continue;
+        }
+        // every reader gets its own context, the session owns it from here on
+        NfcdReader *r = &nfcdReaders[nfcdReaderCount];
+        lRet = transport->establishContext(SCARD_SCOPE_SYSTEM, &hContext);
+        if (lRet != SCARD_S_SUCCESS) {
+            LOG_CRITICAL("Failed to establish context for %s: 0x%x", p, (unsigned int)lRet);
+            return lRet;
+        }
+        lRet = session_open(&r->session, hContext, p);
+        if (lRet != SCARD_S_SUCCESS) {
+            LOG_CRITICAL("Failed to watch reader %s: 0x%x", p, (unsigned int)lRet);
+            session_close(&r->session);
+            return lRet;
+        }
+        pthread_mutex_init(&r->lock, NULL);
+        LOG_INFO("Reader %zu: %s", nfcdReaderCount, p);
+        nfcdReaderCount++;
+    }
+    if (nfcdReaderCount == 0) {
+        LOG_CRITICAL("No ACR1581 PICC reader found.");
+        return SCARD_E_NO_READERS_AVAILABLE;
+    }
+    return SCARD_S_SUCCESS;
+}
+
+static void nfcd_close_readers(void) {
+    for (size_t i = 0; i < nfcdReaderCount; i++) {
+        pthread_mutex_lock(&nfcdReaders[i].lock);
+        session_close(&nfcdReaders[i].session);
+        pthread_mutex_unlock(&nfcdReaders[i].lock);
+    }
+}
+
+// nfcd_attach makes sure the session is connected to the tag on the reader and that tag is identified. the tag that
+// was identified for the previous request is reused as long as pcscd did not report a change in between
+static BYTE nfcd_attach(NfcdReader *r, uint16_t waitMs) {
+    LONG lRet = session_refresh(&r->session);
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_ERROR("[%s] Failed to query reader state: 0x%x", r->session.reader, (unsigned int)lRet);
+        return NFCD_STATUS_READER_ERROR;
+    }
+    if (!r->session.attached) {
+        r->identified = FALSE;
+        lRet = session_wait_tag_timeout(&r->session, waitMs);
+        if (lRet == SCARD_E_TIMEOUT) {
+            return NFCD_STATUS_NO_TAG;
+        }
+        if (lRet != SCARD_S_SUCCESS) {
+            return NFCD_STATUS_READER_ERROR;
+        }
+    }
+    if (session_begin(&r->session) != SCARD_S_SUCCESS) {
+        r->session.attached = FALSE; // most likely gone already, the next request connects again
+        return NFCD_STATUS_TAG_ERROR;
+    }
+    if (!r->identified) {
+        presence_first_apdu(&r->session.watcher);
+        DWORD size = sizeof(r->pbRecvBuffer);
+        lRet = session_identify(&r->session, r->mszReaders, sizeof(r->mszReaders), r->pbRecvBuffer, &size, &r->tag);
+        if (lRet != SCARD_S_SUCCESS) {
+            session_end(&r->session);
+            r->session.attached = FALSE;
+            return NFCD_STATUS_TAG_ERROR;
+        }
+        r->identified = TRUE;
+    }
+    return NFCD_STATUS_OK;
+}
+
+// -------------------- Requests -------------------------------
+
+// nfcd_execute runs one request, the response payload goes to response (NFCD_MAX_PAYLOAD bytes)
+static BYTE nfcd_execute(BYTE op, BYTE reader, uint16_t waitMs, const BYTE *payload, size_t length, BYTE *response, size_t *responseLength) {
+    *responseLength = 0;
+    if (op == NFCD_OP_PING) {
+        response[0] = (BYTE)nfcdReaderCount;
+        *responseLength = 1;
+        return NFCD_STATUS_OK;
+    }
+    if ((op > NFCD_OP_WRITE_NDEF) || ((op != NFCD_OP_WRITE_NDEF) && (length > 0))) {
+        return NFCD_STATUS_BAD_REQUEST;
+    }
+    if (reader >= nfcdReaderCount) {
+        return NFCD_STATUS_NO_READER;
+    }
+    if ((op == NFCD_OP_WRITE_NDEF) && ((length == 0) || (length > NFCD_WRITE_NDEF_MAX))) {
+        return NFCD_STATUS_BAD_REQUEST;
+    }
+
+    NfcdReader *r = &nfcdReaders[reader];
+    pthread_mutex_lock(&r->lock);
+    BYTE status = nfcd_attach(r, waitMs);
+    if (status != NFCD_STATUS_OK) {
+        pthread_mutex_unlock(&r->lock);
+        return status;
+    }
+
+    // only the EM4423 (ultralight layout) has the page commands behind fastread and write
+    BOOL pages = (r->tag.type == TAG_TYPE_ULTRALIGHT_NTAG2XX) && (r->tag.caps & TAG_CAP_UPDATE_BINARY);
+    DWORD size = sizeof(r->pbRecvBuffer);
+    switch (op) {
+        case NFCD_OP_READ_UID:
+            memcpy(response, r->tag.uid, r->tag.uidLen);
+            *responseLength = r->tag.uidLen;
+            break;
+        case NFCD_OP_IDENTIFY:
+            response[0] = (BYTE)r->tag.type;
+            nfcd_put_u16(&response[1], (uint16_t)r->tag.caps);
+            memcpy(&response[3], r->tag.uid, r->tag.uidLen);
+            *responseLength = 3 + (size_t)r->tag.uidLen;
+            break;
+        case NFCD_OP_FASTREAD: {
+            EM_4423_Pages image;
+            if (!pages) {
+                status = NFCD_STATUS_UNSUPPORTED;
+            } else if (!em_4423_fastread_into(&image, r->session.hCard, r->pbRecvBuffer, &size)) {
+                status = NFCD_STATUS_TAG_ERROR;
+            } else {
+                memcpy(response, image.Pages, NFCD_FASTREAD_BYTES);
+                *responseLength = NFCD_FASTREAD_BYTES;
+            }
+            break;
+        }
+        case NFCD_OP_WRITE_NDEF: {
+            // refuse anything that is not a well formed TLV area with an NDEF message in it
+            NdefReader ndef;
+            NdefTlvView tlv;
+            NdefParseResult parsed;
+            ndef_reader_init(&ndef, payload, length);
+            while (((parsed = ndef_next_tlv(&ndef, &tlv)) == NDEF_PARSE_OK) && (tlv.tag != TLV_HEADER)) {
+            }
+            if (!pages) {
+                status = NFCD_STATUS_UNSUPPORTED;
+            } else if (parsed != NDEF_PARSE_OK) {
+                status = NFCD_STATUS_BAD_REQUEST;
+            } else if (!em_4423_write_range(EM_4423_FIRST_USER_PAGE, payload, length, r->session.hCard, r->pbRecvBuffer, &size)) {
+                status = NFCD_STATUS_TAG_ERROR;
+            }
+            break;
+        }
+    }
+    if (status == NFCD_STATUS_TAG_ERROR) {
+        r->session.attached = FALSE; // let the next request start over with a fresh attach and identify
+    }
+    session_end(&r->session);
+    pthread_mutex_unlock(&r->lock);
+    return status;
+}
+
+static BOOL nfcd_read_full(int fd, BYTE *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t n = read(fd, buffer, length);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        buffer += n;
+        length -= (size_t)n;
+    }
+    return TRUE;
+}
+
+static BOOL nfcd_write_full(int fd, const BYTE *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, buffer, length);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        buffer += n;
+        length -= (size_t)n;
+    }
+    return TRUE;
+}
+
+// nfcd_client serves one connection until the client hangs up (one thread per connection, services keep theirs open)
+static void *nfcd_client(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    BYTE request[NFCD_REQUEST_HEADER_SIZE + NFCD_MAX_PAYLOAD];
+    BYTE response[NFCD_RESPONSE_HEADER_SIZE + NFCD_MAX_PAYLOAD];
+
+    while (nfcd_read_full(fd, request, NFCD_REQUEST_HEADER_SIZE)) {
+        size_t length = nfcd_get_u16(&request[4]);
+        if (length > NFCD_MAX_PAYLOAD) {
+            LOG_WARN("Dropping client that sent a %zu byte payload", length);
+            break; // can't skip it without reading it, the stream is out of sync anyway
+        }
+        if (!nfcd_read_full(fd, &request[NFCD_REQUEST_HEADER_SIZE], length)) {
+            break;
+        }
+
+        size_t responseLength;
+        BYTE status = nfcd_execute(request[0], request[1], nfcd_get_u16(&request[2]), &request[NFCD_REQUEST_HEADER_SIZE], length,
+                                   &response[NFCD_RESPONSE_HEADER_SIZE], &responseLength);
+        response[0] = status;
+        response[1] = request[0];
+        nfcd_put_u16(&response[2], (uint16_t)responseLength);
+        if (!nfcd_write_full(fd, response, NFCD_RESPONSE_HEADER_SIZE + responseLength)) {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+// -------------------- Socket -------------------------------
+
+static void nfcd_on_signal(int signo) {
+    (void)signo;
+    nfcdStop = 1; // accept() returns EINTR (no SA_RESTART), the main loop checks the flag
+}
+
+static int nfcd_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_CRITICAL("Socket path too long: %s", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOG_CRITICAL("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    // a socket left over from a daemon that did not shut down cleanly is removed, but only if nobody answers on it: a
+    // running daemon keeps its socket, and a path that is not a socket at all is never deleted
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            LOG_CRITICAL("%s exists and is not a socket, refusing to replace it", path);
+            close(fd);
+            return -1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        BOOL answered = (probe >= 0) && (connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        if (probe >= 0) {
+            close(probe);
+        }
+        if (answered) {
+            LOG_CRITICAL("Another nfcd is already listening on %s", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(fd, 16) != 0)) {
+        LOG_CRITICAL("Failed to listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    const char *path = getenv("NFCD_SOCKET") ? getenv("NFCD_SOCKET") : NFCD_DEFAULT_SOCKET;
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc)) {
+            path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [-s <socket path>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if ((getenv("NFC_LOG_ASYNC") != NULL) && log_async_start()) {
+        atexit(log_async_stop);
+    }
+    transport_select_from_env();
+    // a console line per apdu would cost more than the apdu itself, NFC_TRACE=console brings it back
+    if (getenv("NFC_TRACE") == NULL) {
+        apdu_trace_set_mode(APDU_TRACE_NONE);
+    } else {
+        apdu_trace_configure_from_env();
+    }
+    apdu_retry_configure_from_env();
+    metrics_configure_from_env();
+
+    if (nfcd_open_readers() != SCARD_S_SUCCESS) {
+        nfcd_close_readers();
+        return 1;
+    }
+    int listenFd = nfcd_listen(path);
+    if (listenFd < 0) {
+        nfcd_close_readers();
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = nfcd_on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); // a client that hangs up mid response must not kill the daemon
+    LOG_INFO("Listening on %s", path);
+
+    while (!nfcdStop) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                LOG_ERROR("accept failed: %s", strerror(errno));
+            }
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, nfcd_client, (void *)(intptr_t)fd) != 0) {
+            LOG_ERROR("Failed to start a thread for a new client");
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    LOG_INFO("Shutting down");
+    close(listenFd);
+    unlink(path);
+    nfcd_close_readers();
+    return 0;
+}
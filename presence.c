@@ -0,0 +1,113 @@
+#include "presence.h"
+#include "transport.h"
+#include "timing.h"
+#include "metrics.h"
+#include "logging.h"
+
+// presence_update stores the new reader state and turns a change of the PRESENT bit into an event, returns FALSE if nothing happened
+static BOOL presence_update(PresenceWatcher *watcher, const SCARD_READERSTATE *state, PresenceEvent *event) {
+    uint64_t now = timing_now_ns();
+    BOOL wasPresent = watcher->cardPresent;
+    // a mute tag (e.g. only half in the field) can't be talked to, so it does not count as present
+    BOOL isPresent = (state->dwEventState & SCARD_STATE_PRESENT) && !(state->dwEventState & SCARD_STATE_MUTE);
+    // the upper 16 bits count events, if they changed while the tag still looks present the tag was swapped in between
+    BOOL swapped = wasPresent && isPresent && ((watcher->currentState >> 16) != (state->dwEventState >> 16));
+
+    watcher->currentState = state->dwEventState & ~(DWORD)SCARD_STATE_CHANGED;
+    watcher->cardPresent = isPresent;
+
+    if ((wasPresent == isPresent) && !swapped) {
+        return FALSE;
+    }
+
+    event->type = isPresent ? PRESENCE_CARD_INSERTED : PRESENCE_CARD_REMOVED;
+    event->atrLength = isPresent ? state->cbAtr : 0;
+    if (event->atrLength > sizeof(event->atr)) {
+        event->atrLength = sizeof(event->atr);
+    }
+    memcpy(event->atr, state->rgbAtr, event->atrLength);
+    event->detectedAtNs = now;
+    metrics_record_presence(watcher->reader, isPresent);
+
+    if (isPresent) {
+        watcher->lastInsert = *event;
+        watcher->firstApduPending = TRUE;
+    }
+    return TRUE;
+}
+
+LONG presence_watcher_init(PresenceWatcher *watcher, SCARDCONTEXT hContext, const char *reader) {
+    memset(watcher, 0, sizeof(*watcher));
+    watcher->hContext = hContext;
+    watcher->reader = reader;
+
+    SCARD_READERSTATE state = {0};
+    state.szReader = reader;
+    state.dwCurrentState = SCARD_STATE_UNAWARE; // makes pcscd answer right away with the current state
+    LONG lRet = transport_get()->getStatusChange(hContext, 0, &state, 1);
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_ERROR("Failed to query state of reader %s: 0x%x", reader, (unsigned int)lRet);
+        return lRet;
+    }
+
+    PresenceEvent event;
+    presence_update(watcher, &state, &event);
+    return SCARD_S_SUCCESS;
+}
+
+LONG presence_wait(PresenceWatcher *watcher, DWORD timeoutMs, PresenceEvent *event) {
+    uint64_t deadline = timing_now_ns() + (uint64_t)timeoutMs * 1000000ull;
+
+    for (;;) {
+        SCARD_READERSTATE state = {0};
+        state.szReader = watcher->reader;
+        state.dwCurrentState = watcher->currentState;
+
+        DWORD timeout = timeoutMs;
+        if (timeoutMs != INFINITE) {
+            uint64_t now = timing_now_ns();
+            timeout = (now >= deadline) ? 0 : (DWORD)((deadline - now) / 1000000ull);
+        }
+
+        LONG lRet = transport_get()->getStatusChange(watcher->hContext, timeout, &state, 1);
+        if (lRet != SCARD_S_SUCCESS) {
+            return lRet;
+        }
+        // pcscd also reports changes that don't matter here (e.g. INUSE when somebody connects), those are just swallowed
+        if (presence_update(watcher, &state, event)) {
+            return SCARD_S_SUCCESS;
+        }
+        if ((timeoutMs != INFINITE) && (timing_now_ns() >= deadline)) {
+            return SCARD_E_TIMEOUT;
+        }
+    }
+}
+
+LONG presence_run(PresenceWatcher *watcher, PresenceCallback callback, void *userData) {
+    for (;;) {
+        PresenceEvent event;
+        LONG lRet = presence_wait(watcher, INFINITE, &event);
+        if (lRet == SCARD_E_TIMEOUT) {
+            continue; // some pcsc-lite versions time out even with INFINITE
+        }
+        if (lRet != SCARD_S_SUCCESS) {
+            return lRet;
+        }
+        if (!callback(&event, userData)) {
+            return SCARD_S_SUCCESS;
+        }
+    }
+}
+
+LONG presence_cancel(PresenceWatcher *watcher) {
+    return transport_get()->cancel(watcher->hContext);
+}
+
+uint64_t presence_first_apdu(PresenceWatcher *watcher) {
+    if (watcher->firstApduPending) {
+        watcher->detectToFirstApduNs = timing_now_ns() - watcher->lastInsert.detectedAtNs;
+        watcher->firstApduPending = FALSE;
+        metrics_record_detection(watcher->reader, watcher->detectToFirstApduNs);
+    }
+    return watcher->detectToFirstApduNs;
+}
@@ -0,0 +1,52 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+// Event driven tag detection on top of SCardGetStatusChange: the calling thread sleeps inside pcscd until a tag is
+// put on (or taken off) the reader, so there is no poll interval that adds dead time to every tag.
+
+typedef enum PresenceEventType {
+    PRESENCE_CARD_INSERTED,
+    PRESENCE_CARD_REMOVED
+} PresenceEventType;
+
+typedef struct PresenceEvent {
+    PresenceEventType type;
+    BYTE atr[MAX_ATR_SIZE];     // ATR of the inserted tag (atrLength is 0 for removals)
+    DWORD atrLength;
+    uint64_t detectedAtNs;      // timing_now_ns() when SCardGetStatusChange reported the change
+} PresenceEvent;
+
+typedef struct PresenceWatcher {
+    SCARDCONTEXT hContext;
+    const char *reader;
+    DWORD currentState;         // last dwEventState reported by pcscd (without SCARD_STATE_CHANGED)
+    BOOL cardPresent;
+    PresenceEvent lastInsert;
+    BOOL firstApduPending;      // TRUE between an insert and the call to presence_first_apdu
+    uint64_t detectToFirstApduNs;
+} PresenceWatcher;
+
+// returns TRUE to keep watching, FALSE to make presence_run return
+typedef BOOL (*PresenceCallback)(const PresenceEvent *event, void *userData);
+
+// presence_watcher_init queries the current state of the reader without blocking (a tag that is already there counts as inserted now)
+LONG presence_watcher_init(PresenceWatcher *watcher, SCARDCONTEXT hContext, const char *reader);
+
+// presence_wait blocks until the next insert or removal, timeoutMs can be INFINITE. returns SCARD_E_TIMEOUT / SCARD_E_CANCELLED accordingly
+LONG presence_wait(PresenceWatcher *watcher, DWORD timeoutMs, PresenceEvent *event);
+
+// presence_run calls callback for every insert and removal until it returns FALSE, presence_cancel is called or an error occurs
+LONG presence_run(PresenceWatcher *watcher, PresenceCallback callback, void *userData);
+
+// presence_cancel wakes up presence_wait / presence_run from another thread
+LONG presence_cancel(PresenceWatcher *watcher);
+
+// presence_first_apdu is called right before the first APDU to a freshly detected tag and returns (and remembers) the
+// detection-to-first-APDU latency in nanoseconds. later calls for the same tag return the stored value
+uint64_t presence_first_apdu(PresenceWatcher *watcher);
+
+#endif
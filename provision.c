@@ -0,0 +1,299 @@
+#define _POSIX_C_SOURCE 200809L // sigaction, pipe
+
+#include <signal.h>
+#include <errno.h>
+
+#include "provision.h"
+#include "reader.h"
+#include "timing.h"
+#include "logging.h"
+
+static const char *const PROVISION_STAGE_NAMES[PROVISION_STAGE_COUNT] = {
+    "detect", "identify", "encode", "write", "verify", "prepare"
+};
+
+static void provision_record_locked(ProvisionStats *stats, ProvisionStage stage, uint64_t ns, BOOL ok) {
+    ProvisionStageStats *s = &stats->stages[stage];
+    s->count++;
+    s->totalNs += ns;
+    s->maxNs = (ns > s->maxNs) ? ns : s->maxNs;
+    if (!ok) {
+        s->failures++;
+    }
+}
+
+static void provision_record(Provisioner *p, ProvisionStage stage, uint64_t startNs, BOOL ok) {
+    uint64_t ns = timing_now_ns() - startNs;
+    pthread_mutex_lock(&p->lock);
+    provision_record_locked(&p->stats, stage, ns, ok);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// -------------------- Payload preparation (helper thread) -------------------------------
+
+static void *provision_prepare_thread(void *arg) {
+    Provisioner *p = (Provisioner *)arg;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        ProvisionSlot *slot = NULL;
+        for (size_t i = 0; i < PROVISION_SLOTS; i++) {
+            if (!p->slots[i].ready) {
+                slot = &p->slots[i];
+                break;
+            }
+        }
+        if (slot == NULL) {
+            pthread_cond_wait(&p->changed, &p->lock);
+            continue;
+        }
+        uint64_t sequence = p->nextSequence++;
+        pthread_mutex_unlock(&p->lock);
+
+        // the slot belongs to this thread until ready is set, so it is filled without holding the lock
+        uint64_t start = timing_now_ns();
+        NdefBuilder builder;
+        ndef_builder_init(&builder, slot->data, sizeof(slot->data));
+        BOOL ok = p->config.payload(sequence, &builder, p->config.userData) && ndef_builder_finish(&builder, &slot->length);
+        uint64_t ns = timing_now_ns() - start;
+
+        pthread_mutex_lock(&p->lock);
+        provision_record_locked(&p->stats, PROVISION_STAGE_PREPARE, ns, ok);
+        if (!ok) {
+            LOG_CRITICAL("Failed to encode the payload for tag %llu, stopping.", (unsigned long long)sequence);
+            p->stop = TRUE;
+        }
+        slot->sequence = sequence;
+        slot->ready = ok;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// provision_take_payload returns the prepared slot with the lowest sequence number (NULL if stopped)
+static ProvisionSlot *provision_take_payload(Provisioner *p) {
+    pthread_mutex_lock(&p->lock);
+    ProvisionSlot *slot = NULL;
+    while (!p->stop) {
+        for (size_t i = 0; i < PROVISION_SLOTS; i++) {
+            if (p->slots[i].ready && ((slot == NULL) || (p->slots[i].sequence < slot->sequence))) {
+                slot = &p->slots[i];
+            }
+        }
+        if (slot != NULL) {
+            break;
+        }
+        pthread_cond_wait(&p->changed, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return slot;
+}
+
+static void provision_release_payload(Provisioner *p, ProvisionSlot *slot) {
+    pthread_mutex_lock(&p->lock);
+    slot->ready = FALSE;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// -------------------- Per tag pipeline -------------------------------
+
+// provision_tag runs identify -> encode -> write -> verify for the connected tag, returns TRUE if the tag got its payload
+static BOOL provision_tag(Provisioner *p) {
+    NfcSession *session = p->session;
+
+    uint64_t start = timing_now_ns();
+    TagIdentity tag;
+    p->pbRecvBufferSize = sizeof(p->pbRecvBuffer);
+    LONG lRet = session_identify(session, p->mszReaders, sizeof(p->mszReaders), p->pbRecvBuffer, &p->pbRecvBufferSize, &tag);
+    // EM4423 reports itself as ultralight, that is the memory layout the em_4423_* functions expect
+    BOOL ok = (lRet == SCARD_S_SUCCESS) && (tag.type == TAG_TYPE_ULTRALIGHT_NTAG2XX) && (tag.caps & TAG_CAP_UPDATE_BINARY);
+    provision_record(p, PROVISION_STAGE_IDENTIFY, start, ok);
+    if (!ok) {
+        LOG_ERROR("Tag can't be provisioned (%s, 0x%x)", tag_type_name(tag.type), (unsigned int)lRet);
+        return FALSE;
+    }
+
+    start = timing_now_ns();
+    ProvisionSlot *slot = provision_take_payload(p);
+    provision_record(p, PROVISION_STAGE_ENCODE, start, slot != NULL);
+    if (slot == NULL) {
+        return FALSE;
+    }
+
+    start = timing_now_ns();
+    size_t pages = slot->length / 4;
+    ok = em_4423_write_pages(EM_4423_FIRST_USER_PAGE, slot->data, pages, session->hCard, p->pbRecvBuffer, &p->pbRecvBufferSize);
+    provision_record(p, PROVISION_STAGE_WRITE, start, ok);
+    if (ok) {
+        start = timing_now_ns();
+        ok = em_4423_verify_range(EM_4423_FIRST_USER_PAGE, slot->data, pages, session->hCard, p->pbRecvBuffer, &p->pbRecvBufferSize);
+        provision_record(p, PROVISION_STAGE_VERIFY, start, ok);
+    }
+
+    if (ok) {
+        LOG_INFO("Provisioned tag %llu (%zu bytes)", (unsigned long long)slot->sequence, slot->length);
+        provision_release_payload(p, slot); // a failed tag keeps the payload, the next tag gets the same sequence number
+    }
+    return ok;
+}
+
+static void provision_stop_on_sigint_end(void);
+
+LONG provision_run(Provisioner *p, NfcSession *session, const ProvisionConfig *config) {
+    memset(p, 0, sizeof(*p));
+    p->session = session;
+    p->config = *config;
+    p->stats.startedNs = timing_now_ns();
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+    if (pthread_create(&p->prepareThread, NULL, provision_prepare_thread, p) != 0) {
+        LOG_CRITICAL("Failed to start the payload thread");
+        return SCARD_F_INTERNAL_ERROR;
+    }
+
+    LONG lRet = SCARD_S_SUCCESS;
+    while (!p->stop && ((p->config.maxTags == 0) || (p->stats.tagsOk < p->config.maxTags))) {
+        lRet = session_wait_tag(session);
+        if (lRet != SCARD_S_SUCCESS) {
+            break;
+        }
+        // the insert event is the start of the tag, everything before that is waiting for the operator
+        uint64_t detected = session->watcher.lastInsert.detectedAtNs;
+        if (session->watcher.firstApduPending && (detected >= p->stats.startedNs)) {
+            provision_record(p, PROVISION_STAGE_DETECT, detected, TRUE);
+        }
+        presence_first_apdu(&session->watcher);
+
+        BOOL ok = (session_begin(session) == SCARD_S_SUCCESS) && provision_tag(p);
+        session_end(session);
+
+        pthread_mutex_lock(&p->lock);
+        if (ok) {
+            p->stats.tagsOk++;
+        } else {
+            p->stats.tagsFailed++;
+        }
+        uint64_t handled = p->stats.tagsOk + p->stats.tagsFailed;
+        BOOL done = (p->config.maxTags > 0) && (p->stats.tagsOk >= p->config.maxTags);
+        ProvisionStats snapshot = p->stats; // the helper thread keeps adding PREPARE while the report is printed
+        pthread_mutex_unlock(&p->lock);
+        if ((p->config.reportEvery > 0) && (handled % p->config.reportEvery == 0) && !done) { // the last report comes below
+            provision_stats_print(&snapshot, stdout);
+        }
+        if (!ok) {
+            LOG_WARN("Tag failed, take it away and try again");
+        }
+
+        lRet = session_wait_removal(session);
+        if (lRet != SCARD_S_SUCCESS) {
+            break;
+        }
+    }
+    if (lRet == SCARD_E_CANCELLED) {
+        lRet = SCARD_S_SUCCESS; // provision_stop
+    }
+
+    provision_stop(p);
+    pthread_join(p->prepareThread, NULL);
+    provision_stop_on_sigint_end(); // the stopper thread must not touch p after the lock is gone
+    provision_stats_print(&p->stats, stdout);
+    pthread_cond_destroy(&p->changed);
+    pthread_mutex_destroy(&p->lock);
+    return lRet;
+}
+
+void provision_stop(Provisioner *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = TRUE;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+    session_cancel(p->session);
+}
+
+// -------------------- Ctrl+C -------------------------------
+
+// the signal handler only writes one byte into a pipe (async signal safe), a normal thread reads it and stops the
+// provisioner, because SCardCancel and mutexes must not be used inside a signal handler
+static int provisionSignalPipe[2] = { -1, -1 };
+static pthread_t provisionStopperThread;
+static BOOL provisionStopperRunning = FALSE;
+
+static void provision_on_signal(int signo) {
+    (void)signo;
+    int saved = errno;
+    if (write(provisionSignalPipe[1], "x", 1) < 0) {
+        // nothing to do, the pipe only has to wake up the stopper thread
+    }
+    errno = saved;
+}
+
+static void *provision_stopper_thread(void *arg) {
+    char c;
+    ssize_t n;
+    do {
+        n = read(provisionSignalPipe[0], &c, 1);
+    } while ((n < 0) && (errno == EINTR));
+    if (n <= 0) {
+        return NULL; // write end closed by provision_stop_on_sigint_end, the run is over
+    }
+    LOG_WARN("Stopping after the current tag (Ctrl+C)");
+    provision_stop((Provisioner *)arg);
+    return NULL;
+}
+
+BOOL provision_stop_on_sigint(Provisioner *p) {
+    if (provisionStopperRunning || (pipe(provisionSignalPipe) != 0)) {
+        return FALSE;
+    }
+    if (pthread_create(&provisionStopperThread, NULL, provision_stopper_thread, p) != 0) {
+        close(provisionSignalPipe[0]);
+        close(provisionSignalPipe[1]);
+        provisionSignalPipe[0] = provisionSignalPipe[1] = -1;
+        return FALSE;
+    }
+    provisionStopperRunning = TRUE;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = provision_on_signal;
+    sigemptyset(&action.sa_mask);
+    return (sigaction(SIGINT, &action, NULL) == 0) && (sigaction(SIGTERM, &action, NULL) == 0);
+}
+
+// provision_stop_on_sigint_end puts the default signal handling back and ends the stopper thread by closing the write
+// end of the pipe (its read returns 0), called by provision_run before it tears the provisioner down
+static void provision_stop_on_sigint_end(void) {
+    if (!provisionStopperRunning) {
+        return;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    close(provisionSignalPipe[1]);
+    pthread_join(provisionStopperThread, NULL);
+    close(provisionSignalPipe[0]);
+    provisionSignalPipe[0] = provisionSignalPipe[1] = -1;
+    provisionStopperRunning = FALSE;
+}
+
+// -------------------- Report -------------------------------
+
+void provision_stats_print(const ProvisionStats *stats, FILE *out) {
+    double seconds = (timing_now_ns() - stats->startedNs) / 1e9;
+    uint64_t handled = stats->tagsOk + stats->tagsFailed;
+    fprintf(out, "\nprovisioned %llu tags, %llu failed (%.1f %%) in %.1f s: %.1f tags/min\n",
+            (unsigned long long)stats->tagsOk, (unsigned long long)stats->tagsFailed,
+            handled ? 100.0 * stats->tagsFailed / handled : 0.0, seconds, seconds > 0 ? stats->tagsOk * 60.0 / seconds : 0.0);
+    fprintf(out, "    %-10s %8s %8s %10s %10s\n", "stage", "count", "failed", "avg ms", "max ms");
+    for (int i = 0; i < PROVISION_STAGE_COUNT; i++) {
+        const ProvisionStageStats *s = &stats->stages[i];
+        fprintf(out, "    %-10s %8llu %8llu %10.3f %10.3f\n", PROVISION_STAGE_NAMES[i], (unsigned long long)s->count,
+                (unsigned long long)s->failures, s->count ? s->totalNs / 1e6 / s->count : 0.0, s->maxNs / 1e6);
+    }
+    fflush(out);
+}
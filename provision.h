@@ -0,0 +1,96 @@
+#ifndef PROVISION_H
+#define PROVISION_H
+
+#include <pthread.h>
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#ifndef SESSION_H
+#include "session.h"
+#endif
+
+#ifndef NDEF_H
+#include "ndef.h"
+#endif
+
+#ifndef EM_4423_H
+#include "em-4423.h"
+#endif
+
+// Provisioning mode: encodes one NDEF message per tag for as long as tags are put on the reader.
+// per tag: detect -> identify -> (take prepared payload) -> bulk write -> verify -> wait for removal, all APDUs of a tag
+// inside one transaction of a warm NfcSession. a helper thread builds the payload for the next tag while the RF part
+// of the current one runs, so only a finished buffer has to be picked up. a tag that fails keeps its payload, the
+// sequence number is not used up.
+
+typedef enum ProvisionStage {
+    PROVISION_STAGE_DETECT,     // tag reported by pcscd -> handle connected
+    PROVISION_STAGE_IDENTIFY,   // UID + ATR (+ ATS), see identifyTag
+    PROVISION_STAGE_ENCODE,     // waiting for the prepared payload (should be ~0, the work happens in PREPARE)
+    PROVISION_STAGE_WRITE,      // bulk UPDATE BINARY
+    PROVISION_STAGE_VERIFY,     // one READ BINARY over the written range
+    PROVISION_STAGE_PREPARE,    // building the next payload on the helper thread (not on the critical path)
+    PROVISION_STAGE_COUNT
+} ProvisionStage;
+
+typedef struct ProvisionStageStats {
+    uint64_t count;
+    uint64_t failures;
+    uint64_t totalNs;
+    uint64_t maxNs;
+} ProvisionStageStats;
+
+typedef struct ProvisionStats {
+    ProvisionStageStats stages[PROVISION_STAGE_COUNT];
+    uint64_t tagsOk;
+    uint64_t tagsFailed;
+    uint64_t startedNs;
+} ProvisionStats;
+
+// ProvisionPayloadFn encodes the message for the tag with the given sequence number (0, 1, 2, ... counting written tags)
+typedef BOOL (*ProvisionPayloadFn)(uint64_t sequence, NdefBuilder *builder, void *userData);
+
+typedef struct ProvisionConfig {
+    ProvisionPayloadFn payload;
+    void *userData;
+    uint64_t maxTags;           // stop after this many written tags, 0 = until provision_stop
+    uint64_t reportEvery;       // print the stats every n tags, 0 = only at the end
+} ProvisionConfig;
+
+// one prepared message, the helper thread keeps PROVISION_SLOTS of them ready
+typedef struct ProvisionSlot {
+    BYTE data[EM_4423_USER_MEMORY_BYTES];
+    size_t length;
+    uint64_t sequence;
+    BOOL ready;
+} ProvisionSlot;
+
+#define PROVISION_SLOTS 2
+
+typedef struct Provisioner {
+    NfcSession *session;
+    ProvisionConfig config;
+    ProvisionStats stats;       // guarded by lock (the helper thread adds PREPARE)
+    ProvisionSlot slots[PROVISION_SLOTS];
+    uint64_t nextSequence;      // next sequence the helper thread builds
+    pthread_t prepareThread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    volatile BOOL stop;
+    BYTE pbRecvBuffer[2048];
+    DWORD pbRecvBufferSize;
+    char mszReaders[1024];
+} Provisioner;
+
+// provision_run loops until maxTags tags were written or provision_stop was called, then prints the final stats
+LONG provision_run(Provisioner *provisioner, NfcSession *session, const ProvisionConfig *config);
+
+// provision_stop can be called from any thread, provision_stop_on_sigint makes Ctrl+C call it
+void provision_stop(Provisioner *provisioner);
+BOOL provision_stop_on_sigint(Provisioner *provisioner);
+
+void provision_stats_print(const ProvisionStats *stats, FILE *out);
+
+#endif
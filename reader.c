@@ -0,0 +1,474 @@
+// install drivers from https://www.acs.com.hk/en/products/583/acr1581u-dualboost-iii-usb-dual-interface-reader/
+#include "reader.h"
+#include "transport.h"
+#include "presence.h"
+#include "apdu-trace.h"
+#include "apdu-retry.h"
+#include "tag-memory.h"
+#include "timing.h"
+#include "metrics.h"
+
+#include "logging.h"
+
+
+// -------------------- Functions that interact with reader -------------------------------
+
+LONG getAvailableReaders(SCARDCONTEXT hContext, char *mszReaders, DWORD *dwReaders) {
+    LONG lRet = transport_get()->listReaders(hContext, mszReaders, dwReaders);
+    if (lRet != SCARD_S_SUCCESS) {
+        if (lRet == 0x8010002E) {
+            LOG_CRITICAL("Failed to list readers: Are you sure your smart card reader is connected and turned on?\n");
+        } else {
+            LOG_CRITICAL("Failed to list readers: 0x%lX\n", lRet);
+        }
+    }
+
+    return lRet;
+}
+
+LONG connectToReader(SCARDCONTEXT hContext, const char *reader, SCARDHANDLE *hCard, DWORD *dwActiveProtocol, BOOL directConnect) {
+    LONG lRet;
+    uint64_t start = timing_now_ns();
+
+    if (directConnect) {
+        // direct communication with reader (no present tag required)
+        lRet = transport_get()->connect(hContext, reader, SCARD_SHARE_DIRECT, SCARD_PROTOCOL_T1, hCard, dwActiveProtocol);
+    } else {
+        // T1 = block transmission (works), T0 = character transmission (did not work when testing), Tx = T0 | T1 (works)
+        // https://learn.microsoft.com/en-us/openspecs/windows_protocols/ms-rdpesc/41673567-2710-4e86-be87-7b6f46fe10af
+        lRet = transport_get()->connect(hContext, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, hCard, dwActiveProtocol);
+    }
+
+    metrics_record_connect(reader, directConnect ? METRICS_CONNECT_DIRECT : METRICS_CONNECT, lRet, timing_now_ns() - start);
+    if (lRet == SCARD_S_SUCCESS) {
+        metrics_bind_handle(*hCard, reader); // apdus / control calls on this handle are labeled with the reader
+        tag_memory_bind_handle(*hCard, reader); // and writes through it use the write size learned on that reader
+    }
+    return lRet;
+}
+
+// executeApdu sends the command and returns a view of the reply (data + parsed status word) that points into pbRecvBuffer
+ApduView executeApduOnce(SCARDHANDLE hCard, BYTE *pbSendBuffer, DWORD dwSendLength, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    // the buffer is not cleared anymore: the view only covers the bytes of this reply, so a 90 00 of some previous command can't be confused with it
+
+    // this took me long to figure out (part 1): i want to always remember the size of the array that holds the response. but SCardTransmit modifies the value of pbRecvBufferSize to the amount of bytes of the response. thats why we can lose the information how big our buffer is. this can lead to nasty bugs (e.g. you just once forget to update pbRecvBufferSize to the amount of bytes of the expected response and then u get UB due to buffer overflow. so safer is to just always reset to actual buffer size)
+    DWORD pbRecvBufferSizeBackup = *pbRecvBufferSize;
+
+    LONG lRet = transport_get()->transmit(hCard, pbSendBuffer, dwSendLength, pbRecvBuffer, pbRecvBufferSize);
+    DWORD received = (lRet == SCARD_S_SUCCESS) ? *pbRecvBufferSize : 0;
+    // hand command and reply to the trace sink (console by default, see apdu-trace.h)
+    apdu_trace_exchange(hCard, pbSendBuffer, dwSendLength, lRet, pbRecvBuffer, received);
+
+    LOG_DEBUG("Response status: %0lx (0 means success)", lRet);
+    LOG_DEBUG("Response size: %lu bytes", received); // linux wants %lu, macos wants %u. just use either and ignore warning lul
+
+    ApduView response = {
+        .status = lRet,
+        .outcome = APDU_TRANSMIT_FAILED,
+        .data = pbRecvBuffer,
+        .data_len = 0,
+        .sw1 = 0x00,
+        .sw2 = 0x00,
+        .attempts = 1
+    };
+    if (lRet == SCARD_S_SUCCESS) {
+        if (received < 2) {
+            response.outcome = APDU_MALFORMED;
+        } else {
+            response.data_len = received - 2;
+            response.sw1 = pbRecvBuffer[received - 2];
+            response.sw2 = pbRecvBuffer[received - 1];
+            response.outcome = ((response.sw1 == 0x90) && (response.sw2 == 0x00)) ? APDU_OK : APDU_STATUS_ERROR;
+        }
+    }
+
+    // this took me long to figure out (part 2): i want to always retain the constant buffer size in this variable
+    *pbRecvBufferSize = pbRecvBufferSizeBackup;
+
+    return response;
+}
+
+// executeApdu is executeApduOnce plus the retry policy of apdu-retry.h: transient rf errors (tag removed / mute / 63 00)
+// and protocol errors are repeated after a jittered backoff (with a reconnect if the handle needs one), permanent ones
+// are returned right away. response.attempts tells how many exchanges it took
+ApduView executeApdu(SCARDHANDLE hCard, BYTE *pbSendBuffer, DWORD dwSendLength, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    ApduRetryPolicy policy = apdu_retry_get_policy();
+    DWORD failedByClass[APDU_ERROR_PERMANENT + 1] = {0};
+    DWORD attempt = 0;
+    ApduView response;
+    ApduErrorClass errorClass;
+    uint64_t start = timing_now_ns();
+
+    for (;;) {
+        attempt++;
+        response = executeApduOnce(hCard, pbSendBuffer, dwSendLength, pbRecvBuffer, pbRecvBufferSize);
+        errorClass = apdu_classify(&response);
+        if (errorClass == APDU_ERROR_NONE) {
+            break;
+        }
+        failedByClass[errorClass]++;
+        DWORD limit = (errorClass == APDU_ERROR_PROTOCOL) ? policy.maxProtocolAttempts : policy.maxAttempts;
+        if ((errorClass == APDU_ERROR_PERMANENT) || (attempt >= limit)) {
+            break;
+        }
+
+        DWORD delay = apdu_retry_backoff_us(&policy, attempt);
+        LOG_DEBUG("Attempt %lu failed (%s, 0x%lx, SW %02x %02x), retrying in %lu us", (unsigned long)attempt, apdu_error_class_name(errorClass),
+                  (unsigned long)response.status, response.sw1, response.sw2, (unsigned long)delay);
+        timing_sleep_us(delay);
+        ApduErrorClass recovered = (errorClass == APDU_ERROR_TRANSIENT_RF) ? apdu_retry_recover(hCard, &response) : APDU_ERROR_NONE;
+        if (recovered == APDU_ERROR_PERMANENT) {
+            // swapped tag: the apdu is not repeated, and nobody must mistake this for a tag that is just out of reach
+            errorClass = APDU_ERROR_PERMANENT;
+            response.outcome = APDU_TRANSMIT_FAILED;
+            response.status = SCARD_W_REMOVED_CARD;
+            break;
+        }
+        if (recovered != APDU_ERROR_NONE) {
+            break;
+        }
+    }
+
+    response.attempts = attempt;
+    apdu_retry_count(attempt, errorClass, failedByClass);
+    metrics_record_apdu(hCard, pbSendBuffer, dwSendLength, response.outcome, timing_now_ns() - start);
+    if ((attempt > 1) && (errorClass == APDU_ERROR_NONE)) {
+        LOG_INFO("Apdu recovered after %lu attempts", (unsigned long)attempt);
+    }
+    return response;
+}
+
+// apduResult turns a view into the usual LONG result: SCARD_S_SUCCESS, the error of SCardTransmit or ACR_90_00_FAILURE if the status word was not 90 00
+LONG apduResult(ApduView response) {
+    switch (response.outcome) {
+        case APDU_OK:
+            return SCARD_S_SUCCESS;
+        case APDU_TRANSMIT_FAILED:
+            return response.status;
+        default:
+            return ACR_90_00_FAILURE;
+    }
+}
+
+LONG disableBuzzer(SCARDCONTEXT hContext, const char *reader, SCARDHANDLE *hCard, DWORD *dwActiveProtocol, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    LONG lRet = connectToReader(hContext, reader, hCard, dwActiveProtocol, TRUE);
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_ERROR("Failed to connect: 0x%x\n", (unsigned int)lRet);
+        return 1;
+    }
+
+    // APDU command to disable the buzzer sound of ACR1581U
+    BYTE pbSendBuffer[6] = { 0xE0, 0x00, 0x00, 0x21, 0x01, 0x01 };
+
+    uint64_t start = timing_now_ns();
+    LONG result = transport_get()->control(*hCard, SCARD_CTL_CODE(3500), pbSendBuffer, sizeof(pbSendBuffer), pbRecvBuffer, *pbRecvBufferSize, pbRecvBufferSize);
+    metrics_record_control(*hCard, result, timing_now_ns() - start);
+
+    return result;
+}
+
+void disconnectReader(SCARDHANDLE hCard, SCARDCONTEXT hContext) {
+    apdu_retry_bind_uid(hCard, NULL, 0); // pcscd may hand out the same value for the next handle
+    transport_get()->disconnect(hCard, SCARD_LEAVE_CARD);
+    transport_get()->releaseContext(hContext);
+}
+
+// -------------------- General Functions that interact with various tags -------------------------------
+
+// getUID reads the UID of the tag, pass uid / uidLen (TAG_UID_MAX bytes) to get a copy of it or NULL if printing is enough
+LONG getUID(SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, BOOL printResult, BYTE *uid, BYTE *uidLen) {
+    LOG_INFO("Will now try to determine UID");
+    // Define the GET UID APDU command (PC/SC standard for many cards)
+    BYTE pbSendBuffer[5] = { 0xFF, 0xCA, 0x00, 0x00, 0x00 }; // if u change last byte to e.g. 0x04 then u only get first 4 bytes of UID
+    ApduView response = executeApdu(hCard, pbSendBuffer, sizeof(pbSendBuffer), pbRecvBuffer, pbRecvBufferSize);
+    if (response.outcome != APDU_OK) {
+        return apduResult(response);
+    }
+
+    // UIDs are 4 (single), 7 (double) or 10 (oh baby a triple oh yeah) bytes long, ISO 15693 tags (ICODE SLIX) have 8
+    if ((response.data_len != 4) && (response.data_len != 7) && (response.data_len != 8) && (response.data_len != 10)) {
+        return ACR_90_00_FAILURE;
+    }
+    if ((uid != NULL) && (uidLen != NULL)) {
+        memcpy(uid, response.data, response.data_len);
+        *uidLen = (BYTE)response.data_len;
+    }
+    // retries that have to re-activate the tag check that it is still this one
+    apdu_retry_bind_uid(hCard, response.data, (BYTE)response.data_len);
+
+    if (printResult) {
+        // success: now print UID
+        printf("Detected UID: ");
+        for (DWORD i = 0; i < response.data_len; i++) {
+            printf("%02X ", response.data[i]);
+        }
+        printf("\n\n");
+        return SCARD_S_SUCCESS;
+    }
+
+    printf("\n");
+    return SCARD_S_SUCCESS;
+}
+
+// getATS_14443A sends a RATS (Request for Answer To Select) to the tag (afaik only stuff like desfire, ntag 424 dna, smartMX and some java cards even support this)
+// and refines *tagType with the ATS table of tag-type.c
+ApduView getATS_14443A(SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, TagType *tagType) {
+    LOG_INFO("Will now try to determine ATS");
+    BYTE pbSendBuffer[] = { 0xFF, 0xCA, 0x01, 0x00, 0x00 };
+    ApduView response = executeApdu(hCard, pbSendBuffer, sizeof(pbSendBuffer), pbRecvBuffer, pbRecvBufferSize);
+
+    if ((response.outcome == APDU_STATUS_ERROR) && (response.sw1 == 0x6A) && (response.sw2 == 0x81)) {
+        LOG_WARN("Accessing ATS of this tag type is currently not supported by this program\n");
+    }
+
+    if (response.outcome == APDU_OK) {
+        TagType refined = tag_classify_ats(*tagType, response.data, response.data_len);
+        if (refined != *tagType) {
+            LOG_INFO("I now know for sure that your tag is: %s", tag_type_name(refined));
+            *tagType = refined;
+        }
+    }
+
+    printf("\n");
+    return response;
+}
+
+// getStatus reads the ATR with SCardStatus and classifies it with the ATR table of tag-type.c
+LONG getStatus(SCARDHANDLE *hCard, char *mszReaders, DWORD dwState, DWORD dwReaders, DWORD *dwActiveProtocol, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, BOOL printResult, TagType *tagType) {
+    LOG_INFO("Will now try to determine which model your tag is");
+    LONG lRet = transport_get()->status(*hCard, mszReaders, &dwReaders, &dwState, dwActiveProtocol, pbRecvBuffer, pbRecvBufferSize);
+    if (lRet != SCARD_S_SUCCESS) {
+        printf("\n");
+        return lRet;
+    }
+
+    // SCardStatus puts only the ATR into the buffer (no status word)
+    *tagType = tag_classify_atr(pbRecvBuffer, *pbRecvBufferSize);
+    if (printResult) {
+        printf("Detected tag type: ");
+        for (DWORD i = 0; i < *pbRecvBufferSize; i++) {
+            printf("%02X ", pbRecvBuffer[i]);
+        }
+        printf("\n");
+
+        if (*tagType == TAG_TYPE_UNKNOWN) {
+            LOG_WARN("Identified tag as: %s\n", tag_type_name(*tagType));
+        } else if (*tagType == TAG_TYPE_UNIDENTIFIED) {
+            LOG_ERROR("Failed to identify the tag\n");
+        } else {
+            printf("Identified tag as: %s\n", tag_type_name(*tagType));
+        }
+    }
+
+    printf("\n");
+    return lRet;
+}
+
+// -------------------- Tag detection and identification (the steps of main()) -------------------------------
+
+// findPiccReader prints all readers of the multi-string mszReaders and returns the last one with 'PICC' in its name (NULL if there is none)
+char *findPiccReader(char *mszReaders) {
+    char *reader = NULL;
+    char *p = mszReaders;
+
+    while (*p) {
+        printf("found reader: %s\n", p);
+        // we want to connect to the CONTACTLESS interface (01 00 or 00 00?), so pick the one with 'PICC' in it
+        // if you want to connect to the CONTACT interface (00 00 or 01 00?), then replace 'PICC' with 'ICC'
+        // if you want to connect to the SAM interface (02 00), then replace 'PICC' with 'SAM'
+        if (strstr(p, "PICC")) {
+            reader = p;
+        }
+        p += strlen(p) + 1;   // jump to next entry
+    }
+
+    return reader;
+}
+
+#define WAIT_TAG_RETRY_MS 50     // connect retry interval for a tag that is there but could not be connected
+
+// waitForTag sleeps in SCardGetStatusChange until a tag lies on the reader and then connects to it in shared mode.
+// pass a watcher to get the insert event (ATR, detection time) back, e.g. for presence_first_apdu, otherwise NULL
+LONG waitForTag(SCARDCONTEXT hContext, const char *reader, SCARDHANDLE *hCard, DWORD *dwActiveProtocol, PresenceWatcher *watcher) {
+    PresenceWatcher localWatcher;
+    if (watcher == NULL) {
+        watcher = &localWatcher;
+    }
+    LONG lRet = presence_watcher_init(watcher, hContext, reader);
+    if (lRet != SCARD_S_SUCCESS) {
+        return lRet;
+    }
+
+    BOOL didPrintWarningAlready = FALSE;
+    BOOL connectNow = watcher->cardPresent;
+    for (;;) {
+        if (!connectNow) {
+            if (!watcher->cardPresent && !didPrintWarningAlready) {
+                LOG_WARN("Did not detect a connected tag / NFC chip, please hold one near the reader.");
+                didPrintWarningAlready = TRUE;
+            }
+            // no polling while the reader is empty: this only returns when pcscd reports that the state of the reader
+            // changed. a tag that lies there but could not be connected causes no further event, it is tried again
+            // every WAIT_TAG_RETRY_MS instead
+            PresenceEvent event;
+            lRet = presence_wait(watcher, watcher->cardPresent ? WAIT_TAG_RETRY_MS : INFINITE, &event);
+            if ((lRet == SCARD_E_TIMEOUT) && !watcher->cardPresent) {
+                continue; // some pcsc-lite versions time out even with INFINITE
+            }
+            if ((lRet != SCARD_S_SUCCESS) && (lRet != SCARD_E_TIMEOUT)) {
+                LOG_ERROR("Failed to wait for a tag, google this pcsc-lite error code: 0x%x\n", (unsigned int)lRet);
+                return lRet;
+            }
+            if ((lRet == SCARD_S_SUCCESS) && (event.type != PRESENCE_CARD_INSERTED)) {
+                continue;
+            }
+        }
+
+        lRet = connectToReader(hContext, reader, hCard, dwActiveProtocol, FALSE);
+        if (lRet == SCARD_S_SUCCESS) {
+            return lRet;
+        }
+        if ((lRet != SCARD_E_NO_SMARTCARD) && (lRet != SCARD_W_REMOVED_CARD) && (lRet != SCARD_E_TIMEOUT) && (lRet != SCARD_W_UNRESPONSIVE_CARD)
+            && (lRet != SCARD_W_UNPOWERED_CARD) && (lRet != SCARD_E_SHARING_VIOLATION)) {
+            LOG_ERROR("Google this pcsc-lite error code: 0x%x\n", (unsigned int)lRet);
+            return lRet;
+        }
+        // the tag left the field again before we could connect (or does not answer yet)
+        connectNow = FALSE;
+    }
+}
+
+// identifyTag prints the UID of the connected tag and stores UID, type and capabilities in tag. the ATS is only requested
+// when the ATR is ambiguous, and not at all for a UID that was identified before (see tag_cache_lookup)
+LONG identifyTag(SCARDHANDLE hCard, char *mszReaders, DWORD dwReaders, DWORD *dwActiveProtocol, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, TagIdentity *tag) {
+    return identifyTagKnownUid(hCard, NULL, 0, mszReaders, dwReaders, dwActiveProtocol, pbRecvBuffer, pbRecvBufferSize, tag);
+}
+
+LONG identifyTagKnownUid(SCARDHANDLE hCard, const BYTE *uid, BYTE uidLen, char *mszReaders, DWORD dwReaders, DWORD *dwActiveProtocol, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, TagIdentity *tag) {
+    DWORD dwState = SCARD_POWERED; // TODO: can u dynamically request the actual state somehow?
+    DWORD pbRecvBufferCapacity = *pbRecvBufferSize;
+    memset(tag, 0, sizeof(*tag));
+
+    // Get UID of detected tag (unless the caller knows it already, that saves one round trip per tag)
+    LONG lRet = SCARD_S_SUCCESS;
+    if ((uid != NULL) && (uidLen > 0) && (uidLen <= TAG_UID_MAX)) {
+        memcpy(tag->uid, uid, uidLen);
+        tag->uidLen = uidLen;
+        printf("Detected UID: ");
+        for (BYTE i = 0; i < uidLen; i++) {
+            printf("%02X ", uid[i]);
+        }
+        printf("\n\n");
+    } else {
+        lRet = getUID(hCard, pbRecvBuffer, pbRecvBufferSize, TRUE, tag->uid, &tag->uidLen);
+    }
+    if (lRet != SCARD_S_SUCCESS) {
+        if (lRet == ACR_90_00_FAILURE) {
+            LOG_ERROR("Failed to get UID of tag: %0lx\n", lRet);
+        } else if (lRet == SCARD_E_INSUFFICIENT_BUFFER) {
+            LOG_ERROR("Failed to get UID of tag because the buffer is insufficient!");
+        } else {
+            LOG_ERROR("Failed to get UID with unknown error code: %0lx", lRet);
+        }
+        return lRet;
+    }
+
+    TagType atrType;
+    lRet = getStatus(&hCard, mszReaders, dwState, dwReaders, dwActiveProtocol, pbRecvBuffer, pbRecvBufferSize, TRUE, &atrType);
+    // getStatus uses SCardStatus, so we must restore actual buffer size again
+    *pbRecvBufferSize = pbRecvBufferCapacity;
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_WARN("Failed to get status of tag: 0x%x\n", (unsigned int)lRet);
+        return lRet;
+    }
+    tag->type = atrType;
+
+    // only ask for the ATS if the ATR can't tell (currently desfire 8k vs NTAG 424 DNA TT) and this UID is new
+    if (tag_type_caps(atrType) & TAG_CAP_NEEDS_ATS) {
+        if (tag_cache_lookup(tag->uid, tag->uidLen, atrType, &tag->type)) {
+            LOG_INFO("Tag was identified before, skipping ATS: %s", tag_type_name(tag->type));
+            tag->fromCache = TRUE;
+        } else {
+            ApduView response = getATS_14443A(hCard, pbRecvBuffer, pbRecvBufferSize, &tag->type);
+            if (response.status != SCARD_S_SUCCESS) {
+                LOG_WARN("Failed to get ATS of tag: 0x%x\n", (unsigned int)response.status);
+                return response.status;
+            }
+            // only a real answer that settled the type is worth remembering, a refused ATS (6A 81, 63 00) would hide
+            // the tag type for as long as the UID stays in the cache
+            if ((response.outcome == APDU_OK) && !(tag_type_caps(tag->type) & TAG_CAP_NEEDS_ATS)) {
+                tag_cache_store(tag->uid, tag->uidLen, atrType, tag->type);
+            }
+        }
+    }
+
+    tag->caps = tag_type_caps(tag->type);
+    return SCARD_S_SUCCESS;
+}
+
+// -------------------- Helper functions -------------------------------------------------------
+
+BOOL containsSubstring(const char *string, const char *substring) {
+    // Edge case: if substring is empty, it's always considered a match
+    if (*substring == '\0') {
+        return TRUE;
+    }
+
+    // Iterate through the string
+    for (const char *s = string; *s != '\0'; ++s) {
+        // Check if the current character matches the first character of substring
+        if (*s == *substring) {
+            const char *str_ptr = s;
+            const char *sub_ptr = substring;
+
+            // Compare the substring starting from here
+            while (*sub_ptr != '\0' && *str_ptr == *sub_ptr) {
+                str_ptr++;
+                sub_ptr++;
+            }
+
+            // If the entire substring matches, return 1 (true)
+            if (*sub_ptr == '\0') {
+                return TRUE;
+            }
+        }
+    }
+
+    // Return 0 (false) if the substring was not found
+    return FALSE;
+}
+
+// printHex prints bytes as hex
+void printHex(LPCBYTE pbData, DWORD cbData) {
+    for (DWORD i = 0; i < cbData; i++) {
+        printf("%02x ", pbData[i]);
+    }
+    printf("\n");
+}
+
+// dump_response_buffer_16 prints the first 16 values contained in the array (but there is more in the array, so maybe write a full dump function if necessary)
+void dump_response_buffer_16(BYTE *pbRecvBuffer) {
+    printf("\nDumping first 16 values in response buffer:\n");
+    for (int i = 0; i < 16; i++) {
+        printf("0x%02x", pbRecvBuffer[i]);
+        if (i != 15) {
+            printf("  ");
+        }
+    }
+    printf("\n\n");
+}
+
+// dump_response_buffer_256 prints the first 256 values contained in the array. line-breaks after every 4 bytes.
+void dump_response_buffer_256(BYTE *pbRecvBuffer) {
+    printf("\nDumping first 256 values in response buffer:\n");
+    for (int i = 0; i < 256; i++) {
+        printf("0x%02x", pbRecvBuffer[i]);
+        if ((i+1) % 4 == 0) { // +1 so that it doesnt line-break for i=0
+            printf("\n");
+        }
+        else {
+            printf("  ");
+        }
+    }
+    printf("\n\n");
+}
@@ -0,0 +1,67 @@
+#ifndef READER_H
+#define READER_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#ifndef PRESENCE_H
+#include "presence.h"
+#endif
+
+#ifndef TAG_TYPE_H
+#include "tag-type.h"
+#endif
+
+// Reader level functions of libnfcacr (reader.c): reader list, connect, executeApdu and the identification steps that
+// main() goes through. the buffers are always passed in, nothing here allocates
+
+// ApduOutcome tells callers in one value whether an apdu worked, so nobody has to look for 90 00 at hard-coded offsets anymore
+typedef enum {
+    APDU_OK,                // transmit worked and the reader / tag answered 90 00
+    APDU_TRANSMIT_FAILED,   // SCardTransmit itself failed, see status
+    APDU_STATUS_ERROR,      // answer came with another status word, see sw1 / sw2
+    APDU_MALFORMED          // answer is shorter than the 2 byte status word
+} ApduOutcome;
+
+// ApduView describes the reply of one apdu without copying it: data points into the receive buffer that was passed to
+// executeApdu and holds data_len bytes (the status word is not included, it is already split into sw1 / sw2).
+// only those data_len bytes are valid, the rest of the buffer can contain leftovers of earlier replies
+typedef struct {
+    LONG status;            // what SCardTransmit returned
+    ApduOutcome outcome;
+    const BYTE *data;
+    DWORD data_len;
+    BYTE sw1;
+    BYTE sw2;
+    DWORD attempts;         // exchanges it took, more than 1 if executeApdu had to retry (see apdu-retry.h)
+} ApduView;
+
+// general functions
+LONG getAvailableReaders(SCARDCONTEXT hContext, char *mszReaders, DWORD *dwReaders);
+LONG connectToReader(SCARDCONTEXT hContext, const char *reader, SCARDHANDLE *hCard, DWORD *dwActiveProtocol, BOOL directConnect);
+ApduView executeApdu(SCARDHANDLE hCard, BYTE *pbSendBuffer, DWORD dwSendLength, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+ApduView executeApduOnce(SCARDHANDLE hCard, BYTE *pbSendBuffer, DWORD dwSendLength, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize); // no retries, for commands that must not be repeated
+LONG apduResult(ApduView response);
+LONG disableBuzzer(SCARDCONTEXT hContext, const char *reader, SCARDHANDLE *hCard, DWORD *dwActiveProtocol, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+void disconnectReader(SCARDHANDLE hCard, SCARDCONTEXT hContext);
+
+// general interactions with tags
+LONG getUID(SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, BOOL printResult, BYTE *uid, BYTE *uidLen);
+ApduView getATS_14443A(SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, TagType *tagType);
+LONG getStatus(SCARDHANDLE *hCard, char *mszReaders, DWORD dwState, DWORD dwReaders, DWORD *dwActiveProtocol, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, BOOL printResult, TagType *tagType);
+
+// tag detection and identification (the steps of main())
+char *findPiccReader(char *mszReaders);
+LONG waitForTag(SCARDCONTEXT hContext, const char *reader, SCARDHANDLE *hCard, DWORD *dwActiveProtocol, PresenceWatcher *watcher);
+LONG identifyTag(SCARDHANDLE hCard, char *mszReaders, DWORD dwReaders, DWORD *dwActiveProtocol, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, TagIdentity *tag);
+// identifyTagKnownUid is identifyTag for a caller that read the UID already (e.g. the session when it attached), uidLen 0 reads it
+LONG identifyTagKnownUid(SCARDHANDLE hCard, const BYTE *uid, BYTE uidLen, char *mszReaders, DWORD dwReaders, DWORD *dwActiveProtocol, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, TagIdentity *tag);
+
+// helper functions
+BOOL containsSubstring(const char *string, const char *substring);
+void printHex(LPCBYTE pbData, DWORD cbData);
+void dump_response_buffer_16(BYTE *pbRecvBuffer);
+void dump_response_buffer_256(BYTE *pbRecvBuffer);
+
+#endif
\ No newline at end of file
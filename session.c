@@ -0,0 +1,232 @@
+#include "session.h"
+#include "reader.h"
+#include "transport.h"
+#include "timing.h"
+#include "apdu-retry.h"
+#include "metrics.h"
+#include "logging.h"
+
+LONG session_open(NfcSession *session, SCARDCONTEXT hContext, const char *reader) {
+    memset(session, 0, sizeof(*session));
+    session->hContext = hContext;
+    strncpy(session->reader, reader, sizeof(session->reader) - 1);
+
+    // the buzzer setting survives until the reader is unplugged, so one direct connection per session is enough
+    SCARDHANDLE hDirect;
+    DWORD dwProtocol;
+    BYTE pbRecvBuffer[64];
+    DWORD pbRecvBufferSize = sizeof(pbRecvBuffer);
+    LONG lRet = disableBuzzer(hContext, session->reader, &hDirect, &dwProtocol, pbRecvBuffer, &pbRecvBufferSize);
+    if (lRet == SCARD_S_SUCCESS) {
+        transport_get()->disconnect(hDirect, SCARD_LEAVE_CARD);
+    } else {
+        LOG_WARN("[%s] Failed to disable buzzer: 0x%x", session->reader, (unsigned int)lRet);
+    }
+
+    return presence_watcher_init(&session->watcher, hContext, session->reader);
+}
+
+// session_read_uid reads the UID through the handle without retries, FALSE if the tag does not answer with one
+static BOOL session_read_uid(NfcSession *session, BYTE *uid, BYTE *uidLen) {
+    BYTE pbSendBuffer[5] = { 0xFF, 0xCA, 0x00, 0x00, 0x00 };
+    BYTE pbRecvBuffer[TAG_UID_MAX + 2];
+    DWORD pbRecvBufferSize = sizeof(pbRecvBuffer);
+    ApduView response = executeApduOnce(session->hCard, pbSendBuffer, sizeof(pbSendBuffer), pbRecvBuffer, &pbRecvBufferSize);
+    if ((response.outcome != APDU_OK) || (response.data_len == 0) || (response.data_len > TAG_UID_MAX)) {
+        return FALSE;
+    }
+    memcpy(uid, response.data, response.data_len);
+    *uidLen = (BYTE)response.data_len;
+    return TRUE;
+}
+
+// session_bind_uid remembers the UID of the tag that was just attached, retries check it after every reconnect
+static void session_bind_uid(NfcSession *session) {
+    if (!session_read_uid(session, session->uid, &session->uidLen)) {
+        session->uidLen = 0;
+    }
+    apdu_retry_bind_uid(session->hCard, (session->uidLen > 0) ? session->uid : NULL, session->uidLen);
+}
+
+// session_attach connects to the tag on the reader, reusing the warm handle whenever possible
+static LONG session_attach(NfcSession *session) {
+    const Transport *transport = transport_get();
+    if (session->hCard != 0) {
+        // LEAVE_CARD keeps the state of the same tag (e.g. after SCARD_W_RESET_CARD). pcscd lets it succeed on a tag
+        // that was swapped in the meantime as well, that one was activated by pcscd when it came in and answers just
+        // the same, so whatever UID comes back is bound. only a tag that does not answer (halted, e.g. after a failed
+        // Mifare Classic authentication) gets RESET_CARD
+        uint64_t start = timing_now_ns();
+        LONG lRet = transport->reconnect(session->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &session->dwActiveProtocol);
+        BOOL uidRead = FALSE;
+        if (lRet == SCARD_S_SUCCESS) {
+            uidRead = session_read_uid(session, session->uid, &session->uidLen);
+            if (!uidRead) {
+                lRet = SCARD_E_NO_SMARTCARD;
+            }
+        }
+        if (lRet == SCARD_E_NO_SMARTCARD) {
+            lRet = transport->reconnect(session->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_RESET_CARD, &session->dwActiveProtocol);
+        }
+        metrics_record_connect(session->reader, METRICS_RECONNECT, lRet, timing_now_ns() - start);
+        if (lRet == SCARD_S_SUCCESS) {
+            session->reconnects++;
+            session->attached = TRUE;
+            if (uidRead) {
+                apdu_retry_bind_uid(session->hCard, session->uid, session->uidLen);
+            } else {
+                session_bind_uid(session);
+            }
+            return lRet;
+        }
+        session->uidLen = 0;
+        if ((lRet == SCARD_E_NO_SMARTCARD) || (lRet == SCARD_W_REMOVED_CARD)) {
+            return lRet; // tag already gone again, keep the handle for the next one
+        }
+        LOG_DEBUG("[%s] Reconnect failed (0x%x), connecting again", session->reader, (unsigned int)lRet);
+        apdu_retry_bind_uid(session->hCard, NULL, 0);
+        transport->disconnect(session->hCard, SCARD_LEAVE_CARD);
+        session->hCard = 0;
+    }
+
+    LONG lRet = connectToReader(session->hContext, session->reader, &session->hCard, &session->dwActiveProtocol, FALSE);
+    if (lRet != SCARD_S_SUCCESS) {
+        session->hCard = 0;
+        return lRet;
+    }
+    session->connects++;
+    session->attached = TRUE;
+    session_bind_uid(session);
+    return lRet;
+}
+
+#define SESSION_RETRY_MS 50      // attach retry interval for a tag that is there but could not be attached
+
+LONG session_wait_tag(NfcSession *session) {
+    return session_wait_tag_timeout(session, INFINITE);
+}
+
+LONG session_wait_tag_timeout(NfcSession *session, DWORD timeoutMs) {
+    if (session->attached) {
+        return SCARD_S_SUCCESS;
+    }
+
+    uint64_t deadline = timing_now_ns() + (uint64_t)timeoutMs * 1000000ull;
+    BOOL attachNow = session->watcher.cardPresent;
+    for (;;) {
+        if (!attachNow) {
+            DWORD remaining = INFINITE;
+            if (timeoutMs != INFINITE) {
+                uint64_t now = timing_now_ns();
+                remaining = (now >= deadline) ? 0 : (DWORD)((deadline - now) / 1000000ull);
+            }
+            // a tag that lies there but could not be attached causes no further event, it is tried again every
+            // SESSION_RETRY_MS instead. an empty reader only wakes up when pcscd reports a change
+            BOOL retrying = session->watcher.cardPresent;
+            if (retrying && (remaining > SESSION_RETRY_MS)) {
+                remaining = SESSION_RETRY_MS;
+            }
+            PresenceEvent event;
+            LONG lRet = presence_wait(&session->watcher, remaining, &event);
+            if (lRet == SCARD_E_TIMEOUT) {
+                if ((timeoutMs != INFINITE) && (timing_now_ns() >= deadline)) {
+                    return lRet;
+                }
+                if (!retrying) {
+                    continue; // some pcsc-lite versions time out even with INFINITE
+                }
+            } else if (lRet != SCARD_S_SUCCESS) {
+                return lRet;
+            } else if (event.type != PRESENCE_CARD_INSERTED) {
+                continue;
+            }
+        }
+
+        LONG lRet = session_attach(session);
+        if (lRet == SCARD_S_SUCCESS) {
+            return lRet;
+        }
+        if ((lRet != SCARD_E_NO_SMARTCARD) && (lRet != SCARD_W_REMOVED_CARD) && (lRet != SCARD_E_TIMEOUT) && (lRet != SCARD_W_UNRESPONSIVE_CARD)
+            && (lRet != SCARD_W_UNPOWERED_CARD) && (lRet != SCARD_E_SHARING_VIOLATION)) {
+            LOG_ERROR("[%s] Google this pcsc-lite error code: 0x%x", session->reader, (unsigned int)lRet);
+            return lRet;
+        }
+        // the tag left the field again before we could connect (or does not answer yet)
+        attachNow = FALSE;
+    }
+}
+
+LONG session_refresh(NfcSession *session) {
+    PresenceEvent event;
+    LONG lRet;
+    while ((lRet = presence_wait(&session->watcher, 0, &event)) == SCARD_S_SUCCESS) {
+        session->attached = FALSE; // taken away, or swapped for a tag that needs a reconnect
+    }
+    return (lRet == SCARD_E_TIMEOUT) ? SCARD_S_SUCCESS : lRet;
+}
+
+LONG session_begin(NfcSession *session) {
+    const Transport *transport = transport_get();
+    LONG lRet = transport->beginTransaction(session->hCard);
+    if (lRet == SCARD_W_RESET_CARD) {
+        // somebody else reset the tag, it is still the same one so the handle just has to be told
+        lRet = transport->reconnect(session->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &session->dwActiveProtocol);
+        if (lRet == SCARD_S_SUCCESS) {
+            lRet = transport->beginTransaction(session->hCard);
+        }
+    }
+    if (lRet != SCARD_S_SUCCESS) {
+        LOG_WARN("[%s] Failed to begin transaction: 0x%x", session->reader, (unsigned int)lRet);
+        return lRet;
+    }
+    session->inTransaction = TRUE;
+    return lRet;
+}
+
+LONG session_end(NfcSession *session) {
+    if (!session->inTransaction) {
+        return SCARD_S_SUCCESS;
+    }
+    session->inTransaction = FALSE;
+    LONG lRet = transport_get()->endTransaction(session->hCard, SCARD_LEAVE_CARD);
+    if ((lRet != SCARD_S_SUCCESS) && (lRet != SCARD_W_REMOVED_CARD)) {
+        LOG_WARN("[%s] Failed to end transaction: 0x%x", session->reader, (unsigned int)lRet);
+    }
+    return lRet;
+}
+
+LONG session_wait_removal(NfcSession *session) {
+    session_end(session);
+    while (session->watcher.cardPresent) {
+        PresenceEvent event;
+        LONG lRet = presence_wait(&session->watcher, INFINITE, &event);
+        if ((lRet != SCARD_S_SUCCESS) && (lRet != SCARD_E_TIMEOUT)) {
+            return lRet;
+        }
+        if ((lRet == SCARD_S_SUCCESS) && (event.type == PRESENCE_CARD_INSERTED)) {
+            break; // swapped for another tag in between, that one is new
+        }
+    }
+    session->attached = FALSE;
+    return SCARD_S_SUCCESS;
+}
+
+LONG session_identify(NfcSession *session, char *mszReaders, DWORD dwReaders, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, TagIdentity *tag) {
+    // the UID was read when the tag was attached, no need to ask the tag again
+    return identifyTagKnownUid(session->hCard, session->uid, session->uidLen, mszReaders, dwReaders, &session->dwActiveProtocol, pbRecvBuffer, pbRecvBufferSize, tag);
+}
+
+LONG session_cancel(NfcSession *session) {
+    return presence_cancel(&session->watcher);
+}
+
+void session_close(NfcSession *session) {
+    session_end(session);
+    if (session->hCard != 0) {
+        apdu_retry_bind_uid(session->hCard, NULL, 0);
+        transport_get()->disconnect(session->hCard, SCARD_LEAVE_CARD);
+        session->hCard = 0;
+    }
+    LOG_DEBUG("[%s] Session closed (%zu connects, %zu reconnects)", session->reader, session->connects, session->reconnects);
+    transport_get()->releaseContext(session->hContext);
+}
@@ -0,0 +1,74 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+#ifndef PRESENCE_H
+#include "presence.h"
+#endif
+
+#ifndef TAG_TYPE_H
+#include "tag-type.h"
+#endif
+
+// NfcSession keeps the PC/SC context and the card handle of one reader warm across tags: the first tag is connected
+// with SCardConnect, every following one reuses the handle through SCardReconnect (SCARD_RESET_CARD only if the tag
+// does not answer). the UID read while attaching is kept, session_identify uses it instead of asking the tag again. the buzzer is switched off once when the session is opened instead of for every tag.
+// session_begin / session_end wrap the APDUs for one tag into a single PC/SC transaction, so pcscd locks the reader
+// once per tag instead of once per APDU.
+//
+//      session_open(&session, hContext, reader);
+//      while (session_wait_tag(&session) == SCARD_S_SUCCESS) {
+//          session_begin(&session);
+//          ... session_identify(&session, ...), em_4423_* ...
+//          session_end(&session);
+//          session_wait_removal(&session);
+//      }
+//      session_close(&session);
+
+typedef struct NfcSession {
+    SCARDCONTEXT hContext;      // owned by the session, released in session_close
+    char reader[256];
+    SCARDHANDLE hCard;          // stays open between tags, 0 until the first tag was connected
+    DWORD dwActiveProtocol;
+    BOOL attached;              // hCard is connected to the tag that lies on the reader right now
+    BOOL inTransaction;
+    BYTE uid[TAG_UID_MAX];      // UID of the tag hCard was attached to last, uidLen 0 = could not be read
+    BYTE uidLen;
+    PresenceWatcher watcher;
+    size_t connects;            // tags that needed a full SCardConnect
+    size_t reconnects;          // tags that got the warm handle through SCardReconnect
+} NfcSession;
+
+// session_open takes over hContext and switches the buzzer of reader off
+LONG session_open(NfcSession *session, SCARDCONTEXT hContext, const char *reader);
+
+// session_wait_tag blocks until a tag lies on the reader and session->hCard is connected to it
+LONG session_wait_tag(NfcSession *session);
+
+// session_wait_tag_timeout is session_wait_tag that gives up after timeoutMs (SCARD_E_TIMEOUT), 0 only takes a tag that is already there
+LONG session_wait_tag_timeout(NfcSession *session, DWORD timeoutMs);
+
+// session_refresh applies inserts and removals since the last call without blocking (one SCardGetStatusChange with
+// timeout 0). for long running services that answer requests instead of sitting in session_wait_removal
+LONG session_refresh(NfcSession *session);
+
+// session_begin / session_end put one transaction around the APDUs of a tag (a reset by another application is
+// handled with a reconnect that leaves the tag as it is)
+LONG session_begin(NfcSession *session);
+LONG session_end(NfcSession *session);
+
+// session_wait_removal ends an open transaction and blocks until the tag left the reader, the handle stays open
+LONG session_wait_removal(NfcSession *session);
+
+// session_identify is identifyTag for the attached tag, it takes the UID read while attaching instead of asking again
+LONG session_identify(NfcSession *session, char *mszReaders, DWORD dwReaders, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize, TagIdentity *tag);
+
+// session_cancel wakes up session_wait_tag / session_wait_removal from another thread (they return SCARD_E_CANCELLED)
+LONG session_cancel(NfcSession *session);
+
+void session_close(NfcSession *session);
+
+#endif
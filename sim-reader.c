@@ -0,0 +1,1151 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <time.h>
+
+#include "sim-reader.h"
+#include "transport.h"
+#include "em-4423.h"
+#include "tag-memory.h"
+#include "desfire.h"
+#include "mifare-classic.h"
+#include "timing.h"
+#include "logging.h"
+
+#define SIM_PAGE_SIZE       EM_4423_PAGE_SIZE
+#define SIM_PAGE_COUNT      EM_4423_PAGE_COUNT
+#define SIM_HANDLE_MAX      64
+#define SIM_HANDLE_BASE     0x5100  // handles and contexts start at made up values so that 0 or garbage is never valid
+#define SIM_CONTEXT_BASE    0x51C0
+
+// ATR that the ACR1581U reports for Mifare Ultralight / NTAG2xx like tags (PC/SC part 3, bytes 13 and 14 are 00 03)
+static const BYTE SIM_ATR_ULTRALIGHT[20] = { 0x3B, 0x8F, 0x80, 0x01, 0x80, 0x4F, 0x0C, 0xA0, 0x00, 0x00,
+                                             0x03, 0x06, 0x03, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x68 };
+
+// same ATR with card name 00 01 / 00 02 (Mifare Classic 1k / 4k)
+static const BYTE SIM_ATR_CLASSIC_1K[20] = { 0x3B, 0x8F, 0x80, 0x01, 0x80, 0x4F, 0x0C, 0xA0, 0x00, 0x00,
+                                             0x03, 0x06, 0x03, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x6A };
+static const BYTE SIM_ATR_CLASSIC_4K[20] = { 0x3B, 0x8F, 0x80, 0x01, 0x80, 0x4F, 0x0C, 0xA0, 0x00, 0x00,
+                                             0x03, 0x06, 0x03, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x69 };
+
+// short ATR the ACR1581U builds for ISO 14443-4 tags (desfire, NTAG 424 DNA), the type is only visible in the ATS
+static const BYTE SIM_ATR_ISO14443_4[6] = { 0x3B, 0x81, 0x80, 0x01, 0x80, 0x80 };
+static const BYTE SIM_ATS_DESFIRE_EV3[6] = { 0x06, 0x75, 0x77, 0x81, 0x02, 0x80 };
+static const BYTE SIM_ATS_NTAG_424[6] = { 0x06, 0x77, 0x77, 0x71, 0x02, 0x80 };
+
+// ATR for ISO 15693 tags: standard 0B (ISO 15693 part 3) and card name 00 14 (ICODE SLI family)
+static const BYTE SIM_ATR_ICODE_SLI[20] = { 0x3B, 0x8F, 0x80, 0x01, 0x80, 0x4F, 0x0C, 0xA0, 0x00, 0x00,
+                                            0x03, 0x06, 0x0B, 0x00, 0x14, 0x00, 0x00, 0x00, 0x00, 0x77 };
+
+// SimTagProfile is what a kind of virtual tag looks like from the outside
+typedef struct SimTagProfile {
+    const char *name;       // value of NFC_SIM_TAG
+    const BYTE *atr;
+    DWORD atrLength;
+    const BYTE *ats;        // NULL: FF CA 01 answers 6A 81
+    DWORD atsLength;
+    BYTE manufacturer;      // first UID byte
+    BOOL pages;             // READ / UPDATE BINARY work on the memory map of `memory`
+    TagMemoryKind memory;
+    BYTE uidLength;         // 4 (Mifare Classic), 7 (ISO 14443A double size) or 8 (ISO 15693, sent LSB first)
+    TagType classic;        // Mifare Classic with sector authentication, TAG_TYPE_UNIDENTIFIED for everything else
+} SimTagProfile;
+
+// indexed by SimTagKind
+static const SimTagProfile SIM_TAG_PROFILES[] = {
+    { "em4423",    SIM_ATR_ULTRALIGHT, sizeof(SIM_ATR_ULTRALIGHT), NULL,                0,                           0x16, TRUE,  TAG_MEMORY_EM4423,      7, TAG_TYPE_UNIDENTIFIED }, // EM Microelectronic
+    { "desfire",   SIM_ATR_ISO14443_4, sizeof(SIM_ATR_ISO14443_4), SIM_ATS_DESFIRE_EV3, sizeof(SIM_ATS_DESFIRE_EV3), 0x04, FALSE, TAG_MEMORY_COUNT,       7, TAG_TYPE_UNIDENTIFIED }, // NXP
+    { "ntag424",   SIM_ATR_ISO14443_4, sizeof(SIM_ATR_ISO14443_4), SIM_ATS_NTAG_424,    sizeof(SIM_ATS_NTAG_424),    0x04, FALSE, TAG_MEMORY_COUNT,       7, TAG_TYPE_UNIDENTIFIED },
+    { "slix",      SIM_ATR_ICODE_SLI,  sizeof(SIM_ATR_ICODE_SLI),  NULL,                0,                           0x04, TRUE,  TAG_MEMORY_ICODE_SLIX,  8, TAG_TYPE_UNIDENTIFIED },
+    { "slix2",     SIM_ATR_ICODE_SLI,  sizeof(SIM_ATR_ICODE_SLI),  NULL,                0,                           0x04, TRUE,  TAG_MEMORY_ICODE_SLIX2, 8, TAG_TYPE_UNIDENTIFIED },
+    { "classic1k", SIM_ATR_CLASSIC_1K, sizeof(SIM_ATR_CLASSIC_1K), NULL,                0,                           0xC1, FALSE, TAG_MEMORY_COUNT,       4, TAG_TYPE_MIFARE_CLASSIC_1K }, // NUID, made up first byte
+    { "classic4k", SIM_ATR_CLASSIC_4K, sizeof(SIM_ATR_CLASSIC_4K), NULL,                0,                           0xC1, FALSE, TAG_MEMORY_COUNT,       4, TAG_TYPE_MIFARE_CLASSIC_4K },
+};
+
+static const char SIM_FIRMWARE[] = "ACR1581U_SIM";
+
+// virtual DESFire: application 000001 with two standard data files (free access), big enough to stream a few kB
+#define SIM_DESFIRE_AID         0x000001
+#define SIM_DESFIRE_FRAME_DATA  59      // data bytes per answer frame: FSC 64 (FSCI 5 in the ATS) minus PCB, SW and CRC
+#define SIM_DESFIRE_CMD_DATA    55      // FSC 64 minus PCB, CRC and the ISO 7816 wrapping
+#define SIM_DESFIRE_STORAGE     (4096 + 256)
+
+typedef struct SimDesfireFile {
+    BYTE fileNo;
+    DWORD offset;               // where the file starts in SimDesfire.storage
+    DWORD size;
+} SimDesfireFile;
+
+static const SimDesfireFile SIM_DESFIRE_FILES[] = {
+    { 0x01, 0,    4096 },
+    { 0x02, 4096, 256 },
+};
+
+typedef struct SimDesfire {
+    DWORD aid;                  // selected application, 0 = PICC level
+    BYTE pending;               // ReadData / WriteData that continues with 90 AF, 0 = none
+    DWORD position;             // next byte in storage that is sent / written
+    DWORD end;
+    BYTE storage[SIM_DESFIRE_STORAGE];
+} SimDesfire;
+
+typedef struct SimReader {
+    BOOL cardPresent;
+    const SimTagProfile *tag;   // kind of the tag that lies on the reader
+    DWORD eventCounter; // incremented on every insert / removal, reported in the upper 16 bits of dwEventState like pcsc-lite does
+    BYTE buzzer;
+    SCARDHANDLE owner;          // handle that holds the transaction (0 = none), other handles wait in their next call
+    BYTE uid[8];
+    BYTE memory[SIM_PAGE_COUNT * SIM_PAGE_SIZE];    // EM4423 is the biggest memory map that is simulated
+    SimDesfire desfire;
+    BYTE classic[MIFARE_CLASSIC_MAX_BLOCKS * MIFARE_CLASSIC_BLOCK_SIZE];
+    BYTE classicKeys[MIFARE_CLASSIC_KEY_SLOTS][MIFARE_CLASSIC_KEY_SIZE];   // volatile key slots, belong to the reader and outlive the tag
+    BOOL classicKeyLoaded[MIFARE_CLASSIC_KEY_SLOTS];
+    int classicAuthSector;      // -1 = not authenticated
+    BOOL classicHalted;         // failed authentication, the tag answers nothing until it is activated again
+} SimReader;
+
+typedef struct SimHandle {
+    BOOL inUse;
+    BOOL direct;
+    size_t reader;
+    DWORD cardGeneration;       // eventCounter of the reader when this handle was (re)connected, a swapped tag makes it stale
+} SimHandle;
+
+// parsed command apdu (short and extended length)
+typedef struct SimApdu {
+    BYTE cla, ins, p1, p2;
+    const BYTE *data;
+    DWORD lc;
+    DWORD le;   // 0 if no Le was sent, otherwise already decoded (short 00 = 256, extended 00 00 = 65536)
+} SimApdu;
+
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t simChanged = PTHREAD_COND_INITIALIZER; // signalled on card insert / removal and on cancel
+static DWORD simCancelGeneration[64];  // per context (modulo 64), bumped by SCardCancel
+static SimReader simReaders[SIM_READER_MAX];
+static SimHandle simHandles[SIM_HANDLE_MAX];
+static size_t simReaderCount = 1;
+static DWORD simLatencyUs = 0;
+static DWORD simMaxWrite = SIM_PAGE_SIZE;
+static DWORD simMaxRead = 0;        // largest READ BINARY in bytes, 0 = whatever the tag has
+static DWORD simRfErrorPercent;     // share of exchanges that fail like a tag at the edge of the field
+static uint64_t simRandomState = 0x9E3779B97F4A7C15ull;
+static SimTagKind simTagKind = SIM_TAG_EM4423;
+static SCARDCONTEXT simNextContext = SIM_CONTEXT_BASE;
+static uint32_t simUidCounter = 0;
+static BOOL simInitialized = FALSE;
+
+// -------------------- Virtual tag -------------------------------
+
+// sim_put_classic fills the sectors of a Mifare Classic: block 0 holds UID, BCC, SAK and ATQA, data blocks get a pattern
+// and every trailer the transport access bits (FF 07 80) with key A = A0A1A2A3A4A5 in sector 0 (MAD),
+// D3F7D3F7D3F7 in every fourth sector (NDEF) and FFFFFFFFFFFF in the others, key B is FFFFFFFFFFFF everywhere
+static void sim_put_classic(SimReader *r) {
+    BYTE *m = r->classic;
+    BOOL fourK = (r->tag->classic == TAG_TYPE_MIFARE_CLASSIC_4K);
+    size_t blocks = mifare_classic_block_count(r->tag->classic);
+    memset(r->classic, 0, sizeof(r->classic));
+    for (size_t i = MIFARE_CLASSIC_BLOCK_SIZE; i < blocks * MIFARE_CLASSIC_BLOCK_SIZE; i++) {
+        m[i] = (BYTE)(i * 13 + (i >> 8) + r->uid[3]);
+    }
+    memcpy(m, r->uid, 4);
+    m[4] = r->uid[0] ^ r->uid[1] ^ r->uid[2] ^ r->uid[3];
+    m[5] = fourK ? 0x18 : 0x08;
+    m[6] = fourK ? 0x02 : 0x04;
+    m[7] = 0x00;
+    for (BYTE sector = 0; sector < mifare_classic_sector_count(r->tag->classic); sector++) {
+        BYTE *trailer = m + (mifare_classic_first_block(sector) + mifare_classic_blocks_in_sector(sector) - 1) * MIFARE_CLASSIC_BLOCK_SIZE;
+        const BYTE *keyA = MIFARE_CLASSIC_DEFAULT_KEYS[(sector == 0) ? 1 : ((sector % 4 == 3) ? 2 : 0)];
+        memcpy(trailer, keyA, MIFARE_CLASSIC_KEY_SIZE);
+        trailer[6] = 0xFF; trailer[7] = 0x07; trailer[8] = 0x80; trailer[9] = 0x69;
+        memset(trailer + 10, 0xFF, MIFARE_CLASSIC_KEY_SIZE);
+    }
+    r->classicAuthSector = -1;
+    r->classicHalted = FALSE;
+}
+
+// sim_put_tag lays a factory fresh tag of the configured kind on the reader. for an EM4423 that is UID + BCCs in
+// pages 0-2, capability container in page 3 and an empty NDEF TLV in page 4. an ICODE SLIX gets an E0 04 01 UID
+// (LSB first, type bits 36-37 say SLIX or SLIX2) and a type 5 capability container in block 0
+static void sim_put_tag(SimReader *r) {
+    simUidCounter++;
+    memset(r->memory, 0, sizeof(r->memory));
+    r->tag = &SIM_TAG_PROFILES[simTagKind];
+    BYTE *m = r->memory;
+
+    if (r->tag->uidLength == 8) {
+        BOOL slix2 = (r->tag->memory == TAG_MEMORY_ICODE_SLIX2);
+        r->uid[7] = 0xE0;
+        r->uid[6] = r->tag->manufacturer;
+        r->uid[5] = 0x01;
+        r->uid[4] = slix2 ? 0x08 : 0x10;
+        r->uid[3] = (BYTE)(simUidCounter >> 24);
+        r->uid[2] = (BYTE)(simUidCounter >> 16);
+        r->uid[1] = (BYTE)(simUidCounter >> 8);
+        r->uid[0] = (BYTE)(simUidCounter);
+        m[0] = 0xE1; m[1] = 0x40; m[2] = slix2 ? 0x27 : 0x0E; m[3] = 0x01; // CC: NDEF v1.0, data area in 8 byte units, read multiple blocks
+        m[4] = 0x03; m[5] = 0x00; m[6] = 0xFE;
+    } else if (r->tag->uidLength == 4) {
+        r->uid[0] = r->tag->manufacturer;
+        r->uid[1] = (BYTE)(simUidCounter >> 16);
+        r->uid[2] = (BYTE)(simUidCounter >> 8);
+        r->uid[3] = (BYTE)(simUidCounter);
+        sim_put_classic(r);
+    } else {
+        r->uid[0] = r->tag->manufacturer;
+        r->uid[1] = 0x5E;
+        r->uid[2] = 0x4D;
+        r->uid[3] = (BYTE)(simUidCounter >> 24);
+        r->uid[4] = (BYTE)(simUidCounter >> 16);
+        r->uid[5] = (BYTE)(simUidCounter >> 8);
+        r->uid[6] = (BYTE)(simUidCounter);
+
+        m[0] = r->uid[0]; m[1] = r->uid[1]; m[2] = r->uid[2]; m[3] = 0x88 ^ r->uid[0] ^ r->uid[1] ^ r->uid[2];
+        m[4] = r->uid[3]; m[5] = r->uid[4]; m[6] = r->uid[5]; m[7] = r->uid[6];
+        m[8] = r->uid[3] ^ r->uid[4] ^ r->uid[5] ^ r->uid[6]; m[9] = 0x48;
+        m[12] = 0xE1; m[13] = 0x10; m[14] = 0x1E; m[15] = 0x00;     // CC: NDEF v1.0, 240 bytes of data area, read/write
+        m[16] = 0x03; m[17] = 0x00; m[18] = 0xFE;                   // empty NDEF message
+    }
+
+    // a DESFire comes with a recognisable pattern in file 01, so a read that skips or repeats a frame shows up
+    memset(&r->desfire, 0, sizeof(r->desfire));
+    for (DWORD i = 0; i < SIM_DESFIRE_FILES[0].size; i++) {
+        r->desfire.storage[i] = (BYTE)(i * 7 + (i >> 8) + r->uid[6]);
+    }
+    r->cardPresent = TRUE;
+    r->owner = 0;
+    r->eventCounter++;
+}
+
+static void sim_init_locked(void) {
+    if (simInitialized) {
+        return;
+    }
+    for (size_t i = 0; i < SIM_READER_MAX; i++) {
+        simReaders[i].buzzer = 0x01;
+        sim_put_tag(&simReaders[i]);
+    }
+    simInitialized = TRUE;
+}
+
+static void sim_reader_name(char *out, size_t size, size_t reader, BOOL picc) {
+    // same pattern pcsc-lite uses for the real thing, e.g. "ACS ACR1581 1S Dual Reader [ACR1581 1S Dual Reader PICC] 00 01"
+    snprintf(out, size, "ACS ACR1581 1S Dual Reader [ACR1581 1S Dual Reader %s] %02u %02u", picc ? "PICC" : "ICC", (unsigned int)reader, picc ? 1u : 0u);
+}
+
+// sim_find_reader maps a reader name back to the index of the virtual reader, returns FALSE for unknown names
+static BOOL sim_find_reader(const char *name, size_t *reader, BOOL *picc) {
+    char candidate[128];
+    for (size_t i = 0; i < simReaderCount; i++) {
+        for (int slot = 0; slot < 2; slot++) {
+            sim_reader_name(candidate, sizeof(candidate), i, slot == 1);
+            if (strcmp(candidate, name) == 0) {
+                *reader = i;
+                *picc = (slot == 1);
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+static SimHandle *sim_lookup_handle(SCARDHANDLE hCard) {
+    if ((hCard < SIM_HANDLE_BASE) || (hCard >= SIM_HANDLE_BASE + SIM_HANDLE_MAX)) {
+        return NULL;
+    }
+    SimHandle *h = &simHandles[hCard - SIM_HANDLE_BASE];
+    return h->inUse ? h : NULL;
+}
+
+// sim_parse_apdu decodes the 4 ISO 7816-4 cases in short and extended form
+static BOOL sim_parse_apdu(const BYTE *apdu, DWORD len, SimApdu *out) {
+    if (len < 4) {
+        return FALSE;
+    }
+    out->cla = apdu[0]; out->ins = apdu[1]; out->p1 = apdu[2]; out->p2 = apdu[3];
+    out->data = NULL; out->lc = 0; out->le = 0;
+
+    if (len == 4) {                                     // case 1
+        return TRUE;
+    }
+    if (len == 5) {                                     // case 2 short
+        out->le = (apdu[4] == 0) ? 256 : apdu[4];
+        return TRUE;
+    }
+    if (apdu[4] != 0x00) {                              // case 3 / 4 short
+        out->lc = apdu[4];
+        out->data = apdu + 5;
+        if (len == 5 + out->lc) {
+            return TRUE;
+        }
+        if (len == 6 + out->lc) {
+            out->le = (apdu[len - 1] == 0) ? 256 : apdu[len - 1];
+            return TRUE;
+        }
+        return FALSE;
+    }
+    if (len == 7) {                                     // case 2 extended
+        out->le = ((DWORD)apdu[5] << 8) | apdu[6];
+        out->le = (out->le == 0) ? 65536 : out->le;
+        return TRUE;
+    }
+    out->lc = ((DWORD)apdu[5] << 8) | apdu[6];          // case 3 / 4 extended
+    out->data = apdu + 7;
+    if ((out->lc != 0) && (len == 7 + out->lc)) {
+        return TRUE;
+    }
+    if ((out->lc != 0) && (len == 9 + out->lc)) {
+        out->le = ((DWORD)apdu[len - 2] << 8) | apdu[len - 1];
+        out->le = (out->le == 0) ? 65536 : out->le;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static const SimDesfireFile *sim_desfire_file(const SimDesfire *d, BYTE fileNo) {
+    if (d->aid != SIM_DESFIRE_AID) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(SIM_DESFIRE_FILES) / sizeof(SIM_DESFIRE_FILES[0]); i++) {
+        if (SIM_DESFIRE_FILES[i].fileNo == fileNo) {
+            return &SIM_DESFIRE_FILES[i];
+        }
+    }
+    return NULL;
+}
+
+// sim_desfire_execute answers DESFire native commands wrapped in CLA 90: SelectApplication, GetFileIDs, ReadData and
+// WriteData with 91 AF chaining in both directions. any command but 90 AF aborts a chained one, like on the real card
+static LONG sim_desfire_execute(SimReader *r, const SimApdu *apdu, BYTE *pbRecvBuffer, DWORD *pcbRecvLength) {
+    SimDesfire *d = &r->desfire;
+    DWORD n = 0;
+    BYTE sw1 = 0x91, sw2 = DESFIRE_STATUS_OK;
+    BYTE pending = (apdu->ins == DESFIRE_CMD_ADDITIONAL_FRAME) ? d->pending : 0;
+    d->pending = 0;
+
+    if (r->tag != &SIM_TAG_PROFILES[SIM_TAG_DESFIRE]) {
+        sw1 = 0x6E; sw2 = 0x00;                         // class not supported
+    } else if ((apdu->p1 != 0x00) || (apdu->p2 != 0x00)) {
+        sw2 = DESFIRE_STATUS_PARAMETER_ERROR;
+    } else if (apdu->lc > SIM_DESFIRE_CMD_DATA) {
+        sw2 = DESFIRE_STATUS_LENGTH_ERROR;              // frame does not fit into the FSC of the card
+    } else if (apdu->ins == DESFIRE_CMD_SELECT_APPLICATION) {
+        DWORD aid = (apdu->lc == 3) ? (apdu->data[0] | ((DWORD)apdu->data[1] << 8) | ((DWORD)apdu->data[2] << 16)) : 0xFFFFFFFF;
+        if (apdu->lc != 3) {
+            sw2 = DESFIRE_STATUS_LENGTH_ERROR;
+        } else if ((aid == 0) || (aid == SIM_DESFIRE_AID)) {
+            d->aid = aid;
+        } else {
+            sw2 = DESFIRE_STATUS_APP_NOT_FOUND;
+        }
+    } else if (apdu->ins == DESFIRE_CMD_GET_FILE_IDS) {
+        if (d->aid != SIM_DESFIRE_AID) {
+            sw2 = DESFIRE_STATUS_APP_NOT_FOUND;         // the PICC level has no files
+        } else if (*pcbRecvLength < sizeof(SIM_DESFIRE_FILES) / sizeof(SIM_DESFIRE_FILES[0]) + 2) {
+            return SCARD_E_INSUFFICIENT_BUFFER;
+        } else {
+            for (; n < sizeof(SIM_DESFIRE_FILES) / sizeof(SIM_DESFIRE_FILES[0]); n++) {
+                pbRecvBuffer[n] = SIM_DESFIRE_FILES[n].fileNo;
+            }
+        }
+    } else if ((apdu->ins == DESFIRE_CMD_READ_DATA) || (apdu->ins == DESFIRE_CMD_WRITE_DATA)) {
+        BOOL write = (apdu->ins == DESFIRE_CMD_WRITE_DATA);
+        const SimDesfireFile *file = (apdu->lc >= 7) ? sim_desfire_file(d, apdu->data[0]) : NULL;
+        DWORD offset = (apdu->lc >= 7) ? (apdu->data[1] | ((DWORD)apdu->data[2] << 8) | ((DWORD)apdu->data[3] << 16)) : 0;
+        DWORD length = (apdu->lc >= 7) ? (apdu->data[4] | ((DWORD)apdu->data[5] << 8) | ((DWORD)apdu->data[6] << 16)) : 0;
+        if ((apdu->lc < 7) || (!write && (apdu->lc != 7)) || (write && (length == 0))) {
+            sw2 = DESFIRE_STATUS_LENGTH_ERROR;
+        } else if (file == NULL) {
+            sw2 = (d->aid == SIM_DESFIRE_AID) ? DESFIRE_STATUS_FILE_NOT_FOUND : DESFIRE_STATUS_APP_NOT_FOUND;
+        } else if ((offset > file->size) || (length > file->size - offset)) {
+            sw2 = DESFIRE_STATUS_BOUNDARY_ERROR;
+        } else {
+            d->position = file->offset + offset;
+            d->end = d->position + ((length == 0) ? file->size - offset : length);
+            pending = apdu->ins;
+        }
+    } else if ((apdu->ins != DESFIRE_CMD_ADDITIONAL_FRAME) || (pending == 0)) {
+        sw2 = DESFIRE_STATUS_ILLEGAL_COMMAND;
+    }
+
+    if ((sw1 == 0x91) && (sw2 == DESFIRE_STATUS_OK) && (pending == DESFIRE_CMD_READ_DATA)) {
+        n = d->end - d->position;
+        if (n > SIM_DESFIRE_FRAME_DATA) {
+            n = SIM_DESFIRE_FRAME_DATA;
+        }
+        if (*pcbRecvLength < n + 2) {
+            return SCARD_E_INSUFFICIENT_BUFFER;
+        }
+        memcpy(pbRecvBuffer, d->storage + d->position, n);
+        d->position += n;
+    } else if ((sw1 == 0x91) && (sw2 == DESFIRE_STATUS_OK) && (pending == DESFIRE_CMD_WRITE_DATA)) {
+        DWORD skip = (apdu->ins == DESFIRE_CMD_WRITE_DATA) ? 7 : 0;
+        DWORD chunk = apdu->lc - skip;
+        if (chunk > d->end - d->position) {
+            sw2 = DESFIRE_STATUS_LENGTH_ERROR;
+            pending = 0;
+        } else {
+            memcpy(d->storage + d->position, apdu->data + skip, chunk);
+            d->position += chunk;
+        }
+    }
+    if ((sw1 == 0x91) && (sw2 == DESFIRE_STATUS_OK) && (pending != 0) && (d->position < d->end)) {
+        d->pending = pending;
+        sw2 = DESFIRE_STATUS_ADDITIONAL_FRAME;
+    }
+
+    if (*pcbRecvLength < n + 2) {
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    pbRecvBuffer[n] = sw1;
+    pbRecvBuffer[n + 1] = sw2;
+    *pcbRecvLength = n + 2;
+    return SCARD_S_SUCCESS;
+}
+
+// sim_classic_execute answers the Mifare Classic pseudo apdus: LOAD KEYS (volatile slots 00 / 01, taken for any tag
+// because they live in the reader), GENERAL AUTHENTICATE with key A (key B is readable with these access bits, so the
+// tag refuses it), READ BINARY over blocks of the authenticated sector (at most NFC_SIM_MAX_READ bytes) and UPDATE
+// BINARY of single data blocks. a failed authentication halts the tag until the handle reconnects with a reset
+static LONG sim_classic_execute(SimReader *r, const SimApdu *apdu, BYTE *pbRecvBuffer, DWORD *pcbRecvLength) {
+    DWORD n = 0;
+    BYTE sw1 = 0x90, sw2 = 0x00;
+    BOOL classic = (r->tag->classic != TAG_TYPE_UNIDENTIFIED);
+    size_t blocks = classic ? mifare_classic_block_count(r->tag->classic) : 0;
+
+    if (apdu->ins == 0x82) {
+        if ((apdu->p1 != 0x00) || (apdu->p2 >= MIFARE_CLASSIC_KEY_SLOTS) || (apdu->lc != MIFARE_CLASSIC_KEY_SIZE)) {
+            sw1 = 0x63; sw2 = 0x00;
+        } else {
+            memcpy(r->classicKeys[apdu->p2], apdu->data, MIFARE_CLASSIC_KEY_SIZE);
+            r->classicKeyLoaded[apdu->p2] = TRUE;
+        }
+    } else if (!classic || r->classicHalted) {
+        sw1 = 0x63; sw2 = 0x00;                         // no Mifare Classic, or it does not answer anymore
+    } else if (apdu->ins == 0x86) {
+        const BYTE *d = apdu->data;
+        if ((apdu->lc != 5) || (d[0] != 0x01) || (d[1] != 0x00) || (d[2] >= blocks) || (d[4] >= MIFARE_CLASSIC_KEY_SLOTS) || !r->classicKeyLoaded[d[4]]) {
+            sw1 = 0x63; sw2 = 0x00;
+        } else {
+            BYTE sector = mifare_classic_sector_of_block(d[2]);
+            const BYTE *trailer = r->classic + (mifare_classic_first_block(sector) + mifare_classic_blocks_in_sector(sector) - 1) * MIFARE_CLASSIC_BLOCK_SIZE;
+            if ((d[3] == MIFARE_CLASSIC_KEY_A) && (memcmp(trailer, r->classicKeys[d[4]], MIFARE_CLASSIC_KEY_SIZE) == 0)) {
+                r->classicAuthSector = sector;
+            } else {
+                r->classicAuthSector = -1;
+                r->classicHalted = TRUE;
+                sw1 = 0x63; sw2 = 0x00;
+            }
+        }
+    } else if ((apdu->p1 != 0x00) || (apdu->p2 >= blocks) || (r->classicAuthSector != (int)mifare_classic_sector_of_block(apdu->p2))) {
+        sw1 = 0x69; sw2 = 0x82;                         // security status not satisfied
+    } else if (apdu->ins == 0xB0) {
+        BYTE sector = (BYTE)r->classicAuthSector;
+        DWORD end = (DWORD)mifare_classic_first_block(sector) + mifare_classic_blocks_in_sector(sector);
+        if ((apdu->le == 0) || (apdu->le % MIFARE_CLASSIC_BLOCK_SIZE != 0) || ((simMaxRead > 0) && (apdu->le > simMaxRead))) {
+            sw1 = 0x67; sw2 = 0x00;                     // wrong length
+        } else if (apdu->p2 + apdu->le / MIFARE_CLASSIC_BLOCK_SIZE > end) {
+            sw1 = 0x69; sw2 = 0x82;                     // reaches into the next sector
+        } else {
+            n = apdu->le;
+            if (*pcbRecvLength < n + 2) {
+                return SCARD_E_INSUFFICIENT_BUFFER;
+            }
+            memcpy(pbRecvBuffer, r->classic + apdu->p2 * MIFARE_CLASSIC_BLOCK_SIZE, n);
+            // key A never leaves the tag
+            for (DWORD block = apdu->p2; block < apdu->p2 + n / MIFARE_CLASSIC_BLOCK_SIZE; block++) {
+                if (block == end - 1) {
+                    memset(pbRecvBuffer + (block - apdu->p2) * MIFARE_CLASSIC_BLOCK_SIZE, 0, MIFARE_CLASSIC_KEY_SIZE);
+                }
+            }
+        }
+    } else {
+        BYTE sector = (BYTE)r->classicAuthSector;
+        DWORD trailer = (DWORD)mifare_classic_first_block(sector) + mifare_classic_blocks_in_sector(sector) - 1;
+        if (apdu->lc != MIFARE_CLASSIC_BLOCK_SIZE) {
+            sw1 = 0x67; sw2 = 0x00;
+        } else if ((apdu->p2 == 0) || (apdu->p2 == trailer)) {
+            sw1 = 0x63; sw2 = 0x00;                     // manufacturer block and trailers stay as they are
+        } else {
+            memcpy(r->classic + apdu->p2 * MIFARE_CLASSIC_BLOCK_SIZE, apdu->data, MIFARE_CLASSIC_BLOCK_SIZE);
+        }
+    }
+
+    if (*pcbRecvLength < n + 2) {
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    pbRecvBuffer[n] = sw1;
+    pbRecvBuffer[n + 1] = sw2;
+    *pcbRecvLength = n + 2;
+    return SCARD_S_SUCCESS;
+}
+
+// sim_execute runs one pseudo apdu against the tag and writes data + SW1 SW2 into pbRecvBuffer
+static LONG sim_execute(SimReader *r, const SimApdu *apdu, BYTE *pbRecvBuffer, DWORD *pcbRecvLength) {
+    DWORD n = 0;
+    BYTE sw1 = 0x90, sw2 = 0x00;
+
+    if (apdu->cla == DESFIRE_CLA) {
+        return sim_desfire_execute(r, apdu, pbRecvBuffer, pcbRecvLength);
+    } else if (apdu->cla != 0xFF) {
+        sw1 = 0x6E; sw2 = 0x00;                         // class not supported
+    } else if ((apdu->ins == 0xCA) && (apdu->p1 == 0x00)) {
+        n = r->tag->uidLength;
+        if ((apdu->le != 0) && (apdu->le < n)) {
+            n = apdu->le;
+        }
+        if (*pcbRecvLength < n + 2) {
+            return SCARD_E_INSUFFICIENT_BUFFER;
+        }
+        memcpy(pbRecvBuffer, r->uid, n);
+    } else if ((apdu->ins == 0xCA) && (apdu->p1 == 0x01)) {
+        if (r->tag->ats == NULL) {
+            sw1 = 0x6A; sw2 = 0x81;                     // EM4423 is not ISO 14443-4, so there is no ATS
+        } else {
+            n = r->tag->atsLength;
+            if (*pcbRecvLength < n + 2) {
+                return SCARD_E_INSUFFICIENT_BUFFER;
+            }
+            memcpy(pbRecvBuffer, r->tag->ats, n);
+        }
+    } else if ((apdu->ins == 0x82) || (apdu->ins == 0x86)
+               || ((r->tag->classic != TAG_TYPE_UNIDENTIFIED) && ((apdu->ins == 0xB0) || (apdu->ins == 0xD6)))) {
+        return sim_classic_execute(r, apdu, pbRecvBuffer, pcbRecvLength);
+    } else if (((apdu->ins == 0xB0) || (apdu->ins == 0xD6)) && !r->tag->pages) {
+        sw1 = 0x6A; sw2 = 0x81;                         // no memory map behind these tags
+    } else if (apdu->ins == 0xB0) {
+        const TagMemoryProfile *memory = tag_memory_profile(r->tag->memory);
+        DWORD size = memory->pageCount * SIM_PAGE_SIZE;
+        BOOL wraps = (r->tag->memory == TAG_MEMORY_EM4423);
+        if ((apdu->p1 != 0x00) || (apdu->p2 >= memory->pageCount) || (apdu->le == 0)
+            || (!wraps && ((apdu->le % SIM_PAGE_SIZE != 0) || (apdu->p2 * SIM_PAGE_SIZE + apdu->le > size)))) {
+            sw1 = 0x63; sw2 = 0x00;
+        } else {
+            n = apdu->le;
+            if (*pcbRecvLength < n + 2) {
+                return SCARD_E_INSUFFICIENT_BUFFER;
+            }
+            // reading past the last page of an EM4423 continues at page 0, same as the real tag. ISO 15693 tags
+            // refuse blocks that do not exist (Read Multiple Blocks)
+            for (DWORD i = 0; i < n; i++) {
+                pbRecvBuffer[i] = r->memory[(apdu->p2 * SIM_PAGE_SIZE + i) % size];
+            }
+        }
+    } else if (apdu->ins == 0xD6) {
+        if ((apdu->lc == 0) || (apdu->lc % SIM_PAGE_SIZE != 0) || (apdu->lc > simMaxWrite)) {
+            sw1 = 0x67; sw2 = 0x00;                     // wrong length
+        } else {
+            DWORD pages = apdu->lc / SIM_PAGE_SIZE;
+            BOOL writable = (apdu->p1 == 0x00);
+            for (DWORD i = 0; writable && (i < pages); i++) {
+                DWORD page = apdu->p2 + i;
+                writable = tag_memory_page_is_user(tag_memory_profile(r->tag->memory), page);
+            }
+            if (writable) {
+                memcpy(r->memory + apdu->p2 * SIM_PAGE_SIZE, apdu->data, apdu->lc);
+            } else {
+                sw1 = 0x63; sw2 = 0x00;
+            }
+        }
+    } else {
+        sw1 = 0x6A; sw2 = 0x81;                         // function not supported
+    }
+
+    if (*pcbRecvLength < n + 2) {
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    pbRecvBuffer[n] = sw1;
+    pbRecvBuffer[n + 1] = sw2;
+    *pcbRecvLength = n + 2;
+    return SCARD_S_SUCCESS;
+}
+
+// -------------------- Transport functions -------------------------------
+
+static LONG sim_establish_context(DWORD dwScope, SCARDCONTEXT *phContext) {
+    (void)dwScope;
+    pthread_mutex_lock(&simLock);
+    sim_init_locked();
+    *phContext = simNextContext++;
+    pthread_mutex_unlock(&simLock);
+    return SCARD_S_SUCCESS;
+}
+
+static LONG sim_release_context(SCARDCONTEXT hContext) {
+    return (hContext >= SIM_CONTEXT_BASE) ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+}
+
+static LONG sim_list_readers(SCARDCONTEXT hContext, char *mszReaders, DWORD *pcchReaders) {
+    if (hContext < SIM_CONTEXT_BASE) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    char name[128];
+    DWORD needed = 1; // final \0 of the multi string
+    for (size_t i = 0; i < simReaderCount; i++) {
+        for (int slot = 0; slot < 2; slot++) {
+            sim_reader_name(name, sizeof(name), i, slot == 1);
+            needed += (DWORD)strlen(name) + 1;
+        }
+    }
+    if (mszReaders == NULL) {
+        *pcchReaders = needed;
+        return SCARD_S_SUCCESS;
+    }
+    if (*pcchReaders < needed) {
+        *pcchReaders = needed;
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+
+    char *p = mszReaders;
+    for (size_t i = 0; i < simReaderCount; i++) {
+        for (int slot = 0; slot < 2; slot++) {
+            sim_reader_name(name, sizeof(name), i, slot == 1);
+            memcpy(p, name, strlen(name) + 1);
+            p += strlen(name) + 1;
+        }
+    }
+    *p = '\0';
+    *pcchReaders = needed;
+    return SCARD_S_SUCCESS;
+}
+
+// sim_card_check_locked returns what pcsc-lite answers for a handle whose tag is gone: SCARD_W_REMOVED_CARD, also when
+// another tag lies there by now (the handle has to be reconnected first)
+static LONG sim_card_check_locked(const SimHandle *h, const SimReader *r) {
+    if (!r->cardPresent || (h->cardGeneration != r->eventCounter)) {
+        return SCARD_W_REMOVED_CARD;
+    }
+    return SCARD_S_SUCCESS;
+}
+
+// sim_wait_transaction_locked blocks while another handle holds the transaction of the reader, like pcscd does.
+// returns the handle again because the slot could have been disconnected in the meantime
+static SimHandle *sim_wait_transaction_locked(SCARDHANDLE hCard) {
+    SimHandle *h = sim_lookup_handle(hCard);
+    while ((h != NULL) && (simReaders[h->reader].owner != 0) && (simReaders[h->reader].owner != hCard)) {
+        pthread_cond_wait(&simChanged, &simLock);
+        h = sim_lookup_handle(hCard);
+    }
+    return h;
+}
+
+static LONG sim_connect(SCARDCONTEXT hContext, const char *reader, DWORD dwShareMode, DWORD dwPreferredProtocols, SCARDHANDLE *phCard, DWORD *pdwActiveProtocol) {
+    (void)dwPreferredProtocols;
+    if (hContext < SIM_CONTEXT_BASE) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    pthread_mutex_lock(&simLock);
+    size_t index;
+    BOOL picc;
+    if (!sim_find_reader(reader, &index, &picc)) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_UNKNOWN_READER;
+    }
+    BOOL direct = (dwShareMode == SCARD_SHARE_DIRECT);
+    if (!direct && (!picc || !simReaders[index].cardPresent)) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_NO_SMARTCARD;
+    }
+
+    size_t slot = 0;
+    while ((slot < SIM_HANDLE_MAX) && simHandles[slot].inUse) {
+        slot++;
+    }
+    if (slot == SIM_HANDLE_MAX) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_SHARING_VIOLATION;
+    }
+    simHandles[slot].inUse = TRUE;
+    simHandles[slot].direct = direct;
+    simHandles[slot].reader = index;
+    simHandles[slot].cardGeneration = simReaders[index].eventCounter;
+    if (!direct) {
+        simReaders[index].classicAuthSector = -1;
+        simReaders[index].classicHalted = FALSE;
+    }
+    DWORD latency = simLatencyUs;
+    pthread_mutex_unlock(&simLock);
+
+    *phCard = SIM_HANDLE_BASE + (SCARDHANDLE)slot;
+    *pdwActiveProtocol = direct ? SCARD_PROTOCOL_UNDEFINED : SCARD_PROTOCOL_T1;
+    if (!direct && (latency > 0)) {
+        timing_sleep_us(latency); // activating the tag (REQA, anticollision, select) is at least one RF round trip
+    }
+    return SCARD_S_SUCCESS;
+}
+
+static LONG sim_disconnect(SCARDHANDLE hCard, DWORD dwDisposition) {
+    (void)dwDisposition;
+    pthread_mutex_lock(&simLock);
+    SimHandle *h = sim_lookup_handle(hCard);
+    if (h != NULL) {
+        h->inUse = FALSE;
+        if (simReaders[h->reader].owner == hCard) {
+            simReaders[h->reader].owner = 0; // disconnecting ends the transaction
+            pthread_cond_broadcast(&simChanged);
+        }
+    }
+    pthread_mutex_unlock(&simLock);
+    return (h != NULL) ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+}
+
+// sim_reconnect follows pcsc-lite: the handle is pointed at whatever tag lies on the reader now, with every disposition.
+// SCARD_LEAVE_CARD succeeds on a swapped tag too (the stale handle only sees SCARD_W_REMOVED_CARD on its first use
+// before the reconnect), so callers that care about the tag have to look at the UID themselves
+static LONG sim_reconnect(SCARDHANDLE hCard, DWORD dwShareMode, DWORD dwPreferredProtocols, DWORD dwInitialization, DWORD *pdwActiveProtocol) {
+    (void)dwShareMode;
+    (void)dwPreferredProtocols;
+    pthread_mutex_lock(&simLock);
+    SimHandle *h = sim_wait_transaction_locked(hCard);
+    if ((h == NULL) || h->direct) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    SimReader *r = &simReaders[h->reader];
+    if (!r->cardPresent) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_NO_SMARTCARD;
+    }
+    BOOL activate = (h->cardGeneration != r->eventCounter) || (dwInitialization != SCARD_LEAVE_CARD);
+    h->cardGeneration = r->eventCounter;
+    if (activate) {
+        r->classicAuthSector = -1;  // a new select wakes a halted Mifare Classic up, unauthenticated
+        r->classicHalted = FALSE;
+    }
+    DWORD latency = simLatencyUs;
+    pthread_mutex_unlock(&simLock);
+
+    *pdwActiveProtocol = SCARD_PROTOCOL_T1;
+    if (activate && (latency > 0)) {
+        timing_sleep_us(latency); // same RF activation as in sim_connect, but no new handle
+    }
+    return SCARD_S_SUCCESS;
+}
+
+static LONG sim_begin_transaction(SCARDHANDLE hCard) {
+    pthread_mutex_lock(&simLock);
+    SimHandle *h = sim_wait_transaction_locked(hCard);
+    if (h == NULL) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    LONG lRet = h->direct ? SCARD_S_SUCCESS : sim_card_check_locked(h, &simReaders[h->reader]);
+    if (lRet == SCARD_S_SUCCESS) {
+        simReaders[h->reader].owner = hCard;
+    }
+    pthread_mutex_unlock(&simLock);
+    return lRet;
+}
+
+static LONG sim_end_transaction(SCARDHANDLE hCard, DWORD dwDisposition) {
+    (void)dwDisposition;
+    pthread_mutex_lock(&simLock);
+    SimHandle *h = sim_lookup_handle(hCard);
+    if (h == NULL) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    LONG lRet = SCARD_S_SUCCESS;
+    if (simReaders[h->reader].owner == hCard) {
+        simReaders[h->reader].owner = 0;
+        pthread_cond_broadcast(&simChanged);
+    } else {
+        lRet = SCARD_E_NOT_TRANSACTED;
+    }
+    pthread_mutex_unlock(&simLock);
+    return lRet;
+}
+
+static LONG sim_status(SCARDHANDLE hCard, char *mszReaderName, DWORD *pcchReaderLen, DWORD *pdwState, DWORD *pdwProtocol, BYTE *pbAtr, DWORD *pcbAtrLen) {
+    pthread_mutex_lock(&simLock);
+    SimHandle *h = sim_lookup_handle(hCard);
+    if (h == NULL) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    SimReader *r = &simReaders[h->reader];
+    if (sim_card_check_locked(h, r) != SCARD_S_SUCCESS) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_W_REMOVED_CARD;
+    }
+
+    char name[128];
+    sim_reader_name(name, sizeof(name), h->reader, TRUE);
+    const SimTagProfile *tag = r->tag;
+    pthread_mutex_unlock(&simLock);
+
+    if ((*pcchReaderLen < strlen(name) + 1) || (*pcbAtrLen < tag->atrLength)) {
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(mszReaderName, name, strlen(name) + 1);
+    *pcchReaderLen = (DWORD)strlen(name) + 1;
+    *pdwState = SCARD_PRESENT | SCARD_POWERED | SCARD_SPECIFIC;
+    *pdwProtocol = SCARD_PROTOCOL_T1;
+    memcpy(pbAtr, tag->atr, tag->atrLength);
+    *pcbAtrLen = tag->atrLength;
+    return SCARD_S_SUCCESS;
+}
+
+// sim_random_locked is a xorshift, good enough to pick the exchanges that fail
+static uint64_t sim_random_locked(void) {
+    simRandomState ^= simRandomState << 13;
+    simRandomState ^= simRandomState >> 7;
+    simRandomState ^= simRandomState << 17;
+    return simRandomState;
+}
+
+static LONG sim_transmit(SCARDHANDLE hCard, const BYTE *pbSendBuffer, DWORD cbSendLength, BYTE *pbRecvBuffer, DWORD *pcbRecvLength) {
+    pthread_mutex_lock(&simLock);
+    SimHandle *h = sim_wait_transaction_locked(hCard);
+    if (h == NULL) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    if (h->direct) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_PROTO_MISMATCH;
+    }
+    SimReader *r = &simReaders[h->reader];
+    if (sim_card_check_locked(h, r) != SCARD_S_SUCCESS) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_W_REMOVED_CARD;
+    }
+
+    LONG lRet;
+    SimApdu apdu;
+    if ((simRfErrorPercent > 0) && (sim_random_locked() % 100 < simRfErrorPercent) && (*pcbRecvLength >= 2)) {
+        // weak coupling: either the reader reports the failed exchange (63 00) or the tag does not answer at all. a Mifare
+        // Classic loses its authentication with it, the next read needs a new one
+        r->classicAuthSector = -1;
+        if (sim_random_locked() & 1) {
+            pbRecvBuffer[0] = 0x63;
+            pbRecvBuffer[1] = 0x00;
+            *pcbRecvLength = 2;
+            lRet = SCARD_S_SUCCESS;
+        } else {
+            lRet = SCARD_W_UNRESPONSIVE_CARD;
+        }
+    } else if (sim_parse_apdu(pbSendBuffer, cbSendLength, &apdu)) {
+        lRet = sim_execute(r, &apdu, pbRecvBuffer, pcbRecvLength);
+    } else if (*pcbRecvLength >= 2) {
+        pbRecvBuffer[0] = 0x67; // wrong length
+        pbRecvBuffer[1] = 0x00;
+        *pcbRecvLength = 2;
+        lRet = SCARD_S_SUCCESS;
+    } else {
+        lRet = SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    DWORD latency = simLatencyUs;
+    pthread_mutex_unlock(&simLock);
+
+    // the RF exchange is modelled outside of the lock so that multiple virtual readers work in parallel
+    if (latency > 0) {
+        timing_sleep_us(latency);
+    }
+    return lRet;
+}
+
+static LONG sim_control(SCARDHANDLE hCard, DWORD dwControlCode, const BYTE *pbSendBuffer, DWORD cbSendLength, BYTE *pbRecvBuffer, DWORD cbRecvLength, DWORD *lpBytesReturned) {
+    if (dwControlCode != SCARD_CTL_CODE(3500)) {
+        return SCARD_E_INVALID_PARAMETER;
+    }
+    if ((cbSendLength < 5) || (pbSendBuffer[0] != 0xE0) || (cbSendLength != 5u + pbSendBuffer[4])) {
+        return SCARD_E_INVALID_PARAMETER;
+    }
+
+    pthread_mutex_lock(&simLock);
+    SimHandle *h = sim_lookup_handle(hCard);
+    if (h == NULL) {
+        pthread_mutex_unlock(&simLock);
+        return SCARD_E_INVALID_HANDLE;
+    }
+    SimReader *r = &simReaders[h->reader];
+
+    // escape responses look like E1 00 00 00 <len> <data>
+    BYTE response[5 + sizeof(SIM_FIRMWARE)] = { 0xE1, 0x00, 0x00, 0x00, 0x00 };
+    DWORD responseLength = 5;
+    LONG lRet = SCARD_S_SUCCESS;
+    if (pbSendBuffer[3] == 0x21) {                      // buzzer: write if one byte is sent, otherwise read
+        if (pbSendBuffer[4] == 1) {
+            r->buzzer = pbSendBuffer[5];
+        }
+        response[4] = 1;
+        response[5] = r->buzzer;
+        responseLength = 6;
+    } else if (pbSendBuffer[3] == 0x18) {               // firmware version
+        response[4] = (BYTE)(sizeof(SIM_FIRMWARE) - 1);
+        memcpy(response + 5, SIM_FIRMWARE, sizeof(SIM_FIRMWARE) - 1);
+        responseLength = 5 + sizeof(SIM_FIRMWARE) - 1;
+    } else {
+        lRet = SCARD_E_INVALID_PARAMETER;
+    }
+    pthread_mutex_unlock(&simLock);
+
+    if (lRet != SCARD_S_SUCCESS) {
+        return lRet;
+    }
+    if (cbRecvLength < responseLength) {
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(pbRecvBuffer, response, responseLength);
+    *lpBytesReturned = responseLength;
+    return SCARD_S_SUCCESS;
+}
+
+// sim_reader_state_locked returns what SCardGetStatusChange would report as dwEventState for the given reader name (0 for unknown readers)
+static DWORD sim_reader_state_locked(const char *name, BYTE *atr, DWORD *atrLength) {
+    size_t index;
+    BOOL picc;
+    *atrLength = 0;
+    if (!sim_find_reader(name, &index, &picc)) {
+        return 0;
+    }
+    SimReader *r = &simReaders[index];
+    if (!picc || !r->cardPresent) {
+        return SCARD_STATE_EMPTY | ((r->eventCounter & 0xFFFF) << 16);
+    }
+    memcpy(atr, r->tag->atr, r->tag->atrLength);
+    *atrLength = r->tag->atrLength;
+    return SCARD_STATE_PRESENT | ((r->eventCounter & 0xFFFF) << 16);
+}
+
+static LONG sim_get_status_change(SCARDCONTEXT hContext, DWORD dwTimeout, SCARD_READERSTATE *rgReaderStates, DWORD cReaders) {
+    if (hContext < SIM_CONTEXT_BASE) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline); // pthread_cond_timedwait uses the realtime clock by default
+    deadline.tv_sec += dwTimeout / 1000;
+    deadline.tv_nsec += (long)(dwTimeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&simLock);
+    sim_init_locked();
+    DWORD *cancelSlot = &simCancelGeneration[(hContext - SIM_CONTEXT_BASE) % 64];
+    DWORD cancelGeneration = *cancelSlot;
+    for (;;) {
+        BOOL changed = FALSE;
+        for (DWORD i = 0; i < cReaders; i++) {
+            SCARD_READERSTATE *rs = &rgReaderStates[i];
+            if (rs->dwCurrentState & SCARD_STATE_IGNORE) {
+                continue;
+            }
+            BYTE atr[MAX_ATR_SIZE];
+            DWORD atrLength;
+            DWORD state = sim_reader_state_locked(rs->szReader, atr, &atrLength);
+            if (state == 0) {
+                pthread_mutex_unlock(&simLock);
+                return SCARD_E_UNKNOWN_READER;
+            }
+            // a change is either a different presence bit or, if the caller passed an event counter, a different counter (tag swapped in between)
+            DWORD presenceMask = SCARD_STATE_PRESENT | SCARD_STATE_EMPTY;
+            BOOL differs = ((rs->dwCurrentState & presenceMask) != (state & presenceMask)) ||
+                           (((rs->dwCurrentState >> 16) != 0) && ((rs->dwCurrentState >> 16) != (state >> 16)));
+            rs->dwEventState = state | (differs ? SCARD_STATE_CHANGED : 0);
+            memcpy(rs->rgbAtr, atr, atrLength);
+            rs->cbAtr = atrLength;
+            changed = changed || differs;
+        }
+        if (changed) {
+            pthread_mutex_unlock(&simLock);
+            return SCARD_S_SUCCESS;
+        }
+        if (*cancelSlot != cancelGeneration) {
+            pthread_mutex_unlock(&simLock);
+            return SCARD_E_CANCELLED;
+        }
+        if (dwTimeout == INFINITE) {
+            pthread_cond_wait(&simChanged, &simLock);
+        } else if (pthread_cond_timedwait(&simChanged, &simLock, &deadline) != 0) {
+            pthread_mutex_unlock(&simLock);
+            return SCARD_E_TIMEOUT;
+        }
+    }
+}
+
+static LONG sim_cancel(SCARDCONTEXT hContext) {
+    if (hContext < SIM_CONTEXT_BASE) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    pthread_mutex_lock(&simLock);
+    simCancelGeneration[(hContext - SIM_CONTEXT_BASE) % 64]++;
+    pthread_cond_broadcast(&simChanged);
+    pthread_mutex_unlock(&simLock);
+    return SCARD_S_SUCCESS;
+}
+
+const Transport SIM_TRANSPORT = {
+    .name             = "sim",
+    .establishContext = sim_establish_context,
+    .releaseContext   = sim_release_context,
+    .listReaders      = sim_list_readers,
+    .connect          = sim_connect,
+    .disconnect       = sim_disconnect,
+    .reconnect        = sim_reconnect,
+    .beginTransaction = sim_begin_transaction,
+    .endTransaction   = sim_end_transaction,
+    .status           = sim_status,
+    .transmit         = sim_transmit,
+    .control          = sim_control,
+    .getStatusChange  = sim_get_status_change,
+    .cancel           = sim_cancel
+};
+
+// -------------------- Configuration -------------------------------
+
+static DWORD sim_env_dword(const char *name, DWORD fallback) {
+    const char *value = getenv(name);
+    if ((value == NULL) || (*value == '\0')) {
+        return fallback;
+    }
+    char *end;
+    unsigned long parsed = strtoul(value, &end, 0);
+    if (*end != '\0') {
+        LOG_WARN("Ignoring invalid value '%s' of %s", value, name);
+        return fallback;
+    }
+    return (DWORD)parsed;
+}
+
+void sim_reader_configure_from_env(void) {
+    sim_reader_set_count(sim_env_dword("NFC_SIM_READERS", 1));
+    sim_reader_set_latency_us(sim_env_dword("NFC_SIM_LATENCY_US", 0));
+    sim_reader_set_max_write(sim_env_dword("NFC_SIM_MAX_WRITE", SIM_PAGE_SIZE));
+    sim_reader_set_max_read(sim_env_dword("NFC_SIM_MAX_READ", 0));
+    sim_reader_set_rf_error_percent(sim_env_dword("NFC_SIM_RF_ERRORS", 0));
+
+    const char *tag = getenv("NFC_SIM_TAG");
+    if (tag != NULL) {
+        size_t kind = 0;
+        while ((kind < sizeof(SIM_TAG_PROFILES) / sizeof(SIM_TAG_PROFILES[0])) && (strcmp(tag, SIM_TAG_PROFILES[kind].name) != 0)) {
+            kind++;
+        }
+        if (kind < sizeof(SIM_TAG_PROFILES) / sizeof(SIM_TAG_PROFILES[0])) {
+            sim_reader_set_tag_kind((SimTagKind)kind);
+        } else {
+            LOG_WARN("Ignoring unknown NFC_SIM_TAG '%s' (em4423, desfire, ntag424, slix, slix2, classic1k or classic4k)", tag);
+        }
+    }
+
+    BOOL present = (sim_env_dword("NFC_SIM_CARD", 1) != 0);
+    for (size_t i = 0; i < sim_reader_count(); i++) {
+        sim_reader_set_card_present(i, present);
+    }
+    DWORD swapMs = sim_env_dword("NFC_SIM_SWAP_MS", 0);
+    if (swapMs > 0) {
+        sim_reader_start_auto_swap(swapMs);
+    }
+    LOG_DEBUG("Simulating %zu reader(s) with %lu us RF latency", sim_reader_count(), (unsigned long)simLatencyUs);
+}
+
+void sim_reader_set_latency_us(DWORD latencyUs) {
+    pthread_mutex_lock(&simLock);
+    simLatencyUs = latencyUs;
+    pthread_mutex_unlock(&simLock);
+}
+
+void sim_reader_set_max_write(DWORD maxWriteBytes) {
+    pthread_mutex_lock(&simLock);
+    simMaxWrite = (maxWriteBytes < SIM_PAGE_SIZE) ? SIM_PAGE_SIZE : maxWriteBytes;
+    pthread_mutex_unlock(&simLock);
+}
+
+void sim_reader_set_max_read(DWORD maxReadBytes) {
+    pthread_mutex_lock(&simLock);
+    simMaxRead = (maxReadBytes == 0) ? 0 : ((maxReadBytes < MIFARE_CLASSIC_BLOCK_SIZE) ? MIFARE_CLASSIC_BLOCK_SIZE : maxReadBytes);
+    pthread_mutex_unlock(&simLock);
+}
+
+void sim_reader_set_rf_error_percent(DWORD percent) {
+    pthread_mutex_lock(&simLock);
+    simRfErrorPercent = (percent > 100) ? 100 : percent;
+    pthread_mutex_unlock(&simLock);
+}
+
+void sim_reader_set_tag_kind(SimTagKind kind) {
+    pthread_mutex_lock(&simLock);
+    simTagKind = kind;
+    pthread_mutex_unlock(&simLock);
+}
+
+void sim_reader_set_count(size_t count) {
+    if (count == 0) {
+        count = 1;
+    } else if (count > SIM_READER_MAX) {
+        LOG_WARN("At most %d simulated readers are supported", SIM_READER_MAX);
+        count = SIM_READER_MAX;
+    }
+    pthread_mutex_lock(&simLock);
+    simReaderCount = count;
+    pthread_mutex_unlock(&simLock);
+}
+
+size_t sim_reader_count(void) {
+    pthread_mutex_lock(&simLock);
+    size_t count = simReaderCount;
+    pthread_mutex_unlock(&simLock);
+    return count;
+}
+
+void sim_reader_set_card_present(size_t reader, BOOL present) {
+    if (reader >= SIM_READER_MAX) {
+        return;
+    }
+    pthread_mutex_lock(&simLock);
+    sim_init_locked();
+    if (present) {
+        sim_put_tag(&simReaders[reader]);
+    } else if (simReaders[reader].cardPresent) {
+        simReaders[reader].cardPresent = FALSE;
+        simReaders[reader].owner = 0;
+        simReaders[reader].eventCounter++;
+    }
+    pthread_cond_broadcast(&simChanged);
+    pthread_mutex_unlock(&simLock);
+}
+
+// -------------------- Auto swap (operator model) -------------------------------
+
+static DWORD simSwapMs;
+
+static void *sim_auto_swap_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&simLock);
+        DWORD dwellMs = simSwapMs;
+        pthread_mutex_unlock(&simLock);
+        timing_sleep_us((uint64_t)dwellMs * 1000);
+        size_t count = sim_reader_count();
+        for (size_t i = 0; i < count; i++) {
+            sim_reader_set_card_present(i, FALSE);
+        }
+        timing_sleep_us(1000); // the hand moving the next tag into the field
+        for (size_t i = 0; i < count; i++) {
+            sim_reader_set_card_present(i, TRUE);
+        }
+    }
+    return NULL;
+}
+
+void sim_reader_start_auto_swap(DWORD dwellMs) {
+    pthread_mutex_lock(&simLock);
+    BOOL running = (simSwapMs > 0);
+    simSwapMs = (dwellMs == 0) ? 1 : dwellMs;
+    pthread_mutex_unlock(&simLock);
+    if (running) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sim_auto_swap_thread, NULL) != 0) {
+        LOG_ERROR("Failed to start the simulated operator");
+        return;
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,62 @@
+#ifndef SIM_READER_H
+#define SIM_READER_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+// Simulated ACR1581U (used through SIM_TRANSPORT, see transport.h). every virtual reader exposes an ICC and a PICC slot,
+// the PICC slot can hold one EM4423 whose memory map is taken from the TAG_MEMORY_EM4423 profile (tag-memory.c)
+// (or a desfire / NTAG 424 DNA / ICODE SLIX, see NFC_SIM_TAG. the desfire has application 000001 with standard data files
+// 01 (4096 bytes) and 02 (256 bytes), the NTAG 424 DNA only has ATR, UID and ATS, the ICODE SLIX and SLIX2 have the block
+// layout of their tag-memory.c profile and an 8 byte UID, the Mifare Classic 1k / 4k have a 4 byte UID and sectors that
+// open with key A, see sim_put_classic).
+// modelled commands:
+//      escape (SCardControl 3500):   E0 00 00 21 (buzzer), E0 00 00 18 (firmware version)
+//      pseudo apdus (SCardTransmit):  FF CA 00 00 (UID), FF CA 01 00 (ATS, EM4423 has none so 6A 81),
+//                                     FF B0 00 <page> (READ BINARY, short and extended Le, wraps around like the real EM4423,
+//                                                      multiple ISO 15693 blocks like Read Multiple Blocks),
+//                                     FF D6 00 <page> (UPDATE BINARY, short and extended Lc, user memory only)
+//                                     FF 82 / FF 86 (LOAD KEYS / GENERAL AUTHENTICATE of Mifare Classic sectors)
+//                                     90 5A / 6F / BD / 3D / AF (desfire native, 59 data bytes per answer frame)
+//
+// configuration via environment (read by sim_reader_configure_from_env):
+//      NFC_SIM_READERS     amount of virtual ACR1581U units (default 1, max SIM_READER_MAX)
+//      NFC_SIM_LATENCY_US  RF round trip in microseconds that every exchange with the tag costs (default 0)
+//      NFC_SIM_CARD        "0" starts with empty readers (default: an EM4423 lies on every reader)
+//      NFC_SIM_MAX_WRITE   largest UPDATE BINARY payload in bytes the reader accepts (default 4 = one page)
+//      NFC_SIM_MAX_READ    largest READ BINARY in bytes a Mifare Classic answers (default 0 = a whole sector)
+//      NFC_SIM_TAG         kind of tag that is put on the readers: em4423 (default), desfire, ntag424, slix, slix2,
+//                          classic1k, classic4k
+//      NFC_SIM_RF_ERRORS   percentage of exchanges that fail like a weakly coupled tag (63 00 or no answer), default 0
+//      NFC_SIM_SWAP_MS     when set, a simulated operator replaces the tag on every reader after this many milliseconds
+
+#define SIM_READER_MAX 8
+
+typedef enum SimTagKind {
+    SIM_TAG_EM4423,
+    SIM_TAG_DESFIRE,
+    SIM_TAG_NTAG424,
+    SIM_TAG_ICODE_SLIX,
+    SIM_TAG_ICODE_SLIX2,
+    SIM_TAG_CLASSIC_1K,
+    SIM_TAG_CLASSIC_4K,
+} SimTagKind;
+
+void sim_reader_configure_from_env(void);
+void sim_reader_set_latency_us(DWORD latencyUs);
+void sim_reader_set_max_write(DWORD maxWriteBytes);
+void sim_reader_set_max_read(DWORD maxReadBytes);
+void sim_reader_set_rf_error_percent(DWORD percent);
+void sim_reader_set_count(size_t count);
+void sim_reader_set_tag_kind(SimTagKind kind); // used for every tag that is put on a reader from now on
+size_t sim_reader_count(void);
+
+// sim_reader_set_card_present puts a fresh tag (new UID, EM4423s get an empty NDEF message) on the reader or takes the tag away
+void sim_reader_set_card_present(size_t reader, BOOL present);
+
+// sim_reader_start_auto_swap starts a thread that takes the tags away every dwellMs milliseconds and puts fresh ones
+// down 1 ms later (like an operator feeding a production run), calling it again only changes the dwell time
+void sim_reader_start_auto_swap(DWORD dwellMs);
+
+#endif
@@ -0,0 +1,265 @@
+#include <string.h>
+
+#include "sun.h"
+
+// first 6 bytes of SV2, the input for the SDM MAC session key (AN12196, "SDM Session Key Generation")
+static const uint8_t SUN_SV2_PREFIX[6] = { 0x3C, 0xC3, 0x00, 0x01, 0x00, 0x80 };
+
+void sun_verifier_init(SunVerifier *verifier, const SunKeys *keys) {
+    aes128_init(&verifier->metaRead, keys->metaRead);
+    aes_cmac_init(&verifier->fileRead, keys->fileRead);
+}
+
+// -------------------- Parsing -------------------------------
+
+static int sun_hex_value(char c) {
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// sun_parse_hex decodes exactly 2 * length hex digits, returns 0 if one of them is not hex
+int sun_parse_hex(const char *hex, size_t length, uint8_t *out) {
+    for (size_t i = 0; i < length; i++) {
+        int high = sun_hex_value(hex[2 * i]);
+        int low = (high < 0) ? -1 : sun_hex_value(hex[2 * i + 1]);
+        if (low < 0) {
+            return 0;
+        }
+        out[i] = (uint8_t)((high << 4) | low);
+    }
+    return 1;
+}
+
+// sun_find_param returns the value of the first of the given parameter names in the query of url (NULL if none is there)
+static const char *sun_find_param(const char *url, const char *const names[2], size_t *valueLength) {
+    const char *query = strchr(url, '?');
+    for (const char *p = query; p != NULL; p = strchr(p + 1, '&')) {
+        for (int n = 0; n < 2; n++) {
+            size_t nameLength = strlen(names[n]);
+            if ((strncmp(p + 1, names[n], nameLength) == 0) && (p[1 + nameLength] == '=')) {
+                const char *value = p + 2 + nameLength;
+                *valueLength = strcspn(value, "&#\r\n ");
+                return value;
+            }
+        }
+    }
+    return NULL;
+}
+
+SunStatus sun_parse_url(const char *url, SunMacInput macInput, SunMessage *message) {
+    static const char *const PICC_NAMES[2] = { "e", "picc_data" };
+    static const char *const MAC_NAMES[2] = { "c", "cmac" };
+    memset(message, 0, sizeof(*message));
+    message->parsed = SUN_BAD_FORMAT;
+
+    size_t piccLength;
+    size_t macLength;
+    const char *picc = sun_find_param(url, PICC_NAMES, &piccLength);
+    const char *mac = sun_find_param(url, MAC_NAMES, &macLength);
+    if ((picc == NULL) || (mac == NULL) || (piccLength != 2 * SUN_PICC_DATA_LENGTH) || (macLength != 2 * SUN_MAC_LENGTH)) {
+        return SUN_BAD_FORMAT;
+    }
+    if (!sun_parse_hex(picc, SUN_PICC_DATA_LENGTH, message->piccData) || !sun_parse_hex(mac, SUN_MAC_LENGTH, message->mac)) {
+        return SUN_BAD_FORMAT;
+    }
+
+    // the MAC covers the url text from SDMMACInputOffset up to the MAC itself
+    if (macInput == SUN_MAC_INPUT_FROM_PICC_DATA) {
+        if ((mac < picc) || ((size_t)(mac - picc) > SUN_MAC_INPUT_MAX)) {
+            return SUN_BAD_FORMAT;
+        }
+        message->macInput = (const uint8_t *)picc;
+        message->macInputLength = (size_t)(mac - picc);
+    }
+    message->parsed = SUN_OK;
+    return SUN_OK;
+}
+
+// -------------------- Verification -------------------------------
+
+// sun_read_picc_data checks the decrypted PICCData and builds SV2 from it
+static SunStatus sun_read_picc_data(const uint8_t plain[SUN_PICC_DATA_LENGTH], SunResult *result, uint8_t sv2[AES_BLOCK_SIZE]) {
+    memset(result, 0, sizeof(*result));
+    result->piccTag = plain[0];
+    int hasUid = (plain[0] & SUN_PICC_TAG_UID) != 0;
+    int hasCounter = (plain[0] & SUN_PICC_TAG_COUNTER) != 0;
+    // bits 5 and 4 are RFU, the low nibble is the UID length (always 7 on an NTAG 424 DNA)
+    if ((plain[0] & 0x30) || (!hasUid && !hasCounter) || ((plain[0] & 0x0F) != (hasUid ? SUN_UID_LENGTH : 0))) {
+        return SUN_BAD_PICC_DATA;
+    }
+
+    memset(sv2, 0, AES_BLOCK_SIZE);
+    memcpy(sv2, SUN_SV2_PREFIX, sizeof(SUN_SV2_PREFIX));
+    size_t in = 1;
+    size_t out = sizeof(SUN_SV2_PREFIX);
+    if (hasUid) {
+        memcpy(result->uid, plain + in, SUN_UID_LENGTH);
+        memcpy(sv2 + out, plain + in, SUN_UID_LENGTH);
+        in += SUN_UID_LENGTH;
+        out += SUN_UID_LENGTH;
+    }
+    if (hasCounter) {
+        result->counter = plain[in] | ((uint32_t)plain[in + 1] << 8) | ((uint32_t)plain[in + 2] << 16);
+        memcpy(sv2 + out, plain + in, 3);
+    }
+    return SUN_OK;
+}
+
+// sun_truncate keeps the odd bytes S1 S3 .. S15 of the CMAC, which is what the tag mirrors
+static void sun_truncate(const uint8_t full[AES_BLOCK_SIZE], uint8_t mac[SUN_MAC_LENGTH]) {
+    for (int i = 0; i < SUN_MAC_LENGTH; i++) {
+        mac[i] = full[2 * i + 1];
+    }
+}
+
+// sun_mac_equal compares in constant time, so the time it takes tells nothing about how many bytes were right
+static int sun_mac_equal(const uint8_t a[SUN_MAC_LENGTH], const uint8_t b[SUN_MAC_LENGTH]) {
+    uint8_t diff = 0;
+    for (int i = 0; i < SUN_MAC_LENGTH; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+SunStatus sun_verify(const SunVerifier *verifier, const SunMessage *message, SunResult *result) {
+    uint8_t plain[SUN_PICC_DATA_LENGTH];
+    uint8_t sv2[AES_BLOCK_SIZE];
+    uint8_t sessionKey[AES_BLOCK_SIZE];
+    uint8_t full[AES_BLOCK_SIZE];
+    uint8_t mac[SUN_MAC_LENGTH];
+    AesCmac session;
+
+    if (message->parsed != SUN_OK) {
+        memset(result, 0, sizeof(*result));
+        result->status = message->parsed;
+        return result->status;
+    }
+
+    // one block with a zero IV, so CBC is just a block decryption
+    aes128_decrypt(&verifier->metaRead, message->piccData, plain);
+    result->status = sun_read_picc_data(plain, result, sv2);
+    if (result->status != SUN_OK) {
+        return result->status;
+    }
+
+    aes_cmac(&verifier->fileRead, sv2, sizeof(sv2), sessionKey);
+    aes_cmac_init(&session, sessionKey);
+    aes_cmac(&session, message->macInput, message->macInputLength, full);
+    sun_truncate(full, mac);
+    result->status = sun_mac_equal(mac, message->mac) ? SUN_OK : SUN_BAD_MAC;
+    return result->status;
+}
+
+// sun_verify_x4 is sun_verify for four messages in lockstep: every AES step of the four goes through one _x4 call.
+// lanes with bad PICCData run along with a dummy SV2 and keep their status
+static void sun_verify_x4(const SunVerifier *verifier, const SunMessage *const message[4], SunResult *const result[4]) {
+    uint8_t in[4][AES_BLOCK_SIZE];
+    uint8_t plain[4][AES_BLOCK_SIZE];
+    uint8_t sv2[4][AES_BLOCK_SIZE];
+    uint8_t sessionKey[4][AES_BLOCK_SIZE];
+    uint8_t full[4][AES_BLOCK_SIZE];
+    AesCmac session[4];
+    const Aes128 *metaRead[4];
+    const AesCmac *fileRead[4];
+    const AesCmac *sessions[4];
+    AesCmac *sessionInit[4];
+    const uint8_t *sv2Message[4];
+    const uint8_t *macInput[4];
+    size_t sv2Length[4];
+    size_t macInputLength[4];
+
+    for (int lane = 0; lane < 4; lane++) {
+        memcpy(in[lane], message[lane]->piccData, AES_BLOCK_SIZE);
+        metaRead[lane] = &verifier->metaRead;
+        fileRead[lane] = &verifier->fileRead;
+        sessions[lane] = &session[lane];
+        sessionInit[lane] = &session[lane];
+        sv2Message[lane] = sv2[lane];
+        sv2Length[lane] = AES_BLOCK_SIZE;
+        macInput[lane] = message[lane]->macInput;
+        macInputLength[lane] = message[lane]->macInputLength;
+    }
+
+    aes128_decrypt_x4(metaRead, (const uint8_t (*)[AES_BLOCK_SIZE])in, plain);
+    for (int lane = 0; lane < 4; lane++) {
+        if (message[lane]->parsed != SUN_OK) {
+            memset(result[lane], 0, sizeof(*result[lane]));
+            result[lane]->status = message[lane]->parsed;
+        } else {
+            result[lane]->status = sun_read_picc_data(plain[lane], result[lane], sv2[lane]);
+        }
+        if (result[lane]->status != SUN_OK) {
+            memset(sv2[lane], 0, AES_BLOCK_SIZE);
+            macInputLength[lane] = 0;
+        }
+    }
+
+    aes_cmac_x4(fileRead, sv2Message, sv2Length, sessionKey);
+    aes_cmac_init_x4(sessionInit, (const uint8_t (*)[AES_BLOCK_SIZE])sessionKey);
+    aes_cmac_x4(sessions, macInput, macInputLength, full);
+
+    for (int lane = 0; lane < 4; lane++) {
+        if (result[lane]->status == SUN_OK) {
+            uint8_t mac[SUN_MAC_LENGTH];
+            sun_truncate(full[lane], mac);
+            result[lane]->status = sun_mac_equal(mac, message[lane]->mac) ? SUN_OK : SUN_BAD_MAC;
+        }
+    }
+}
+
+void sun_verify_batch(const SunVerifier *verifier, const SunMessage *messages, size_t count, SunResult *results) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const SunMessage *const message[4] = { &messages[i], &messages[i + 1], &messages[i + 2], &messages[i + 3] };
+        SunResult *const result[4] = { &results[i], &results[i + 1], &results[i + 2], &results[i + 3] };
+        sun_verify_x4(verifier, message, result);
+    }
+    for (; i < count; i++) {
+        sun_verify(verifier, &messages[i], &results[i]);
+    }
+}
+
+void sun_make_message(const SunVerifier *verifier, const uint8_t uid[SUN_UID_LENGTH], uint32_t counter, const uint8_t random[5], SunMessage *message) {
+    uint8_t plain[SUN_PICC_DATA_LENGTH];
+    uint8_t sv2[AES_BLOCK_SIZE] = {0};
+    uint8_t sessionKey[AES_BLOCK_SIZE];
+    uint8_t full[AES_BLOCK_SIZE];
+    AesCmac session;
+
+    plain[0] = SUN_PICC_TAG_UID | SUN_PICC_TAG_COUNTER | SUN_UID_LENGTH;
+    memcpy(plain + 1, uid, SUN_UID_LENGTH);
+    plain[8] = (uint8_t)counter;
+    plain[9] = (uint8_t)(counter >> 8);
+    plain[10] = (uint8_t)(counter >> 16);
+    memcpy(plain + 11, random, 5);
+
+    memset(message, 0, sizeof(*message));
+    // the tag encrypts, so this needs the inverse of sun_verify: encrypt with K_SDMMetaRead (zero IV, one block)
+    aes128_encrypt(&verifier->metaRead, plain, message->piccData);
+
+    memcpy(sv2, SUN_SV2_PREFIX, sizeof(SUN_SV2_PREFIX));
+    memcpy(sv2 + sizeof(SUN_SV2_PREFIX), plain + 1, SUN_UID_LENGTH + 3);
+    aes_cmac(&verifier->fileRead, sv2, sizeof(sv2), sessionKey);
+    aes_cmac_init(&session, sessionKey);
+    aes_cmac(&session, NULL, 0, full);
+    sun_truncate(full, message->mac);
+    message->parsed = SUN_OK;
+}
+
+const char *sun_status_name(SunStatus status) {
+    switch (status) {
+        case SUN_OK:            return "ok";
+        case SUN_BAD_FORMAT:    return "bad format";
+        case SUN_BAD_PICC_DATA: return "bad PICCData";
+        case SUN_BAD_MAC:       return "bad MAC";
+        default:                return "unknown";
+    }
+}
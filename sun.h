@@ -0,0 +1,81 @@
+#ifndef SUN_H
+#define SUN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+// Offline verification of NTAG 424 DNA Secure Unique NFC messages (SUN / SDM, NXP AN12196), e.g. a scanned
+//      https://example.com/tag?e=EF963FF7828658A599F3041510671E88&c=94EED9EE65337086
+// e (or picc_data) is the encrypted PICCData: AES-128-CBC with K_SDMMetaRead and a zero IV over
+//      PICCDataTag | UID (7) | SDMReadCtr (3, LSB first) | random padding
+// c (or cmac) is the SDM MAC: the session key KSesSDMFileReadMAC = CMAC(K_SDMFileRead, SV2) with
+//      SV2 = 3C C3 00 01 00 80 | UID | SDMReadCtr (zero padded to 16 bytes)
+// and MAC = CMAC(KSesSDMFileReadMAC, MAC input) truncated to its 8 odd bytes (S1 S3 .. S15).
+// sun_verify_batch does the same for many messages, four at a time through the _x4 functions of aes.h. no PC/SC needed.
+// encrypted file data (SDMENCFileData) is not covered.
+
+#define SUN_UID_LENGTH          7
+#define SUN_PICC_DATA_LENGTH    16
+#define SUN_MAC_LENGTH          8
+#define SUN_MAC_INPUT_MAX       256
+
+#define SUN_PICC_TAG_UID        0x80    // PICCDataTag: UID is mirrored
+#define SUN_PICC_TAG_COUNTER    0x40    // PICCDataTag: SDMReadCtr is mirrored
+
+typedef enum SunMacInput {
+    SUN_MAC_INPUT_EMPTY,                // SDMMACInputOffset = SDMMACOffset (what AN12196 uses and most tags are set up with)
+    SUN_MAC_INPUT_FROM_PICC_DATA,       // SDMMACInputOffset points at the PICCData, the input is "<e value>&c="
+} SunMacInput;
+
+typedef enum SunStatus {
+    SUN_OK,
+    SUN_BAD_FORMAT,                     // no e / c parameter or not hex of the right length
+    SUN_BAD_PICC_DATA,                  // decrypted PICCData does not look like one (wrong key for K_SDMMetaRead?)
+    SUN_BAD_MAC,                        // MAC does not match (wrong K_SDMFileRead or message was tampered with)
+} SunStatus;
+
+typedef struct SunKeys {
+    uint8_t metaRead[AES_BLOCK_SIZE];   // K_SDMMetaRead, decrypts the PICCData
+    uint8_t fileRead[AES_BLOCK_SIZE];   // K_SDMFileRead, the SDM MAC session key is derived from it
+} SunKeys;
+
+// SunVerifier holds the expanded keys, set it up once and share it between threads (it is only read)
+typedef struct SunVerifier {
+    Aes128 metaRead;
+    AesCmac fileRead;
+} SunVerifier;
+
+// SunMessage is one scanned message. macInput points into the url that sun_parse_url was given
+typedef struct SunMessage {
+    uint8_t piccData[SUN_PICC_DATA_LENGTH];
+    uint8_t mac[SUN_MAC_LENGTH];
+    const uint8_t *macInput;
+    size_t macInputLength;
+    SunStatus parsed;                   // SUN_BAD_FORMAT if the url could not be parsed, verifying then just copies it
+} SunMessage;
+
+typedef struct SunResult {
+    SunStatus status;
+    uint8_t piccTag;
+    uint8_t uid[SUN_UID_LENGTH];        // all 0 if the tag does not mirror its UID
+    uint32_t counter;                   // SDMReadCtr, 0 if it is not mirrored
+} SunResult;
+
+void sun_verifier_init(SunVerifier *verifier, const SunKeys *keys);
+
+// sun_parse_url finds e= / picc_data= and c= / cmac= in the query of url
+SunStatus sun_parse_url(const char *url, SunMacInput macInput, SunMessage *message);
+
+SunStatus sun_verify(const SunVerifier *verifier, const SunMessage *message, SunResult *result);
+// sun_verify_batch verifies count messages, results[i] belongs to messages[i]
+void sun_verify_batch(const SunVerifier *verifier, const SunMessage *messages, size_t count, SunResult *results);
+
+// sun_make_message builds a valid message for uid / counter (used by the self test and the benchmark of nfc-sun)
+void sun_make_message(const SunVerifier *verifier, const uint8_t uid[SUN_UID_LENGTH], uint32_t counter, const uint8_t random[5], SunMessage *message);
+
+const char *sun_status_name(SunStatus status);
+int sun_parse_hex(const char *hex, size_t length, uint8_t *out);
+
+#endif
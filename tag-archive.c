@@ -0,0 +1,651 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "tag-archive.h"
+#include "timing.h"
+#include "logging.h"
+
+#define TAG_ARCHIVE_INDEX_MIN_CAPACITY  1024
+#define TAG_ARCHIVE_MAP_MIN             (1u << 20)  // the data mapping grows in steps of at least 1 MB (and doubles)
+
+// field offsets of the index header
+#define TAG_ARCHIVE_INDEX_CAPACITY      16
+#define TAG_ARCHIVE_INDEX_UIDS          24
+#define TAG_ARCHIVE_INDEX_RECORDS       32
+#define TAG_ARCHIVE_INDEX_END           40
+#define TAG_ARCHIVE_INDEX_CREATED       48
+
+// -------------------- Helpers -------------------------------
+
+static void tag_archive_put_le(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint64_t tag_archive_get_le(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static uint32_t tagArchiveCrcTable[256];
+static pthread_once_t tagArchiveCrcOnce = PTHREAD_ONCE_INIT;
+
+static void tag_archive_crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320u : 0);
+        }
+        tagArchiveCrcTable[i] = crc;
+    }
+}
+
+static uint32_t tag_archive_crc_update(uint32_t crc, const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        crc = tagArchiveCrcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// tag_archive_record_crc is the crc32 of the record header (with its crc field taken as 0) and the image
+static uint32_t tag_archive_record_crc(const uint8_t *header, const uint8_t *image, size_t imageLength) {
+    static const uint8_t zero[4] = {0};
+    pthread_once(&tagArchiveCrcOnce, tag_archive_crc_init);
+    uint32_t crc = 0xFFFFFFFFu;
+    crc = tag_archive_crc_update(crc, header, 24);
+    crc = tag_archive_crc_update(crc, zero, sizeof(zero));
+    crc = tag_archive_crc_update(crc, header + 28, TAG_ARCHIVE_RECORD_HEADER_SIZE - 28);
+    crc = tag_archive_crc_update(crc, image, imageLength);
+    return ~crc;
+}
+
+// FNV-1a over length and UID, 0 marks an empty slot so it is never returned
+static uint64_t tag_archive_hash(const uint8_t *uid, uint8_t uidLength) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    hash = (hash ^ uidLength) * 0x100000001B3ull;
+    for (uint8_t i = 0; i < uidLength; i++) {
+        hash = (hash ^ uid[i]) * 0x100000001B3ull;
+    }
+    return (hash == 0) ? 1 : hash;
+}
+
+static uint64_t tag_archive_record_length(size_t imageLength) {
+    return (TAG_ARCHIVE_RECORD_HEADER_SIZE + imageLength + 7) & ~(uint64_t)7;
+}
+
+// tag_archive_parse turns the record at offset into a view, limit is where readable data ends
+static TagArchiveStatus tag_archive_parse(const uint8_t *data, uint64_t limit, uint64_t offset, TagArchiveRecord *record) {
+    if ((offset < TAG_ARCHIVE_HEADER_SIZE) || (offset + TAG_ARCHIVE_RECORD_HEADER_SIZE > limit)) {
+        return TAG_ARCHIVE_CORRUPT;
+    }
+    const uint8_t *header = data + offset;
+    uint64_t length = tag_archive_get_le(header + 4, 4);
+    uint16_t imageLength = (uint16_t)tag_archive_get_le(header + 28, 2);
+    if ((tag_archive_get_le(header, 4) != TAG_ARCHIVE_RECORD_MAGIC) || (length != tag_archive_record_length(imageLength))
+        || (offset + length > limit) || (header[32] > TAG_ARCHIVE_UID_MAX)) {
+        return TAG_ARCHIVE_CORRUPT;
+    }
+
+    record->offset = offset;
+    record->timestamp = tag_archive_get_le(header + 8, 8);
+    record->previous = tag_archive_get_le(header + 16, 8);
+    record->imageLength = imageLength;
+    record->tagType = header[30];
+    record->pageSize = header[31];
+    record->uidLength = header[32];
+    record->uid = header + 33;
+    record->image = header + TAG_ARCHIVE_RECORD_HEADER_SIZE;
+    return TAG_ARCHIVE_OK;
+}
+
+// tag_archive_map_data makes sure the data mapping reaches `need` bytes. the mapping is made bigger than the file, so
+// appends only remap every now and then (nothing past the end of the file is ever touched)
+static TagArchiveStatus tag_archive_map_data(TagArchive *archive, uint64_t need) {
+    if ((archive->data != NULL) && (need <= archive->dataMapped)) {
+        return TAG_ARCHIVE_OK;
+    }
+    size_t size = TAG_ARCHIVE_MAP_MIN;
+    while (size < need * 2) {
+        size *= 2;
+    }
+    if (archive->data != NULL) {
+        munmap((void *)archive->data, archive->dataMapped);
+        archive->data = NULL;
+    }
+    void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, archive->fd, 0);
+    if (data == MAP_FAILED) {
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    // scans go front to back
+    posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+    archive->data = data;
+    archive->dataMapped = size;
+    return TAG_ARCHIVE_OK;
+}
+
+// -------------------- Index -------------------------------
+
+static uint8_t *tag_archive_slot(const TagArchive *archive, uint64_t slot) {
+    return archive->index + TAG_ARCHIVE_HEADER_SIZE + slot * TAG_ARCHIVE_INDEX_SLOT_SIZE;
+}
+
+static uint64_t tag_archive_index_get(const TagArchive *archive, int field) {
+    return tag_archive_get_le(archive->index + field, 8);
+}
+
+static void tag_archive_index_set(TagArchive *archive, int field, uint64_t value) {
+    tag_archive_put_le(archive->index + field, value, 8);
+}
+
+static void tag_archive_index_release(TagArchive *archive) {
+    if (archive->index != NULL) {
+        if (archive->indexMalloced) {
+            free(archive->index);
+        } else {
+            munmap(archive->index, archive->indexSize);
+        }
+    }
+    if (archive->indexFd >= 0) {
+        close(archive->indexFd);
+    }
+    archive->index = NULL;
+    archive->indexFd = -1;
+    archive->indexMalloced = 0;
+}
+
+// tag_archive_index_new puts an empty index of capacity slots in memory (tag_archive_index_persist writes it out)
+static TagArchiveStatus tag_archive_index_new(TagArchive *archive, uint64_t capacity, uint8_t **index) {
+    size_t size = TAG_ARCHIVE_HEADER_SIZE + capacity * TAG_ARCHIVE_INDEX_SLOT_SIZE;
+    *index = calloc(1, size);
+    if (*index == NULL) {
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    memcpy(*index, TAG_ARCHIVE_INDEX_MAGIC, 8);
+    tag_archive_put_le(*index + 8, TAG_ARCHIVE_VERSION, 4);
+    tag_archive_put_le(*index + 12, TAG_ARCHIVE_INDEX_SLOT_SIZE, 4);
+    tag_archive_put_le(*index + TAG_ARCHIVE_INDEX_CAPACITY, capacity, 8);
+    tag_archive_put_le(*index + TAG_ARCHIVE_INDEX_END, TAG_ARCHIVE_HEADER_SIZE, 8);
+    tag_archive_put_le(*index + TAG_ARCHIVE_INDEX_CREATED, archive->created, 8);
+    return TAG_ARCHIVE_OK;
+}
+
+// tag_archive_index_persist writes an in-memory index to "<path>.idx" (temporary file + rename, so readers never see a
+// half written index) and maps the file instead. read only archives keep the index in memory
+static TagArchiveStatus tag_archive_index_persist(TagArchive *archive) {
+    if (!archive->writable || !archive->indexMalloced) {
+        return TAG_ARCHIVE_OK;
+    }
+    size_t length = strlen(archive->indexPath);
+    char *tmpPath = malloc(length + 5);
+    if (tmpPath == NULL) {
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    memcpy(tmpPath, archive->indexPath, length);
+    memcpy(tmpPath + length, ".tmp", 5);
+
+    TagArchiveStatus status = TAG_ARCHIVE_IO_ERROR;
+    int fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    size_t done = 0;
+    while ((fd >= 0) && (done < archive->indexSize)) {
+        ssize_t n = write(fd, archive->index + done, archive->indexSize - done);
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    if ((done == archive->indexSize) && (rename(tmpPath, archive->indexPath) == 0)) {
+        void *index = mmap(NULL, archive->indexSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (index != MAP_FAILED) {
+            free(archive->index);
+            archive->index = index;
+            archive->indexMalloced = 0;
+            if (archive->indexFd >= 0) {
+                close(archive->indexFd);
+            }
+            archive->indexFd = fd;
+            fd = -1;
+            status = TAG_ARCHIVE_OK;
+        }
+    } else {
+        unlink(tmpPath);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(tmpPath);
+    return status;
+}
+
+// tag_archive_index_find looks for the slot of uid. returns 1 with *slot on the entry if it is there, otherwise 0 with
+// *slot on the empty slot where it belongs, -1 if the table has no empty slot (only a broken index can get there, the
+// table grows at half full). equal hashes are told apart by the UID in the record
+static int tag_archive_index_find(const TagArchive *archive, const uint8_t *uid, uint8_t uidLength, uint64_t hash, uint64_t *slot) {
+    uint64_t mask = archive->capacity - 1;
+    uint64_t i = hash & mask;
+    for (uint64_t probe = 0; probe < archive->capacity; probe++, i = (i + 1) & mask) {
+        const uint8_t *entry = tag_archive_slot(archive, i);
+        uint64_t entryHash = tag_archive_get_le(entry, 8);
+        if (entryHash == 0) {
+            *slot = i;
+            return 0;
+        }
+        if (entryHash != hash) {
+            continue;
+        }
+        TagArchiveRecord record;
+        if ((tag_archive_parse(archive->data, archive->end, tag_archive_get_le(entry + 8, 8), &record) == TAG_ARCHIVE_OK)
+            && (record.uidLength == uidLength) && (memcmp(record.uid, uid, uidLength) == 0)) {
+            *slot = i;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// tag_archive_index_grow doubles the slots once the table is half full. entries move by their stored hash, the data
+// file is not touched
+static TagArchiveStatus tag_archive_index_grow(TagArchive *archive) {
+    if (tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_UIDS) * 2 < archive->capacity) {
+        return TAG_ARCHIVE_OK;
+    }
+    uint64_t capacity = archive->capacity * 2;
+    uint8_t *index;
+    if (tag_archive_index_new(archive, capacity, &index) != TAG_ARCHIVE_OK) {
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    memcpy(index + TAG_ARCHIVE_INDEX_UIDS, archive->index + TAG_ARCHIVE_INDEX_UIDS, 8 * 3); // uids, records, indexed end
+    for (uint64_t i = 0; i < archive->capacity; i++) {
+        const uint8_t *entry = tag_archive_slot(archive, i);
+        uint64_t hash = tag_archive_get_le(entry, 8);
+        if (hash == 0) {
+            continue;
+        }
+        uint64_t slot = hash & (capacity - 1);
+        while (tag_archive_get_le(index + TAG_ARCHIVE_HEADER_SIZE + slot * TAG_ARCHIVE_INDEX_SLOT_SIZE, 8) != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        memcpy(index + TAG_ARCHIVE_HEADER_SIZE + slot * TAG_ARCHIVE_INDEX_SLOT_SIZE, entry, TAG_ARCHIVE_INDEX_SLOT_SIZE);
+    }
+
+    int indexFd = archive->indexFd;
+    archive->indexFd = -1;
+    tag_archive_index_release(archive);
+    archive->indexFd = indexFd;
+    archive->index = index;
+    archive->indexMalloced = 1;
+    archive->indexSize = TAG_ARCHIVE_HEADER_SIZE + capacity * TAG_ARCHIVE_INDEX_SLOT_SIZE;
+    archive->capacity = capacity;
+    return tag_archive_index_persist(archive);
+}
+
+// tag_archive_index_add makes the record the newest one of its UID (the caller grows the table first)
+static TagArchiveStatus tag_archive_index_add(TagArchive *archive, const TagArchiveRecord *record) {
+    uint64_t hash = tag_archive_hash(record->uid, record->uidLength);
+    uint64_t slot;
+    int found = tag_archive_index_find(archive, record->uid, record->uidLength, hash, &slot);
+    if (found < 0) {
+        return TAG_ARCHIVE_CORRUPT;
+    }
+    if (!found) {
+        tag_archive_put_le(tag_archive_slot(archive, slot), hash, 8);
+        tag_archive_index_set(archive, TAG_ARCHIVE_INDEX_UIDS, tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_UIDS) + 1);
+    }
+    tag_archive_put_le(tag_archive_slot(archive, slot) + 8, record->offset, 8);
+    tag_archive_index_set(archive, TAG_ARCHIVE_INDEX_RECORDS, tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_RECORDS) + 1);
+    tag_archive_index_set(archive, TAG_ARCHIVE_INDEX_END, record->offset + tag_archive_record_length(record->imageLength));
+    return TAG_ARCHIVE_OK;
+}
+
+// tag_archive_index_adopt maps an existing index file, returns FALSE-ish (not OK) if it is missing or does not belong
+// to this data file
+static TagArchiveStatus tag_archive_index_adopt(TagArchive *archive, uint64_t fileSize) {
+    int fd = open(archive->indexPath, archive->writable ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) != 0) || (st.st_size < TAG_ARCHIVE_HEADER_SIZE)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return TAG_ARCHIVE_NOT_FOUND;
+    }
+    // read only archives map the index privately: records that still have to be indexed only change the copy
+    void *index = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, archive->writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (index == MAP_FAILED) {
+        close(fd);
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    archive->index = index;
+    archive->indexSize = (size_t)st.st_size;
+    archive->indexFd = fd;
+    archive->indexMalloced = 0;
+
+    uint64_t capacity = tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_CAPACITY);
+    uint64_t indexedEnd = tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_END);
+    if ((memcmp(archive->index, TAG_ARCHIVE_INDEX_MAGIC, 8) != 0) || (tag_archive_get_le(archive->index + 8, 4) != TAG_ARCHIVE_VERSION)
+        || (tag_archive_get_le(archive->index + 12, 4) != TAG_ARCHIVE_INDEX_SLOT_SIZE)
+        || (capacity == 0) || ((capacity & (capacity - 1)) != 0)
+        || ((uint64_t)st.st_size != TAG_ARCHIVE_HEADER_SIZE + capacity * TAG_ARCHIVE_INDEX_SLOT_SIZE)
+        || (tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_CREATED) != archive->created)
+        || (indexedEnd < TAG_ARCHIVE_HEADER_SIZE) || (indexedEnd > fileSize)) {
+        tag_archive_index_release(archive);
+        return TAG_ARCHIVE_BAD_FORMAT;
+    }
+    // the slots come from disk as well: every entry has to point at a record below the indexed end, and the table has
+    // to be at most half full like tag_archive_index_grow keeps it, otherwise probes could run around it forever
+    uint64_t uids = 0;
+    int slotsValid = 1;
+    for (uint64_t i = 0; (i < capacity) && slotsValid; i++) {
+        const uint8_t *entry = archive->index + TAG_ARCHIVE_HEADER_SIZE + i * TAG_ARCHIVE_INDEX_SLOT_SIZE;
+        if (tag_archive_get_le(entry, 8) == 0) {
+            continue;
+        }
+        uint64_t offset = tag_archive_get_le(entry + 8, 8);
+        slotsValid = (offset >= TAG_ARCHIVE_HEADER_SIZE) && (offset + TAG_ARCHIVE_RECORD_HEADER_SIZE <= indexedEnd);
+        uids++;
+    }
+    if (!slotsValid || (uids * 2 > capacity) || (uids != tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_UIDS))
+        || (tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_RECORDS) < uids)) {
+        tag_archive_index_release(archive);
+        return TAG_ARCHIVE_BAD_FORMAT;
+    }
+    archive->capacity = capacity;
+    return TAG_ARCHIVE_OK;
+}
+
+// tag_archive_catch_up walks the records behind `from` up to the end of the file, checks their checksums and adds them
+// to the index. the first broken record ends the archive (a crash in the middle of an append), writers cut it off
+static TagArchiveStatus tag_archive_catch_up(TagArchive *archive, uint64_t from, uint64_t fileSize) {
+    uint64_t offset = from;
+    archive->end = fileSize;
+    while (offset < fileSize) {
+        TagArchiveRecord record;
+        if ((tag_archive_parse(archive->data, fileSize, offset, &record) != TAG_ARCHIVE_OK)
+            || (tag_archive_check(archive, &record) != TAG_ARCHIVE_OK)) {
+            break;
+        }
+        if (tag_archive_index_grow(archive) != TAG_ARCHIVE_OK) {
+            return TAG_ARCHIVE_IO_ERROR;
+        }
+        TagArchiveStatus status = tag_archive_index_add(archive, &record);
+        if (status != TAG_ARCHIVE_OK) {
+            return status;
+        }
+        offset += tag_archive_record_length(record.imageLength);
+    }
+    archive->end = offset;
+
+    if (offset < fileSize) {
+        LOG_WARN("Archive ends with %llu bytes that are not a complete record (interrupted append?)%s.",
+                 (unsigned long long)(fileSize - offset), archive->writable ? ", cutting them off" : "");
+        if (archive->writable && (ftruncate(archive->fd, (off_t)offset) != 0)) {
+            return TAG_ARCHIVE_IO_ERROR;
+        }
+    }
+    return TAG_ARCHIVE_OK;
+}
+
+// -------------------- Open / close -------------------------------
+
+TagArchiveStatus tag_archive_open(TagArchive *archive, const char *path, int writable) {
+    memset(archive, 0, sizeof(*archive));
+    archive->indexFd = -1;
+    archive->writable = writable;
+    archive->fd = open(path, writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (archive->fd < 0) {
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    // one writer at a time: a second one would append at the same offsets and rewrite the index under the first one.
+    // the lock goes away with the descriptor, also when the writer crashes
+    if (writable && (flock(archive->fd, LOCK_EX | LOCK_NB) != 0)) {
+        TagArchiveStatus status = (errno == EWOULDBLOCK) ? TAG_ARCHIVE_LOCKED : TAG_ARCHIVE_IO_ERROR;
+        tag_archive_close(archive);
+        return status;
+    }
+
+    struct stat st;
+    if (fstat(archive->fd, &st) != 0) {
+        tag_archive_close(archive);
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    uint8_t header[TAG_ARCHIVE_HEADER_SIZE] = {0};
+    if ((st.st_size == 0) && writable) {
+        memcpy(header, TAG_ARCHIVE_MAGIC, 8);
+        tag_archive_put_le(header + 8, TAG_ARCHIVE_VERSION, 4);
+        tag_archive_put_le(header + 12, TAG_ARCHIVE_HEADER_SIZE, 4);
+        tag_archive_put_le(header + 16, timing_wall_ns(), 8);
+        if (pwrite(archive->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+            tag_archive_close(archive);
+            return TAG_ARCHIVE_IO_ERROR;
+        }
+        st.st_size = TAG_ARCHIVE_HEADER_SIZE;
+    } else if ((st.st_size < TAG_ARCHIVE_HEADER_SIZE) || (pread(archive->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header))) {
+        tag_archive_close(archive);
+        return TAG_ARCHIVE_BAD_FORMAT;
+    }
+    if ((memcmp(header, TAG_ARCHIVE_MAGIC, 8) != 0) || (tag_archive_get_le(header + 8, 4) != TAG_ARCHIVE_VERSION)
+        || (tag_archive_get_le(header + 12, 4) != TAG_ARCHIVE_HEADER_SIZE)) {
+        tag_archive_close(archive);
+        return TAG_ARCHIVE_BAD_FORMAT;
+    }
+    archive->created = tag_archive_get_le(header + 16, 8);
+
+    uint64_t fileSize = (uint64_t)st.st_size;
+    size_t pathLength = strlen(path);
+    archive->indexPath = malloc(pathLength + 5);
+    if ((archive->indexPath == NULL) || (tag_archive_map_data(archive, fileSize) != TAG_ARCHIVE_OK)) {
+        tag_archive_close(archive);
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    memcpy(archive->indexPath, path, pathLength);
+    memcpy(archive->indexPath + pathLength, ".idx", 5);
+
+    // a usable index only needs the records behind its indexed end, otherwise it is built from the whole file
+    TagArchiveStatus status;
+    uint64_t from = TAG_ARCHIVE_HEADER_SIZE;
+    if (tag_archive_index_adopt(archive, fileSize) == TAG_ARCHIVE_OK) {
+        from = tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_END);
+    } else {
+        if (fileSize > TAG_ARCHIVE_HEADER_SIZE) {
+            LOG_WARN("Index %s is missing or stale, rebuilding it.", archive->indexPath);
+        }
+        status = tag_archive_index_new(archive, TAG_ARCHIVE_INDEX_MIN_CAPACITY, &archive->index);
+        if (status != TAG_ARCHIVE_OK) {
+            tag_archive_close(archive);
+            return status;
+        }
+        archive->indexMalloced = 1;
+        archive->indexSize = TAG_ARCHIVE_HEADER_SIZE + TAG_ARCHIVE_INDEX_MIN_CAPACITY * TAG_ARCHIVE_INDEX_SLOT_SIZE;
+        archive->capacity = TAG_ARCHIVE_INDEX_MIN_CAPACITY;
+    }
+
+    status = tag_archive_catch_up(archive, from, fileSize);
+    if (status == TAG_ARCHIVE_OK) {
+        status = tag_archive_index_persist(archive);
+    }
+    if (status != TAG_ARCHIVE_OK) {
+        tag_archive_close(archive);
+    }
+    return status;
+}
+
+void tag_archive_close(TagArchive *archive) {
+    tag_archive_index_release(archive);
+    if (archive->data != NULL) {
+        munmap((void *)archive->data, archive->dataMapped);
+    }
+    if (archive->fd >= 0) {
+        close(archive->fd);
+    }
+    free(archive->indexPath);
+    memset(archive, 0, sizeof(*archive));
+    archive->fd = -1;
+    archive->indexFd = -1;
+}
+
+TagArchiveStatus tag_archive_sync(TagArchive *archive) {
+    if (!archive->writable) {
+        return TAG_ARCHIVE_READ_ONLY;
+    }
+    if (fdatasync(archive->fd) != 0) {
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    if ((archive->indexFd >= 0) && (msync(archive->index, archive->indexSize, MS_SYNC) != 0)) {
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    return TAG_ARCHIVE_OK;
+}
+
+TagArchiveStatus tag_archive_reindex(TagArchive *archive) {
+    if (!archive->writable) {
+        return TAG_ARCHIVE_READ_ONLY;
+    }
+    uint64_t end = archive->end;
+    tag_archive_index_release(archive);
+    TagArchiveStatus status = tag_archive_index_new(archive, TAG_ARCHIVE_INDEX_MIN_CAPACITY, &archive->index);
+    if (status != TAG_ARCHIVE_OK) {
+        return status;
+    }
+    archive->indexMalloced = 1;
+    archive->indexSize = TAG_ARCHIVE_HEADER_SIZE + TAG_ARCHIVE_INDEX_MIN_CAPACITY * TAG_ARCHIVE_INDEX_SLOT_SIZE;
+    archive->capacity = TAG_ARCHIVE_INDEX_MIN_CAPACITY;
+    status = tag_archive_catch_up(archive, TAG_ARCHIVE_HEADER_SIZE, end);
+    return (status == TAG_ARCHIVE_OK) ? tag_archive_index_persist(archive) : status;
+}
+
+// -------------------- Records -------------------------------
+
+TagArchiveStatus tag_archive_append(TagArchive *archive, const uint8_t *uid, uint8_t uidLength, uint8_t tagType, uint8_t pageSize,
+                                    const uint8_t *image, size_t imageLength, uint64_t timestamp, uint64_t *offset) {
+    if (!archive->writable) {
+        return TAG_ARCHIVE_READ_ONLY;
+    }
+    if ((uidLength > TAG_ARCHIVE_UID_MAX) || (imageLength > TAG_ARCHIVE_IMAGE_MAX)) {
+        return TAG_ARCHIVE_TOO_BIG;
+    }
+    if (tag_archive_index_grow(archive) != TAG_ARCHIVE_OK) {
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+
+    uint64_t slot;
+    uint64_t previous = 0;
+    int found = tag_archive_index_find(archive, uid, uidLength, tag_archive_hash(uid, uidLength), &slot);
+    if (found < 0) {
+        return TAG_ARCHIVE_CORRUPT;
+    }
+    if (found) {
+        previous = tag_archive_get_le(tag_archive_slot(archive, slot) + 8, 8);
+    }
+
+    uint64_t length = tag_archive_record_length(imageLength);
+    uint8_t header[TAG_ARCHIVE_RECORD_HEADER_SIZE] = {0};
+    static const uint8_t padding[8] = {0};
+    tag_archive_put_le(header, TAG_ARCHIVE_RECORD_MAGIC, 4);
+    tag_archive_put_le(header + 4, length, 4);
+    tag_archive_put_le(header + 8, timestamp, 8);
+    tag_archive_put_le(header + 16, previous, 8);
+    tag_archive_put_le(header + 28, imageLength, 2);
+    header[30] = tagType;
+    header[31] = pageSize;
+    header[32] = uidLength;
+    memcpy(header + 33, uid, uidLength);
+    tag_archive_put_le(header + 24, tag_archive_record_crc(header, image, imageLength), 4);
+
+    // header, image and padding in one write. the index only learns about the record once it is completely in the file
+    struct iovec parts[3] = {
+        { header, sizeof(header) },
+        { (void *)image, imageLength },
+        { (void *)padding, (size_t)(length - sizeof(header) - imageLength) },
+    };
+    if ((lseek(archive->fd, (off_t)archive->end, SEEK_SET) < 0) || (writev(archive->fd, parts, 3) != (ssize_t)length)) {
+        int error = errno;
+        if (ftruncate(archive->fd, (off_t)archive->end) != 0) {
+            LOG_ERROR("Could not cut off a failed append, the next open will.");
+        }
+        errno = error;
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+
+    TagArchiveRecord record;
+    uint64_t recordOffset = archive->end;
+    archive->end += length;
+    if ((tag_archive_map_data(archive, archive->end) != TAG_ARCHIVE_OK)
+        || (tag_archive_parse(archive->data, archive->end, recordOffset, &record) != TAG_ARCHIVE_OK)) {
+        return TAG_ARCHIVE_IO_ERROR;
+    }
+    TagArchiveStatus status = tag_archive_index_add(archive, &record);
+    if (status != TAG_ARCHIVE_OK) {
+        return status;
+    }
+    if (offset != NULL) {
+        *offset = recordOffset;
+    }
+    return TAG_ARCHIVE_OK;
+}
+
+TagArchiveStatus tag_archive_lookup(TagArchive *archive, const uint8_t *uid, uint8_t uidLength, TagArchiveRecord *record) {
+    uint64_t slot;
+    if ((uidLength > TAG_ARCHIVE_UID_MAX) || (tag_archive_index_find(archive, uid, uidLength, tag_archive_hash(uid, uidLength), &slot) != 1)) {
+        return TAG_ARCHIVE_NOT_FOUND;
+    }
+    return tag_archive_read(archive, tag_archive_get_le(tag_archive_slot(archive, slot) + 8, 8), record);
+}
+
+TagArchiveStatus tag_archive_read(TagArchive *archive, uint64_t offset, TagArchiveRecord *record) {
+    return tag_archive_parse(archive->data, archive->end, offset, record);
+}
+
+TagArchiveStatus tag_archive_next(TagArchive *archive, uint64_t *cursor, TagArchiveRecord *record) {
+    if (*cursor < TAG_ARCHIVE_HEADER_SIZE) {
+        *cursor = TAG_ARCHIVE_HEADER_SIZE;
+    }
+    if (*cursor >= archive->end) {
+        return TAG_ARCHIVE_END;
+    }
+    TagArchiveStatus status = tag_archive_parse(archive->data, archive->end, *cursor, record);
+    if (status == TAG_ARCHIVE_OK) {
+        *cursor += tag_archive_record_length(record->imageLength);
+    }
+    return status;
+}
+
+TagArchiveStatus tag_archive_check(const TagArchive *archive, const TagArchiveRecord *record) {
+    const uint8_t *header = archive->data + record->offset;
+    uint32_t stored = (uint32_t)tag_archive_get_le(header + 24, 4);
+    return (tag_archive_record_crc(header, record->image, record->imageLength) == stored) ? TAG_ARCHIVE_OK : TAG_ARCHIVE_CORRUPT;
+}
+
+uint64_t tag_archive_uid_count(const TagArchive *archive) {
+    return tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_UIDS);
+}
+
+uint64_t tag_archive_record_count(const TagArchive *archive) {
+    return tag_archive_index_get(archive, TAG_ARCHIVE_INDEX_RECORDS);
+}
+
+const char *tag_archive_status_name(TagArchiveStatus status) {
+    switch (status) {
+    case TAG_ARCHIVE_OK:          return "ok";
+    case TAG_ARCHIVE_END:         return "end of archive";
+    case TAG_ARCHIVE_NOT_FOUND:   return "not found";
+    case TAG_ARCHIVE_IO_ERROR:    return "i/o error";
+    case TAG_ARCHIVE_BAD_FORMAT:  return "not a tag archive";
+    case TAG_ARCHIVE_CORRUPT:     return "corrupt record";
+    case TAG_ARCHIVE_READ_ONLY:   return "archive is read only";
+    case TAG_ARCHIVE_TOO_BIG:     return "uid or image too big";
+    case TAG_ARCHIVE_LOCKED:      return "archive is open for writing elsewhere";
+    }
+    return "unknown";
+}
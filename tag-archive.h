@@ -0,0 +1,110 @@
+#ifndef TAG_ARCHIVE_H
+#define TAG_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only archive of tag memory dumps (written by main --archive, read by nfc-archive). one data file holds the
+// records, "<path>.idx" is a hash table from UID to the newest record of that UID, and every record points back to the
+// previous dump of the same tag, so the history of a UID is a chain of offsets. both files are memory mapped: a lookup is
+// one probe into the index plus one record read, a scan walks the data file sequentially without copying anything.
+// all integers are little endian, no PC/SC dependency.
+//
+//      data header (64 bytes):    "NFCARCHV" | u32 version | u32 header size | u64 created (ns since 1970) | reserved
+//      record header (48 bytes):  u32 magic "TREC" | u32 record length (header + image, padded to 8) | u64 timestamp (ns)
+//                                 | u64 offset of the previous record of this UID (0 = none) | u32 crc32 (header with
+//                                 crc 0, then image) | u16 image length | u8 tag type (TagType) | u8 page size
+//                                 | u8 uid length | uid (10 bytes, zero padded) | 5 reserved bytes
+//      followed by the image (the raw page dump)
+//
+//      index header (64 bytes):   "NFCAIDX1" | u32 version | u32 slot size | u64 capacity (power of 2) | u64 uids
+//                                 | u64 records | u64 indexed end (data offset up to which records are in the index)
+//                                 | u64 created (must match the data header) | reserved
+//      slots (16 bytes each):     u64 hash of the UID (0 = empty) | u64 offset of the newest record
+//
+// the index is only a cache: records that were appended but not indexed (crash) are picked up when the archive is
+// opened, a missing, foreign or broken index is rebuilt from the data file, and a torn last record is cut off. one
+// writer at a time (a writable open takes an exclusive flock on the data file), any number of readers.
+//
+//      TagArchive archive;
+//      TagArchiveRecord record;
+//      tag_archive_open(&archive, "tags.nfca", 1);
+//      tag_archive_append(&archive, uid, 7, TAG_TYPE_ULTRALIGHT_NTAG2XX, 4, image, 396, timing_wall_ns(), NULL);
+//      if (tag_archive_lookup(&archive, uid, 7, &record) == TAG_ARCHIVE_OK) { ... record.image ... }
+//      tag_archive_close(&archive);
+
+#define TAG_ARCHIVE_MAGIC               "NFCARCHV"
+#define TAG_ARCHIVE_INDEX_MAGIC         "NFCAIDX1"
+#define TAG_ARCHIVE_VERSION             1
+#define TAG_ARCHIVE_HEADER_SIZE         64
+#define TAG_ARCHIVE_RECORD_HEADER_SIZE  48
+#define TAG_ARCHIVE_RECORD_MAGIC        0x43455254u     // "TREC"
+#define TAG_ARCHIVE_INDEX_SLOT_SIZE     16
+#define TAG_ARCHIVE_UID_MAX             10
+#define TAG_ARCHIVE_IMAGE_MAX           65535
+
+typedef enum TagArchiveStatus {
+    TAG_ARCHIVE_OK,
+    TAG_ARCHIVE_END,                    // tag_archive_next: no record left
+    TAG_ARCHIVE_NOT_FOUND,
+    TAG_ARCHIVE_IO_ERROR,               // errno has the details
+    TAG_ARCHIVE_BAD_FORMAT,             // not an archive or a version this code does not know
+    TAG_ARCHIVE_CORRUPT,                // bad record magic, length or checksum
+    TAG_ARCHIVE_READ_ONLY,
+    TAG_ARCHIVE_TOO_BIG,                // UID or image longer than the format allows
+    TAG_ARCHIVE_LOCKED,                 // tag_archive_open: another writer has the archive open
+} TagArchiveStatus;
+
+// TagArchiveRecord is a view into the mapping, valid until the archive is appended to or closed
+typedef struct TagArchiveRecord {
+    uint64_t offset;                    // where the record starts in the data file, also its id
+    uint64_t timestamp;                 // wall clock ns since 1970
+    uint64_t previous;                  // offset of the previous dump of this UID, 0 = this is the first one
+    uint8_t tagType;                    // TagType of tag-type.h
+    uint8_t pageSize;                   // bytes per page / block of the image
+    uint8_t uidLength;
+    const uint8_t *uid;
+    uint16_t imageLength;
+    const uint8_t *image;
+} TagArchiveRecord;
+
+typedef struct TagArchive {
+    int fd;
+    int indexFd;                        // -1: index only lives in memory (read only archive without a usable index file)
+    int writable;
+    char *indexPath;
+    uint64_t created;
+    const uint8_t *data;                // mapping of the data file, may reach past the end of the file
+    size_t dataMapped;
+    uint64_t end;                       // end of the last complete record
+    uint8_t *index;                     // index header + slots (shared mapping, private mapping or malloc)
+    size_t indexSize;
+    int indexMalloced;
+    uint64_t capacity;
+} TagArchive;
+
+// tag_archive_open opens (writable: creates) the archive at path and brings its index up to date
+TagArchiveStatus tag_archive_open(TagArchive *archive, const char *path, int writable);
+void tag_archive_close(TagArchive *archive);
+// tag_archive_sync makes appended records durable (fdatasync of data and index)
+TagArchiveStatus tag_archive_sync(TagArchive *archive);
+
+TagArchiveStatus tag_archive_append(TagArchive *archive, const uint8_t *uid, uint8_t uidLength, uint8_t tagType, uint8_t pageSize,
+                                    const uint8_t *image, size_t imageLength, uint64_t timestamp, uint64_t *offset);
+
+// tag_archive_lookup finds the newest record of uid, record.previous leads to the older ones (tag_archive_read)
+TagArchiveStatus tag_archive_lookup(TagArchive *archive, const uint8_t *uid, uint8_t uidLength, TagArchiveRecord *record);
+TagArchiveStatus tag_archive_read(TagArchive *archive, uint64_t offset, TagArchiveRecord *record);
+// tag_archive_next walks all records in the order they were appended, start with *cursor = 0
+TagArchiveStatus tag_archive_next(TagArchive *archive, uint64_t *cursor, TagArchiveRecord *record);
+// tag_archive_check verifies the checksum of a record (scans skip that, it reads every byte of the image)
+TagArchiveStatus tag_archive_check(const TagArchive *archive, const TagArchiveRecord *record);
+
+// tag_archive_reindex throws the index away and rebuilds it from the data file
+TagArchiveStatus tag_archive_reindex(TagArchive *archive);
+uint64_t tag_archive_uid_count(const TagArchive *archive);
+uint64_t tag_archive_record_count(const TagArchive *archive);
+
+const char *tag_archive_status_name(TagArchiveStatus status);
+
+#endif
@@ -0,0 +1,231 @@
+#include <pthread.h>
+
+#include "tag-memory.h"
+#include "reader.h"
+#include "logging.h"
+
+// -------------------- Profiles -------------------------------
+
+// indexed by TagMemoryKind. EM4423 is what this code was written for (fastread of all 396 bytes in one apdu works on
+// the ACR1581U), the NXP layouts are taken from the datasheets and stay below 256 bytes per read to be safe
+static const TagMemoryProfile TAG_MEMORY_PROFILES[TAG_MEMORY_COUNT] = {
+    // 0x00 - 0x62, only the 240 bytes of user memory that both EM4423 versions have are used (see em-4423.c)
+    { TAG_MEMORY_EM4423,     "EM4423",           99, 4, { { 0x04, 60 } },  { { 0x02, 1 } },                             99 * 4 },
+    // NTAG213: 144 bytes user memory, dynamic lock bytes in 0x28, configuration 0x29 - 0x2C
+    { TAG_MEMORY_NTAG213,    "NTAG213",          45, 4, { { 0x04, 36 } },  { { 0x02, 1 }, { 0x28, 1 }, { 0x29, 4 } },   180 },
+    // NTAG215: 504 bytes user memory, dynamic lock bytes in 0x82, configuration 0x83 - 0x86
+    { TAG_MEMORY_NTAG215,    "NTAG215",         135, 4, { { 0x04, 126 } }, { { 0x02, 1 }, { 0x82, 1 }, { 0x83, 4 } },   240 },
+    // NTAG216: 888 bytes user memory, dynamic lock bytes in 0xE2, configuration 0xE3 - 0xE6
+    { TAG_MEMORY_NTAG216,    "NTAG216",         231, 4, { { 0x04, 222 } }, { { 0x02, 1 }, { 0xE2, 1 }, { 0xE3, 4 } },   240 },
+    // Mifare Ultralight (MF0ICU1): 48 bytes user memory, page 0x03 is OTP
+    { TAG_MEMORY_ULTRALIGHT, "Mifare Ultralight", 16, 4, { { 0x04, 12 } }, { { 0x02, 1 }, { 0x03, 1 } },                64 },
+    // ICODE SLIX family (ISO 15693): every block is user memory, locks are per block status bits outside the memory map.
+    // the reader turns a READ BINARY over several blocks into one Read Multiple Blocks, so the whole tag is one apdu
+    { TAG_MEMORY_ICODE_SLIX,   "ICODE SLIX",     28, 4, { { 0x00, 28 } },  { { 0 } },                                   28 * 4 },
+    { TAG_MEMORY_ICODE_SLIX_S, "ICODE SLIX-S",   40, 4, { { 0x00, 40 } },  { { 0 } },                                   40 * 4 },
+    { TAG_MEMORY_ICODE_SLIX_L, "ICODE SLIX-L",    8, 4, { { 0x00, 8 } },   { { 0 } },                                   8 * 4 },
+    // ICODE SLIX2: 79 blocks user memory, block 0x4F is the 16 bit counter
+    { TAG_MEMORY_ICODE_SLIX2,  "ICODE SLIX2",    80, 4, { { 0x00, 79 } },  { { 0x4F, 1 } },                             160 },
+};
+
+// one bit per page, built from the ranges above the first time a profile is used
+typedef struct TagPageBitmaps {
+    BYTE user[TAG_MEMORY_MAX_PAGES / 8];
+    BYTE lock[TAG_MEMORY_MAX_PAGES / 8];
+} TagPageBitmaps;
+
+static TagPageBitmaps tagMemoryBitmaps[TAG_MEMORY_COUNT];
+static pthread_once_t tagMemoryOnce = PTHREAD_ONCE_INIT;
+
+static void tag_memory_set_ranges(BYTE *bitmap, const TagPageRange *ranges) {
+    for (size_t i = 0; i < TAG_MEMORY_RANGES; i++) {
+        for (size_t page = ranges[i].first; page < (size_t)ranges[i].first + ranges[i].count; page++) {
+            bitmap[page / 8] |= (BYTE)(1u << (page % 8));
+        }
+    }
+}
+
+static void tag_memory_build_bitmaps(void) {
+    for (size_t kind = 0; kind < TAG_MEMORY_COUNT; kind++) {
+        tag_memory_set_ranges(tagMemoryBitmaps[kind].user, TAG_MEMORY_PROFILES[kind].user);
+        tag_memory_set_ranges(tagMemoryBitmaps[kind].lock, TAG_MEMORY_PROFILES[kind].lock);
+    }
+}
+
+static const TagPageBitmaps *tag_memory_bitmaps(const TagMemoryProfile *profile) {
+    pthread_once(&tagMemoryOnce, tag_memory_build_bitmaps);
+    return &tagMemoryBitmaps[profile->kind];
+}
+
+static BOOL tag_memory_bit(const BYTE *bitmap, size_t page) {
+    return (page < TAG_MEMORY_MAX_PAGES) && (bitmap[page / 8] & (1u << (page % 8)));
+}
+
+const TagMemoryProfile *tag_memory_profile(TagMemoryKind kind) {
+    return (kind < TAG_MEMORY_COUNT) ? &TAG_MEMORY_PROFILES[kind] : NULL;
+}
+
+// -------------------- Page checks -------------------------------
+
+BOOL tag_memory_page_exists(const TagMemoryProfile *profile, size_t page) {
+    return page < profile->pageCount;
+}
+
+BOOL tag_memory_page_is_user(const TagMemoryProfile *profile, size_t page) {
+    return tag_memory_bit(tag_memory_bitmaps(profile)->user, page);
+}
+
+BOOL tag_memory_page_is_lock(const TagMemoryProfile *profile, size_t page) {
+    return tag_memory_bit(tag_memory_bitmaps(profile)->lock, page);
+}
+
+BOOL tag_memory_range_is_user(const TagMemoryProfile *profile, size_t first_page, size_t pages) {
+    const BYTE *user = tag_memory_bitmaps(profile)->user;
+    for (size_t i = 0; i < pages; i++) {
+        if (!tag_memory_bit(user, first_page + i)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// -------------------- Reading -------------------------------
+
+BOOL tag_memory_read(const TagMemoryProfile *profile, size_t first_page, size_t pages, BYTE *out, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    if ((pages == 0) || (first_page + pages > profile->pageCount)) {
+        LOG_WARN("%s has no pages 0x%02zx - 0x%02zx.", profile->name, first_page, first_page + pages - 1);
+        return FALSE;
+    }
+
+    size_t max_pages = profile->maxRead / profile->pageSize;
+    size_t done = 0;
+    while (done < pages) {
+        size_t chunk = ((pages - done) < max_pages) ? (pages - done) : max_pages;
+        DWORD length = (DWORD)(chunk * profile->pageSize);
+        BYTE page = (BYTE)(first_page + done);
+
+        // extended Le (00 hi lo) is only needed above 255 bytes, e.g. for the 396 bytes of an EM4423 in one apdu
+        BYTE APDU_Read[7] = { 0xff, 0xb0, 0x00, page, 0x00, (BYTE)(length >> 8), (BYTE)length };
+        DWORD apdu_length = 7;
+        if (length <= 0xFF) {
+            APDU_Read[4] = (BYTE)length;
+            apdu_length = 5;
+        }
+
+        ApduView response = executeApdu(hCard, APDU_Read, apdu_length, pbRecvBuffer, pbRecvBufferSize);
+        if ((response.outcome != APDU_OK) || (response.data_len < length)) {
+            LOG_ERROR("Failed to read %lu bytes from page 0x%02x of %s.", (unsigned long)length, page, profile->name);
+            return FALSE;
+        }
+        memcpy(out + done * profile->pageSize, response.data, length);
+        done += chunk;
+    }
+    return TRUE;
+}
+
+// -------------------- Writing -------------------------------
+
+// largest UPDATE BINARY payload a reader took so far, per reader and profile (0 = nothing learned yet, start with
+// TAG_MEMORY_MAX_WRITE). the limit is a property of the reader firmware, so it is kept across tags and only the handles
+// of that reader use it. slot 0 is for handles that were never bound (tools that connect on their own)
+#define TAG_MEMORY_MAX_READERS  8
+#define TAG_MEMORY_MAX_HANDLES  64
+
+typedef struct TagMemoryReader {
+    char name[256];
+    DWORD maxWrite[TAG_MEMORY_COUNT];
+} TagMemoryReader;
+
+typedef struct TagMemoryHandle {
+    SCARDHANDLE hCard;
+    BYTE reader;
+} TagMemoryHandle;
+
+static TagMemoryReader tagMemoryReaders[TAG_MEMORY_MAX_READERS + 1];
+static size_t tagMemoryReaderCount = 1;
+static TagMemoryHandle tagMemoryHandles[TAG_MEMORY_MAX_HANDLES];
+static size_t tagMemoryHandleNext;
+static pthread_mutex_t tagMemoryLock = PTHREAD_MUTEX_INITIALIZER;
+
+void tag_memory_bind_handle(SCARDHANDLE hCard, const char *reader) {
+    pthread_mutex_lock(&tagMemoryLock);
+    BYTE slot = 0;
+    for (size_t i = 1; (reader != NULL) && (i < tagMemoryReaderCount); i++) {
+        if (strcmp(tagMemoryReaders[i].name, reader) == 0) {
+            slot = (BYTE)i;
+            break;
+        }
+    }
+    if ((slot == 0) && (reader != NULL) && (tagMemoryReaderCount < TAG_MEMORY_MAX_READERS + 1) && (strlen(reader) < sizeof(tagMemoryReaders[0].name))) {
+        strcpy(tagMemoryReaders[tagMemoryReaderCount].name, reader);
+        slot = (BYTE)tagMemoryReaderCount++;
+    }
+
+    size_t i = 0;
+    while ((i < TAG_MEMORY_MAX_HANDLES) && (tagMemoryHandles[i].hCard != hCard)) {
+        i++;
+    }
+    if (i == TAG_MEMORY_MAX_HANDLES) {
+        i = tagMemoryHandleNext; // oldest binding goes, handles of finished connections are never looked up again
+        tagMemoryHandleNext = (tagMemoryHandleNext + 1) % TAG_MEMORY_MAX_HANDLES;
+    }
+    __atomic_store_n(&tagMemoryHandles[i].reader, slot, __ATOMIC_RELAXED);
+    __atomic_store_n(&tagMemoryHandles[i].hCard, hCard, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tagMemoryLock);
+}
+
+// tag_memory_write_limit returns the learned limits of the reader behind hCard, one scan per tag_memory_write call
+static DWORD *tag_memory_write_limit(SCARDHANDLE hCard, TagMemoryKind kind) {
+    BYTE slot = 0;
+    for (size_t i = 0; i < TAG_MEMORY_MAX_HANDLES; i++) {
+        if ((hCard != 0) && (__atomic_load_n(&tagMemoryHandles[i].hCard, __ATOMIC_ACQUIRE) == hCard)) {
+            slot = __atomic_load_n(&tagMemoryHandles[i].reader, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    return &tagMemoryReaders[slot].maxWrite[kind];
+}
+
+// wrong length (67 xx) and wrong Le (6C xx) are the only answers that say the payload was too long, anything else
+// (locked page, authentication, a tag that is gone) would shrink the writes of every later tag on that reader for nothing
+static BOOL tag_memory_is_length_error(const ApduView *response) {
+    return (response->outcome == APDU_STATUS_ERROR) && ((response->sw1 == 0x67) || (response->sw1 == 0x6C));
+}
+
+BOOL tag_memory_write(const TagMemoryProfile *profile, size_t first_page, size_t pages, const BYTE *data, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize) {
+    if (!tag_memory_range_is_user(profile, first_page, pages)) {
+        LOG_WARN("Pages 0x%02zx - 0x%02zx of %s are not all user memory. Refusing to write there.", first_page, first_page + pages - 1, profile->name);
+        return FALSE;
+    }
+
+    BYTE APDU_Write[5 + TAG_MEMORY_MAX_WRITE];
+    DWORD *limit = tag_memory_write_limit(hCard, profile->kind);
+    size_t done = 0;
+    while (done < pages) {
+        DWORD max_write = __atomic_load_n(limit, __ATOMIC_RELAXED);
+        size_t max_pages = ((max_write == 0) ? TAG_MEMORY_MAX_WRITE : max_write) / profile->pageSize;
+        size_t chunk = ((pages - done) < max_pages) ? (pages - done) : max_pages;
+        DWORD length = (DWORD)(chunk * profile->pageSize);
+        BYTE page = (BYTE)(first_page + done);
+
+        APDU_Write[0] = 0xff; APDU_Write[1] = 0xd6; APDU_Write[2] = 0x00; APDU_Write[3] = page; APDU_Write[4] = (BYTE)length;
+        memcpy(APDU_Write + 5, data + done * profile->pageSize, length);
+
+        ApduView response = executeApdu(hCard, APDU_Write, 5 + length, pbRecvBuffer, pbRecvBufferSize);
+        if (response.outcome == APDU_OK) {
+            done += chunk;
+            continue;
+        }
+        // only the reader disliking the length makes the payload smaller
+        if (!tag_memory_is_length_error(&response) || (chunk == 1)) {
+            LOG_ERROR("Failed to write %lu bytes to page 0x%02x of %s (SW %02x %02x). Aborting..", (unsigned long)length, page, profile->name, response.sw1, response.sw2);
+            return FALSE;
+        }
+        DWORD smaller = (DWORD)(((chunk / 2) < 1 ? 1 : (chunk / 2)) * profile->pageSize);
+        LOG_DEBUG("Reader rejected a %lu byte write (SW %02x %02x), trying %lu bytes.", (unsigned long)length, response.sw1, response.sw2, (unsigned long)smaller);
+        __atomic_store_n(limit, smaller, __ATOMIC_RELAXED);
+    }
+
+    LOG_INFO("Wrote %zu pages starting at page 0x%02zx of %s with success.", pages, first_page, profile->name);
+    return TRUE;
+}
@@ -0,0 +1,72 @@
+#ifndef TAG_MEMORY_H
+#define TAG_MEMORY_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+// Declarative memory maps of page based tags (NFC Forum type 2 layout, and the blocks of ISO 15693 tags, which the
+// reader addresses the same way). a profile lists page count, page size, the user memory, lock / configuration pages
+// and how many bytes one READ BINARY may return. the page ranges are turned into bitmaps once, so checking a page is a
+// single bit test instead of a scan over a page list, and tag_memory_read / tag_memory_write move any range with as few
+// apdus as the profile and the reader allow. a new tag only needs a new entry in TAG_MEMORY_PROFILES.
+//
+//      const TagMemoryProfile *ntag = tag_memory_profile(TAG_MEMORY_NTAG215);
+//      BYTE image[135 * 4];
+//      tag_memory_read(ntag, 0, ntag->pageCount, image, hCard, pbRecvBuffer, &pbRecvBufferSize);
+
+typedef enum TagMemoryKind {
+    TAG_MEMORY_EM4423,
+    TAG_MEMORY_NTAG213,
+    TAG_MEMORY_NTAG215,
+    TAG_MEMORY_NTAG216,
+    TAG_MEMORY_ULTRALIGHT,
+    TAG_MEMORY_ICODE_SLIX,
+    TAG_MEMORY_ICODE_SLIX_S,
+    TAG_MEMORY_ICODE_SLIX_L,
+    TAG_MEMORY_ICODE_SLIX2,
+    TAG_MEMORY_COUNT
+} TagMemoryKind;
+
+#define TAG_MEMORY_MAX_PAGES    256     // pages are addressed with one byte (P2 of READ / UPDATE BINARY)
+#define TAG_MEMORY_RANGES       4
+#define TAG_MEMORY_MAX_WRITE    252     // largest UPDATE BINARY tag_memory_write tries (short Lc, whole pages)
+
+typedef struct TagPageRange {
+    BYTE first;
+    BYTE count;                 // 0 = unused slot
+} TagPageRange;
+
+typedef struct TagMemoryProfile {
+    TagMemoryKind kind;
+    const char *name;
+    uint16_t pageCount;         // pages 0 .. pageCount - 1 exist
+    BYTE pageSize;
+    TagPageRange user[TAG_MEMORY_RANGES];   // may be written with UPDATE BINARY
+    TagPageRange lock[TAG_MEMORY_RANGES];   // lock bytes and configuration pages, readable but never written by this code
+    uint16_t maxRead;           // largest READ BINARY in bytes that reader and tag answer in one go, longer reads are split
+} TagMemoryProfile;
+
+const TagMemoryProfile *tag_memory_profile(TagMemoryKind kind);
+
+// page checks, O(1) each
+BOOL tag_memory_page_exists(const TagMemoryProfile *profile, size_t page);
+BOOL tag_memory_page_is_user(const TagMemoryProfile *profile, size_t page);
+BOOL tag_memory_page_is_lock(const TagMemoryProfile *profile, size_t page);
+BOOL tag_memory_range_is_user(const TagMemoryProfile *profile, size_t first_page, size_t pages);
+
+// tag_memory_read reads pages pages starting at first_page into out (pages * pageSize bytes) with one READ BINARY per
+// maxRead bytes (short Le up to 255 bytes, extended Le above)
+BOOL tag_memory_read(const TagMemoryProfile *profile, size_t first_page, size_t pages, BYTE *out, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+
+// tag_memory_write writes pages * pageSize bytes of data starting at first_page (user memory only, no verification)
+// with as few UPDATE BINARY apdus as the reader allows. if the reader rejects a large write as too long (67 xx, 6C xx)
+// the payload is halved until it is accepted (down to one page per apdu), and that size is remembered per reader and
+// profile for the next writes, also to later tags on that reader
+BOOL tag_memory_write(const TagMemoryProfile *profile, size_t first_page, size_t pages, const BYTE *data, SCARDHANDLE hCard, BYTE *pbRecvBuffer, DWORD *pbRecvBufferSize);
+
+// tag_memory_bind_handle tells tag_memory_write which reader hCard belongs to (called by connectToReader), writes
+// through handles that were never bound share one set of limits
+void tag_memory_bind_handle(SCARDHANDLE hCard, const char *reader);
+
+#endif
@@ -0,0 +1,143 @@
+#include <pthread.h>
+
+#include "tag-type.h"
+
+// -------------------- Tables -------------------------------
+
+// indexed by TagType
+static const TagTypeInfo TAG_TYPES[TAG_TYPE_COUNT] = {
+    { TAG_TYPE_UNIDENTIFIED,        "UNIDENTIFIED TAG",                         0 },
+    { TAG_TYPE_UNKNOWN,             "UNKNOWN TAG",                              0 },
+    { TAG_TYPE_MIFARE_CLASSIC_1K,   "Mifare Classic 1k",                        TAG_CAP_READ_BINARY | TAG_CAP_UPDATE_BINARY | TAG_CAP_MIFARE_AUTH },
+    { TAG_TYPE_MIFARE_CLASSIC_4K,   "Mifare Classic 4k",                        TAG_CAP_READ_BINARY | TAG_CAP_UPDATE_BINARY | TAG_CAP_MIFARE_AUTH },
+    { TAG_TYPE_ULTRALIGHT_NTAG2XX,  "Mifare Ultralight or NTAG2xx",             TAG_CAP_READ_BINARY | TAG_CAP_UPDATE_BINARY | TAG_CAP_NDEF },
+    { TAG_TYPE_MIFARE_MINI,         "Mifare Mini",                              TAG_CAP_READ_BINARY | TAG_CAP_UPDATE_BINARY | TAG_CAP_MIFARE_AUTH },
+    { TAG_TYPE_TOPAZ_JEWEL,         "Topaz/Jewel",                              TAG_CAP_NDEF },
+    { TAG_TYPE_FELICA_212K,         "FeliCa 212K",                              TAG_CAP_NDEF },
+    { TAG_TYPE_FELICA_424K,         "FeliCa 424K",                              TAG_CAP_NDEF },
+    { TAG_TYPE_ISO14443_4,          "Mifare Desfire EV3 8k or NTAG 424 DNA TT", TAG_CAP_ISO14443_4 | TAG_CAP_NEEDS_ATS },
+    { TAG_TYPE_DESFIRE_EV3,         "Mifare Desfire EV3 8k",                    TAG_CAP_ISO14443_4 | TAG_CAP_DESFIRE_NATIVE | TAG_CAP_NDEF },
+    { TAG_TYPE_NTAG_424_DNA,        "NTAG 424 DNA TT",                          TAG_CAP_ISO14443_4 | TAG_CAP_SUN | TAG_CAP_NDEF },
+    { TAG_TYPE_ICODE_SLI,           "ICODE SLI / SLIX",                         TAG_CAP_READ_BINARY | TAG_CAP_UPDATE_BINARY | TAG_CAP_NDEF },
+};
+
+// TagPattern matches when the ATR / ATS holds `length` bytes equal to `bytes` starting at `offset`
+typedef struct TagPattern {
+    BYTE offset;
+    BYTE length;
+    BYTE bytes[6];
+    TagType type;
+} TagPattern;
+
+// first match wins. bytes 13 + 14 of the ACR1581 ATR are the card name of the PC/SC part 3 supplemental document
+static const TagPattern ATR_PATTERNS[] = {
+    { 13, 2, { 0x00, 0x01 },             TAG_TYPE_MIFARE_CLASSIC_1K },
+    { 13, 2, { 0x00, 0x02 },             TAG_TYPE_MIFARE_CLASSIC_4K },
+    { 13, 2, { 0x00, 0x03 },             TAG_TYPE_ULTRALIGHT_NTAG2XX },
+    { 13, 2, { 0x00, 0x26 },             TAG_TYPE_MIFARE_MINI },
+    { 13, 2, { 0xF0, 0x04 },             TAG_TYPE_TOPAZ_JEWEL },
+    { 13, 2, { 0xF0, 0x11 },             TAG_TYPE_FELICA_212K },
+    { 13, 2, { 0xF0, 0x12 },             TAG_TYPE_FELICA_424K },
+    { 13, 2, { 0x00, 0x14 },             TAG_TYPE_ICODE_SLI },
+    { 0,  4, { 0x3B, 0x81, 0x80, 0x01 }, TAG_TYPE_ISO14443_4 },  // short ATR of ISO 14443-4 tags, historical bytes come from the ATS
+    { 13, 1, { 0xFF },                   TAG_TYPE_UNKNOWN },
+};
+
+// TL T0 TA TB TC T1 of the ATS
+static const TagPattern ATS_PATTERNS[] = {
+    { 0, 6, { 0x06, 0x75, 0x77, 0x81, 0x02, 0x80 }, TAG_TYPE_DESFIRE_EV3 }, // i dont own enough tags to tell whether that decides just desfire, or desfire ev3, or desfire ev3 8k
+    { 0, 6, { 0x06, 0x77, 0x77, 0x71, 0x02, 0x80 }, TAG_TYPE_NTAG_424_DNA },
+};
+
+static TagType tag_match(const TagPattern *patterns, size_t count, const BYTE *data, DWORD len, TagType fallback) {
+    for (size_t i = 0; i < count; i++) {
+        const TagPattern *p = &patterns[i];
+        if ((p->offset + p->length <= len) && (memcmp(data + p->offset, p->bytes, p->length) == 0)) {
+            return p->type;
+        }
+    }
+    return fallback;
+}
+
+const TagTypeInfo *tag_type_info(TagType type) {
+    return &TAG_TYPES[(type < TAG_TYPE_COUNT) ? type : TAG_TYPE_UNIDENTIFIED];
+}
+
+const char *tag_type_name(TagType type) {
+    return tag_type_info(type)->name;
+}
+
+TagCapabilities tag_type_caps(TagType type) {
+    return tag_type_info(type)->caps;
+}
+
+TagType tag_classify_atr(const BYTE *atr, DWORD atrLen) {
+    return tag_match(ATR_PATTERNS, sizeof(ATR_PATTERNS) / sizeof(ATR_PATTERNS[0]), atr, atrLen, TAG_TYPE_UNIDENTIFIED);
+}
+
+TagType tag_classify_ats(TagType atrType, const BYTE *ats, DWORD atsLen) {
+    if (!(tag_type_caps(atrType) & TAG_CAP_NEEDS_ATS)) {
+        return atrType;
+    }
+    return tag_match(ATS_PATTERNS, sizeof(ATS_PATTERNS) / sizeof(ATS_PATTERNS[0]), ats, atsLen, atrType);
+}
+
+// -------------------- UID cache -------------------------------
+
+typedef struct TagCacheEntry {
+    BYTE uid[TAG_UID_MAX];
+    BYTE uidLen;                // 0 = unused
+    TagType atrType;            // a different ATR with the same UID is a different tag (or a random UID), so it is part of the key
+    TagType type;
+} TagCacheEntry;
+
+static TagCacheEntry tagCache[TAG_CACHE_SIZE];
+static size_t tagCacheNext;     // entry that is replaced next (round robin)
+static pthread_mutex_t tagCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static TagCacheEntry *tag_cache_find(const BYTE *uid, BYTE uidLen, TagType atrType) {
+    for (size_t i = 0; i < TAG_CACHE_SIZE; i++) {
+        TagCacheEntry *entry = &tagCache[i];
+        if ((entry->uidLen == uidLen) && (entry->atrType == atrType) && (memcmp(entry->uid, uid, uidLen) == 0)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+BOOL tag_cache_lookup(const BYTE *uid, BYTE uidLen, TagType atrType, TagType *type) {
+    if ((uidLen == 0) || (uidLen > TAG_UID_MAX)) {
+        return FALSE;
+    }
+    pthread_mutex_lock(&tagCacheLock);
+    TagCacheEntry *entry = tag_cache_find(uid, uidLen, atrType);
+    if (entry != NULL) {
+        *type = entry->type;
+    }
+    pthread_mutex_unlock(&tagCacheLock);
+    return entry != NULL;
+}
+
+void tag_cache_store(const BYTE *uid, BYTE uidLen, TagType atrType, TagType type) {
+    if ((uidLen == 0) || (uidLen > TAG_UID_MAX)) {
+        return;
+    }
+    pthread_mutex_lock(&tagCacheLock);
+    TagCacheEntry *entry = tag_cache_find(uid, uidLen, atrType);
+    if (entry == NULL) {
+        entry = &tagCache[tagCacheNext];
+        tagCacheNext = (tagCacheNext + 1) % TAG_CACHE_SIZE;
+        memcpy(entry->uid, uid, uidLen);
+        entry->uidLen = uidLen;
+        entry->atrType = atrType;
+    }
+    entry->type = type;
+    pthread_mutex_unlock(&tagCacheLock);
+}
+
+void tag_cache_clear(void) {
+    pthread_mutex_lock(&tagCacheLock);
+    memset(tagCache, 0, sizeof(tagCache));
+    tagCacheNext = 0;
+    pthread_mutex_unlock(&tagCacheLock);
+}
@@ -0,0 +1,71 @@
+#ifndef TAG_TYPE_H
+#define TAG_TYPE_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+// Tag identification without string handling: ATR and ATS are matched against static pattern tables that map to a
+// TagType and a set of capabilities. identifyTag (reader.c) only asks for the ATS when the ATR leaves the type open,
+// and remembers the result per UID so the next tap of the same tag skips that round trip.
+
+typedef enum TagType {
+    TAG_TYPE_UNIDENTIFIED,          // ATR did not match anything (or was too short)
+    TAG_TYPE_UNKNOWN,               // reader says it does not know the tag (ATR byte 13 = FF)
+    TAG_TYPE_MIFARE_CLASSIC_1K,
+    TAG_TYPE_MIFARE_CLASSIC_4K,
+    TAG_TYPE_ULTRALIGHT_NTAG2XX,    // also EM4423, it reports itself as ultralight
+    TAG_TYPE_MIFARE_MINI,
+    TAG_TYPE_TOPAZ_JEWEL,
+    TAG_TYPE_FELICA_212K,
+    TAG_TYPE_FELICA_424K,
+    TAG_TYPE_ISO14443_4,            // Desfire EV3 8k or NTAG 424 DNA TT, the ATS decides
+    TAG_TYPE_DESFIRE_EV3,
+    TAG_TYPE_NTAG_424_DNA,
+    TAG_TYPE_ICODE_SLI,             // ICODE SLI / SLIX / SLIX2 / SLIX-S / SLIX-L (ISO 15693), the UID tells which one (icode-slix.c)
+    TAG_TYPE_COUNT
+} TagType;
+
+// capability bits, combine with |
+typedef DWORD TagCapabilities;
+#define TAG_CAP_READ_BINARY     0x0001  // pages / blocks can be read with the reader's FF B0
+#define TAG_CAP_UPDATE_BINARY   0x0002  // pages / blocks can be written with the reader's FF D6
+#define TAG_CAP_MIFARE_AUTH     0x0004  // sectors need FF 82 / FF 86 before read and write
+#define TAG_CAP_ISO14443_4      0x0008  // speaks ISO 7816 APDUs (passed through by the reader)
+#define TAG_CAP_NEEDS_ATS       0x0010  // ATR is ambiguous, the ATS tells the exact type
+#define TAG_CAP_DESFIRE_NATIVE  0x0020  // desfire native commands wrapped in CLA 90
+#define TAG_CAP_SUN             0x0040  // secure unique NFC messages (SDM)
+#define TAG_CAP_NDEF            0x0080  // NFC Forum tag, can hold an NDEF message
+
+typedef struct TagTypeInfo {
+    TagType type;
+    const char *name;
+    TagCapabilities caps;
+} TagTypeInfo;
+
+#define TAG_UID_MAX 10
+
+// TagIdentity is what identifyTag found out about the connected tag
+typedef struct TagIdentity {
+    TagType type;
+    TagCapabilities caps;
+    BYTE uid[TAG_UID_MAX];
+    BYTE uidLen;
+    BOOL fromCache;                 // type came from the UID cache, the ATS was not requested
+} TagIdentity;
+
+const TagTypeInfo *tag_type_info(TagType type);
+const char *tag_type_name(TagType type);
+TagCapabilities tag_type_caps(TagType type);
+
+// tag_classify_atr / tag_classify_ats walk the pattern tables, the ATS only refines types with TAG_CAP_NEEDS_ATS
+TagType tag_classify_atr(const BYTE *atr, DWORD atrLen);
+TagType tag_classify_ats(TagType atrType, const BYTE *ats, DWORD atsLen);
+
+// per-UID identification cache (shared by all readers, thread safe)
+#define TAG_CACHE_SIZE 64
+BOOL tag_cache_lookup(const BYTE *uid, BYTE uidLen, TagType atrType, TagType *type);
+void tag_cache_store(const BYTE *uid, BYTE uidLen, TagType atrType, TagType type);
+void tag_cache_clear(void);
+
+#endif
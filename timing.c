@@ -0,0 +1,55 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "timing.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+uint64_t timing_now_ns(void) {
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((counter.QuadPart * 1000000000.0) / frequency.QuadPart);
+}
+
+uint64_t timing_wall_ns(void) {
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft); // 100 ns ticks since 1601
+    uint64_t ticks = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (ticks - 116444736000000000ull) * 100ull;
+}
+
+void timing_sleep_us(uint64_t microseconds) {
+    Sleep((DWORD)((microseconds + 999) / 1000)); // windows can't do better than milliseconds without busy waiting
+}
+
+#else
+#include <time.h>
+#include <errno.h>
+
+uint64_t timing_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t timing_wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void timing_sleep_us(uint64_t microseconds) {
+    struct timespec ts = {
+        .tv_sec = (time_t)(microseconds / 1000000ull),
+        .tv_nsec = (long)((microseconds % 1000000ull) * 1000ull)
+    };
+    // nanosleep writes the remaining time back into ts when interrupted by a signal, so just continue sleeping
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+#endif
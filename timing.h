@@ -0,0 +1,18 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+
+// monotonic clock helpers. they live in their own translation unit because clock_gettime/nanosleep need _POSIX_C_SOURCE
+// and the rest of the code is compiled as plain c99
+
+// timing_now_ns returns nanoseconds of a monotonic clock (only useful for measuring differences)
+uint64_t timing_now_ns(void);
+
+// timing_wall_ns returns nanoseconds since 1970 (wall clock, can jump, only use it for timestamps that humans read)
+uint64_t timing_wall_ns(void);
+
+// timing_sleep_us sleeps for the given amount of microseconds (more precise than SLEEP_CUSTOM which works in milliseconds)
+void timing_sleep_us(uint64_t microseconds);
+
+#endif
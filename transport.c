@@ -0,0 +1,103 @@
+#include "transport.h"
+#include "sim-reader.h"
+#include "logging.h"
+
+
+// -------------------- PC/SC transport (real reader) -------------------------------
+
+static LONG pcsc_establish_context(DWORD dwScope, SCARDCONTEXT *phContext) {
+    return SCardEstablishContext(dwScope, NULL, NULL, phContext);
+}
+
+static LONG pcsc_release_context(SCARDCONTEXT hContext) {
+    return SCardReleaseContext(hContext);
+}
+
+static LONG pcsc_list_readers(SCARDCONTEXT hContext, char *mszReaders, DWORD *pcchReaders) {
+    return SCardListReaders(hContext, NULL, mszReaders, pcchReaders);
+}
+
+static LONG pcsc_connect(SCARDCONTEXT hContext, const char *reader, DWORD dwShareMode, DWORD dwPreferredProtocols, SCARDHANDLE *phCard, DWORD *pdwActiveProtocol) {
+    return SCardConnect(hContext, reader, dwShareMode, dwPreferredProtocols, phCard, pdwActiveProtocol);
+}
+
+static LONG pcsc_disconnect(SCARDHANDLE hCard, DWORD dwDisposition) {
+    return SCardDisconnect(hCard, dwDisposition);
+}
+
+static LONG pcsc_reconnect(SCARDHANDLE hCard, DWORD dwShareMode, DWORD dwPreferredProtocols, DWORD dwInitialization, DWORD *pdwActiveProtocol) {
+    return SCardReconnect(hCard, dwShareMode, dwPreferredProtocols, dwInitialization, pdwActiveProtocol);
+}
+
+static LONG pcsc_begin_transaction(SCARDHANDLE hCard) {
+    return SCardBeginTransaction(hCard);
+}
+
+static LONG pcsc_end_transaction(SCARDHANDLE hCard, DWORD dwDisposition) {
+    return SCardEndTransaction(hCard, dwDisposition);
+}
+
+static LONG pcsc_status(SCARDHANDLE hCard, char *mszReaderName, DWORD *pcchReaderLen, DWORD *pdwState, DWORD *pdwProtocol, BYTE *pbAtr, DWORD *pcbAtrLen) {
+    return SCardStatus(hCard, mszReaderName, pcchReaderLen, pdwState, pdwProtocol, pbAtr, pcbAtrLen);
+}
+
+static LONG pcsc_transmit(SCARDHANDLE hCard, const BYTE *pbSendBuffer, DWORD cbSendLength, BYTE *pbRecvBuffer, DWORD *pcbRecvLength) {
+    return SCardTransmit(hCard, SCARD_PCI_T1, pbSendBuffer, cbSendLength, NULL, pbRecvBuffer, pcbRecvLength);
+}
+
+static LONG pcsc_control(SCARDHANDLE hCard, DWORD dwControlCode, const BYTE *pbSendBuffer, DWORD cbSendLength, BYTE *pbRecvBuffer, DWORD cbRecvLength, DWORD *lpBytesReturned) {
+    return SCardControl(hCard, dwControlCode, pbSendBuffer, cbSendLength, pbRecvBuffer, cbRecvLength, lpBytesReturned);
+}
+
+static LONG pcsc_get_status_change(SCARDCONTEXT hContext, DWORD dwTimeout, SCARD_READERSTATE *rgReaderStates, DWORD cReaders) {
+    return SCardGetStatusChange(hContext, dwTimeout, rgReaderStates, cReaders);
+}
+
+static LONG pcsc_cancel(SCARDCONTEXT hContext) {
+    return SCardCancel(hContext);
+}
+
+const Transport PCSC_TRANSPORT = {
+    .name             = "pcsc",
+    .establishContext = pcsc_establish_context,
+    .releaseContext   = pcsc_release_context,
+    .listReaders      = pcsc_list_readers,
+    .connect          = pcsc_connect,
+    .disconnect       = pcsc_disconnect,
+    .reconnect        = pcsc_reconnect,
+    .beginTransaction = pcsc_begin_transaction,
+    .endTransaction   = pcsc_end_transaction,
+    .status           = pcsc_status,
+    .transmit         = pcsc_transmit,
+    .control          = pcsc_control,
+    .getStatusChange  = pcsc_get_status_change,
+    .cancel           = pcsc_cancel
+};
+
+// -------------------- Transport selection -------------------------------
+
+static const Transport *activeTransport = &PCSC_TRANSPORT;
+
+const Transport *transport_get(void) {
+    return activeTransport;
+}
+
+void transport_set(const Transport *transport) {
+    activeTransport = (transport != NULL) ? transport : &PCSC_TRANSPORT;
+}
+
+const Transport *transport_select_from_env(void) {
+    const char *name = getenv("NFC_TRANSPORT");
+    if ((name == NULL) || (strcmp(name, "pcsc") == 0)) {
+        transport_set(&PCSC_TRANSPORT);
+    } else if (strcmp(name, "sim") == 0) {
+        sim_reader_configure_from_env();
+        transport_set(&SIM_TRANSPORT);
+        LOG_INFO("Using simulated ACR1581U (NFC_TRANSPORT=sim)");
+    } else {
+        LOG_WARN("Unknown NFC_TRANSPORT '%s', falling back to pcsc", name);
+        transport_set(&PCSC_TRANSPORT);
+    }
+
+    return activeTransport;
+}
@@ -0,0 +1,39 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#ifndef COMMON_H
+#include "common.h"
+#endif
+
+// Transport is the set of PC/SC calls that the rest of the code goes through instead of calling SCard* directly.
+// PCSC_TRANSPORT just forwards to pcsc-lite / winscard, SIM_TRANSPORT (see sim-reader.c) pretends to be an ACR1581U with an
+// EM4423 lying on it, so that executeApdu and the em_4423_* functions can be measured on a box without a reader
+typedef struct Transport {
+    const char *name;
+    LONG (*establishContext)(DWORD dwScope, SCARDCONTEXT *phContext);
+    LONG (*releaseContext)(SCARDCONTEXT hContext);
+    LONG (*listReaders)(SCARDCONTEXT hContext, char *mszReaders, DWORD *pcchReaders);
+    LONG (*connect)(SCARDCONTEXT hContext, const char *reader, DWORD dwShareMode, DWORD dwPreferredProtocols, SCARDHANDLE *phCard, DWORD *pdwActiveProtocol);
+    LONG (*disconnect)(SCARDHANDLE hCard, DWORD dwDisposition);
+    LONG (*reconnect)(SCARDHANDLE hCard, DWORD dwShareMode, DWORD dwPreferredProtocols, DWORD dwInitialization, DWORD *pdwActiveProtocol);
+    LONG (*beginTransaction)(SCARDHANDLE hCard); // other handles to the same reader wait until endTransaction
+    LONG (*endTransaction)(SCARDHANDLE hCard, DWORD dwDisposition);
+    LONG (*status)(SCARDHANDLE hCard, char *mszReaderName, DWORD *pcchReaderLen, DWORD *pdwState, DWORD *pdwProtocol, BYTE *pbAtr, DWORD *pcbAtrLen);
+    LONG (*transmit)(SCARDHANDLE hCard, const BYTE *pbSendBuffer, DWORD cbSendLength, BYTE *pbRecvBuffer, DWORD *pcbRecvLength); // always T=1
+    LONG (*control)(SCARDHANDLE hCard, DWORD dwControlCode, const BYTE *pbSendBuffer, DWORD cbSendLength, BYTE *pbRecvBuffer, DWORD cbRecvLength, DWORD *lpBytesReturned);
+    LONG (*getStatusChange)(SCARDCONTEXT hContext, DWORD dwTimeout, SCARD_READERSTATE *rgReaderStates, DWORD cReaders);
+    LONG (*cancel)(SCARDCONTEXT hContext); // wakes up a getStatusChange that blocks on this context
+} Transport;
+
+extern const Transport PCSC_TRANSPORT;
+extern const Transport SIM_TRANSPORT;
+
+// transport_get returns the currently active transport (PCSC_TRANSPORT unless something else was selected)
+const Transport *transport_get(void);
+void transport_set(const Transport *transport);
+
+// transport_select_from_env activates the transport named in the environment variable NFC_TRANSPORT ("pcsc" or "sim")
+// and returns it. unset or unknown values keep the real pcsc transport
+const Transport *transport_select_from_env(void);
+
+#endif